@@ -0,0 +1,135 @@
+/**
+ * changefeed_bench.c - Finding what changed: full scan vs change feed
+ *
+ * A store of STORE_KEYS entries gets a round of updates, then a consumer
+ * catches up. The polling consumer walks every entry and compares a
+ * digest with the one it remembered; the feed consumer reads batches of
+ * changes from its sequence. Also reports what the feed adds to kvs_set.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/kvstore.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STORE_KEYS 1000000
+#define BATCH 256
+#define SET_ROUNDS 2000000
+
+static const int update_counts[] = { 100, 10000, 100000 };
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Polling consumer state: the digest of every key as last seen
+ */
+typedef struct {
+    uint64_t* seen;
+    size_t changed;
+} poller_t;
+
+static bool poll_entry(void* ctx, int key, const char* value) {
+    poller_t* poller = ctx;
+    uint64_t digest = merkle_entry_digest(key, value);
+    if (poller->seen[key] != digest) {
+        poller->seen[key] = digest;
+        poller->changed++;
+    }
+    return true;
+}
+
+static size_t consume_feed(kvstore_t* kvs, uint64_t* seq) {
+    kvs_change_t changes[BATCH];
+    size_t total = 0;
+    size_t count;
+    while (kvs_changefeed_read(kvs, *seq, changes, BATCH, &count) && count > 0) {
+        *seq += count;
+        total += count;
+    }
+    return total;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return *state >> 33;
+}
+
+/**
+ * Time SET_ROUNDS sets over the existing keys
+ */
+static double time_sets(kvstore_t* kvs) {
+    uint64_t state = 1;
+    double start = now_ms();
+    for (int i = 0; i < SET_ROUNDS; i++) {
+        kvs_set(kvs, (int)(next_random(&state) % STORE_KEYS), "updated-value");
+    }
+    return (now_ms() - start) * 1e6 / SET_ROUNDS;
+}
+
+int main(void) {
+    kvstore_t* kvs = kvs_create(STORE_KEYS * 2);
+    poller_t poller = { calloc(STORE_KEYS, sizeof(uint64_t)), 0 };
+    if (!kvs || !poller.seen) {
+        return 1;
+    }
+
+    char value[32];
+    for (int key = 0; key < STORE_KEYS; key++) {
+        snprintf(value, sizeof(value), "value-%d", key);
+        kvs_set(kvs, key, value);
+    }
+
+    // first pass replaces every value, so both timed passes do the same work
+    time_sets(kvs);
+    double plain = time_sets(kvs);
+    if (!kvs_changefeed_enable(kvs, 128 * 1024, 0)) {
+        return 1;
+    }
+    double recorded = time_sets(kvs);
+    printf("kvs_set, %d keys: %.0f ns plain, %.0f ns with the change feed\n\n",
+           STORE_KEYS, plain, recorded);
+
+    // both consumers start up to date
+    kvs_foreach(kvs, poll_entry, &poller);
+    uint64_t seq = kvs_changefeed_seq(kvs);
+
+    printf("%-10s %14s %14s %12s\n", "updates", "scan ms", "feed ms", "found");
+    uint64_t state = 7;
+    int round = 0;
+    for (size_t u = 0; u < sizeof(update_counts) / sizeof(update_counts[0]); u++) {
+        for (int i = 0; i < update_counts[u]; i++) {
+            snprintf(value, sizeof(value), "round-%d-%d", round, i);
+            kvs_set(kvs, (int)(next_random(&state) % STORE_KEYS), value);
+        }
+        round++;
+
+        poller.changed = 0;
+        double start = now_ms();
+        kvs_foreach(kvs, poll_entry, &poller);
+        double scan = now_ms() - start;
+
+        start = now_ms();
+        size_t consumed = consume_feed(kvs, &seq);
+        double feed = now_ms() - start;
+
+        // the feed lists every update, the scan only the distinct keys
+        char found[32];
+        snprintf(found, sizeof(found), "%zu/%zu", poller.changed, consumed);
+        if (consumed != (size_t)update_counts[u]) {
+            snprintf(found, sizeof(found), "truncated");
+        }
+        printf("%-10d %14.2f %14.3f %12s\n", update_counts[u], scan, feed, found);
+    }
+
+    free(poller.seen);
+    kvs_destroy(kvs);
+    return 0;
+}
@@ -0,0 +1,193 @@
+/**
+ * io_bench.c - Server throughput, epoll backend vs io_uring backend
+ *
+ * Runs the server in-process on a loopback TCP port and drives it from
+ * one client thread holding many connections, each with one GET in
+ * flight at a time. Small values show the per-request syscall cost (the
+ * io_uring loop batches all sends, receives and accepts into one
+ * io_uring_enter per iteration); large values go through zero-copy send.
+ */
+
+#define _GNU_SOURCE
+
+#include "../include/kvstore.h"
+#include "../include/server.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define BENCH_PORT 16480
+#define RUN_SECONDS 1.0
+#define KEY_COUNT 1000
+
+static const int connection_counts[] = { 10, 1000, 5000 };
+static const size_t value_sizes[] = { 16, 64 * 1024 };
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* run_server(void* arg) {
+    kvs_server_run(arg);
+    return NULL;
+}
+
+typedef struct {
+    int fd;
+    int key;
+    size_t received;    // bytes of the current reply
+} client_t;
+
+static bool send_get(client_t* client) {
+    char request[32];
+    int len = snprintf(request, sizeof(request), "GET %d\r\n", client->key);
+    return write(client->fd, request, (size_t)len) == len;
+}
+
+/**
+ * Keep every connection busy for RUN_SECONDS
+ * @return replies per second, negative on failure
+ */
+static double drive(int connections, size_t reply_size) {
+    client_t* clients = calloc((size_t)connections, sizeof(client_t));
+    int epoll_fd = epoll_create1(0);
+    if (!clients || epoll_fd < 0) {
+        free(clients);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bool ok = true;
+    int opened = 0;
+    for (; ok && opened < connections; opened++) {
+        client_t* client = &clients[opened];
+        client->fd = socket(AF_INET, SOCK_STREAM, 0);
+        client->key = opened % KEY_COUNT;
+        struct epoll_event event = { EPOLLIN, { .ptr = client } };
+        ok = client->fd >= 0 && connect(client->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+             epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event) == 0;
+    }
+
+    long replies = 0;
+    double start = now_sec();
+    for (int i = 0; ok && i < connections; i++) {
+        ok = send_get(&clients[i]);
+    }
+
+    static char buffer[256 * 1024];
+    struct epoll_event events[256];
+    while (ok && now_sec() - start < RUN_SECONDS) {
+        int n = epoll_wait(epoll_fd, events, 256, 100);
+        for (int i = 0; ok && i < n; i++) {
+            client_t* client = events[i].data.ptr;
+            ssize_t got = read(client->fd, buffer, sizeof(buffer));
+            if (got <= 0) {
+                ok = got < 0 && errno == EAGAIN;
+                continue;
+            }
+            client->received += (size_t)got;
+            if (client->received >= reply_size) {
+                client->received -= reply_size;
+                client->key = (client->key + 1) % KEY_COUNT;
+                replies++;
+                ok = send_get(client);
+            }
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    for (int i = 0; i < opened; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+        }
+    }
+    close(epoll_fd);
+    free(clients);
+    return ok ? replies / elapsed : -1;
+}
+
+int main(void) {
+    // a file descriptor per connection on both ends
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("Server I/O backends, one loop, one GET in flight per connection, %.0fs per run\n\n",
+           RUN_SECONDS);
+    printf("%-10s %12s %12s %14s\n", "value", "connections", "backend", "replies/s");
+
+    char* value = malloc(value_sizes[1] + 1);
+    if (!value) {
+        return 1;
+    }
+    int status = 0;
+    kvs_server_backend_t backends[] = { KVS_BACKEND_EPOLL, KVS_BACKEND_IO_URING };
+
+    for (size_t v = 0; v < sizeof(value_sizes) / sizeof(value_sizes[0]); v++) {
+        kvstore_t* kvs = kvs_create(KEY_COUNT * 2);
+        if (!kvs) {
+            return 1;
+        }
+        memset(value, 'v', value_sizes[v]);
+        value[value_sizes[v]] = '\0';
+        for (int key = 0; key < KEY_COUNT; key++) {
+            kvs_set(kvs, key, value);
+        }
+        char header[32];
+        size_t reply_size = (size_t)snprintf(header, sizeof(header), "$%zu\r\n", value_sizes[v]) +
+                            value_sizes[v] + 2;
+
+        for (size_t c = 0; c < sizeof(connection_counts) / sizeof(connection_counts[0]); c++) {
+            for (size_t b = 0; b < 2; b++) {
+                kvs_server_config_t config = { "127.0.0.1", BENCH_PORT, NULL, false, backends[b], NULL, 0, false };
+                kvs_server_t* server = kvs_server_create(kvs, &config);
+                pthread_t thread;
+                if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+                    fprintf(stderr, "could not start the server\n");
+                    kvs_server_destroy(server);
+                    return 1;
+                }
+
+                double rate = drive(connection_counts[c], reply_size);
+                kvs_server_stop(server);
+                pthread_join(thread, NULL);
+
+                char size[16];
+                snprintf(size, sizeof(size), value_sizes[v] >= 1024 ? "%zuK" : "%zuB",
+                         value_sizes[v] >= 1024 ? value_sizes[v] / 1024 : value_sizes[v]);
+                if (rate < 0) {
+                    printf("%-10s %12d %12s %14s\n", size, connection_counts[c],
+                           kvs_server_backend_name(server->backend), "failed");
+                    status = 1;
+                } else {
+                    printf("%-10s %12d %12s %14.0f\n", size, connection_counts[c],
+                           kvs_server_backend_name(server->backend), rate);
+                }
+                fflush(stdout);
+                kvs_server_destroy(server);
+            }
+        }
+        kvs_destroy(kvs);
+    }
+
+    free(value);
+    return status;
+}
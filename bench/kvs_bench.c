@@ -0,0 +1,588 @@
+/**
+ * kvs-bench - load generator for the library and the server
+ *
+ * Drives either the library in process (one store per thread, as the
+ * store is not thread-safe; each thread behaves like a server shard) or
+ * a kvstore-server through libkvsclient, with several connections per
+ * thread and a pipeline of outstanding requests on each. Requests are
+ * GET / SET over a key space picked from a uniform, Zipfian, sequential
+ * or hot-set distribution. Reports throughput and log-linear histogram
+ * latency percentiles, as a table or as one JSON object.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/kvstore.h"
+#include "../include/kvsclient.h"
+#include "../include/histogram.h"
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_THREADS 256
+#define MAX_CONNS 64
+#define MAX_PIPELINE 1024
+#define MAX_VALUE_SIZE RESP_MAX_BULK_LENGTH
+
+// Keys per MSET while prefilling a server
+#define PREFILL_BATCH 8192
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_ZIPF,
+    DIST_SEQUENTIAL,
+    DIST_HOTSET
+} dist_kind_t;
+
+static const char* dist_names[] = { "uniform", "zipf", "sequential", "hotset" };
+
+typedef struct {
+    const char* target;         // NULL for the library
+    int threads;
+    int conns;                  // per thread
+    int pipeline;               // outstanding requests per connection
+    double duration;            // seconds, when requests is 0
+    uint64_t requests;          // total
+    double read_ratio;
+    int keys;
+    size_t value_min;
+    size_t value_max;
+    dist_kind_t dist;
+    double zipf_theta;
+    double hot_fraction;        // share of the keys that are hot
+    double hot_probability;     // share of the requests that go to them
+    bool prefill;
+    bool json;
+} bench_config_t;
+
+/**
+ * Zipfian generator constants (Gray et al., "Quickly generating
+ * billion-record synthetic databases"), shared by all threads
+ */
+typedef struct {
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf_t;
+
+typedef struct {
+    const bench_config_t* config;
+    const zipf_t* zipf;
+    int index;
+    uint64_t rng;
+    uint64_t sequence;
+    uint64_t quota;             // requests to issue, 0 for the duration
+    uint64_t issued;
+    uint64_t done;
+    uint64_t errors;
+    double deadline;
+    bool running;
+    histogram_t reads;
+    histogram_t writes;
+    kvstore_t* kvs;             // library mode
+    char* value;                // value bytes, value_max long
+} worker_t;
+
+/**
+ * One outstanding request of a connection
+ */
+typedef struct {
+    worker_t* worker;
+    kvsc_conn_t* conn;
+    uint64_t start;
+    bool read;
+} slot_t;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    // splitmix64
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static double next_unit(uint64_t* state) {
+    return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double zeta(int n, double theta) {
+    double sum = 0;
+    for (int i = 1; i <= n; i++) {
+        sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void zipf_init(zipf_t* zipf, int n, double theta) {
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = zeta(n, theta);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / zipf->zetan);
+}
+
+static int next_key(worker_t* worker) {
+    const bench_config_t* config = worker->config;
+    int n = config->keys;
+    switch (config->dist) {
+        case DIST_ZIPF: {
+            const zipf_t* zipf = worker->zipf;
+            double u = next_unit(&worker->rng);
+            double uz = u * zipf->zetan;
+            if (uz < 1.0) {
+                return 0;
+            }
+            if (uz < 1.0 + pow(0.5, zipf->theta)) {
+                return 1;
+            }
+            int key = (int)(n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+            return key < n ? key : n - 1;
+        }
+        case DIST_SEQUENTIAL:
+            // each thread starts at its own offset
+            return (int)((worker->sequence++ + (uint64_t)worker->index * n / config->threads) % n);
+        case DIST_HOTSET: {
+            int hot = (int)(n * config->hot_fraction);
+            if (hot < 1) {
+                hot = 1;
+            }
+            if (next_unit(&worker->rng) < config->hot_probability || hot == n) {
+                return (int)(next_random(&worker->rng) % hot);
+            }
+            return hot + (int)(next_random(&worker->rng) % (uint64_t)(n - hot));
+        }
+        default:
+            return (int)(next_random(&worker->rng) % (uint64_t)n);
+    }
+}
+
+static size_t next_value_size(worker_t* worker) {
+    const bench_config_t* config = worker->config;
+    if (config->value_max == config->value_min) {
+        return config->value_min;
+    }
+    return config->value_min + next_random(&worker->rng) % (config->value_max - config->value_min + 1);
+}
+
+/**
+ * Whether to issue another request, and count it
+ */
+static bool take_request(worker_t* worker, uint64_t now) {
+    if (worker->quota ? worker->issued >= worker->quota : (double)now / 1e9 >= worker->deadline || interrupted) {
+        worker->running = false;
+        return false;
+    }
+    worker->issued++;
+    return true;
+}
+
+static void* run_library(void* arg) {
+    worker_t* worker = arg;
+    uint64_t now = now_ns();
+    while (take_request(worker, now)) {
+        int key = next_key(worker);
+        bool read = next_unit(&worker->rng) < worker->config->read_ratio;
+        size_t len = read ? 0 : next_value_size(worker);
+
+        uint64_t start = now_ns();
+        bool ok = read ? (kvs_get(worker->kvs, key), true) : kvs_set_len(worker->kvs, key, worker->value, len);
+        now = now_ns();
+        histogram_record(read ? &worker->reads : &worker->writes, now - start);
+        worker->done++;
+        worker->errors += !ok;
+    }
+    return NULL;
+}
+
+static bool issue(slot_t* slot);
+
+static void on_reply(void* ctx, const kvsc_reply_t* reply) {
+    slot_t* slot = ctx;
+    worker_t* worker = slot->worker;
+    uint64_t now = now_ns();
+    if (!reply || reply->type == RESP_REPLY_ERROR) {
+        worker->errors++;
+    } else {
+        histogram_record(slot->read ? &worker->reads : &worker->writes, now - slot->start);
+        worker->done++;
+    }
+    if (reply && worker->running && take_request(worker, now)) {
+        issue(slot);
+    }
+}
+
+static bool issue(slot_t* slot) {
+    worker_t* worker = slot->worker;
+    char key[16];
+    size_t lens[3];
+    lens[1] = (size_t)snprintf(key, sizeof(key), "%d", next_key(worker));
+    slot->read = next_unit(&worker->rng) < worker->config->read_ratio;
+
+    const char* argv[3] = { slot->read ? "GET" : "SET", key, worker->value };
+    lens[0] = 3;
+    lens[2] = slot->read ? 0 : next_value_size(worker);
+    slot->start = now_ns();
+    if (!kvsc_async(slot->conn, slot->read ? 2 : 3, argv, lens, on_reply, slot)) {
+        worker->errors++;
+        return false;
+    }
+    return true;
+}
+
+static void* run_client(void* arg) {
+    worker_t* worker = arg;
+    const bench_config_t* config = worker->config;
+    kvsc_conn_t* conns[MAX_CONNS] = { NULL };
+    struct pollfd fds[MAX_CONNS];
+    slot_t* slots = calloc((size_t)config->conns * config->pipeline, sizeof(slot_t));
+    int open = 0;
+
+    while (slots && open < config->conns && (conns[open] = kvsc_connect(config->target, 10000))) {
+        fds[open].fd = kvsc_fd(conns[open]);
+        fds[open].events = POLLIN;
+        open++;
+    }
+    if (open < config->conns) {
+        fprintf(stderr, "kvs-bench: could not connect to %s: %s\n", config->target,
+                kvs_error_string(kvs_get_error()));
+        worker->errors++;
+        worker->running = false;
+    }
+
+    for (int c = 0; worker->running && c < open; c++) {
+        for (int d = 0; d < config->pipeline && take_request(worker, now_ns()); d++) {
+            slot_t* slot = &slots[c * config->pipeline + d];
+            slot->worker = worker;
+            slot->conn = conns[c];
+            issue(slot);
+        }
+    }
+
+    // run until every connection has drained
+    for (;;) {
+        size_t pending = 0;
+        int handled = 0;
+        for (int c = 0; c < open; c++) {
+            int n = kvsc_poll(conns[c], 0);
+            if (n < 0 || !kvsc_flush(conns[c])) {
+                pending = 0;
+                worker->running = false;
+                break;
+            }
+            handled += n;
+            pending += kvsc_pending(conns[c]);
+        }
+        if (pending == 0) {
+            break;
+        }
+        if (handled == 0) {
+            poll(fds, (nfds_t)open, 100);
+        }
+    }
+
+    for (int c = 0; c < open; c++) {
+        kvsc_close(conns[c]);
+    }
+    free(slots);
+    return NULL;
+}
+
+/**
+ * Fill every key, so that reads hit
+ */
+static bool prefill(const bench_config_t* config, worker_t* workers) {
+    char* value = workers[0].value;
+    size_t len = config->value_min;
+
+    if (!config->target) {
+        for (int t = 0; t < config->threads; t++) {
+            for (int key = 0; key < config->keys; key++) {
+                if (!kvs_set_len(workers[t].kvs, key, value, len)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    kvsc_conn_t* conn = kvsc_connect(config->target, 30000);
+    int* keys = malloc(PREFILL_BATCH * sizeof(int));
+    const char** values = malloc(PREFILL_BATCH * sizeof(char*));
+    size_t* lens = malloc(PREFILL_BATCH * sizeof(size_t));
+    bool ok = conn && keys && values && lens;
+    for (int base = 0; ok && base < config->keys; base += PREFILL_BATCH) {
+        int n = config->keys - base < PREFILL_BATCH ? config->keys - base : PREFILL_BATCH;
+        for (int i = 0; i < n; i++) {
+            keys[i] = base + i;
+            values[i] = value;
+            lens[i] = len;
+        }
+        ok = kvsc_mset(conn, keys, values, lens, (size_t)n);
+    }
+    kvsc_close(conn);
+    free(keys);
+    free(values);
+    free(lens);
+    return ok;
+}
+
+static void print_usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --target <lib | host:port | socket>  What to drive (default lib)\n");
+    printf("  -t <threads>          Threads (default 4)\n");
+    printf("  -c <conns>            Connections per thread (default 1)\n");
+    printf("  -P <depth>            Outstanding requests per connection (default 1)\n");
+    printf("  -d <seconds>          Run time (default 5)\n");
+    printf("  -n <requests>         Stop after this many requests instead\n");
+    printf("  -r <ratio>            Share of reads, 0 to 1 (default 0.9)\n");
+    printf("  -k <keys>             Key space (default 100000)\n");
+    printf("  -v <bytes>[-<bytes>]  Value size, or a range (default 32)\n");
+    printf("  --dist <name>         uniform, zipf[:theta], sequential,\n"
+           "                        hotset[:fraction:probability] (default uniform,\n"
+           "                        zipf:0.99, hotset:0.01:0.9)\n");
+    printf("  --no-prefill          Start from an empty store\n");
+    printf("  --json                Print one JSON object instead of a table\n");
+}
+
+static bool parse_dist(const char* text, bench_config_t* config) {
+    for (int i = 0; i < (int)(sizeof(dist_names) / sizeof(dist_names[0])); i++) {
+        size_t len = strlen(dist_names[i]);
+        if (strncmp(text, dist_names[i], len) == 0 && (text[len] == '\0' || text[len] == ':')) {
+            config->dist = (dist_kind_t)i;
+            const char* params = text[len] == ':' ? text + len + 1 : NULL;
+            if (params && config->dist == DIST_ZIPF) {
+                config->zipf_theta = atof(params);
+            } else if (params && config->dist == DIST_HOTSET) {
+                return sscanf(params, "%lf:%lf", &config->hot_fraction, &config->hot_probability) == 2;
+            } else if (params) {
+                return false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_args(int argc, char* argv[], bench_config_t* config) {
+    for (int i = 1; i < argc; i++) {
+        const char* next = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--target") == 0 && next) {
+            config->target = strcmp(next, "lib") == 0 ? NULL : next;
+        } else if (strcmp(argv[i], "-t") == 0 && next) {
+            config->threads = atoi(next);
+        } else if (strcmp(argv[i], "-c") == 0 && next) {
+            config->conns = atoi(next);
+        } else if (strcmp(argv[i], "-P") == 0 && next) {
+            config->pipeline = atoi(next);
+        } else if (strcmp(argv[i], "-d") == 0 && next) {
+            config->duration = atof(next);
+        } else if (strcmp(argv[i], "-n") == 0 && next) {
+            config->requests = strtoull(next, NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0 && next) {
+            config->read_ratio = atof(next);
+        } else if (strcmp(argv[i], "-k") == 0 && next) {
+            config->keys = atoi(next);
+        } else if (strcmp(argv[i], "-v") == 0 && next) {
+            unsigned long long min, max;
+            int fields = sscanf(next, "%llu-%llu", &min, &max);
+            if (fields < 1) {
+                return false;
+            }
+            config->value_min = (size_t)min;
+            config->value_max = (size_t)(fields == 2 ? max : min);
+        } else if (strcmp(argv[i], "--dist") == 0 && next) {
+            if (!parse_dist(next, config)) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--no-prefill") == 0) {
+            config->prefill = false;
+            continue;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            config->json = true;
+            continue;
+        } else {
+            return false;
+        }
+        i++;
+    }
+
+    return config->threads >= 1 && config->threads <= MAX_THREADS && config->conns >= 1 &&
+           config->conns <= MAX_CONNS && config->pipeline >= 1 && config->pipeline <= MAX_PIPELINE &&
+           (config->requests > 0 || config->duration > 0) && config->read_ratio >= 0 &&
+           config->read_ratio <= 1 && config->keys >= 2 && config->value_min >= 1 &&
+           config->value_min <= config->value_max && config->value_max <= MAX_VALUE_SIZE &&
+           config->zipf_theta > 0 && config->zipf_theta < 1 && config->hot_fraction > 0 &&
+           config->hot_fraction <= 1 && config->hot_probability >= 0 && config->hot_probability <= 1;
+}
+
+static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+static const char* percentile_names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+#define PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+static void print_row(const char* name, const histogram_t* hist, double seconds) {
+    printf("%-6s %12llu %12.0f %9.2f", name, (unsigned long long)hist->total, hist->total / seconds,
+           histogram_mean(hist) / 1e3);
+    for (size_t i = 0; i < PERCENTILES; i++) {
+        printf(" %9.2f", histogram_percentile(hist, percentiles[i]) / 1e3);
+    }
+    printf(" %9.2f\n", hist->max / 1e3);
+}
+
+static void print_json_latency(const char* name, const histogram_t* hist, bool last) {
+    printf("\"%s\":{\"requests\":%llu,\"mean\":%.3f", name, (unsigned long long)hist->total,
+           histogram_mean(hist) / 1e3);
+    for (size_t i = 0; i < PERCENTILES; i++) {
+        printf(",\"%s\":%.3f", percentile_names[i], histogram_percentile(hist, percentiles[i]) / 1e3);
+    }
+    printf(",\"max\":%.3f}%s", hist->max / 1e3, last ? "" : ",");
+}
+
+static void report(const bench_config_t* config, const histogram_t* reads, const histogram_t* writes,
+                   uint64_t errors, double seconds) {
+    histogram_t* all = malloc(sizeof(histogram_t));
+    if (!all) {
+        return;
+    }
+    histogram_reset(all);
+    histogram_merge(all, reads);
+    histogram_merge(all, writes);
+    const char* target = config->target ? config->target : "lib";
+
+    if (config->json) {
+        printf("{\"target\":\"%s\",\"threads\":%d,\"connections\":%d,\"pipeline\":%d,\"keys\":%d,"
+               "\"distribution\":\"%s\",\"read_ratio\":%.3f,\"value_min\":%zu,\"value_max\":%zu,"
+               "\"seconds\":%.3f,\"requests\":%llu,\"errors\":%llu,\"ops_per_sec\":%.0f,\"latency_us\":{",
+               target, config->threads, config->target ? config->conns : 0, config->target ? config->pipeline : 0,
+               config->keys, dist_names[config->dist], config->read_ratio, config->value_min, config->value_max,
+               seconds, (unsigned long long)all->total, (unsigned long long)errors, all->total / seconds);
+        print_json_latency("all", all, false);
+        print_json_latency("get", reads, false);
+        print_json_latency("set", writes, true);
+        printf("}}\n");
+    } else {
+        printf("kvs-bench: %s, %d threads", target, config->threads);
+        if (config->target) {
+            printf(" x %d connections, pipeline %d", config->conns, config->pipeline);
+        }
+        printf(", %d keys %s, %.0f%% reads, values %zu", config->keys, dist_names[config->dist],
+               config->read_ratio * 100, config->value_min);
+        if (config->value_max != config->value_min) {
+            printf("-%zu", config->value_max);
+        }
+        printf(" B, %.2f s\n\n", seconds);
+        printf("%-6s %12s %12s %9s", "", "requests", "ops/s", "mean us");
+        for (size_t i = 0; i < PERCENTILES; i++) {
+            printf(" %9s", percentile_names[i]);
+        }
+        printf(" %9s\n", "max");
+        print_row("all", all, seconds);
+        print_row("get", reads, seconds);
+        print_row("set", writes, seconds);
+        if (errors > 0) {
+            printf("\nerrors: %llu\n", (unsigned long long)errors);
+        }
+    }
+    free(all);
+}
+
+int main(int argc, char* argv[]) {
+    bench_config_t config = { NULL, 4, 1, 1, 5.0, 0, 0.9, 100000, 32, 32, DIST_UNIFORM, 0.99, 0.01, 0.9,
+                              true, false };
+    if (!parse_args(argc, argv, &config)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    zipf_t zipf;
+    if (config.dist == DIST_ZIPF) {
+        zipf_init(&zipf, config.keys, config.zipf_theta);
+    }
+
+    worker_t* workers = calloc((size_t)config.threads, sizeof(worker_t));
+    char* value = malloc(config.value_max);
+    if (!workers || !value) {
+        fprintf(stderr, "kvs-bench: out of memory\n");
+        return 1;
+    }
+    memset(value, 'x', config.value_max);
+
+    uint64_t per_thread = config.requests / (uint64_t)config.threads;
+    for (int t = 0; t < config.threads; t++) {
+        worker_t* worker = &workers[t];
+        worker->config = &config;
+        worker->zipf = &zipf;
+        worker->index = t;
+        worker->rng = 0x1234567ull * (uint64_t)(t + 1);
+        worker->quota = config.requests ? per_thread + ((uint64_t)t < config.requests % config.threads) : 0;
+        worker->running = true;
+        worker->value = value;
+        histogram_reset(&worker->reads);
+        histogram_reset(&worker->writes);
+        if (!config.target && !(worker->kvs = kvs_create((size_t)config.keys * 2))) {
+            fprintf(stderr, "kvs-bench: could not create a store\n");
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_signal);
+    if (config.prefill && !prefill(&config, workers)) {
+        fprintf(stderr, "kvs-bench: prefill failed: %s\n", kvs_error_string(kvs_get_error()));
+        return 1;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    uint64_t start = now_ns();
+    for (int t = 0; t < config.threads; t++) {
+        workers[t].deadline = start / 1e9 + config.duration;
+        if (pthread_create(&threads[t], NULL, config.target ? run_client : run_library, &workers[t]) != 0) {
+            fprintf(stderr, "kvs-bench: could not start thread %d\n", t);
+            return 1;
+        }
+    }
+    for (int t = 0; t < config.threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    histogram_t* reads = malloc(sizeof(histogram_t));
+    histogram_t* writes = malloc(sizeof(histogram_t));
+    uint64_t errors = 0;
+    if (!reads || !writes) {
+        return 1;
+    }
+    histogram_reset(reads);
+    histogram_reset(writes);
+    for (int t = 0; t < config.threads; t++) {
+        histogram_merge(reads, &workers[t].reads);
+        histogram_merge(writes, &workers[t].writes);
+        errors += workers[t].errors;
+        kvs_destroy(workers[t].kvs);
+    }
+    report(&config, reads, writes, errors, seconds);
+
+    free(reads);
+    free(writes);
+    free(workers);
+    free(value);
+    return errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * mapped_bench.c - Persistent-heap (mapped) mode vs snapshot mode
+ *
+ * For each dataset size, measures:
+ * - insert and overwrite cost per operation in both modes
+ * - durability cost: full snapshot save vs checkpoint of dirty pages
+ * - restart time: create + snapshot load vs mmap + header check
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/kvstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_FILENAME "mapped_bench.bin"
+#define MAPPED_FILENAME "mapped_bench.kvm"
+#define VALUE_SIZE 64
+
+static const size_t default_sizes[] = { 10000, 100000, 500000 };
+
+/**
+ * Timings for one mode at one dataset size
+ */
+typedef struct {
+    double insert_ns;       // per op, fresh keys
+    double overwrite_ns;    // per op, same-size values
+    double durable_ms;      // save (snapshot) or checkpoint (mapped)
+    double restart_ms;      // load (snapshot) or open (mapped)
+    bool verified;          // all keys present after restart
+} mode_result_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void make_value(char* buf, int round, int key) {
+    int len = snprintf(buf, VALUE_SIZE + 1, "r%d:k%d:", round, key);
+    memset(buf + len, 'v', VALUE_SIZE - len);
+    buf[VALUE_SIZE] = '\0';
+}
+
+/**
+ * Write every key, return nanoseconds per operation
+ */
+static double write_all(kvstore_t* kvs, size_t entries, int round) {
+    char value[VALUE_SIZE + 1];
+    double start = now_ms();
+    for (size_t i = 0; i < entries; i++) {
+        make_value(value, round, (int)i);
+        kvs_set(kvs, (int)i, value);
+    }
+    return (now_ms() - start) * 1e6 / entries;
+}
+
+static bool verify_all(kvstore_t* kvs, size_t entries, int round) {
+    char value[VALUE_SIZE + 1];
+    if (kvs_count(kvs) != entries) {
+        return false;
+    }
+    for (size_t i = 0; i < entries; i++) {
+        const char* got = kvs_get(kvs, (int)i);
+        make_value(value, round, (int)i);
+        if (!got || strcmp(got, value) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_snapshot(size_t entries, mode_result_t* r) {
+    kvstore_t* kvs = kvs_create(0);
+    if (!kvs) {
+        return false;
+    }
+
+    r->insert_ns = write_all(kvs, entries, 0);
+    r->overwrite_ns = write_all(kvs, entries, 1);
+
+    double start = now_ms();
+    bool ok = kvs_save(kvs, SNAPSHOT_FILENAME);
+    r->durable_ms = now_ms() - start;
+    kvs_destroy(kvs);
+    if (!ok) {
+        return false;
+    }
+
+    start = now_ms();
+    kvs = kvs_create(0);
+    ok = kvs && kvs_load(kvs, SNAPSHOT_FILENAME);
+    r->restart_ms = now_ms() - start;
+
+    r->verified = ok && verify_all(kvs, entries, 1);
+    kvs_destroy(kvs);
+    unlink(SNAPSHOT_FILENAME);
+    return ok;
+}
+
+static bool run_mapped(size_t entries, mode_result_t* r) {
+    unlink(MAPPED_FILENAME);
+    kvstore_t* kvs = kvs_open_mapped(MAPPED_FILENAME, 0);
+    if (!kvs) {
+        return false;
+    }
+
+    r->insert_ns = write_all(kvs, entries, 0);
+    kvs_checkpoint(kvs);
+    r->overwrite_ns = write_all(kvs, entries, 1);
+
+    double start = now_ms();
+    bool ok = kvs_checkpoint(kvs);
+    r->durable_ms = now_ms() - start;
+    kvs_destroy(kvs);
+    if (!ok) {
+        return false;
+    }
+
+    start = now_ms();
+    kvs = kvs_open_mapped(MAPPED_FILENAME, 0);
+    r->restart_ms = now_ms() - start;
+
+    r->verified = kvs && verify_all(kvs, entries, 1);
+    kvs_destroy(kvs);
+    unlink(MAPPED_FILENAME);
+    return kvs != NULL;
+}
+
+int main(int argc, char* argv[]) {
+    size_t sizes[32];
+    size_t size_count = 0;
+
+    for (int i = 1; i < argc && size_count < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        sizes[size_count++] = (size_t)strtoul(argv[i], NULL, 10);
+    }
+    if (size_count == 0) {
+        size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    printf("Mapped (persistent-heap) mode vs snapshot mode\n\n");
+    printf("%10s %9s %12s %14s %14s %12s %9s\n",
+           "entries", "mode", "insert ns", "overwrite ns", "durable ms", "restart ms", "verified");
+
+    bool all_ok = true;
+    for (size_t i = 0; i < size_count; i++) {
+        mode_result_t snap = {0};
+        mode_result_t mapped = {0};
+
+        if (!run_snapshot(sizes[i], &snap) || !run_mapped(sizes[i], &mapped)) {
+            printf("%10zu  failed: %s\n", sizes[i], kvs_error_string(kvs_get_error()));
+            all_ok = false;
+            continue;
+        }
+
+        printf("%10zu %9s %12.1f %14.1f %14.2f %12.2f %9s\n", sizes[i], "snapshot",
+               snap.insert_ns, snap.overwrite_ns, snap.durable_ms, snap.restart_ms,
+               snap.verified ? "yes" : "NO");
+        printf("%10s %9s %12.1f %14.1f %14.2f %12.2f %9s\n", "", "mapped",
+               mapped.insert_ns, mapped.overwrite_ns, mapped.durable_ms, mapped.restart_ms,
+               mapped.verified ? "yes" : "NO");
+
+        all_ok = all_ok && snap.verified && mapped.verified;
+    }
+
+    printf("\ndurable = snapshot save / dirty-page checkpoint, "
+           "restart = create+load / mmap+header check\n");
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,354 @@
+/**
+ * multikey_bench.c - Multi-key calls vs single-key loops
+ *
+ * Library: kvs_mget / kvs_mset / kvs_mdel on batches of random keys
+ * against a loop of kvs_get / kvs_set / kvs_delete over the same keys,
+ * on a table much bigger than the caches, plus bulk inserts into an empty
+ * store (one resize per batch vs growing step by step).
+ * Server: one client over a Unix socket waiting for each reply, sending
+ * BATCH single-key requests vs one MGET / MSET / MDEL.
+ * Protocol: the same batches through libkvsclient, RESP (kvsc_mget /
+ * kvsc_mset / MDEL) vs binary frames (kvsc_bin_*), client encoding and
+ * decoding included.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/kvstore.h"
+#include "../include/server.h"
+#include "../include/kvsclient.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STORE_KEYS 2000000
+#define BATCH 100
+#define LIBRARY_KEYS 2000000
+#define INSERT_KEYS 1000000
+#define SERVER_KEYS 200000
+#define PROTOCOL_VALUE 64
+#define SOCKET_PATH "multikey_bench.sock"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return *state >> 33;
+}
+
+static void random_keys(int* keys, size_t count, uint64_t seed) {
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = (int)(next_random(&seed) % STORE_KEYS);
+    }
+}
+
+static void report(const char* what, size_t keys, double single, double batched) {
+    printf("%-28s %14.0f %14.0f %9.2fx\n", what, keys / single, keys / batched, single / batched);
+}
+
+static void bench_library(void) {
+    kvstore_t* kvs = kvs_create(STORE_KEYS * 2);
+    int* keys = malloc(LIBRARY_KEYS * sizeof(int));
+    const char** values = malloc(LIBRARY_KEYS * sizeof(char*));
+    size_t* lens = malloc(LIBRARY_KEYS * sizeof(size_t));
+    if (!kvs || !keys || !values || !lens) {
+        exit(1);
+    }
+
+    char value[32];
+    for (int key = 0; key < STORE_KEYS; key++) {
+        snprintf(value, sizeof(value), "value-%d", key);
+        kvs_set(kvs, key, value);
+    }
+    for (size_t i = 0; i < LIBRARY_KEYS; i++) {
+        values[i] = "updated";
+        lens[i] = 7;
+    }
+
+    printf("Library, batches of %d random keys over %d entries\n", BATCH, STORE_KEYS);
+    printf("%-28s %14s %14s %10s\n", "", "single keys/s", "batched keys/s", "speedup");
+
+    random_keys(keys, LIBRARY_KEYS, 1);
+    volatile size_t sink = 0;
+    double start = now_sec();
+    for (size_t i = 0; i < LIBRARY_KEYS; i++) {
+        sink += kvs_get(kvs, keys[i]) != NULL;
+    }
+    double single = now_sec() - start;
+    start = now_sec();
+    for (size_t i = 0; i < LIBRARY_KEYS; i += BATCH) {
+        sink += kvs_mget(kvs, keys + i, BATCH, values + i);
+    }
+    report("get / mget", LIBRARY_KEYS, single, now_sec() - start);
+    for (size_t i = 0; i < LIBRARY_KEYS; i++) {
+        values[i] = "updated";
+    }
+
+    random_keys(keys, LIBRARY_KEYS, 2);
+    start = now_sec();
+    for (size_t i = 0; i < LIBRARY_KEYS; i++) {
+        kvs_set_len(kvs, keys[i], values[i], lens[i]);
+    }
+    single = now_sec() - start;
+    random_keys(keys, LIBRARY_KEYS, 3);
+    start = now_sec();
+    for (size_t i = 0; i < LIBRARY_KEYS; i += BATCH) {
+        kvs_mset(kvs, keys + i, values + i, lens + i, BATCH);
+    }
+    report("set / mset (existing keys)", LIBRARY_KEYS, single, now_sec() - start);
+
+    random_keys(keys, LIBRARY_KEYS, 4);
+    start = now_sec();
+    for (size_t i = 0; i < LIBRARY_KEYS / 2; i++) {
+        sink += kvs_delete(kvs, keys[i]);
+    }
+    single = now_sec() - start;
+    start = now_sec();
+    for (size_t i = LIBRARY_KEYS / 2; i < LIBRARY_KEYS; i += BATCH) {
+        sink += kvs_mdel(kvs, keys + i, BATCH, NULL);
+    }
+    report("delete / mdel", LIBRARY_KEYS / 2, single, now_sec() - start);
+    kvs_destroy(kvs);
+
+    // fresh stores: growing by doubling as keys arrive vs once per batch
+    for (size_t i = 0; i < INSERT_KEYS; i++) {
+        keys[i] = (int)i;
+    }
+    kvstore_t* grown = kvs_create(0);
+    kvstore_t* reserved = kvs_create(0);
+    if (!grown || !reserved) {
+        exit(1);
+    }
+    start = now_sec();
+    for (size_t i = 0; i < INSERT_KEYS; i++) {
+        kvs_set_len(grown, keys[i], values[i], lens[i]);
+    }
+    single = now_sec() - start;
+    start = now_sec();
+    kvs_mset(reserved, keys, values, lens, INSERT_KEYS);
+    report("insert 1M into empty store", INSERT_KEYS, single, now_sec() - start);
+    kvs_destroy(grown);
+    kvs_destroy(reserved);
+
+    free(keys);
+    free(values);
+    free(lens);
+    (void)sink;
+}
+
+static void* run_server(void* arg) {
+    kvs_server_run(arg);
+    return NULL;
+}
+
+/**
+ * Send a request and read until replies replies have arrived
+ * (each counted by its line ending; values here have no CRLF inside)
+ */
+static bool round_trip(int sock, const char* request, size_t len, size_t lines) {
+    static char buffer[256 * 1024];
+    if (write(sock, request, len) != (ssize_t)len) {
+        return false;
+    }
+    size_t seen = 0;
+    while (seen < lines) {
+        ssize_t n = read(sock, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return false;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            seen += buffer[i] == '\n';
+        }
+    }
+    return true;
+}
+
+/**
+ * Time SERVER_KEYS keys through single-key requests, one at a time,
+ * then through multi-key requests of BATCH keys
+ */
+static void bench_command(int sock, const char* single_name, const char* multi_name, bool with_value,
+                          size_t multi_lines) {
+    char request[BATCH * 32];
+    uint64_t seed = 9;
+    bool ok = true;
+
+    double start = now_sec();
+    for (size_t i = 0; ok && i < SERVER_KEYS; i++) {
+        int key = (int)(next_random(&seed) % SERVER_KEYS);
+        int len = with_value ? snprintf(request, sizeof(request), "%s %d v\r\n", single_name, key)
+                             : snprintf(request, sizeof(request), "%s %d\r\n", single_name, key);
+        // a GET hit answers in two lines, a miss or the rest in one
+        ok = round_trip(sock, request, (size_t)len, strcmp(single_name, "GET") == 0 ? 2 : 1);
+    }
+    double single = now_sec() - start;
+
+    start = now_sec();
+    for (size_t i = 0; ok && i < SERVER_KEYS; i += BATCH) {
+        size_t len = (size_t)snprintf(request, sizeof(request), "%s", multi_name);
+        for (int k = 0; k < BATCH; k++) {
+            int key = (int)(next_random(&seed) % SERVER_KEYS);
+            len += (size_t)snprintf(request + len, sizeof(request) - len, with_value ? " %d v" : " %d", key);
+        }
+        len += (size_t)snprintf(request + len, sizeof(request) - len, "\r\n");
+        ok = round_trip(sock, request, len, multi_lines);
+    }
+    double batched = now_sec() - start;
+
+    char what[32];
+    snprintf(what, sizeof(what), "%s / %s", single_name, multi_name);
+    if (ok) {
+        report(what, SERVER_KEYS, single, batched);
+    } else {
+        printf("%-28s failed\n", what);
+    }
+}
+
+/**
+ * Time SERVER_KEYS keys through batches of batch keys, RESP vs binary
+ * @param op 0 for SET, 1 for GET, 2 for DEL
+ */
+static void bench_protocol(kvsc_conn_t* conn, int op, size_t batch) {
+    int* keys = malloc(SERVER_KEYS * sizeof(int));
+    const char** values = malloc(batch * sizeof(char*));
+    size_t* lens = malloc(batch * sizeof(size_t));
+    if (!keys || !values || !lens) {
+        exit(1);
+    }
+    static char value[PROTOCOL_VALUE];
+    memset(value, 'v', sizeof(value));
+    const char* mdel[1 + BATCH * 10];
+    size_t mdel_lens[1 + BATCH * 10];
+    char numbers[BATCH * 10][16];
+
+    double elapsed[2];
+    bool ok = true;
+    for (int binary = 0; binary < 2; binary++) {
+        random_keys(keys, SERVER_KEYS, 11);
+        for (size_t i = 0; i < SERVER_KEYS; i++) {
+            keys[i] %= SERVER_KEYS;
+        }
+        for (size_t i = 0; ok && op == 2 && i + batch <= SERVER_KEYS; i += batch) {
+            // both deletes find the keys there
+            for (size_t k = 0; k < batch; k++) {
+                values[k] = value;
+                lens[k] = sizeof(value);
+            }
+            ok = kvsc_bin_mset(conn, keys + i, values, lens, batch);
+        }
+        double start = now_sec();
+        for (size_t i = 0; ok && i + batch <= SERVER_KEYS; i += batch) {
+            size_t deleted;
+            switch (op) {
+                case 0:
+                    for (size_t k = 0; k < batch; k++) {
+                        values[k] = value;
+                        lens[k] = sizeof(value);
+                    }
+                    ok = binary ? kvsc_bin_mset(conn, keys + i, values, lens, batch)
+                                : kvsc_mset(conn, keys + i, values, lens, batch);
+                    break;
+                case 1:
+                    ok = binary ? kvsc_bin_mget(conn, keys + i, batch, values, lens)
+                                : kvsc_mget(conn, keys + i, batch, values, lens);
+                    break;
+                default:
+                    if (binary) {
+                        ok = kvsc_bin_mdel(conn, keys + i, batch, &deleted);
+                        break;
+                    }
+                    // the client has no RESP batch delete, build the MDEL
+                    mdel[0] = "MDEL";
+                    mdel_lens[0] = 4;
+                    for (size_t k = 0; k < batch; k++) {
+                        mdel_lens[k + 1] = (size_t)snprintf(numbers[k], sizeof(numbers[k]), "%d", keys[i + k]);
+                        mdel[k + 1] = numbers[k];
+                    }
+                    ok = kvsc_command(conn, batch + 1, mdel, mdel_lens) != NULL;
+                    break;
+            }
+        }
+        elapsed[binary] = now_sec() - start;
+    }
+
+    static const char* names[] = { "MSET", "MGET", "MDEL" };
+    char what[32];
+    snprintf(what, sizeof(what), "%s x %zu", names[op], batch);
+    if (ok) {
+        size_t done = SERVER_KEYS / batch * batch;
+        report(what, done, elapsed[0], elapsed[1]);
+    } else {
+        printf("%-28s failed\n", what);
+    }
+    free(keys);
+    free(values);
+    free(lens);
+}
+
+static void bench_server(void) {
+    // every key is present, so an MGET answers in 1 + 2 * BATCH lines
+    kvstore_t* kvs = kvs_create(SERVER_KEYS * 2);
+    for (int key = 0; kvs && key < SERVER_KEYS; key++) {
+        kvs_set(kvs, key, "v");
+    }
+    kvs_server_config_t config = { NULL, 0, SOCKET_PATH, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    kvs_server_t* server = kvs ? kvs_server_create(kvs, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        fprintf(stderr, "could not start the server\n");
+        exit(1);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "could not connect\n");
+        exit(1);
+    }
+
+    printf("\nServer, one client waiting for each reply, %d keys per multi-key request\n", BATCH);
+    printf("%-28s %14s %14s %10s\n", "", "single keys/s", "batched keys/s", "speedup");
+    bench_command(sock, "SET", "MSET", true, 1);
+    bench_command(sock, "GET", "MGET", false, 1 + 2 * BATCH);
+    bench_command(sock, "DEL", "MDEL", false, 1);
+    close(sock);
+
+    kvsc_conn_t* conn = kvsc_connect(SOCKET_PATH, 0);
+    if (!conn) {
+        fprintf(stderr, "could not connect\n");
+        exit(1);
+    }
+    printf("\nServer, one client through libkvsclient, %d-byte values\n", PROTOCOL_VALUE);
+    printf("%-28s %14s %14s %10s\n", "", "RESP keys/s", "binary keys/s", "speedup");
+    size_t batches[] = { BATCH, BATCH * 10 };
+    for (size_t b = 0; b < 2; b++) {
+        for (int op = 0; op < 3; op++) {
+            bench_protocol(conn, op, batches[b]);
+        }
+    }
+    kvsc_close(conn);
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+    kvs_destroy(kvs);
+}
+
+int main(void) {
+    bench_library();
+    bench_server();
+    return 0;
+}
@@ -0,0 +1,249 @@
+/**
+ * parser_bench.c - Command parsing cost per line
+ *
+ * Compares the CLI's previous parsing path (trim, strtok, a strcmp
+ * chain, strtok + strlen again in the set handler, strtol for keys)
+ * with the shared tokenizer and perfect-hash command table, on the same
+ * mix of lines. Also reports RESP request parsing cost for a pipelined
+ * buffer of the same commands. No store work is done, only parsing.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/command.h"
+#include "../include/resp.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LINE_COUNT 100000
+#define ROUNDS 20
+#define LINE_SIZE 128
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Previous CLI parsing path, kept here as the baseline
+ */
+static char* legacy_trim(char* str) {
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    if (*str == '\0') {
+        return str;
+    }
+    char* end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) {
+        end--;
+    }
+    end[1] = '\0';
+    return str;
+}
+
+static bool legacy_parse_int(const char* str, int* result) {
+    char* endptr;
+    long val = strtol(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || val > INT32_MAX || val < INT32_MIN) {
+        return false;
+    }
+    *result = (int)val;
+    return true;
+}
+
+static uint64_t legacy_parse(char* line) {
+    line = legacy_trim(line);
+    if (strlen(line) == 0) {
+        return 0;
+    }
+
+    char* command = strtok(line, " \t");
+    char* args = strtok(NULL, "");
+    if (!args) {
+        args = "";
+    }
+
+    int key = 0;
+    if (strcmp(command, "set") == 0) {
+        char* key_str = strtok(args, " \t");
+        char* value = strtok(NULL, "");
+        if (!key_str || !legacy_parse_int(key_str, &key) || !value) {
+            return 1;
+        }
+        value = legacy_trim(value);
+        if (strlen(value) == 0 || strlen(value) > 512) {
+            return 1;
+        }
+        return 2 + (uint64_t)key + strlen(value);
+    } else if (strcmp(command, "get") == 0) {
+        legacy_parse_int(legacy_trim(args), &key);
+        return 3 + (uint64_t)key;
+    } else if (strcmp(command, "delete") == 0 || strcmp(command, "del") == 0) {
+        legacy_parse_int(legacy_trim(args), &key);
+        return 4 + (uint64_t)key;
+    } else if (strcmp(command, "list") == 0 || strcmp(command, "ls") == 0) {
+        return 5;
+    } else if (strcmp(command, "stats") == 0) {
+        return 6;
+    } else if (strcmp(command, "save") == 0) {
+        return 7;
+    } else if (strcmp(command, "load") == 0) {
+        return 8;
+    } else if (strcmp(command, "clear") == 0) {
+        return 9;
+    } else if (strcmp(command, "handoff") == 0) {
+        return 10;
+    } else if (strcmp(command, "help") == 0 || strcmp(command, "?") == 0) {
+        return 11;
+    } else if (strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0) {
+        return 12;
+    }
+    return 13;
+}
+
+/**
+ * Tokenizer + perfect-hash path, mirroring what main.c now does
+ */
+static uint64_t slice_parse(char* line, size_t len) {
+    kvs_tokenizer_t tok;
+    kvs_tokenizer_init(&tok, line, len);
+
+    kvs_slice_t name;
+    if (!kvs_next_token(&tok, &name)) {
+        return 0;
+    }
+
+    int key = 0;
+    kvs_slice_t arg;
+    switch (kvs_command_lookup(name)) {
+        case KVS_CMD_SET: {
+            if (!kvs_next_token(&tok, &arg) || !kvs_slice_to_int(arg, &key)) {
+                return 1;
+            }
+            kvs_slice_t value = kvs_rest_of_line(&tok);
+            if (value.len == 0 || value.len > 512) {
+                return 1;
+            }
+            return 2 + (uint64_t)key + value.len;
+        }
+        case KVS_CMD_GET:
+            kvs_slice_to_int(kvs_rest_of_line(&tok), &key);
+            return 3 + (uint64_t)key;
+        case KVS_CMD_DEL:
+            kvs_slice_to_int(kvs_rest_of_line(&tok), &key);
+            return 4 + (uint64_t)key;
+        case KVS_CMD_LIST: return 5;
+        case KVS_CMD_STATS: return 6;
+        case KVS_CMD_SAVE: return 7;
+        case KVS_CMD_LOAD: return 8;
+        case KVS_CMD_CLEAR: return 9;
+        case KVS_CMD_HANDOFF: return 10;
+        case KVS_CMD_HELP: return 11;
+        case KVS_CMD_QUIT: return 12;
+        default: return 13;
+    }
+}
+
+/**
+ * Mostly sets and gets, some deletes and a sprinkling of the rest
+ */
+static void make_line(char* buf, size_t size, int i) {
+    static const char* others[] = { "stats", "list", "help", "clear", "save", "exit" };
+    int kind = i % 20;
+    if (kind < 9) {
+        snprintf(buf, size, "set %d value_for_key_%d\n", i, i);
+    } else if (kind < 17) {
+        snprintf(buf, size, "get %d\n", i);
+    } else if (kind < 19) {
+        snprintf(buf, size, "delete %d\n", i);
+    } else {
+        snprintf(buf, size, "%s\n", others[(i / 20) % 6]);
+    }
+}
+
+int main(void) {
+    char (*lines)[LINE_SIZE] = malloc(sizeof(*lines) * LINE_COUNT);
+    size_t* lengths = malloc(sizeof(size_t) * LINE_COUNT);
+    if (!lines || !lengths) {
+        return 1;
+    }
+    for (int i = 0; i < LINE_COUNT; i++) {
+        make_line(lines[i], LINE_SIZE, i);
+        lengths[i] = strlen(lines[i]);
+    }
+
+    // strtok writes into the line, so both paths parse a fresh copy
+    char work[LINE_SIZE];
+    uint64_t legacy_sum = 0;
+    uint64_t slice_sum = 0;
+
+    double start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < LINE_COUNT; i++) {
+            memcpy(work, lines[i], lengths[i] + 1);
+            legacy_sum += legacy_parse(work);
+        }
+    }
+    double legacy_ns = (now_ns() - start) / ((double)ROUNDS * LINE_COUNT);
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < LINE_COUNT; i++) {
+            memcpy(work, lines[i], lengths[i] + 1);
+            slice_sum += slice_parse(work, lengths[i]);
+        }
+    }
+    double slice_ns = (now_ns() - start) / ((double)ROUNDS * LINE_COUNT);
+
+    // the same commands as one pipelined RESP buffer
+    resp_buf_t pipeline = { NULL, 0, 0 };
+    for (int i = 0; i < LINE_COUNT; i++) {
+        kvs_slice_t argv[4];
+        kvs_tokenizer_t tok;
+        kvs_tokenizer_init(&tok, lines[i], lengths[i]);
+        size_t argc = 0;
+        while (argc < 3 && kvs_next_token(&tok, &argv[argc])) {
+            argc++;
+        }
+        resp_add_array(&pipeline, argc);
+        for (size_t a = 0; a < argc; a++) {
+            resp_add_bulk(&pipeline, argv[a].ptr, argv[a].len);
+        }
+    }
+
+    kvs_slice_t argv[8];
+    uint64_t resp_args = 0;
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        size_t pos = 0;
+        while (pos < pipeline.len) {
+            size_t argc;
+            size_t used;
+            if (resp_parse_request(pipeline.data + pos, pipeline.len - pos, argv, 8, &argc, &used) != RESP_OK) {
+                return 1;
+            }
+            resp_args += argc + kvs_command_lookup(argv[0]);
+            pos += used;
+        }
+    }
+    double resp_ns = (now_ns() - start) / ((double)ROUNDS * LINE_COUNT);
+    resp_buf_free(&pipeline);
+
+    printf("Command parsing, %d lines x %d rounds\n\n", LINE_COUNT, ROUNDS);
+    printf("%-36s %10s\n", "path", "ns/line");
+    printf("%-36s %10.1f\n", "trim + strtok + strcmp chain", legacy_ns);
+    printf("%-36s %10.1f\n", "tokenizer + perfect hash", slice_ns);
+    printf("%-36s %10.1f\n", "RESP request + perfect hash", resp_ns);
+    printf("\nspeedup (text): %.2fx, results %s (checksum %llu)\n", legacy_ns / slice_ns,
+           legacy_sum == slice_sum ? "match" : "DIFFER", (unsigned long long)(slice_sum + resp_args));
+
+    free(lines);
+    free(lengths);
+    return legacy_sum == slice_sum ? 0 : 1;
+}
@@ -0,0 +1,314 @@
+/**
+ * recovery_bench.c - Crash-recovery benchmark and fault-injection harness
+ *
+ * For each dataset size this harness:
+ * 1. Saves a baseline snapshot
+ * 2. Injects torn writes through the persistence write hook and checks
+ *    that the previous snapshot is still what gets recovered
+ * 3. Forks writers that save in a loop, SIGKILLs them at random points
+ *    and checks that recovery yields one complete generation
+ * Recovery (load) time is measured for every trial and reported against
+ * the dataset size.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/kvstore.h"
+#include "../include/persistence.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BENCH_FILENAME "recovery_bench.bin"
+#define DEFAULT_TRIALS 5
+#define VALUE_SIZE 64
+
+/**
+ * Default dataset sizes when none are given on the command line
+ */
+static const size_t default_sizes[] = { 1000, 10000, 100000, 500000 };
+
+/**
+ * Remaining byte budget for the torn-write shim
+ */
+static size_t torn_budget = 0;
+
+/**
+ * Per-size results
+ */
+typedef struct {
+    size_t entries;
+    long file_bytes;
+    double save_ms;
+    double recovery_ms_mean;
+    double recovery_ms_max;
+    int torn_ok;
+    int torn_total;
+    int kill_ok;
+    int kill_total;
+} recovery_result_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Build the value for a key in a given generation
+ * e.g. "g3:k42:xxxx..." padded to VALUE_SIZE characters
+ */
+static void make_value(char* buf, int generation, int key) {
+    int len = snprintf(buf, VALUE_SIZE + 1, "g%d:k%d:", generation, key);
+    memset(buf + len, 'x', VALUE_SIZE - len);
+    buf[VALUE_SIZE] = '\0';
+}
+
+/**
+ * Rewrite every key with the values of the given generation
+ */
+static bool fill_generation(kvstore_t* kvs, size_t entries, int generation) {
+    char value[VALUE_SIZE + 1];
+    for (size_t i = 0; i < entries; i++) {
+        make_value(value, generation, (int)i);
+        if (!kvs_set(kvs, (int)i, value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Short-writing fwrite replacement
+ * Writes until the budget runs out, then stops mid-record
+ */
+static size_t torn_write(const void* ptr, size_t size, size_t count, FILE* file) {
+    size_t want = size * count;
+    size_t allowed = want < torn_budget ? want : torn_budget;
+
+    size_t written = fwrite(ptr, 1, allowed, file);
+    torn_budget -= written;
+    return size ? written / size : 0;
+}
+
+/**
+ * Load the snapshot into a fresh store and check it is one complete generation
+ * @return the generation found, or -1 if the data is missing or mixed
+ */
+static int recover_and_verify(size_t entries, double* elapsed_ms) {
+    double start = now_ms();
+    kvstore_t* kvs = kvs_create(entries * 2);
+    bool loaded = kvs && kvs_load(kvs, BENCH_FILENAME);
+    *elapsed_ms = now_ms() - start;
+
+    if (!loaded || kvs_count(kvs) != entries) {
+        kvs_destroy(kvs);
+        return -1;
+    }
+
+    int generation = -1;
+    char expected[VALUE_SIZE + 1];
+    for (size_t i = 0; i < entries; i++) {
+        const char* value = kvs_get(kvs, (int)i);
+        if (!value) {
+            generation = -1;
+            break;
+        }
+        if (i == 0) {
+            generation = atoi(value + 1);
+        }
+        make_value(expected, generation, (int)i);
+        if (strcmp(value, expected) != 0) {
+            generation = -1;
+            break;
+        }
+    }
+
+    kvs_destroy(kvs);
+    return generation;
+}
+
+static void record_recovery(recovery_result_t* result, double ms, int trials_done) {
+    result->recovery_ms_mean += (ms - result->recovery_ms_mean) / (trials_done + 1);
+    if (ms > result->recovery_ms_max) {
+        result->recovery_ms_max = ms;
+    }
+}
+
+/**
+ * Run the torn-write and kill trials for one dataset size
+ */
+static bool run_size(size_t entries, int trials, recovery_result_t* result) {
+    memset(result, 0, sizeof(*result));
+    result->entries = entries;
+
+    double start = now_ms();
+    kvstore_t* kvs = kvs_create(entries * 2);
+    if (!kvs || !fill_generation(kvs, entries, 0)) {
+        kvs_destroy(kvs);
+        return false;
+    }
+    double fill_ms = now_ms() - start;
+
+    // Baseline snapshot
+    start = now_ms();
+    if (!kvs_save(kvs, BENCH_FILENAME)) {
+        kvs_destroy(kvs);
+        return false;
+    }
+    result->save_ms = now_ms() - start;
+
+    result->file_bytes = -1;
+    FILE* file = fopen(BENCH_FILENAME, "rb");
+    if (file) {
+        if (fseek(file, 0, SEEK_END) == 0) {
+            result->file_bytes = ftell(file);
+        }
+        fclose(file);
+    }
+    // The torn writes cut the snapshot somewhere inside it
+    if (result->file_bytes <= 0) {
+        kvs_destroy(kvs);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    int recoveries = 0;
+    double ms;
+
+    // Torn writes: every failed save must leave generation 0 recoverable
+    for (int t = 0; t < trials; t++) {
+        fill_generation(kvs, entries, t + 1);
+        torn_budget = (size_t)rand() % (size_t)result->file_bytes;
+
+        kvs_set_write_fn(torn_write);
+        bool saved = kvs_save(kvs, BENCH_FILENAME);
+        kvs_set_write_fn(NULL);
+
+        result->torn_total++;
+        int generation = recover_and_verify(entries, &ms);
+        record_recovery(result, ms, recoveries++);
+        if (!saved && generation == 0) {
+            result->torn_ok++;
+        }
+    }
+
+    // Kills: a writer alternates generations and gets SIGKILLed mid-save
+    for (int t = 0; t < trials; t++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            break;
+        }
+        if (pid == 0) {
+            for (int generation = 1; ; generation++) {
+                fill_generation(kvs, entries, generation);
+                kvs_save(kvs, BENCH_FILENAME);
+            }
+        }
+
+        // Sleep somewhere inside the first couple of fill + save cycles
+        double delay_ms = (fill_ms + result->save_ms) * 3 * ((double)rand() / RAND_MAX);
+        struct timespec delay;
+        delay.tv_sec = (time_t)(delay_ms / 1000);
+        delay.tv_nsec = (long)((delay_ms - delay.tv_sec * 1000.0) * 1e6);
+        nanosleep(&delay, NULL);
+
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        result->kill_total++;
+        int generation = recover_and_verify(entries, &ms);
+        record_recovery(result, ms, recoveries++);
+        if (generation >= 0) {
+            result->kill_ok++;
+        }
+    }
+
+    kvs_destroy(kvs);
+    unlink(BENCH_FILENAME);
+    unlink(BENCH_FILENAME ".tmp");
+    return true;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-t trials] [-o report.csv] [entries...]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int trials = DEFAULT_TRIALS;
+    const char* report_path = NULL;
+    size_t sizes[32];
+    size_t size_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            trials = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            report_path = argv[++i];
+        } else if (argv[i][0] != '-' && size_count < sizeof(sizes) / sizeof(sizes[0])) {
+            sizes[size_count++] = (size_t)strtoul(argv[i], NULL, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (size_count == 0) {
+        size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    FILE* report = NULL;
+    if (report_path) {
+        report = fopen(report_path, "w");
+        if (!report) {
+            perror(report_path);
+            return 1;
+        }
+        fprintf(report, "entries,file_bytes,save_ms,recovery_ms_mean,recovery_ms_max,"
+                        "torn_ok,torn_total,kill_ok,kill_total\n");
+    }
+
+    srand((unsigned)time(NULL));
+
+    printf("Crash-recovery benchmark (%d torn-write + %d kill trials per size)\n\n", trials, trials);
+    printf("%10s %12s %10s %14s %14s %8s %8s\n",
+           "entries", "file bytes", "save ms", "recover ms avg", "recover ms max", "torn", "kill");
+
+    bool all_ok = true;
+    for (size_t i = 0; i < size_count; i++) {
+        recovery_result_t r;
+        if (!run_size(sizes[i], trials, &r)) {
+            printf("%10zu  setup failed: %s\n", sizes[i], kvs_error_string(kvs_get_error()));
+            all_ok = false;
+            continue;
+        }
+
+        printf("%10zu %12ld %10.2f %14.2f %14.2f %5d/%-2d %5d/%-2d\n",
+               r.entries, r.file_bytes, r.save_ms, r.recovery_ms_mean, r.recovery_ms_max,
+               r.torn_ok, r.torn_total, r.kill_ok, r.kill_total);
+        fflush(stdout);
+
+        if (report) {
+            fprintf(report, "%zu,%ld,%.3f,%.3f,%.3f,%d,%d,%d,%d\n",
+                    r.entries, r.file_bytes, r.save_ms, r.recovery_ms_mean, r.recovery_ms_max,
+                    r.torn_ok, r.torn_total, r.kill_ok, r.kill_total);
+        }
+
+        if (r.torn_ok != r.torn_total || r.kill_ok != r.kill_total) {
+            all_ok = false;
+        }
+    }
+
+    if (report) {
+        fclose(report);
+    }
+
+    printf("\n%s\n", all_ok ? "All recoveries verified" : "Recovery verification FAILED");
+    return all_ok ? 0 : 1;
+}
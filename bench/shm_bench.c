@@ -0,0 +1,141 @@
+/**
+ * shm_bench.c - Round-trip latency, Unix socket vs shared-memory rings
+ *
+ * One client through libkvsclient against an in-process server, waiting
+ * for each reply: GET, SET and a single-key binary GET, then 100-key
+ * MGETs. The same connection code runs on both transports (kvsc_connect
+ * vs kvsc_connect_shm), so the difference is the wake-up path: a send
+ * and an epoll/recv pair per direction, or ring indexes both sides poll.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/kvstore.h"
+#include "../include/server.h"
+#include "../include/kvsclient.h"
+#include "../include/histogram.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STORE_KEYS 100000
+#define ROUNDS 200000
+#define WARMUP 10000
+#define BATCH 100
+#define VALUE_SIZE 64
+#define SOCKET_PATH "shm_bench.sock"
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return *state >> 33;
+}
+
+static void* run_server(void* arg) {
+    kvs_server_run(arg);
+    return NULL;
+}
+
+/**
+ * One request of the given kind with random keys
+ */
+static bool round_trip(kvsc_conn_t* conn, int op, uint64_t* seed) {
+    static char value[VALUE_SIZE];
+    int keys[BATCH];
+    const char* values[BATCH];
+    size_t lens[BATCH];
+    int key = (int)(next_random(seed) % STORE_KEYS);
+    switch (op) {
+        case 0:
+            return kvsc_get(conn, key, values, lens);
+        case 1:
+            memset(value, 'v', sizeof(value));
+            return kvsc_set(conn, key, value, sizeof(value));
+        case 2:
+            return kvsc_bin_mget(conn, &key, 1, values, lens);
+        default:
+            for (size_t i = 0; i < BATCH; i++) {
+                keys[i] = (int)(next_random(seed) % STORE_KEYS);
+            }
+            return kvsc_mget(conn, keys, BATCH, values, lens);
+    }
+}
+
+static bool measure(kvsc_conn_t* conn, int op, histogram_t* hist) {
+    uint64_t seed = 7;
+    for (int i = 0; i < WARMUP; i++) {
+        if (!round_trip(conn, op, &seed)) {
+            return false;
+        }
+    }
+    histogram_reset(hist);
+    for (int i = 0; i < ROUNDS; i++) {
+        uint64_t start = now_ns();
+        if (!round_trip(conn, op, &seed)) {
+            return false;
+        }
+        histogram_record(hist, now_ns() - start);
+    }
+    return true;
+}
+
+static void report(const char* what, const char* transport, const histogram_t* hist) {
+    printf("%-18s %-8s %10.0f %9llu %9llu %9llu %9.0f\n", what, transport, 1e9 / histogram_mean(hist),
+           (unsigned long long)histogram_percentile(hist, 50), (unsigned long long)histogram_percentile(hist, 99),
+           (unsigned long long)histogram_percentile(hist, 99.9), histogram_mean(hist));
+}
+
+int main(void) {
+    kvstore_t* kvs = kvs_create(STORE_KEYS * 2);
+    char value[VALUE_SIZE + 1];
+    memset(value, 'v', VALUE_SIZE);
+    value[VALUE_SIZE] = '\0';
+    for (int key = 0; kvs && key < STORE_KEYS; key++) {
+        kvs_set(kvs, key, value);
+    }
+    kvs_server_config_t config = { NULL, 0, SOCKET_PATH, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    kvs_server_t* server = kvs ? kvs_server_create(kvs, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        fprintf(stderr, "could not start the server\n");
+        return 1;
+    }
+
+    kvsc_conn_t* conns[2] = { kvsc_connect(SOCKET_PATH, 1000), kvsc_connect_shm(SOCKET_PATH, 1000) };
+    histogram_t* hist = malloc(sizeof(histogram_t));
+    if (!conns[0] || !conns[1] || !hist) {
+        fprintf(stderr, "could not connect: %s\n", kvs_error_string(kvs_get_error()));
+        return 1;
+    }
+
+    static const char* transports[] = { "socket", "shm" };
+    static const char* names[] = { "GET", "SET", "binary GET", "MGET x 100" };
+    printf("One client waiting for each reply, %d rounds, %d-byte values, latency in ns\n", ROUNDS, VALUE_SIZE);
+    printf("%-18s %-8s %10s %9s %9s %9s %9s\n", "", "", "ops/s", "p50", "p99", "p99.9", "mean");
+    for (int op = 0; op < 4; op++) {
+        for (int t = 0; t < 2; t++) {
+            if (measure(conns[t], op, hist)) {
+                report(names[op], transports[t], hist);
+            } else {
+                printf("%-18s %-8s failed: %s\n", names[op], transports[t], kvs_error_string(kvs_get_error()));
+            }
+        }
+    }
+
+    kvsc_close(conns[0]);
+    kvsc_close(conns[1]);
+    free(hist);
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+    kvs_destroy(kvs);
+    return 0;
+}
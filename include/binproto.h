@@ -0,0 +1,140 @@
+/**
+ * Binary request protocol
+ *
+ * A compact alternative to RESP for clients that move many keys at a
+ * time. Every request and every reply is one frame: a fixed 8-byte
+ * header, then a body. All integers are little-endian.
+ *
+ *   header   magic (0xB7) | opcode or status (u8) | count (u16) | body length (u32)
+ *
+ *   GET / DEL request   body: count keys (i32)
+ *   SET request         body: count keys (i32), count value lengths (u32),
+ *                       then the values back to back
+ *   PING request        count 0, no body
+ *
+ *   GET reply           count values, each a length (i32, -1 for a
+ *                       missing key) followed by the bytes; values
+ *                       adding up to more than KVS_BIN_MAX_BODY get an
+ *                       error reply instead
+ *   SET / DEL reply     count: keys set / deleted, no body
+ *   error reply         status KVS_BIN_ERROR, the body is the message
+ *
+ * The magic byte never starts a RESP or inline request, so the server
+ * tells the two apart request by request and a connection can mix them.
+ * Frames are used where they lie in the input buffer: keys are read in
+ * place and SET values go to the store straight from it, nothing is
+ * decimal-parsed or escaped.
+ */
+
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include "resp.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define KVS_BIN_MAGIC 0xB7
+#define KVS_BIN_HEADER_SIZE 8
+
+/**
+ * Limits enforced while parsing, a frame over them is a protocol error
+ */
+#define KVS_BIN_MAX_KEYS 8192
+#define KVS_BIN_MAX_BODY (64 * 1024 * 1024)
+
+typedef enum {
+    KVS_BIN_PING = 0,
+    KVS_BIN_GET,
+    KVS_BIN_SET,
+    KVS_BIN_DEL
+} kvs_bin_opcode_t;
+
+typedef enum {
+    KVS_BIN_OK = 0,
+    KVS_BIN_ERROR
+} kvs_bin_status_t;
+
+/**
+ * A parsed frame, pointing into the buffer it was parsed from
+ */
+typedef struct {
+    uint8_t code;           // opcode of a request, status of a reply
+    uint16_t count;
+    uint32_t length;        // body bytes
+    const char* body;
+} kvs_bin_frame_t;
+
+static inline uint32_t kvs_bin_read32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+static inline void kvs_bin_write32(char* p, uint32_t value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    memcpy(p, &value, sizeof(value));
+}
+
+/**
+ * Key i of a GET / SET / DEL request
+ */
+static inline int kvs_bin_key(const kvs_bin_frame_t* frame, size_t i) {
+    return (int)(int32_t)kvs_bin_read32(frame->body + 4 * i);
+}
+
+/**
+ * Length of value i of a SET request (values start at kvs_bin_values)
+ */
+static inline uint32_t kvs_bin_value_len(const kvs_bin_frame_t* frame, size_t i) {
+    return kvs_bin_read32(frame->body + 4 * ((size_t)frame->count + i));
+}
+
+static inline const char* kvs_bin_values(const kvs_bin_frame_t* frame) {
+    return frame->body + 8 * (size_t)frame->count;
+}
+
+/**
+ * Parse the frame at the start of a buffer
+ * @param used Set to the frame size
+ * @return RESP_OK, RESP_INCOMPLETE or RESP_PROTOCOL_ERROR (bad magic,
+ *         over the limits)
+ */
+resp_status_t kvs_bin_parse(const char* data, size_t len, kvs_bin_frame_t* frame, size_t* used);
+
+/**
+ * Check that a request's body matches its opcode and count
+ * (for SET, that the value lengths add up to the body)
+ */
+bool kvs_bin_check_request(const kvs_bin_frame_t* frame);
+
+/**
+ * Append a frame header; the body follows with the calls below
+ */
+bool kvs_bin_add_header(resp_buf_t* buf, uint8_t code, uint16_t count, uint32_t length);
+
+/**
+ * Append a request for count keys (count up to KVS_BIN_MAX_KEYS)
+ * @param values SET values, NULL for other opcodes
+ * @param lens Value lengths, NULL when all values are NUL terminated
+ */
+bool kvs_bin_add_request(resp_buf_t* buf, kvs_bin_opcode_t opcode, const int* keys, size_t count,
+                         const char* const* values, const size_t* lens);
+
+/**
+ * Append one value of a GET reply, NULL for a missing key
+ */
+bool kvs_bin_add_value(resp_buf_t* buf, const char* value, size_t len);
+
+/**
+ * Append an error reply
+ */
+bool kvs_bin_add_error(resp_buf_t* buf, const char* msg);
+
+#endif
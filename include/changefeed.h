@@ -0,0 +1,103 @@
+/**
+ * Change feed (change data capture)
+ *
+ * A bounded ring of the mutations applied to a store, numbered by a
+ * sequence that increases by one per change. Consumers keep the sequence
+ * they have seen and read the next batch from it, instead of scanning the
+ * whole store to find what changed.
+ *
+ * Values are copied into a byte arena that wraps like the record ring, so
+ * memory stays fixed; the oldest records are dropped when either fills.
+ * A consumer that asks for a sequence that was dropped must resynchronize
+ * from a snapshot (kvs_changefeed_snapshot) and continue from the
+ * sequence it returns. Bulk changes (kvs_clear, kvs_load) are not logged
+ * record by record; they drop the whole feed the same way.
+ */
+
+#ifndef CHANGEFEED_H
+#define CHANGEFEED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default record and value arena sizes
+ */
+#define CHANGEFEED_DEFAULT_RECORDS 65536
+#define CHANGEFEED_DEFAULT_VALUE_BYTES (4 * 1024 * 1024)
+
+typedef enum {
+    KVS_CHANGE_SET,
+    KVS_CHANGE_DELETE
+} kvs_change_op_t;
+
+/**
+ * One change, as handed to a consumer
+ */
+typedef struct {
+    uint64_t seq;
+    kvs_change_op_t op;
+    int key;
+    const char* value;      // set only, NUL terminated; valid until the next change.
+                            // NULL if the value did not fit the arena (read it with kvs_get)
+    size_t value_len;
+} kvs_change_t;
+
+/**
+ * Record as kept in the ring, the value is a position in the arena
+ */
+typedef struct {
+    uint64_t value_pos;     // arena offset (counts every byte ever written)
+    size_t value_len;
+    int key;
+    uint8_t op;
+    bool has_value;
+} changefeed_record_t;
+
+/**
+ * Change feed structure
+ * Holds the changes with sequences [first, next)
+ */
+typedef struct {
+    changefeed_record_t* records;   // ring, record for seq s at s & (record_capacity - 1)
+    size_t record_capacity;         // power of two
+    char* values;                   // value arena
+    size_t value_capacity;
+    uint64_t value_end;             // arena offset just past the newest value
+    uint64_t first_pos;             // arena position of the oldest record
+    uint64_t first;                 // oldest sequence kept
+    uint64_t next;                  // sequence of the next change
+} changefeed_t;
+
+/**
+ * Create an empty feed
+ * @param records Records kept (rounded up to a power of two, 0 for the default)
+ * @param value_bytes Size of the value arena (0 for the default)
+ * @return Pointer to the feed or NULL on failure
+ */
+changefeed_t* changefeed_create(size_t records, size_t value_bytes);
+
+void changefeed_destroy(changefeed_t* feed);
+
+/**
+ * Record a change, dropping the oldest records to make room
+ * @param value Value of a set (len bytes, need not be terminated), NULL for a delete
+ */
+void changefeed_append(changefeed_t* feed, kvs_change_op_t op, int key, const char* value, size_t len);
+
+/**
+ * Drop every record and skip a sequence number, so that every consumer,
+ * even one that was up to date, has to resynchronize
+ */
+void changefeed_reset(changefeed_t* feed);
+
+/**
+ * Read up to max changes starting at sequence from
+ * @param count Set to the number of changes written to out (0 when up to date)
+ * @return false if from is older than the oldest change kept
+ *         (KVS_ERROR_TRUNCATED) or newer than the next one
+ */
+bool changefeed_read(const changefeed_t* feed, uint64_t from, kvs_change_t* out, size_t max, size_t* count);
+
+#endif
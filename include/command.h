@@ -0,0 +1,107 @@
+/**
+ * Command parsing shared by the CLI and the network server
+ *
+ * A single-pass tokenizer yields (ptr, len) slices of a line without
+ * modifying or copying it, and command names are resolved through a
+ * compile-time perfect-hash table: one multiply, one slot, one compare.
+ */
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Byte range inside a buffer (not NUL terminated)
+ */
+typedef struct {
+    char* ptr;
+    size_t len;
+} kvs_slice_t;
+
+/**
+ * Known commands; aliases (del/delete, list/ls, quit/exit, help/?) share an id
+ */
+typedef enum {
+    KVS_CMD_UNKNOWN = 0,
+    KVS_CMD_GET,
+    KVS_CMD_SET,
+    KVS_CMD_DEL,
+    KVS_CMD_MGET,
+    KVS_CMD_MSET,
+    KVS_CMD_MDEL,
+    KVS_CMD_INCR,
+    KVS_CMD_SCAN,
+    KVS_CMD_INFO,
+    KVS_CMD_PING,
+    KVS_CMD_COMMAND,
+    KVS_CMD_QUIT,
+    KVS_CMD_PSYNC,
+    KVS_CMD_REPLCONF,
+    KVS_CMD_SHM,
+    KVS_CMD_WAITKEY,
+    KVS_CMD_LIST,
+    KVS_CMD_STATS,
+    KVS_CMD_SAVE,
+    KVS_CMD_LOAD,
+    KVS_CMD_CLEAR,
+    KVS_CMD_HANDOFF,
+    KVS_CMD_SLOWLOG,
+    KVS_CMD_LATENCY,
+    KVS_CMD_HELP,
+    KVS_CMD_COUNT
+} kvs_command_id_t;
+
+/**
+ * Resolve a command name (case-insensitive)
+ * @return the command id, KVS_CMD_UNKNOWN if there is none
+ */
+kvs_command_id_t kvs_command_lookup(kvs_slice_t name);
+
+/**
+ * Canonical (lowercase) name of a command
+ */
+const char* kvs_command_name(kvs_command_id_t id);
+
+/**
+ * Tokenizer state, a cursor over a line
+ */
+typedef struct {
+    char* pos;
+    char* end;
+} kvs_tokenizer_t;
+
+/**
+ * Start tokenizing len bytes at line
+ */
+void kvs_tokenizer_init(kvs_tokenizer_t* tok, char* line, size_t len);
+
+/**
+ * Get the next whitespace-separated token
+ * @return false when the line is exhausted
+ */
+bool kvs_next_token(kvs_tokenizer_t* tok, kvs_slice_t* token);
+
+/**
+ * Get the rest of the line with surrounding whitespace removed
+ * (for arguments that may contain spaces, like CLI values and filenames)
+ */
+kvs_slice_t kvs_rest_of_line(kvs_tokenizer_t* tok);
+
+/**
+ * Parse a slice as a 32-bit integer key (strict decimal)
+ */
+bool kvs_slice_to_int(kvs_slice_t slice, int* out);
+
+/**
+ * Parse a slice as a 64-bit integer (strict decimal)
+ */
+bool kvs_slice_to_ll(kvs_slice_t slice, long long* out);
+
+/**
+ * Case-insensitive comparison of a slice with a C string
+ */
+bool kvs_slice_equals(kvs_slice_t slice, const char* str);
+
+#endif
@@ -20,12 +20,17 @@ typedef enum {
     KVS_ERROR_INVALID_PARAM,    // Invalid parameter passed to function 
     KVS_ERROR_FILE_IO,          // File input / output operation failed
     KVS_ERROR_CORRUPTION,       // DATA corruption detected
+    KVS_ERROR_TRUNCATED,        // Requested changes are no longer kept
+    KVS_ERROR_SERVER,           // Server replied with an error
+    KVS_ERROR_BACKEND,          // Backing store of a cache failed
     KVS_ERROR_UNKNOWN           // Uknown or unexpected error
 } kvs_error_t;
 
 
 /**
- * Set the global error state
+ * Set the error state
+ * The state is per thread (like errno): it reports the last
+ * failure of a call made from the same thread
  * @param error The error code to set
  */
 void kvs_set_error(kvs_error_t error);
@@ -0,0 +1,54 @@
+/**
+ * Hot restart by handing the in-memory table to a new process
+ *
+ * A store created with kvs_create_memfd (or kvs_open_mapped) keeps its
+ * table and values in a shared mapping. The running process passes the
+ * descriptor of that mapping over a Unix socket (SCM_RIGHTS); the new
+ * process maps it, validates the layout version and continues serving
+ * without any reload.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "kvstore.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Magic number of the handoff message ("KVHF")
+ */
+#define KVS_HANDOFF_MAGIC 0x4B564846
+
+/**
+ * Message sent along with the table descriptor
+ */
+typedef struct {
+    uint32_t magic;             // KVS_HANDOFF_MAGIC
+    uint32_t layout_version;    // MT_LAYOUT_VERSION of the sender
+    uint64_t entry_count;       // Entries at handoff time, for sanity checks
+} kvs_handoff_msg_t;
+
+/**
+ * Hand a mapped store to the next process
+ * Listens on socket_path, waits for one receiver, sends it the table and
+ * waits for its acknowledgement. On success the store no longer owns a
+ * table: every further operation on it fails and the caller should
+ * kvs_destroy it and exit without saving.
+ * @param kvs Store created in memfd or mapped mode
+ * @param socket_path Path of the Unix socket to listen on
+ * @return true once the receiver has taken over
+ */
+bool kvs_handoff_send(kvstore_t* kvs, const char* socket_path);
+
+/**
+ * Take over the table of a running process
+ * Connects to socket_path, retrying until timeout_ms elapses so the new
+ * process can be started before the old one begins the handoff
+ * @param socket_path Path of the Unix socket the old process listens on
+ * @param timeout_ms How long to keep retrying the connection
+ * @return The store now serving the handed-over table, or NULL on failure
+ */
+kvstore_t* kvs_handoff_receive(const char* socket_path, int timeout_ms);
+
+#endif
@@ -12,6 +12,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * Special key value used to mark deleted entries (tombstones)
@@ -30,20 +31,48 @@ typedef struct {
     bool occupied;   // whether this slot is occupied
 } ht_entry_t;
 
+/**
+ * Callback for the entries visited by ht_visit_home / mt_visit_home
+ */
+typedef void (*ht_visit_fn)(void* ctx, int key, const char* value);
+
+/**
+ * Figures gathered by one walk over a table (ht_stats / mt_stats)
+ */
+typedef struct {
+    size_t tombstones;
+    size_t probe_total;         // sum over live entries of the slots from home to entry
+    size_t probe_max;
+    size_t table_bytes;         // entries array
+    size_t value_bytes;         // value allocations
+} ht_stats_t;
+
 /**
  * Hash table structure
  * Contains the array of entries and metadata about the table
  */
 typedef struct {
     ht_entry_t* entries;       // Array of hash table entries
-    size_t capacity;           // total number of slots in the table
+    size_t capacity;           // total number of slots in the table (power of 2)
     size_t size;               // number of occupied slots (excluding tombstones)
     size_t tombstones;         // number of deleted slots (tombstones)
+    size_t resizes;            // number of resizes so far (slow log, kvs_info)
+    uint64_t resize_ns;        // time spent in them
+    size_t probe_max;          // longest probe sequence since the slow log reset it
+    bool count_probes;         // whether probe_max is kept (while the slow log times an operation)
 } hash_table_t;
 
+/**
+ * Hash an integer key (FNV-1a over the key bytes)
+ * @param key The integer key
+ * @return the hash value
+ */
+size_t ht_hash(int key);
+
 /**
  * Create a new hash table
- * @param initial_capacity Initial number of slots (must be > 0)
+ * @param initial_capacity Initial number of slots (0 for the default,
+ *                         rounded up to a power of 2)
  * @return Pointer to the new hash_table or NULL on failure
  */
 hash_table_t* ht_create(size_t initial_capacity);
@@ -57,6 +86,15 @@ hash_table_t* ht_create(size_t initial_capacity);
  */
 bool ht_set(hash_table_t* table, int key, const char* value);
 
+/**
+ * Insert or update a key-value pair, taking the value length explicitly
+ * so values can be stored straight from a receive buffer
+ * @param value The value bytes (no NUL bytes, need not be terminated)
+ * @param len Number of value bytes
+ * @return true on success, false on failure
+ */
+bool ht_set_len(hash_table_t* table, int key, const char* value, size_t len);
+
 /**
  * Retrieve a value by a key
  * @param table Pointer to the hash table
@@ -65,6 +103,12 @@ bool ht_set(hash_table_t* table, int key, const char* value);
  */
 const char* ht_get(hash_table_t* table, int key);
 
+/**
+ * Retrieve a value whose home slot (ht_hash(key) % capacity) the caller
+ * already computed, as multi-key lookups do when ordering their keys
+ */
+const char* ht_get_at(hash_table_t* table, int key, size_t slot);
+
 /**
  * Delete a key-value pair
  * @param table pointer to the hash table
@@ -73,6 +117,15 @@ const char* ht_get(hash_table_t* table, int key);
  */
 bool ht_delete(hash_table_t* table, int key);
 
+/**
+ * Make room for count more keys, so inserting them does not resize
+ * (grows at most once, to the size the whole batch needs)
+ * @param table pointer to the hash table
+ * @param count number of keys about to be inserted
+ * @return true on success, false on failure
+ */
+bool ht_reserve(hash_table_t* table, size_t count);
+
 /**
  * Get the number of key-value pairs
  * @param table pointer to the hash table
@@ -115,5 +168,15 @@ ht_iterator_t ht_iterator_init(hash_table_t* table);
  */
 bool ht_iterator_next(ht_iterator_t* iter, int* key, const char** value);
 
+/**
+ * Visit every entry whose home slot (ht_hash(key) & (capacity - 1)) is slot
+ * @return number of entries visited
+ */
+size_t ht_visit_home(hash_table_t* table, size_t slot, ht_visit_fn visit, void* ctx);
+
+/**
+ * Walk the table for probe length and memory figures
+ */
+void ht_stats(hash_table_t* table, ht_stats_t* stats);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,85 @@
+/**
+ * Log-linear latency histogram (HDR style)
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS get a bucket each; above that every
+ * power of two is split into 2^(HISTOGRAM_SUB_BITS - 1) equal buckets,
+ * so any value is kept within 1 / 2^(HISTOGRAM_SUB_BITS - 1) (under 2%)
+ * of what was recorded, over the whole 64-bit range, in a fixed array.
+ * Recording is a few shifts and an increment; histograms of the same
+ * shape merge by adding counts, so each thread can keep its own.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_HALF (1u << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_HALF)
+
+/**
+ * Histogram structure, zeroed (or histogram_reset) before use
+ */
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;         // values recorded
+    uint64_t sum;           // of the values, for the mean
+    uint64_t min;           // valid when total > 0
+    uint64_t max;
+} histogram_t;
+
+void histogram_reset(histogram_t* hist);
+
+/**
+ * Bucket of a value
+ */
+static inline size_t histogram_bucket(uint64_t value) {
+    if (value < 2 * HISTOGRAM_HALF) {
+        return (size_t)value;
+    }
+    unsigned shift = 63u - (unsigned)__builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+    return (size_t)shift * HISTOGRAM_HALF + (size_t)(value >> shift);
+}
+
+/**
+ * Record one value
+ */
+static inline void histogram_record(histogram_t* hist, uint64_t value) {
+    hist->counts[histogram_bucket(value)]++;
+    if (hist->total == 0 || value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    hist->total++;
+    hist->sum += value;
+}
+
+/**
+ * Add the counts of src to dst
+ */
+void histogram_merge(histogram_t* dst, const histogram_t* src);
+
+/**
+ * Value at a percentile: the highest value of the bucket holding it,
+ * capped by the largest value recorded (0 when empty)
+ * @param percentile 0 to 100
+ */
+uint64_t histogram_percentile(const histogram_t* hist, double percentile);
+
+/**
+ * Values recorded up to value, counted by whole buckets (so it may
+ * include some within a bucket width above value)
+ */
+uint64_t histogram_count_upto(const histogram_t* hist, uint64_t value);
+
+/**
+ * Mean of the values recorded (0 when empty)
+ */
+double histogram_mean(const histogram_t* hist);
+
+#endif
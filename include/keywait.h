@@ -0,0 +1,72 @@
+/**
+ * Key versions and blocking waits
+ *
+ * A store with key waits keeps a version per key slot: keys hash to one
+ * of KEYWAIT_SLOTS slots, and every change to a key moves its slot's
+ * version on. A thread waiting for a key to change sleeps on the slot's
+ * version word (a futex), and the writer issues the wake-up system call
+ * only for slots somebody sleeps on, so a change costs an atomic add
+ * and a load when nobody waits.
+ *
+ * Keys that share a slot share a version, so a change to one also ends
+ * a wait on the other; callers re-read the value either way.
+ */
+
+#ifndef KEYWAIT_H
+#define KEYWAIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Version slots
+ */
+#define KEYWAIT_SLOT_BITS 12
+#define KEYWAIT_SLOTS (1u << KEYWAIT_SLOT_BITS)
+
+/**
+ * One slot: the version is the futex word
+ */
+typedef struct {
+    uint32_t version;       // never 0, so that 0 means "no version yet"
+    uint32_t sleepers;      // threads asleep on the version
+} keywait_slot_t;
+
+/**
+ * Key wait structure
+ */
+typedef struct {
+    keywait_slot_t slots[KEYWAIT_SLOTS];
+} keywait_t;
+
+/**
+ * Create the slots, every version at 1
+ * @return Pointer to the structure or NULL on failure
+ */
+keywait_t* keywait_create(void);
+
+void keywait_destroy(keywait_t* waits);
+
+/**
+ * Move the version of key on and wake its sleepers
+ */
+void keywait_bump(keywait_t* waits, int key);
+
+/**
+ * Move every version on, after a change to the whole store
+ */
+void keywait_bump_all(keywait_t* waits);
+
+/**
+ * Current version of key (safe from any thread)
+ */
+uint32_t keywait_version(keywait_t* waits, int key);
+
+/**
+ * Sleep until the version of key differs from last_version
+ * @param timeout_ms Limit, negative for none, 0 to only check
+ * @return The version then, last_version if the wait timed out
+ */
+uint32_t keywait_wait(keywait_t* waits, int key, uint32_t last_version, int timeout_ms);
+
+#endif
@@ -0,0 +1,291 @@
+/**
+ * kvsclient - client library for kvstore-server (libkvsclient.a)
+ *
+ * A connection speaks RESP over TCP or a Unix socket, or, opened with
+ * kvsc_connect_shm, over shared-memory rings (shmring.h) with the server
+ * on the same host; everything below works the same on either. Requests are
+ * queued and go out together, so many can be outstanding at once
+ * (pipelining); replies come back in request order. Each connection has
+ * a blocking interface (kvsc_command, kvsc_append + kvsc_read_reply and
+ * the typed helpers) and a callback one (kvsc_async + kvsc_poll). The two
+ * mix: the callbacks of earlier requests run while a blocking call waits
+ * for its own reply.
+ *
+ * Buffers belong to the connection and are reused, so once they have
+ * grown to the working set, requests and replies allocate nothing.
+ * Replies point into the input buffer: one returned by a blocking call
+ * is valid until the next call on the connection, one handed to a
+ * callback until the callback returns.
+ *
+ * A connection is used by one thread at a time. A pool hands connections
+ * out to threads, opening them on first use and again after a failure.
+ *
+ * The kvsc_bin_* helpers move many keys at a time in binary frames
+ * (binproto.h) on the same connection, with no RESP encoding on either
+ * side.
+ *
+ * Failures set the error state (error.h): KVS_ERROR_FILE_IO for socket
+ * failures and timeouts, KVS_ERROR_CORRUPTION for malformed replies
+ * (both leave the connection broken), KVS_ERROR_SERVER for error
+ * replies (the text is kept, see kvsc_server_error).
+ */
+
+#ifndef KVSCLIENT_H
+#define KVSCLIENT_H
+
+#include "resp.h"
+#include "error.h"
+#include "shmring.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Keys per MGET / MSET command sent by kvsc_mget / kvsc_mset
+ */
+#define KVSC_BATCH_KEYS 512
+
+/**
+ * Keys per binary frame sent by the kvsc_bin_* helpers
+ */
+#define KVSC_BIN_BATCH_KEYS 4096
+
+typedef resp_reply_t kvsc_reply_t;
+
+/**
+ * Callback of an async request
+ * @param reply The reply, NULL if the connection failed first
+ */
+typedef void (*kvsc_callback_fn)(void* ctx, const kvsc_reply_t* reply);
+
+/**
+ * Outstanding request, callback NULL for a blocking one
+ */
+typedef struct {
+    kvsc_callback_fn callback;
+    void* ctx;
+} kvsc_pending_t;
+
+/**
+ * Client connection
+ */
+typedef struct {
+    int fd;
+    int timeout_ms;             // limit for each wait of a blocking call, 0 for none
+    bool broken;                // failed, must be closed (a pool reopens it)
+    resp_buf_t out;             // queued requests
+    size_t sent;                // bytes of out already written
+    resp_buf_t in;              // received replies
+    size_t parsed;              // bytes of in held by the last blocking reply
+    resp_reply_t* nodes;        // reply nodes, reused
+    size_t node_capacity;
+    kvsc_pending_t* pending;    // ring of outstanding requests, oldest first
+    size_t pending_capacity;
+    size_t pending_head;
+    size_t pending_count;
+    size_t blocking;            // outstanding blocking requests
+    size_t pool_slot;           // index in the pool it came from
+    char error[128];            // text of the last error reply
+    kvs_shm_t shm;              // shared-memory rings, header NULL on the socket
+    int shm_event_fd;           // wakes the server loop when it is parked
+} kvsc_conn_t;
+
+/**
+ * Connect to a server
+ * @param target "host:port", or a Unix socket path
+ * @param timeout_ms Limit for each wait of a blocking call (0 for none)
+ * @return Pointer to the connection or NULL on failure
+ */
+kvsc_conn_t* kvsc_connect(const char* target, int timeout_ms);
+
+/**
+ * Connect over the Unix socket, then move the connection to shared memory
+ * Waiting for a reply polls for KVS_SHM_SPIN_NS before it sleeps.
+ * @param path Unix socket path of a server on the epoll backend
+ * @return Pointer to the connection or NULL on failure (KVS_ERROR_SERVER
+ *         if the server refused)
+ */
+kvsc_conn_t* kvsc_connect_shm(const char* path, int timeout_ms);
+
+/**
+ * Close a connection, dropping outstanding requests
+ * (async callbacks run with a NULL reply)
+ */
+void kvsc_close(kvsc_conn_t* conn);
+
+/**
+ * Socket of the connection, for callers that wait in their own loop
+ * (on shared memory it never becomes readable: wait in kvsc_poll)
+ */
+int kvsc_fd(const kvsc_conn_t* conn);
+
+/**
+ * Number of requests sent or queued whose reply has not been handed out
+ */
+size_t kvsc_pending(const kvsc_conn_t* conn);
+
+/**
+ * Text of the last error reply (after KVS_ERROR_SERVER)
+ */
+const char* kvsc_server_error(const kvsc_conn_t* conn);
+
+/**
+ * Queue a request whose reply is read with kvsc_read_reply
+ * Nothing is sent until a call waits for a reply or kvsc_flush
+ * @param lens Argument lengths, NULL when all are NUL terminated
+ * @return true on success, false on failure
+ */
+bool kvsc_append(kvsc_conn_t* conn, size_t argc, const char* const* argv, const size_t* lens);
+
+/**
+ * Queue a request whose reply goes to a callback
+ * Callbacks may queue requests but must not wait for replies
+ * @return true on success, false on failure
+ */
+bool kvsc_async(kvsc_conn_t* conn, size_t argc, const char* const* argv, const size_t* lens,
+                kvsc_callback_fn callback, void* ctx);
+
+/**
+ * Send everything queued, blocking until it is written
+ * @return true on success, false on failure
+ */
+bool kvsc_flush(kvsc_conn_t* conn);
+
+/**
+ * Wait for the reply of the oldest kvsc_append request
+ * Callbacks of async requests queued before it run first
+ * @return The reply, or NULL on failure
+ */
+const kvsc_reply_t* kvsc_read_reply(kvsc_conn_t* conn);
+
+/**
+ * Send one request and wait for its reply
+ * @return The reply, or NULL on failure
+ */
+const kvsc_reply_t* kvsc_command(kvsc_conn_t* conn, size_t argc, const char* const* argv, const size_t* lens);
+
+/**
+ * Send what is queued and run the callbacks of the replies that arrived,
+ * waiting up to timeout_ms for the socket (0 to not wait, -1 forever)
+ * @return Number of callbacks run, -1 on failure
+ */
+int kvsc_poll(kvsc_conn_t* conn, int timeout_ms);
+
+/**
+ * Blocking helpers
+ * Each fails with KVS_ERROR_INVALID_PARAM while kvsc_append replies are
+ * left unread. Values point into the connection, see above.
+ */
+
+/**
+ * GET a key
+ * @param value Set to the value, or NULL if the key is missing
+ * @param len Set to the value length (may be NULL)
+ */
+bool kvsc_get(kvsc_conn_t* conn, int key, const char** value, size_t* len);
+
+/**
+ * SET a key
+ * @param len Value length, or 0 for a NUL terminated value
+ */
+bool kvsc_set(kvsc_conn_t* conn, int key, const char* value, size_t len);
+
+/**
+ * DEL a key
+ * @param deleted Set to whether the key was there (may be NULL)
+ */
+bool kvsc_del(kvsc_conn_t* conn, int key, bool* deleted);
+
+/**
+ * WAITKEY: block until the version of key differs from last_version
+ * (0 returns at once) or timeout_ms passes (negative: no limit); the
+ * connection's timeout is stretched by timeout_ms for the call
+ * @param version Set to the version then, last_version on timeout
+ * @param value Set to the value then, NULL if the key is missing (may be NULL)
+ * @param len Set to the value length (may be NULL)
+ */
+bool kvsc_wait(kvsc_conn_t* conn, int key, uint32_t last_version, int timeout_ms, uint32_t* version,
+               const char** value, size_t* len);
+
+/**
+ * GET many keys, as pipelined MGET commands of up to KVSC_BATCH_KEYS
+ * @param values Set to each value, NULL for missing keys
+ * @param lens Set to each value length (may be NULL)
+ */
+bool kvsc_mget(kvsc_conn_t* conn, const int* keys, size_t count, const char** values, size_t* lens);
+
+/**
+ * SET many keys, as pipelined MSET commands of up to KVSC_BATCH_KEYS
+ * @param lens Value lengths, NULL when all values are NUL terminated
+ */
+bool kvsc_mset(kvsc_conn_t* conn, const int* keys, const char* const* values, const size_t* lens,
+               size_t count);
+
+/**
+ * Binary batch helpers
+ * Like kvsc_mget / kvsc_mset, as pipelined binary frames of up to
+ * KVSC_BIN_BATCH_KEYS keys. Each fails with KVS_ERROR_INVALID_PARAM
+ * while any other reply is outstanding.
+ */
+
+/**
+ * GET many keys
+ * @param values Set to each value, NULL for missing keys; values are
+ *        not NUL terminated
+ * @param lens Set to each value length (required)
+ * Fails with KVS_ERROR_SERVER if the values of a frame's keys add up to
+ * more than KVS_BIN_MAX_BODY
+ */
+bool kvsc_bin_mget(kvsc_conn_t* conn, const int* keys, size_t count, const char** values, size_t* lens);
+
+/**
+ * SET many keys
+ * @param lens Value lengths, NULL when all values are NUL terminated
+ */
+bool kvsc_bin_mset(kvsc_conn_t* conn, const int* keys, const char* const* values, const size_t* lens,
+                   size_t count);
+
+/**
+ * DEL many keys
+ * @param deleted Set to how many were there (may be NULL)
+ */
+bool kvsc_bin_mdel(kvsc_conn_t* conn, const int* keys, size_t count, size_t* deleted);
+
+/**
+ * Connection pool
+ */
+typedef struct {
+    char* target;
+    int timeout_ms;
+    kvsc_conn_t** conns;        // NULL until first used, or after a failure
+    bool* busy;
+    size_t size;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+} kvsc_pool_t;
+
+/**
+ * Create a pool of up to size connections, opened on demand
+ * @return Pointer to the pool or NULL on failure
+ */
+kvsc_pool_t* kvsc_pool_create(const char* target, size_t size, int timeout_ms);
+
+/**
+ * Close every connection and free the pool (none may be in use)
+ */
+void kvsc_pool_destroy(kvsc_pool_t* pool);
+
+/**
+ * Take a connection, waiting while all are in use
+ * @return The connection, or NULL if it could not be opened
+ */
+kvsc_conn_t* kvsc_pool_acquire(kvsc_pool_t* pool);
+
+/**
+ * Give a connection back; a broken one, or one with replies left
+ * unread, is closed and reopened by a later kvsc_pool_acquire
+ */
+void kvsc_pool_release(kvsc_pool_t* pool, kvsc_conn_t* conn);
+
+#endif
@@ -12,6 +12,16 @@
 #define KVSTORE_H
 
 #include "hash_table.h"
+#include "mapped_table.h"
+#include "merkle.h"
+#include "changefeed.h"
+#include "slowlog.h"
+#include "latency.h"
+#include "keywait.h"
+#include "readthrough.h"
+#include "writeback.h"
+#include "stats.h"
+#include "persistence.h"
 #include "error.h"
 #include <stdbool.h>
 
@@ -19,7 +29,16 @@
  * Key-value store structure
  */
 typedef struct {
-    hash_table_t* table;        
+    hash_table_t* table;        // heap table (NULL in mapped mode)
+    mapped_table_t* mapped;     // persistent-heap table (NULL in heap mode)
+    merkle_t* merkle;           // digest tree, NULL unless enabled
+    changefeed_t* changes;      // change feed, NULL unless enabled
+    slowlog_t* slowlog;         // slow-operation log, NULL unless enabled
+    latency_t* latency;         // per-operation latency histograms, NULL unless enabled
+    keywait_t* waits;           // key versions for kvs_wait, NULL unless enabled
+    readthrough_t* readthrough; // loader behind kvs_get misses, NULL unless enabled
+    writeback_t* writeback;     // writes queued for a backing service, NULL unless enabled
+    kvs_stats_t stats;          // operation and persistence counters
     char* filename;
 } kvstore_t;
 
@@ -28,26 +47,88 @@ typedef struct {
  */
 kvstore_t* kvs_create(size_t initial_capacity);
 
+/**
+ * open a store whose table lives in a memory-mapped file
+ * restart is an mmap plus a header check instead of a snapshot load
+ */
+kvstore_t* kvs_open_mapped(const char* path, size_t initial_capacity);
+
+/**
+ * create a store whose table lives in an anonymous memfd region,
+ * so it can be handed to another process (see handoff.h)
+ */
+kvstore_t* kvs_create_memfd(size_t initial_capacity);
+
+/**
+ * attach to a mapped table region received from another process
+ * takes ownership of fd on success; on failure fd is left open
+ */
+kvstore_t* kvs_attach_fd(int fd);
+
+/**
+ * make all changes durable
+ * msyncs dirty pages in mapped mode, saves to the associated file otherwise
+ */
+bool kvs_checkpoint(kvstore_t* kvs);
+
 /**
  * set a key-value pair in the store
  */
 bool kvs_set(kvstore_t* kvs, int key, const char* value);
 
+/**
+ * set a key-value pair from a value that is not NUL terminated
+ * (e.g. a slice of a network buffer); the value must not contain NUL bytes
+ */
+bool kvs_set_len(kvstore_t* kvs, int key, const char* value, size_t len);
+
 /**
  * Get a value by key
+ * in read-through mode a miss calls the loader, see kvs_readthrough_enable
  */
 const char* kvs_get(kvstore_t* kvs, int key);
 
+/**
+ * Get a value by key without calling a loader
+ */
+const char* kvs_get_cached(kvstore_t* kvs, int key);
+
 /**
  * Delete a key-value pair
  */
 bool kvs_delete(kvstore_t* kvs, int key);
 
+/**
+ * get several keys at once: values[i] is set to the value of keys[i],
+ * NULL if absent; returns the number of keys found
+ * (keys are looked up grouped by table region, with prefetching)
+ */
+size_t kvs_mget(kvstore_t* kvs, const int* keys, size_t count, const char** values);
+
+/**
+ * set several key-value pairs, growing the table at most once
+ * lens may be NULL for NUL terminated values; a key given twice ends
+ * up with its last value; stops at the first failure, with the pairs
+ * handled so far already set
+ */
+bool kvs_mset(kvstore_t* kvs, const int* keys, const char* const* values, const size_t* lens, size_t count);
+
+/**
+ * delete several keys; deleted (may be NULL) records which ones were
+ * present; returns the number of keys deleted
+ */
+size_t kvs_mdel(kvstore_t* kvs, const int* keys, size_t count, bool* deleted);
+
 /**
  * get the number of key-value pairs in the store
  */
 size_t kvs_count(kvstore_t* kvs);
 
+/**
+ * remove all key-value pairs
+ */
+bool kvs_clear(kvstore_t* kvs);
+
 /**
  * save the store contents to a file
  */
@@ -59,7 +140,40 @@ bool kvs_save(kvstore_t* kvs, const char* filename);
 bool kvs_load(kvstore_t* kvs, const char* filename);
 
 /**
- * print stats
+ * load only the records of a snapshot that pass a filter
+ * (hash range, key range or key predicate, see persistence.h)
+ */
+bool kvs_load_range(kvstore_t* kvs, const char* filename, const kvs_load_filter_t* filter);
+
+/**
+ * Save several stores holding disjoint keys (shards) as one snapshot
+ * Does not change any store's associated filename
+ */
+bool kvs_save_sharded(kvstore_t** shards, size_t count, const char* filename);
+
+/**
+ * Write a snapshot of the store to fd with a writer created for at least
+ * kvs_count entries. Sets no error state and allocates nothing, for use
+ * in a forked child (see kvs_snapshot_writer_save)
+ */
+bool kvs_save_fd(kvstore_t* kvs, int fd, kvs_snapshot_writer_t* writer);
+
+/**
+ * gather statistics: counters, table shape (tombstones, probe lengths,
+ * resizes), memory by category and persistence status
+ * walks the table once, so it costs O(capacity)
+ */
+bool kvs_info(kvstore_t* kvs, kvs_info_t* info);
+
+/**
+ * The part of kvs_info that costs O(1): counters, entries, capacity,
+ * resizes and memory other than values; tombstones, probe lengths,
+ * effective_load_factor and memory_values are left at 0
+ */
+bool kvs_info_summary(kvstore_t* kvs, kvs_info_t* info);
+
+/**
+ * print stats (kvs_info as text)
  */
 void kvs_print_stats(kvstore_t* kvs);
 
@@ -73,4 +187,195 @@ void kvs_destroy(kvstore_t* kvs);
  */
 void kvs_print_all(kvstore_t* kvs);
 
+/**
+ * callback for kvs_foreach, return false to stop
+ */
+typedef bool (*kvs_visit_fn)(void* ctx, int key, const char* value);
+
+/**
+ * visit every key-value pair (heap or mapped mode)
+ */
+void kvs_foreach(kvstore_t* kvs, kvs_visit_fn visit, void* ctx);
+
+/**
+ * Visit one page of the store, starting from a cursor (0 to begin)
+ * Stateless: the cursor walks home slots in reverse-binary order, so a
+ * scan that spans resizes still visits every key present throughout
+ * (some possibly twice). Whole slots are visited, so a page can hold a
+ * few more than count entries; at most 10 * count empty slots are
+ * passed per call.
+ * @return Cursor of the next page, 0 when the scan is complete
+ */
+uint64_t kvs_scan(kvstore_t* kvs, uint64_t cursor, size_t count, ht_visit_fn visit, void* ctx);
+
+/**
+ * start maintaining a merkle tree (depth 0 for the default)
+ * it is built from the current contents and then updated by every
+ * kvs_set / kvs_delete
+ */
+bool kvs_merkle_enable(kvstore_t* kvs, unsigned depth);
+
+/**
+ * list the hash ranges where two stores with merkle trees differ
+ * returns the number of ranges (only max_ranges are written)
+ */
+size_t kvs_merkle_diff(kvstore_t* a, kvstore_t* b, kvs_hash_range_t* ranges, size_t max_ranges);
+
+/**
+ * start recording changes in a feed (0 for the default sizes, see
+ * changefeed.h); every later kvs_set / kvs_delete appends to it
+ */
+bool kvs_changefeed_enable(kvstore_t* kvs, size_t records, size_t value_bytes);
+
+/**
+ * sequence the next change will get
+ * a consumer starting there sees every change made after the call
+ */
+uint64_t kvs_changefeed_seq(kvstore_t* kvs);
+
+/**
+ * read up to max changes from sequence from
+ * fails with KVS_ERROR_TRUNCATED once the consumer has fallen behind
+ * what the feed keeps; it then resyncs with kvs_changefeed_snapshot
+ */
+bool kvs_changefeed_read(kvstore_t* kvs, uint64_t from, kvs_change_t* out, size_t max, size_t* count);
+
+/**
+ * save a snapshot for a consumer that fell behind, and the sequence
+ * to continue reading from once it has loaded it
+ */
+bool kvs_changefeed_snapshot(kvstore_t* kvs, const char* filename, uint64_t* seq);
+
+/**
+ * start logging operations that take threshold_us or longer (0 logs
+ * every one) in a ring of the latest entries (0 for the default, see
+ * slowlog.h); a log already enabled is replaced, ids carry on
+ * timed: get, set, delete, the multi-key calls, clear, save, load and
+ * checkpoint
+ */
+bool kvs_slowlog_enable(kvstore_t* kvs, uint64_t threshold_us, size_t entries);
+
+/**
+ * copy up to max slow log entries, newest first
+ * returns the number copied (0 when no log is enabled)
+ */
+size_t kvs_slowlog_get(kvstore_t* kvs, kvs_slow_entry_t* out, size_t max);
+
+/**
+ * drop the slow log entries
+ */
+void kvs_slowlog_reset(kvstore_t* kvs);
+
+/**
+ * start recording a latency histogram per operation type (see
+ * latency.h), for the operations the slow log times; enabling it again
+ * keeps what was recorded
+ */
+bool kvs_latency_enable(kvstore_t* kvs);
+
+/**
+ * stop recording and drop the histograms
+ */
+void kvs_latency_disable(kvstore_t* kvs);
+
+/**
+ * add the store's histograms to out, so the stores of several threads
+ * can be read as one
+ * returns false when recording is off
+ */
+bool kvs_latency_merge(kvstore_t* kvs, latency_t* out);
+
+/**
+ * empty the histograms
+ */
+void kvs_latency_reset(kvstore_t* kvs);
+
+/**
+ * start keeping key versions (see keywait.h): every later kvs_set /
+ * kvs_delete moves the key's version on, a clear or load moves all of
+ * them; enabling it again keeps the versions
+ */
+bool kvs_wait_enable(kvstore_t* kvs);
+
+/**
+ * current version of a key, 0 when versions are not kept
+ */
+uint32_t kvs_version(kvstore_t* kvs, int key);
+
+/**
+ * block until the version of key differs from last_version (0 returns
+ * at once), or timeout_ms passes (negative: no limit, 0: don't block)
+ * returns the version then, last_version on timeout, 0 with
+ * KVS_ERROR_INVALID_PARAM when versions are not kept
+ * unlike the rest of the API this may run on another thread while the
+ * store is in use: it reads versions only, the value is read after it
+ * under whatever serializes access to the store
+ */
+uint32_t kvs_wait(kvstore_t* kvs, int key, uint32_t last_version, int timeout_ms);
+
+/**
+ * serve the store as a cache of a backing service (see readthrough.h):
+ * a kvs_get miss calls loader and sets what it finds; keys it reports
+ * missing are remembered for negative_ttl_ms (0: not remembered), its
+ * failures are not. Only kvs_get loads, the multi-key calls and scans
+ * see what is cached. Replaces a loader already set; a server picks the
+ * loader up when it starts running
+ */
+bool kvs_readthrough_enable(kvstore_t* kvs, kvs_loader_fn loader, void* ctx, unsigned negative_ttl_ms);
+
+/**
+ * stop loading misses and forget the remembered ones
+ */
+void kvs_readthrough_disable(kvstore_t* kvs);
+
+/**
+ * whether a kvs_get of key would call the loader: read-through is on,
+ * the key is not cached and not remembered missing
+ */
+bool kvs_readthrough_needed(kvstore_t* kvs, int key);
+
+/**
+ * write generation of key, taken when a load of it starts and handed
+ * back to kvs_readthrough_fill; moves on with every set or delete of
+ * the key (and of keys sharing its slot) and every load or clear
+ */
+uint32_t kvs_readthrough_generation(kvstore_t* kvs, int key);
+
+/**
+ * apply the result of a load made outside kvs_get (the server's load
+ * threads): a value found is set and a missing key is remembered, unless
+ * the key was written (set or deleted) after generation was taken or
+ * has a write-back still pending; takes value over
+ * returns false with KVS_ERROR_BACKEND when the load failed
+ */
+bool kvs_readthrough_fill(kvstore_t* kvs, int key, uint32_t generation, kvs_load_result_t result,
+                          char* value, size_t len);
+
+/**
+ * queue the sets and deletes made through the API (single and multi-key)
+ * for a backing service, written in batches by a flusher thread (see
+ * writeback.h; config NULL for the defaults). Read-through fills, loads
+ * and clears are not written back. With read-through on too, a key with
+ * a write still queued is not loaded. Replaces a writer already set,
+ * after giving its queue one more try
+ */
+bool kvs_writeback_enable(kvstore_t* kvs, kvs_writer_fn writer, void* ctx, const kvs_writeback_config_t* config);
+
+/**
+ * give the queued writes one more try and stop the flusher
+ * (kvs_writeback_flush first to know they made it)
+ */
+void kvs_writeback_disable(kvstore_t* kvs);
+
+/**
+ * wait until every queued write is written, timeout_ms negative for no
+ * limit; false with KVS_ERROR_BACKEND on timeout
+ */
+bool kvs_writeback_flush(kvstore_t* kvs, int timeout_ms);
+
+/**
+ * copy the write-back counters, false when write-back is off
+ */
+bool kvs_writeback_stats(kvstore_t* kvs, kvs_writeback_stats_t* stats);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+/**
+ * Per-operation latency histograms
+ *
+ * A store with latency recording keeps one log-linear histogram (see
+ * histogram.h) per operation type, in nanoseconds. Operations are timed
+ * with the CPU's time-stamp counter where it is invariant (x86 rdtsc: no
+ * system call, a few nanoseconds), scaled with a factor measured against
+ * CLOCK_MONOTONIC once per process, and with CLOCK_MONOTONIC elsewhere.
+ *
+ * A store is used by one thread at a time, so its recorder is that
+ * thread's own (one per event loop in the sharded server) and recording
+ * is a plain increment; readers merge the recorders of several stores.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "histogram.h"
+#include "slowlog.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Time spent calibrating the time-stamp counter, once per process
+ */
+#define LATENCY_CALIBRATE_NS 2000000
+
+/**
+ * Latency recorder structure
+ */
+typedef struct {
+    histogram_t ops[KVS_OP_COUNT];  // by kvs_op_t, in nanoseconds
+    bool tsc;                       // clock is the time-stamp counter
+    double tick_ns;                 // nanoseconds per counter tick
+} latency_t;
+
+/**
+ * Create an empty recorder (calibrates the clock on first use)
+ * @return Pointer to the recorder or NULL on failure
+ */
+latency_t* latency_create(void);
+
+void latency_destroy(latency_t* latency);
+
+/**
+ * Empty every histogram
+ */
+void latency_reset(latency_t* latency);
+
+/**
+ * Add the histograms of src to dst
+ */
+void latency_merge(latency_t* dst, const latency_t* src);
+
+/**
+ * Current time in the recorder's clock ticks
+ */
+static inline uint64_t latency_now(const latency_t* latency) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (latency->tsc) {
+        return __builtin_ia32_rdtsc();
+    }
+#endif
+    (void)latency;
+    return slowlog_now();
+}
+
+/**
+ * Record an operation that started at latency_now() == start
+ */
+static inline void latency_record(latency_t* latency, kvs_op_t op, uint64_t start) {
+    uint64_t elapsed = latency_now(latency) - start;
+    if (latency->tsc) {
+        elapsed = (uint64_t)((double)elapsed * latency->tick_ns);
+    }
+    histogram_record(&latency->ops[op], elapsed);
+}
+
+#endif
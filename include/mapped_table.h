@@ -0,0 +1,199 @@
+/**
+ * Memory-mapped hash table header
+ *
+ * A persistent-heap variant of the hash table: the entries array and
+ * the value arena live inside a file-backed MAP_SHARED mapping and
+ * refer to each other with offsets from the start of the mapping, so
+ * a restart is just an mmap plus a header check. Durability comes from
+ * msync'ing the pages dirtied since the last checkpoint.
+ */
+
+#ifndef MAPPED_TABLE_H
+#define MAPPED_TABLE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "hash_table.h"
+
+/**
+ * Magic number at the start of a mapped table file ("KVSM")
+ */
+#define MT_MAGIC_NUMBER 0x4B56534D
+
+/**
+ * Layout version, bumped whenever the on-disk structures change
+ */
+#define MT_LAYOUT_VERSION 1
+
+/**
+ * Number of power-of-two size classes in the arena (16 bytes .. 32 GiB)
+ */
+#define MT_SIZE_CLASSES 32
+
+/**
+ * Header stored at offset 0 of the mapping
+ */
+typedef struct {
+    uint32_t magic;                         // MT_MAGIC_NUMBER
+    uint32_t layout_version;                // MT_LAYOUT_VERSION
+    uint32_t clean;                         // 1 if last closed/checkpointed without writes since
+    uint32_t reserved;                      // Reserved for future use
+    uint64_t file_size;                     // Size of the backing file in bytes
+    uint64_t heap_top;                      // Arena bump pointer (offset)
+    uint64_t entries_off;                   // Offset of the entries array
+    uint64_t capacity;                      // Number of slots (power of 2)
+    uint64_t size;                          // Live entries
+    uint64_t tombstones;                    // Deleted slots
+    uint64_t free_lists[MT_SIZE_CLASSES];   // Free block offsets per size class
+} mt_header_t;
+
+/**
+ * Slot in the mapped entries array
+ */
+typedef struct {
+    int32_t key;            // The integer key (DELETED_KEY marks a tombstone)
+    uint32_t occupied;      // Whether this slot is occupied
+    uint64_t value_off;     // Offset of the value block, 0 if none
+} mt_entry_t;
+
+/**
+ * Handle to an open mapped table
+ */
+typedef struct {
+    int fd;                 // Backing file descriptor
+    uint8_t* base;          // Start of the mapping
+    size_t map_size;        // Bytes currently mapped
+    uint8_t* dirty;         // One flag per page written since the last checkpoint
+    size_t dirty_pages;     // Length of the dirty array
+    size_t page_size;       // System page size
+    size_t resizes;         // Resizes since it was opened (slow log, kvs_info)
+    uint64_t resize_ns;     // Time spent in them
+    size_t probe_max;       // Longest probe sequence since the slow log reset it
+    bool count_probes;      // Whether probe_max is kept (while the slow log times an operation)
+} mapped_table_t;
+
+/**
+ * Open a mapped table, creating the file if it does not exist
+ * A table that was not closed cleanly is validated and its counters rebuilt
+ * @param path Path of the backing file
+ * @param initial_capacity Initial number of slots for a new file (0 for default)
+ * @return Pointer to the table or NULL on failure
+ */
+mapped_table_t* mt_open(const char* path, size_t initial_capacity);
+
+/**
+ * Create a table in an anonymous memfd region
+ * The fd can be passed to another process, which maps the same table
+ * @param name Debug name of the memfd (shows up in /proc/<pid>/fd)
+ * @param initial_capacity Initial number of slots (0 for default)
+ * @return Pointer to the table or NULL on failure
+ */
+mapped_table_t* mt_create_memfd(const char* name, size_t initial_capacity);
+
+/**
+ * Map a table from a descriptor handed over by another process
+ * The header magic and layout version are validated; on success the
+ * table takes ownership of fd
+ * @return Pointer to the table or NULL on failure
+ */
+mapped_table_t* mt_attach_fd(int fd);
+
+/**
+ * Get the descriptor backing the table
+ */
+int mt_fd(mapped_table_t* mt);
+
+/**
+ * Insert or update a key-value pair
+ * @return true on success, false on failure
+ */
+bool mt_set(mapped_table_t* mt, int key, const char* value);
+
+/**
+ * Insert or update a key-value pair from a value of known length
+ * (no NUL bytes, need not be terminated)
+ */
+bool mt_set_len(mapped_table_t* mt, int key, const char* value, size_t len);
+
+/**
+ * Make room for count more keys, so inserting them does not resize
+ * (grows at most once, to the size the whole batch needs)
+ */
+bool mt_reserve(mapped_table_t* mt, size_t count);
+
+/**
+ * Retrieve a value by key
+ * The pointer refers into the mapping and stays valid until the next
+ * mt_set / mt_delete, which may grow and remap the file
+ * @return pointer to the value string, or NULL if not found
+ */
+const char* mt_get(mapped_table_t* mt, int key);
+
+/**
+ * Delete a key-value pair
+ * @return true if the key was found and deleted
+ */
+bool mt_delete(mapped_table_t* mt, int key);
+
+/**
+ * Get the number of key-value pairs
+ */
+size_t mt_size(mapped_table_t* mt);
+
+/**
+ * Get the table capacity
+ */
+size_t mt_capacity(mapped_table_t* mt);
+
+/**
+ * Flush all pages dirtied since the last checkpoint and mark the file clean
+ * @return true on success, false on failure
+ */
+bool mt_checkpoint(mapped_table_t* mt);
+
+/**
+ * Checkpoint, unmap and close the table
+ */
+void mt_close(mapped_table_t* mt);
+
+/**
+ * Unmap and close the table without checkpointing
+ * Used after handing the region to another process, which now owns
+ * the header and must not see it rewritten by the old owner
+ * An fd of -1 is left alone (the descriptor belongs to someone else)
+ */
+void mt_release(mapped_table_t* mt);
+
+/**
+ * Iterator for traversing the mapped table
+ */
+typedef struct {
+    mapped_table_t* table;      // table being traversed
+    size_t index;               // current slot
+} mt_iterator_t;
+
+/**
+ * Init an iterator for the mapped table
+ */
+mt_iterator_t mt_iterator_init(mapped_table_t* mt);
+
+/**
+ * Get the next key-value pair from the iterator
+ * @return true if a pair was returned, false at the end
+ */
+bool mt_iterator_next(mt_iterator_t* iter, int* key, const char** value);
+
+/**
+ * Visit every entry whose home slot is slot (see ht_visit_home)
+ * @return number of entries visited
+ */
+size_t mt_visit_home(mapped_table_t* mt, size_t slot, ht_visit_fn visit, void* ctx);
+
+/**
+ * Walk the table for probe length and memory figures (see ht_stats);
+ * value bytes are the arena blocks holding values
+ */
+void mt_stats(mapped_table_t* mt, ht_stats_t* stats);
+
+#endif
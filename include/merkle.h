@@ -0,0 +1,116 @@
+/**
+ * Merkle tree over hash-space ranges
+ *
+ * The 32-bit key hash space is split into 2^depth equal ranges (leaves).
+ * Each leaf holds the sum of the digests of the entries whose key hashes
+ * into it, so a set or delete updates one leaf in O(1); interior nodes
+ * are recomputed lazily along dirty paths when a digest is read.
+ * Two stores (or a store and a snapshot) can then be compared by walking
+ * only the subtrees whose digests differ.
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Default and maximum tree depths (leaves = 2^depth)
+ */
+#define MERKLE_DEFAULT_DEPTH 10
+#define MERKLE_MAX_DEPTH 20
+
+/**
+ * Inclusive range of 32-bit key hashes
+ */
+typedef struct {
+    uint32_t start;     // first hash in the range
+    uint32_t end;       // last hash in the range
+} kvs_hash_range_t;
+
+/**
+ * Merkle tree structure
+ * nodes[1] is the root, node i has children 2i and 2i+1,
+ * leaves occupy nodes[2^depth .. 2^(depth+1) - 1]
+ */
+typedef struct {
+    unsigned depth;     // number of levels below the root
+    uint64_t* nodes;    // digests, index 0 unused
+    uint8_t* dirty;     // interior nodes that need recomputing
+} merkle_t;
+
+/**
+ * Create an empty tree
+ * @param depth Levels below the root (1..MERKLE_MAX_DEPTH, 0 for default)
+ * @return Pointer to the tree or NULL on failure
+ */
+merkle_t* merkle_create(unsigned depth);
+
+/**
+ * Destroy a tree and free all memory
+ */
+void merkle_destroy(merkle_t* tree);
+
+/**
+ * Reset every digest to the empty state
+ */
+void merkle_clear(merkle_t* tree);
+
+/**
+ * Digest of a single key-value pair
+ * @return the digest; absent entries are represented by 0
+ */
+uint64_t merkle_entry_digest(int key, const char* value);
+
+/**
+ * Digest of a key-value pair whose value length is known
+ */
+uint64_t merkle_entry_digest_len(int key, const char* value, size_t len);
+
+/**
+ * Replace a key's contribution to its leaf
+ * @param old_digest Digest before the change (0 if the key was absent)
+ * @param new_digest Digest after the change (0 if the key was deleted)
+ */
+void merkle_apply(merkle_t* tree, int key, uint64_t old_digest, uint64_t new_digest);
+
+/**
+ * Get the root digest
+ */
+uint64_t merkle_root(merkle_t* tree);
+
+/**
+ * Export all digests of one level, for sending to a peer
+ * @param level 0 for the root .. depth for the leaves
+ * @param out Array with room for 2^level digests
+ * @return number of digests written, 0 on invalid level
+ */
+size_t merkle_level_digests(merkle_t* tree, unsigned level, uint64_t* out);
+
+/**
+ * List hash ranges where two trees of the same depth differ
+ * Only subtrees with differing digests are visited, and adjacent
+ * ranges are merged
+ * @param ranges Output array
+ * @param max_ranges Capacity of ranges
+ * @return number of ranges found (may exceed max_ranges; only max_ranges are written)
+ */
+size_t merkle_diff(merkle_t* a, merkle_t* b, kvs_hash_range_t* ranges, size_t max_ranges);
+
+/**
+ * List hash ranges where a level exported by a peer differs from ours
+ * @param level Level the remote digests were exported from
+ * @param remote 2^level digests from merkle_level_digests on the peer
+ * @return number of ranges found (may exceed max_ranges)
+ */
+size_t merkle_diff_level(merkle_t* tree, unsigned level, const uint64_t* remote,
+                         kvs_hash_range_t* ranges, size_t max_ranges);
+
+/**
+ * Check whether a key hash falls into a range
+ */
+bool kvs_hash_in_range(const kvs_hash_range_t* range, uint32_t hash);
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ * Metrics exporter
+ *
+ * Every event loop keeps its own metrics shard: about once per
+ * KVS_METRICS_PUBLISH_MS it copies its store's O(1) statistics
+ * (kvs_info_summary), its server counters and its request latency
+ * histogram into the shard under a sequence lock. A scrape only reads
+ * the shards, retrying a copy that raced with a publish, so it never
+ * takes a lock or touches a store, and the loops never wait for it.
+ *
+ * The exporter thread renders the shards as OpenMetrics text (or the
+ * Prometheus text format, for clients that don't ask for OpenMetrics)
+ * on a small HTTP responder at GET /metrics, and/or rewrites a textfile
+ * for node_exporter's textfile collector at a fixed interval.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "histogram.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Interval at which a loop publishes its shard
+ */
+#define KVS_METRICS_PUBLISH_MS 1000
+
+/**
+ * Default textfile rewrite interval
+ */
+#define KVS_METRICS_DEFAULT_INTERVAL_MS 15000
+
+/**
+ * What one event loop publishes
+ */
+typedef struct {
+    kvs_info_t info;            // kvs_info_summary of its store (filename left NULL)
+    uint64_t commands;          // commands executed since start
+    uint64_t connections;       // connections accepted since start
+    uint64_t connected;         // open connections
+    histogram_t latency;        // request latency in nanoseconds, parse to reply
+} kvs_metrics_sample_t;
+
+/**
+ * Metrics shard, written by its loop only
+ */
+typedef struct {
+    uint64_t seq;               // odd while a publish is in progress
+    kvs_metrics_sample_t sample;
+} __attribute__((aligned(64))) kvs_metrics_shard_t;
+
+/**
+ * Start a publish; fill in the returned sample, then call kvs_metrics_end
+ */
+kvs_metrics_sample_t* kvs_metrics_begin(kvs_metrics_shard_t* shard);
+
+void kvs_metrics_end(kvs_metrics_shard_t* shard);
+
+/**
+ * Copy the last complete publish of a shard (any thread)
+ */
+void kvs_metrics_read(const kvs_metrics_shard_t* shard, kvs_metrics_sample_t* out);
+
+/**
+ * Format samples as OpenMetrics text (ending in "# EOF") or as the
+ * Prometheus text format; counters and the latency histogram are summed
+ * over the samples, keys and capacity are also given per shard
+ * @return Length of the full text, as snprintf
+ */
+int kvs_metrics_format(const kvs_metrics_sample_t* samples, size_t count, bool openmetrics,
+                       char* buf, size_t size);
+
+/**
+ * Read every shard and render them
+ * @return Malloc'd NUL-terminated text, NULL on failure
+ */
+char* kvs_metrics_render(const kvs_metrics_shard_t* shards, size_t count, bool openmetrics);
+
+/**
+ * Render the shards in the Prometheus text format into path, through a
+ * temporary file renamed over it so the collector never sees half a file
+ */
+bool kvs_metrics_write_textfile(const kvs_metrics_shard_t* shards, size_t count, const char* path);
+
+/**
+ * Exporter settings
+ */
+typedef struct {
+    const char* bind_address;   // HTTP address (default 127.0.0.1)
+    int port;                   // HTTP port, 0 for no endpoint
+    const char* textfile;       // textfile to keep up to date, NULL for none
+    unsigned interval_ms;       // textfile rewrite interval, 0 for the default
+} kvs_metrics_config_t;
+
+/**
+ * Exporter structure
+ */
+typedef struct {
+    const kvs_metrics_shard_t* shards;
+    size_t count;
+    int listen_fd;              // -1 without an HTTP endpoint
+    int wake_fd;                // eventfd that stops the thread
+    char* textfile;
+    unsigned interval_ms;
+    pthread_t thread;
+} kvs_metrics_exporter_t;
+
+/**
+ * Start listening and/or writing, on a thread of its own
+ * @param shards Shards to export, must outlive the exporter
+ * @return Pointer to the exporter or NULL on failure
+ */
+kvs_metrics_exporter_t* kvs_metrics_exporter_start(const kvs_metrics_shard_t* shards, size_t count,
+                                                   const kvs_metrics_config_t* config);
+
+/**
+ * Stop the thread (writing the textfile a last time) and free the exporter
+ */
+void kvs_metrics_exporter_stop(kvs_metrics_exporter_t* exporter);
+
+#endif
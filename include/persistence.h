@@ -11,8 +11,11 @@
 #define PERSISTENCE_H
 
 #include "hash_table.h"
+#include "mapped_table.h"
+#include "merkle.h"
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 /**
  * Magic number for file format identification
@@ -23,8 +26,24 @@
 /**
  * current file format version
  * allows for future format upgrades 
+ * version 2 groups records into blocks with key and hash bounds
  */
-#define KVS_FILE_VERSION 1
+#define KVS_FILE_VERSION 2
+
+/**
+ * original flat format (records only), still readable
+ */
+#define KVS_FILE_VERSION_FLAT 1
+
+/**
+ * Records per block in version 2 files
+ */
+#define KVS_BLOCK_RECORDS 256
+
+/**
+ * Largest value length accepted when loading
+ */
+#define KVS_MAX_VALUE_LENGTH 100000
 
 /**
  * File header structure
@@ -34,11 +53,104 @@ typedef struct {
     uint32_t magic;         // Magic number for format identification
     uint32_t version;       // file format version
     uint32_t entry_count;   // Number of key-value pairs in the file
-    uint32_t reserved;      //Reserved for future use
+    uint32_t reserved;      //Records per block (version 2), 0 in version 1
 } kvs_file_header_t;
 
+/**
+ * Block header (version 2)
+ * Bounds let a partial load skip blocks that cannot contain its share
+ */
+typedef struct {
+    uint32_t record_count;  // Records in this block
+    uint32_t byte_length;   // Bytes of records following this header
+    int32_t min_key;        // Smallest key in the block
+    int32_t max_key;        // Largest key in the block
+    uint32_t min_hash;      // Smallest key hash in the block
+    uint32_t max_hash;      // Largest key hash in the block
+} kvs_block_header_t;
+
+/**
+ * Which records a partial load keeps
+ */
+typedef enum {
+    KVS_FILTER_ALL = 0,         // Every record
+    KVS_FILTER_HASH_RANGE,      // Keys whose hash is in hash_range
+    KVS_FILTER_KEY_RANGE,       // Keys in [key_min, key_max]
+    KVS_FILTER_PREDICATE        // Keys for which predicate returns true
+} kvs_filter_kind_t;
+
+/**
+ * Key predicate for KVS_FILTER_PREDICATE, called before the value is read
+ */
+typedef bool (*kvs_key_predicate_fn)(void* ctx, int key);
+
+/**
+ * Filter for partial loads
+ */
+typedef struct {
+    kvs_filter_kind_t kind;
+    kvs_hash_range_t hash_range;        // KVS_FILTER_HASH_RANGE
+    int key_min;                        // KVS_FILTER_KEY_RANGE
+    int key_max;
+    kvs_key_predicate_fn predicate;     // KVS_FILTER_PREDICATE
+    void* ctx;
+} kvs_load_filter_t;
+
+/**
+ * Insert callback used by kvs_load_filtered
+ */
+typedef bool (*kvs_insert_fn)(void* table, int key, const char* value);
+
+/**
+ * Write function used while saving
+ * Same contract as fwrite, so it can be swapped out to inject
+ * short (torn) writes when testing crash recovery
+ */
+typedef size_t (*kvs_write_fn)(const void* ptr, size_t size, size_t count, FILE* file);
+
+/**
+ * Replace the write function used by kvs_save_to_file
+ * @param fn The new write function, or NULL to restore fwrite
+ */
+void kvs_set_write_fn(kvs_write_fn fn);
+
+/**
+ * Iteration callback that lets the same writer serve any entry source
+ * @return false once there are no more entries
+ */
+typedef bool (*kvs_entry_next_fn)(void* iter, int* key, const char** value);
+
+/**
+ * Save count entries produced by next to a snapshot file
+ * Keys must be unique; same format and temp-file-then-rename
+ * behaviour as kvs_save_to_file
+ */
+bool kvs_save_entries(const char* filename, size_t count, kvs_entry_next_fn next, void* iter);
+
+/**
+ * Snapshot writer whose memory is all allocated up front
+ */
+typedef struct kvs_snapshot_writer kvs_snapshot_writer_t;
+
+/**
+ * Allocate a writer for snapshots of up to capacity entries
+ */
+kvs_snapshot_writer_t* kvs_snapshot_writer_create(size_t capacity);
+
+/**
+ * Write entries produced by next to fd in the snapshot format
+ * Allocates nothing, takes no locks and uses no stdio (write(2) only),
+ * so it is safe in a child forked from a threaded process. Entries past
+ * the writer's capacity are left out; fd is neither synced nor closed
+ */
+bool kvs_snapshot_writer_save(kvs_snapshot_writer_t* writer, int fd, kvs_entry_next_fn next, void* iter);
+
+void kvs_snapshot_writer_destroy(kvs_snapshot_writer_t* writer);
+
 /**
  * Save the hash table contents to a file
+ * Data is written to "<filename>.tmp", synced, then renamed over
+ * filename, so a crash mid-save leaves the previous file intact
  */
 bool kvs_save_to_file(hash_table_t* table, const char* filename);
 
@@ -48,9 +160,32 @@ bool kvs_save_to_file(hash_table_t* table, const char* filename);
  */
 bool kvs_load_from_file(hash_table_t* table,  const char* filename);
 
+/**
+ * Load only the records passing filter (NULL for all) through insert
+ * Non-matching records are skipped without allocating; in version 2
+ * files whole blocks are skipped when their bounds miss the filter
+ */
+bool kvs_load_filtered(const char* filename, const kvs_load_filter_t* filter,
+                       kvs_insert_fn insert, void* table);
+
+/**
+ * Save a mapped table to a snapshot file (same format)
+ */
+bool kvs_save_mapped_to_file(mapped_table_t* table, const char* filename);
+
+/**
+ * Load a snapshot file into a mapped table
+ */
+bool kvs_load_mapped_from_file(mapped_table_t* table, const char* filename);
+
 /**
  * check if a file exists and is redable
  */
 bool kvs_file_exists(const char* filename);
 
+/**
+ * size of a file in bytes, -1 if it cannot be examined
+ */
+long long kvs_file_size(const char* filename);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,155 @@
+/**
+ * Read-through cache
+ *
+ * A store with a loader is a cache in front of a slower backing service:
+ * a kvs_get miss calls the loader, and what it finds is set before
+ * kvs_get returns. Keys the loader reports missing can be remembered for
+ * a while (negative caching), so lookups of absent keys don't reach the
+ * backend over and over. The negative cache is direct-mapped, so its size
+ * is fixed and a key can push another out early.
+ *
+ * A store is used by one thread, so concurrent misses meet in the
+ * server: its loops hand loads to a load pool (below) instead of waiting
+ * on the backend, and a miss on a key that is already loading waits for
+ * that load rather than starting another.
+ */
+
+#ifndef READTHROUGH_H
+#define READTHROUGH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Negative cache and write generation slots
+ */
+#define READTHROUGH_MISS_BITS 12
+#define READTHROUGH_MISS_SLOTS (1u << READTHROUGH_MISS_BITS)
+
+/**
+ * What a load found
+ */
+typedef enum {
+    KVS_LOAD_FOUND,         // value set
+    KVS_LOAD_MISSING,       // the backend doesn't have the key
+    KVS_LOAD_FAILED         // the backend could not answer (not remembered)
+} kvs_load_result_t;
+
+/**
+ * Fetch a key from the backing service
+ * On KVS_LOAD_FOUND *value is a malloc'd value of *len bytes, without
+ * NUL bytes, that the store takes over
+ * The server calls it from its load threads, several at once for
+ * different keys, never twice at once for the same key
+ */
+typedef kvs_load_result_t (*kvs_loader_fn)(void* ctx, int key, char** value, size_t* len);
+
+/**
+ * A key the backend doesn't have
+ */
+typedef struct {
+    int key;
+    long long expires_ms;   // 0 for an empty slot
+} readthrough_miss_t;
+
+/**
+ * Read-through state of a store
+ */
+typedef struct {
+    kvs_loader_fn loader;
+    void* ctx;
+    unsigned negative_ttl_ms;
+    readthrough_miss_t* misses;     // negative cache, NULL when off
+    uint32_t* generations;          // per slot, moved on by writes of its keys
+    uint32_t epoch;                 // moved on by changes to the whole store
+} readthrough_t;
+
+/**
+ * Create the state
+ * @param negative_ttl_ms How long a missing key is remembered, 0 for not at all
+ * @return Pointer to the state or NULL on failure
+ */
+readthrough_t* readthrough_create(kvs_loader_fn loader, void* ctx, unsigned negative_ttl_ms);
+
+void readthrough_destroy(readthrough_t* rt);
+
+/**
+ * Whether the backend was found not to have key less than the TTL ago
+ */
+bool readthrough_known_missing(readthrough_t* rt, int key);
+
+/**
+ * Remember that the backend doesn't have key (no-op without negative caching)
+ */
+void readthrough_remember_missing(readthrough_t* rt, int key);
+
+/**
+ * Note a write of key: a remembered miss is forgotten and the key's
+ * write generation moves on
+ */
+void readthrough_written(readthrough_t* rt, int key);
+
+/**
+ * Note a change to the whole store (every write generation moves on)
+ */
+void readthrough_written_all(readthrough_t* rt);
+
+/**
+ * Write generation of key, to tell whether it was written since
+ * Keys sharing a slot share it, so a write of one only costs the
+ * other a skipped fill
+ */
+uint32_t readthrough_generation(readthrough_t* rt, int key);
+
+/**
+ * One load handed to a load pool
+ */
+typedef struct kvs_load {
+    kvs_loader_fn loader;
+    void* ctx;
+    int key;
+    unsigned queue;             // done queue it is returned on
+    kvs_load_result_t result;   // filled in by the pool
+    char* value;
+    size_t len;
+    struct kvs_load* next;
+} kvs_load_t;
+
+/**
+ * Threads running loads off the event loops
+ */
+typedef struct load_pool load_pool_t;
+
+/**
+ * Start the threads
+ * @param wake_fds Per done queue, an eventfd written once a load lands on it
+ * @return Pointer to the pool or NULL on failure
+ */
+load_pool_t* load_pool_create(unsigned threads, const int* wake_fds, unsigned queues);
+
+/**
+ * Queue a load; it belongs to the pool until taken back
+ */
+void load_pool_submit(load_pool_t* pool, kvs_load_t* load);
+
+/**
+ * Take the finished loads of a queue (a list linked by next)
+ */
+kvs_load_t* load_pool_take(load_pool_t* pool, unsigned queue);
+
+/**
+ * Stop the threads once their current loads return
+ * Finished loads can still be taken afterwards; loads not started yet
+ * are left to their owners
+ */
+void load_pool_stop(load_pool_t* pool);
+
+/**
+ * Stop the threads and free the pool
+ * Loads are never freed by the pool: owners take the finished ones
+ * (load_pool_stop, then load_pool_take) before destroying it
+ */
+void load_pool_destroy(load_pool_t* pool);
+
+#endif
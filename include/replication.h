@@ -0,0 +1,86 @@
+/**
+ * Primary / replica replication
+ *
+ * A replica connects to its primary and sends PSYNC with the replication
+ * id and offset it has (or "?" and -1 the first time). The primary
+ * answers either
+ *   +CONTINUE <id>                      and resends the log from the offset
+ *   +FULLRESYNC <id> <offset>           followed by $<len>\r\n and a v2 snapshot
+ *                                       taken at that offset, then the log
+ * The log is the stream of write commands (SET / DEL, in RESP) the
+ * primary applied, and offsets count its bytes. The replica applies the
+ * stream, serves reads, and reports its offset with REPLCONF ACK <offset>
+ * at most every KVS_REPL_ACK_INTERVAL_MS.
+ *
+ * The primary keeps the last part of the log in a ring (kvs_repl_log_t),
+ * so a replica that was disconnected briefly picks up where it stopped;
+ * one that fell further behind gets a new snapshot.
+ */
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default size of the log kept for partial resyncs
+ */
+#define KVS_REPL_LOG_DEFAULT_SIZE (1024 * 1024)
+
+/**
+ * Replication id length (hex characters)
+ */
+#define KVS_REPL_ID_LENGTH 40
+
+/**
+ * Replica acknowledgement batching, link retry delay, and how long a
+ * link may take to connect
+ */
+#define KVS_REPL_ACK_INTERVAL_MS 100
+#define KVS_REPL_RETRY_MS 1000
+#define KVS_REPL_CONNECT_TIMEOUT_MS 5000
+
+/**
+ * Tail of the replication stream, a ring of capacity bytes
+ * Holds the bytes at offsets [start, end)
+ */
+typedef struct {
+    char* data;
+    size_t capacity;
+    uint64_t start;     // offset of the oldest byte kept
+    uint64_t end;       // offset just past the newest byte
+} kvs_repl_log_t;
+
+/**
+ * Allocate an empty log, starting at offset
+ * @return false if out of memory
+ */
+bool kvs_repl_log_init(kvs_repl_log_t* log, size_t capacity, uint64_t offset);
+
+void kvs_repl_log_free(kvs_repl_log_t* log);
+
+/**
+ * Append to the log, dropping the oldest bytes if it is full
+ */
+void kvs_repl_log_append(kvs_repl_log_t* log, const char* data, size_t len);
+
+/**
+ * Check whether the log can be resent from offset
+ */
+bool kvs_repl_log_has(const kvs_repl_log_t* log, uint64_t offset);
+
+/**
+ * Contiguous bytes of the log from offset (the ring may wrap, so call
+ * again from offset + returned length for the rest)
+ * @return byte count, 0 if offset is end or no longer kept
+ */
+size_t kvs_repl_log_read(const kvs_repl_log_t* log, uint64_t offset, const char** data);
+
+/**
+ * Fill id with a fresh random replication id (NUL terminated)
+ */
+void kvs_repl_new_id(char id[KVS_REPL_ID_LENGTH + 1]);
+
+#endif
@@ -0,0 +1,122 @@
+/**
+ * RESP protocol helpers
+ *
+ * Parsing of client requests and encoding of replies for the subset of
+ * the Redis serialization protocol (RESP2) spoken by the server, and
+ * parsing of replies for clients.
+ * Requests are arrays of bulk strings, or inline space-separated lines
+ * as typed into telnet / nc. Parsed arguments are slices pointing into
+ * the caller's buffer, which is neither copied nor modified.
+ */
+
+#ifndef RESP_H
+#define RESP_H
+
+#include "command.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Limits enforced while parsing, a request exceeding them is a
+ * protocol error (the connection can't be resynchronized)
+ */
+#define RESP_MAX_BULK_LENGTH (1024 * 1024)
+#define RESP_MAX_INLINE_LENGTH (64 * 1024)
+#define RESP_MAX_REPLY_DEPTH 8
+
+/**
+ * Result of parsing one request
+ */
+typedef enum {
+    RESP_OK = 0,            // a complete request was parsed
+    RESP_INCOMPLETE,        // need more bytes
+    RESP_PROTOCOL_ERROR     // malformed or over the limits
+} resp_status_t;
+
+/**
+ * Reply types
+ */
+typedef enum {
+    RESP_REPLY_STATUS,      // +text
+    RESP_REPLY_ERROR,       // -text
+    RESP_REPLY_INTEGER,     // :number
+    RESP_REPLY_BULK,        // $len, then len bytes
+    RESP_REPLY_NULL,        // $-1 or *-1
+    RESP_REPLY_ARRAY        // *count, then count replies
+} resp_reply_type_t;
+
+/**
+ * A parsed reply
+ * Strings point into the parsed buffer and are NUL terminated in place;
+ * array elements are further nodes filled by the same parse
+ */
+typedef struct resp_reply {
+    resp_reply_type_t type;
+    long long integer;                  // INTEGER value
+    const char* str;                    // STATUS, ERROR and BULK text
+    size_t len;                         // text length, or ARRAY element count
+    const struct resp_reply* elements;  // ARRAY elements
+} resp_reply_t;
+
+/**
+ * Growable byte buffer, used for connection input and output
+ */
+typedef struct {
+    char* data;
+    size_t len;             // bytes in use
+    size_t capacity;        // bytes allocated
+} resp_buf_t;
+
+/**
+ * Parse one request from the start of a buffer
+ * @param data Received bytes
+ * @param len Number of received bytes
+ * @param argv Output slices, pointing into data
+ * @param max_args Capacity of argv
+ * @param argc Number of arguments (0 for an empty inline line)
+ * @param consumed Bytes taken by the request
+ * @return RESP_OK, RESP_INCOMPLETE or RESP_PROTOCOL_ERROR
+ */
+resp_status_t resp_parse_request(char* data, size_t len, kvs_slice_t* argv, size_t max_args,
+                                 size_t* argc, size_t* consumed);
+
+/**
+ * Parse one reply from the start of a buffer
+ * Call it with nodes NULL to learn whether the reply is complete and how
+ * many nodes it takes, then again with room for them: that pass fills
+ * the nodes (the reply itself first) and terminates strings in place
+ * @param nodes Output nodes, or NULL to only measure
+ * @param used Number of nodes the reply takes
+ * @param consumed Bytes taken by the reply
+ * @return RESP_OK, RESP_INCOMPLETE or RESP_PROTOCOL_ERROR
+ */
+resp_status_t resp_parse_reply(char* data, size_t len, resp_reply_t* nodes, size_t* used, size_t* consumed);
+
+/**
+ * Make room for extra bytes at the end of a buffer
+ * @return true on success, false if out of memory
+ */
+bool resp_buf_reserve(resp_buf_t* buf, size_t extra);
+
+/**
+ * Drop bytes from the front of a buffer
+ */
+void resp_buf_consume(resp_buf_t* buf, size_t count);
+
+/**
+ * Free the buffer memory
+ */
+void resp_buf_free(resp_buf_t* buf);
+
+/**
+ * Reply encoders, each returns false if out of memory
+ */
+bool resp_add_simple(resp_buf_t* buf, const char* str);      // +str
+bool resp_add_error(resp_buf_t* buf, const char* msg);       // -msg
+bool resp_add_integer(resp_buf_t* buf, long long value);     // :value
+bool resp_add_bulk(resp_buf_t* buf, const char* data, size_t len);
+bool resp_add_null(resp_buf_t* buf);                          // $-1
+bool resp_add_array(resp_buf_t* buf, size_t count);          // *count, elements follow
+bool resp_add_raw(resp_buf_t* buf, const char* data, size_t len);    // already encoded bytes
+
+#endif
@@ -0,0 +1,177 @@
+/**
+ * Network server header
+ *
+ * Non-blocking server around one store or a set of shards. An epoll loop
+ * accepts clients on a TCP and/or a Unix socket and speaks a
+ * RESP-compatible subset (see resp.h), so redis-cli, redis-benchmark and
+ * other Redis clients can drive the store. Keys are decimal integers.
+ *
+ * Sharded (thread-per-core) mode runs one event loop thread per shard,
+ * each with its own SO_REUSEPORT TCP listener, so the kernel spreads
+ * clients over the loops. A loop owns its shard outright: a request for
+ * a key in another shard is split into single-key operations that are
+ * forwarded to the owning loop over lock-free SPSC rings and answered
+ * back the same way. Nothing on the request path takes a shared lock.
+ * The Unix socket, if any, is served by the first loop only.
+ *
+ * Commands: PING, GET, SET, DEL, MGET, MSET, MDEL (same as DEL), INCR, SCAN,
+ * INFO, COMMAND, QUIT, and PSYNC / REPLCONF between a primary and its
+ * replicas. The keys of a multi-key command that live in the loop's own
+ * shard go to the store in batches (kvs_mget / kvs_mset / kvs_mdel).
+ *
+ * Each connection has its own input and output buffer. Pipelined
+ * requests are executed back to back and their replies leave in a single
+ * write; a client that stops reading stops being read once its pending
+ * output passes SERVER_OUTPUT_LIMIT.
+ *
+ * Socket I/O goes through epoll or io_uring, chosen at startup (see
+ * kvs_server_backend_t); both share the parsing and command code.
+ *
+ * A single-loop server can replicate (see replication.h): any such server
+ * is a primary its replicas sync from, and one started with replica_of
+ * follows a primary, serving reads and refusing writes from clients.
+ *
+ * With metrics on, each loop times every request and publishes its
+ * figures to its own shard in server->metrics for an exporter to read
+ * (see metrics.h).
+ *
+ * Shards in read-through mode (see readthrough.h) are loaded by a pool of
+ * threads, so a slow backend holds up the requests that miss, not the
+ * loop; misses on a key that is already loading wait for the same load.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "kvstore.h"
+#include "metrics.h"
+#include "resp.h"
+#include "spsc_ring.h"
+#include <stdint.h>
+
+/**
+ * Default TCP port (one above Redis, so both can run side by side)
+ */
+#define KVS_SERVER_DEFAULT_PORT 6380
+
+/**
+ * Most arguments accepted in one request (MGET / MSET / DEL / MDEL)
+ */
+#define SERVER_MAX_ARGS 8192
+
+/**
+ * Pending output at which a connection stops being read
+ */
+#define SERVER_OUTPUT_LIMIT (1024 * 1024)
+
+/**
+ * Most shards (event loops) in sharded mode
+ */
+#define SERVER_MAX_SHARDS 64
+
+/**
+ * Network I/O backend
+ */
+typedef enum {
+    KVS_BACKEND_EPOLL = 0,      // readiness events, recv / send per connection
+    KVS_BACKEND_IO_URING        // completions: multishot accept / recv into provided
+                                // buffers, batched submission, zero-copy send of
+                                // large replies to remote peers; falls back to epoll
+                                // on older kernels
+} kvs_server_backend_t;
+
+/**
+ * Server settings
+ */
+typedef struct {
+    const char* bind_address;   // TCP address (default 127.0.0.1)
+    int port;                   // TCP port, 0 for no TCP listener
+    const char* unix_path;      // Unix socket path, NULL for none
+    bool pin_threads;           // pin event loop i to CPU i (sharded mode)
+    kvs_server_backend_t backend;
+    const char* replica_of;     // primary to follow, "host:port" or a Unix socket path
+    size_t repl_log_size;       // log kept for partial resyncs, 0 for the default
+    bool metrics;               // time requests and publish metrics shards
+} kvs_server_config_t;
+
+/**
+ * Client connection, event loop and replication state (private to server.c)
+ */
+typedef struct kvs_conn kvs_conn_t;
+typedef struct kvs_worker kvs_worker_t;
+typedef struct kvs_repl kvs_repl_t;
+
+/**
+ * Server structure
+ */
+typedef struct {
+    kvs_worker_t* workers;      // one event loop per shard
+    unsigned worker_count;
+    spsc_ring_t* rings;         // rings[from * worker_count + to]
+    char* unix_path;            // unlinked on destroy
+    bool pin_threads;
+    kvs_server_backend_t backend;   // backend in use (after any fallback)
+    kvs_repl_t* repl;           // replication state, NULL in sharded mode
+    kvs_metrics_shard_t* metrics;   // one per loop, NULL without config metrics
+    load_pool_t* loads;         // read-through loads while running, NULL if no shard has a loader
+    int stopping;               // set by kvs_server_stop
+} kvs_server_t;
+
+/**
+ * Shard owning a key when keys are spread over count shards
+ * Uses the top of the 32-bit key hash, so each shard is one contiguous
+ * hash range (see kvs_shard_hash_range) and the low bits the table
+ * indexes by stay evenly spread inside a shard
+ */
+static inline unsigned kvs_shard_for_key(int key, unsigned count) {
+    return (unsigned)(((uint64_t)(uint32_t)ht_hash(key) * count) >> 32);
+}
+
+/**
+ * Hash range covered by a shard, for loading it with kvs_load_range
+ */
+kvs_hash_range_t kvs_shard_hash_range(unsigned shard, unsigned count);
+
+/**
+ * Backend name, as shown by INFO
+ */
+const char* kvs_server_backend_name(kvs_server_backend_t backend);
+
+/**
+ * Create a server around a single store and start listening
+ * @param kvs Store to serve, must outlive the server
+ * @return Pointer to the server or NULL on failure
+ */
+kvs_server_t* kvs_server_create(kvstore_t* kvs, const kvs_server_config_t* config);
+
+/**
+ * Create a sharded server, one event loop per shard
+ * Keys must be spread as kvs_shard_for_key says; each shard is only
+ * touched by its own loop while the server runs
+ * @param shards Stores to serve, must outlive the server
+ * @param count Number of shards (and threads), 1 to SERVER_MAX_SHARDS
+ * @return Pointer to the server or NULL on failure
+ */
+kvs_server_t* kvs_server_create_sharded(kvstore_t** shards, unsigned count,
+                                        const kvs_server_config_t* config);
+
+/**
+ * Run the event loops until kvs_server_stop is called
+ * The first loop runs on the calling thread, the others on threads
+ * started here and joined before returning
+ * @return true on a requested stop, false on failure
+ */
+bool kvs_server_run(kvs_server_t* server);
+
+/**
+ * Ask a running server to stop
+ * Async-signal-safe and callable from any thread
+ */
+void kvs_server_stop(kvs_server_t* server);
+
+/**
+ * Close all connections and listeners and free the server
+ */
+void kvs_server_destroy(kvs_server_t* server);
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * Shared-memory transport
+ *
+ * A client on the same host can move its connection off the socket onto
+ * two byte rings in a shared segment (a memfd): requests one way,
+ * replies the other, each with one producer and one consumer. The bytes
+ * are the same RESP or binary frames as on the socket, so the server
+ * runs them through the usual parser.
+ *
+ * While both sides are busy no system call is made. The server's event
+ * loop keeps polling its shared-memory clients for KVS_SHM_SPIN_NS after
+ * the last request, then marks them parked and sleeps in epoll; a client
+ * that finds the loop parked writes the eventfd it was handed. A client
+ * waiting for replies spins for KVS_SHM_SPIN_NS too, then sleeps on a
+ * futex in the segment, which the server bumps whenever it moves bytes.
+ *
+ * Handshake: the client sends SHM on its Unix socket and the server
+ * answers +OK with the segment and the eventfd attached (SCM_RIGHTS).
+ * The socket stays open only so that each side sees the other go away.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include "spsc_ring.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// not MT_MAGIC_NUMBER ("KVSM"): table memfds are passed over sockets too
+#define KVS_SHM_MAGIC 0x4b565352u      // "KVSR"
+
+/**
+ * Bytes per ring, a power of two
+ */
+#define KVS_SHM_RING_SIZE (1024 * 1024)
+
+/**
+ * Offset of the ring bytes in the segment, after the header
+ */
+#define KVS_SHM_DATA_OFFSET 4096
+
+/**
+ * How long each side polls before going to sleep
+ */
+#define KVS_SHM_SPIN_NS 50000
+
+/**
+ * Byte ring indexes, free-running (the position is index & (size - 1))
+ */
+typedef struct {
+    uint64_t head __attribute__((aligned(SPSC_CACHE_LINE)));   // bytes written, by the producer
+    uint64_t tail __attribute__((aligned(SPSC_CACHE_LINE)));   // bytes read, by the consumer
+} kvs_shm_ring_t;
+
+/**
+ * Start of the segment
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t ring_size;
+    kvs_shm_ring_t requests;
+    kvs_shm_ring_t replies;
+    uint32_t server_parked __attribute__((aligned(SPSC_CACHE_LINE)));  // loop sleeps, write the eventfd
+    uint32_t client_seq __attribute__((aligned(SPSC_CACHE_LINE)));     // futex word, bumped by the server
+    uint32_t client_parked;                                             // client sleeps on client_seq
+} kvs_shm_header_t;
+
+/**
+ * A mapped segment
+ */
+typedef struct {
+    kvs_shm_header_t* header;   // NULL when not mapped
+    char* requests;             // ring bytes
+    char* replies;
+    size_t ring_size;
+} kvs_shm_t;
+
+/**
+ * Create and map a segment (server side)
+ * @param fd Set to the memfd, for the caller to hand out and close
+ */
+bool kvs_shm_create(kvs_shm_t* shm, int* fd);
+
+/**
+ * Map a segment received from the server (the fd can be closed after)
+ */
+bool kvs_shm_attach(kvs_shm_t* shm, int fd);
+
+void kvs_shm_detach(kvs_shm_t* shm);
+
+/**
+ * Append up to len bytes (producer side)
+ * @return Bytes written, less than len when the ring fills
+ */
+size_t kvs_shm_write(kvs_shm_ring_t* ring, char* data, size_t size, const char* src, size_t len);
+
+/**
+ * Take up to len bytes (consumer side)
+ * @return Bytes read
+ */
+size_t kvs_shm_read(kvs_shm_ring_t* ring, const char* data, size_t size, char* dst, size_t len);
+
+/**
+ * Sleep on a futex in the segment while it holds expected
+ */
+void kvs_shm_futex_wait(uint32_t* word, uint32_t expected, int timeout_ms);
+
+void kvs_shm_futex_wake(uint32_t* word);
+
+static inline size_t kvs_shm_readable(const kvs_shm_ring_t* ring) {
+    return (size_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+                    __atomic_load_n(&ring->tail, __ATOMIC_RELAXED));
+}
+
+/**
+ * Say that this side is about to sleep; the caller then checks the
+ * rings once more before it does
+ */
+static inline void kvs_shm_park(uint32_t* parked) {
+    __atomic_store_n(parked, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * After moving bytes: take the other side's parked flag
+ * @return true if it was parked, and the caller must wake it
+ */
+static inline bool kvs_shm_unpark(uint32_t* parked) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(parked, __ATOMIC_RELAXED) && __atomic_exchange_n(parked, 0, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * One step of a polling loop: a pause, or on a single CPU a yield, since
+ * there the other side cannot run while this one polls
+ */
+void kvs_shm_relax(void);
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ * Slow-operation log
+ *
+ * Store operations that take longer than a threshold are kept in a fixed
+ * ring of the most recent ones, with their duration and tags for what
+ * the table was doing at the time (a resize, a long probe sequence, a
+ * large value allocation, file I/O). A store with a slow log reads the
+ * monotonic clock twice per operation and writes nothing unless the
+ * operation was slow; a store without one pays a NULL check per
+ * operation, and its table a flag test per lookup (probe lengths are
+ * only counted while the slow log times an operation).
+ */
+
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Defaults for kvs_slowlog_enable
+ */
+#define SLOWLOG_DEFAULT_ENTRIES 128
+#define SLOWLOG_DEFAULT_THRESHOLD_US 1000
+
+/**
+ * Probe sequence length, and value size, from which an operation is
+ * tagged KVS_SLOW_PROBE / KVS_SLOW_ALLOC
+ */
+#define SLOWLOG_LONG_PROBE 32
+#define SLOWLOG_LARGE_VALUE (64 * 1024)
+
+/**
+ * Cause tags (bit flags)
+ */
+#define KVS_SLOW_RESIZE 0x1u    // the table was resized
+#define KVS_SLOW_PROBE 0x2u     // a probe sequence of SLOWLOG_LONG_PROBE slots or more
+#define KVS_SLOW_ALLOC 0x4u     // a value of SLOWLOG_LARGE_VALUE bytes or more was copied
+#define KVS_SLOW_IO 0x8u        // the operation reads or writes a file
+
+typedef enum {
+    KVS_OP_GET,
+    KVS_OP_SET,
+    KVS_OP_DELETE,
+    KVS_OP_MGET,
+    KVS_OP_MSET,
+    KVS_OP_MDEL,
+    KVS_OP_CLEAR,
+    KVS_OP_SAVE,
+    KVS_OP_LOAD,
+    KVS_OP_CHECKPOINT,
+    KVS_OP_COUNT
+} kvs_op_t;
+
+/**
+ * One slow operation
+ */
+typedef struct {
+    uint64_t id;            // increases by one per entry
+    uint64_t time_us;       // wall-clock time it ended, microseconds since the epoch
+    uint64_t duration_us;
+    kvs_op_t op;
+    int key;                // the key, the first key of a multi-key call, else 0
+    size_t count;           // keys of a multi-key call, entries for clear / save / load
+    size_t value_len;       // bytes of the value set, the largest for mset
+    size_t probes;          // longest probe sequence
+    unsigned causes;        // KVS_SLOW_* tags
+} kvs_slow_entry_t;
+
+/**
+ * Slow log structure
+ * Holds the entries with ids [first, next_id), at most capacity of them
+ */
+typedef struct {
+    kvs_slow_entry_t* entries;  // ring, entry with id i at i % capacity
+    size_t capacity;
+    uint64_t first;             // oldest id kept
+    uint64_t next_id;
+    uint64_t threshold_ns;
+} slowlog_t;
+
+/**
+ * Create an empty slow log
+ * @param entries Entries kept (0 for the default)
+ * @param threshold_us Operations that take at least this long are logged
+ * @return Pointer to the log or NULL on failure
+ */
+slowlog_t* slowlog_create(size_t entries, uint64_t threshold_us);
+
+void slowlog_destroy(slowlog_t* log);
+
+/**
+ * Monotonic clock in nanoseconds, for timing operations
+ */
+uint64_t slowlog_now(void);
+
+/**
+ * Add an entry, dropping the oldest when full (id and time_us are set here)
+ */
+void slowlog_record(slowlog_t* log, const kvs_slow_entry_t* entry);
+
+/**
+ * Copy up to max entries, newest first
+ * @return Number of entries written to out
+ */
+size_t slowlog_get(const slowlog_t* log, kvs_slow_entry_t* out, size_t max);
+
+/**
+ * Drop every entry (ids carry on)
+ */
+void slowlog_reset(slowlog_t* log);
+
+/**
+ * Name of an operation ("set", "mget", ...)
+ */
+const char* slowlog_op_name(kvs_op_t op);
+
+/**
+ * Write the cause tags as a comma-separated list ("resize,probe"),
+ * "-" when there are none
+ */
+void slowlog_format_causes(unsigned causes, char* buf, size_t size);
+
+#endif
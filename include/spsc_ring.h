@@ -0,0 +1,78 @@
+/**
+ * Lock-free single-producer / single-consumer ring of pointers
+ *
+ * Used to pass work between two threads without locks: one thread only
+ * pushes, the other only pops. The producer and consumer indexes live on
+ * separate cache lines, and each side keeps a cached copy of the other's
+ * index so it only touches the shared line when the ring looks full
+ * (producer) or empty (consumer).
+ *
+ * The functions are inline since they sit on the request path.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Slots per ring, a power of two
+ */
+#define SPSC_RING_SIZE 1024
+
+#define SPSC_CACHE_LINE 64
+
+/**
+ * Ring structure, must be zeroed and SPSC_CACHE_LINE aligned
+ */
+typedef struct {
+    // producer side
+    uint32_t tail __attribute__((aligned(SPSC_CACHE_LINE)));   // next slot to fill
+    uint32_t head_cache;                                        // producer's view of head
+
+    // consumer side
+    uint32_t head __attribute__((aligned(SPSC_CACHE_LINE)));   // next slot to take
+    uint32_t tail_cache;                                        // consumer's view of tail
+
+    void* slots[SPSC_RING_SIZE] __attribute__((aligned(SPSC_CACHE_LINE)));
+} spsc_ring_t;
+
+/**
+ * Add an item (producer thread only)
+ * @return false if the ring is full
+ */
+static inline bool spsc_push(spsc_ring_t* ring, void* item) {
+    uint32_t tail = ring->tail;
+    if (tail - ring->head_cache == SPSC_RING_SIZE) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache == SPSC_RING_SIZE) {
+            return false;
+        }
+    }
+
+    ring->slots[tail & (SPSC_RING_SIZE - 1)] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Take the oldest item (consumer thread only)
+ * @return the item, NULL if the ring is empty
+ */
+static inline void* spsc_pop(spsc_ring_t* ring) {
+    uint32_t head = ring->head;
+    if (head == ring->tail_cache) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->tail_cache) {
+            return NULL;
+        }
+    }
+
+    void* item = ring->slots[head & (SPSC_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+#endif
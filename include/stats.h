@@ -0,0 +1,90 @@
+/**
+ * Store statistics
+ *
+ * A store keeps a few counters as it runs (kvs_stats_t, one increment
+ * per operation); kvs_info() adds what can be read off the table on
+ * demand (tombstones, probe lengths, memory) into a kvs_info_t, which
+ * formats as INFO-style text or as JSON. Latency histograms (latency.h)
+ * format the same way.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "latency.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Counters kept by a store
+ */
+typedef struct {
+    uint64_t gets;                  // keys looked up, by get and mget
+    uint64_t get_hits;              // of which were present
+    uint64_t sets;                  // keys set, by set and mset
+    uint64_t deletes;               // keys deleted, by delete and mdel
+    uint64_t delete_hits;           // of which were present
+    uint64_t mgets;                 // multi-key calls
+    uint64_t msets;
+    uint64_t mdels;
+    uint64_t scans;                 // scan pages
+    uint64_t clears;
+    uint64_t loads;
+    uint64_t saves;                 // saves and checkpoints that succeeded
+    uint64_t save_failures;
+    uint64_t changes_since_save;    // keys changed since the last save or load
+    uint64_t last_save_time;        // wall clock, seconds since the epoch (0: never)
+    uint64_t last_save_us;          // duration of the last save
+    uint64_t last_save_bytes;       // size of the file it wrote
+    bool last_save_ok;              // whether the last save attempt succeeded
+} kvs_stats_t;
+
+/**
+ * Everything kvs_info() reports
+ */
+typedef struct {
+    kvs_stats_t ops;
+    double hit_ratio;               // get_hits / gets (0 before any get)
+
+    // table
+    const char* mode;               // "heap" or "mapped"
+    size_t entries;
+    size_t capacity;
+    size_t tombstones;
+    double load_factor;             // entries / capacity
+    double effective_load_factor;   // (entries + tombstones) / capacity, what resizes go by
+    double probe_mean;              // slots from home to entry, over live entries
+    size_t probe_max;
+    uint64_t resizes;
+    uint64_t resize_us;             // total time spent resizing
+
+    // memory, in bytes
+    size_t memory_table;            // entries array
+    size_t memory_values;           // value allocations (arena blocks in mapped mode)
+    size_t memory_merkle;
+    size_t memory_changefeed;
+    size_t memory_slowlog;
+    size_t memory_latency;
+    size_t memory_total;
+    size_t mapped_bytes;            // size of the mapping in mapped mode, else 0
+
+    const char* filename;           // associated file, NULL if none
+} kvs_info_t;
+
+/**
+ * Format a report as text ("# Section" headers and "name:value" lines)
+ * or as one JSON object with a member per section
+ * @return Length of the full report, as snprintf (output is truncated
+ *         to size - 1 characters)
+ */
+int kvs_info_format(const kvs_info_t* info, bool json, char* buf, size_t size);
+
+/**
+ * Format latency histograms, one line (or JSON member) per operation
+ * type recorded: calls, then mean, p50, p99, p99.9 and max in microseconds
+ * @return Length of the full report, as snprintf
+ */
+int kvs_latency_format(const latency_t* latency, bool json, char* buf, size_t size);
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * Minimal io_uring wrapper
+ *
+ * Sets up a ring with the raw syscalls (no liburing dependency), hands
+ * out submission entries, submits them in batches and walks the
+ * completions. Also manages a provided buffer ring, which the kernel
+ * picks receive buffers from so idle connections don't pin memory.
+ *
+ * One thread per ring: nothing here is synchronized.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Submission and completion rings, as mapped from the kernel
+ */
+typedef struct {
+    int fd;
+    unsigned features;          // IORING_FEAT_* reported by the kernel
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;        // entries handed out but not yet submitted
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;              // same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * Provided buffer ring: count buffers of size bytes in group bgid
+ */
+typedef struct {
+    struct io_uring_buf_ring* ring;
+    char* base;                 // buffer i is at base + i * size
+    unsigned count;             // a power of two
+    unsigned size;
+    uint16_t bgid;
+    uint16_t tail;
+    size_t ring_size;
+} uring_buffers_t;
+
+/**
+ * Check once whether this kernel has everything the server backend
+ * uses: multishot accept / recv, provided buffer rings, zero-copy send
+ * (all there from Linux 6.0, which added IORING_OP_SEND_ZC)
+ */
+bool uring_available(void);
+
+/**
+ * Create a ring with room for entries submissions
+ * Completion queue is sized 4x, and the ring is set up for a single
+ * submitting thread, which must be the caller
+ * @return true on success
+ */
+bool uring_init(uring_t* ring, unsigned entries);
+
+/**
+ * Tear down a ring; the kernel cancels anything still in flight
+ */
+void uring_exit(uring_t* ring);
+
+/**
+ * Get a zeroed submission entry, submitting queued ones if the ring is full
+ * @return the entry, NULL if the kernel won't take more
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+/**
+ * Submit queued entries and wait for completions
+ * @param wait_nr Completions to wait for (0 to just submit)
+ * @param timeout_ms Wait limit, -1 for none
+ * @return entries submitted, or -errno (-ETIME on timeout)
+ */
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr, int timeout_ms);
+
+/**
+ * Next completion, NULL if there is none
+ */
+static inline struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * Release the completion returned by uring_peek_cqe
+ */
+static inline void uring_cqe_seen(uring_t* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Request preparation
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, uint16_t bgid, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len,
+                     bool zero_copy, uint64_t user_data);
+void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data);   // POLLIN
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, uint32_t events, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data);
+
+/**
+ * Allocate count buffers of size bytes and register them as group bgid
+ * @param count Power of two, at most 32768
+ */
+bool uring_buffers_init(uring_t* ring, uring_buffers_t* buffers, uint16_t bgid,
+                        unsigned count, unsigned size);
+
+/**
+ * Free the buffers (the ring they were registered with must be gone)
+ */
+void uring_buffers_free(uring_buffers_t* buffers);
+
+/**
+ * Address of a buffer the kernel filled
+ */
+static inline char* uring_buffer(uring_buffers_t* buffers, unsigned bid) {
+    return buffers->base + (size_t)bid * buffers->size;
+}
+
+/**
+ * Give a buffer back to the kernel
+ */
+void uring_buffer_return(uring_buffers_t* buffers, unsigned bid);
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * Write-back cache
+ *
+ * A store with a writer is a cache whose writes reach a slower backing
+ * service later: sets and deletes made through the API go on a dirty
+ * table as well as into the store, and a flusher thread hands them to the
+ * writer in batches. A key written again before it is flushed only has
+ * its pending value replaced, so the backend sees each key once per
+ * batch however often it changed.
+ *
+ * The dirty table holds its own copies of the values (the flusher never
+ * touches the store), keyed by key and kept oldest first. A batch goes
+ * out once batch_size keys are dirty or the oldest has waited flush_ms.
+ * A batch the writer rejects goes back in front, behind any newer write
+ * to the same keys, and is retried after retry_ms, doubling up to
+ * retry_max_ms while the writer keeps failing. Once max_dirty keys are
+ * waiting, writers wait for the flusher to make room, up to max_wait_ms;
+ * past that the write fails with KVS_ERROR_BACKEND and is not applied.
+ */
+
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Defaults for the settings left at 0
+ */
+#define WRITEBACK_DEFAULT_BATCH 256
+#define WRITEBACK_DEFAULT_FLUSH_MS 100
+#define WRITEBACK_DEFAULT_MAX_DIRTY 65536
+#define WRITEBACK_DEFAULT_MAX_WAIT_MS 1000
+#define WRITEBACK_DEFAULT_RETRY_MS 10
+#define WRITEBACK_DEFAULT_RETRY_MAX_MS 2000
+
+/**
+ * One write handed to the writer
+ */
+typedef struct {
+    int key;
+    const char* value;      // NULL for a delete
+    size_t len;
+} kvs_dirty_t;
+
+/**
+ * Write a batch to the backing service, on the flusher thread (so it
+ * must not use the store)
+ * @return false to have the whole batch retried
+ */
+typedef bool (*kvs_writer_fn)(void* ctx, const kvs_dirty_t* entries, size_t count);
+
+/**
+ * Write-back settings, 0 for the defaults
+ */
+typedef struct {
+    size_t batch_size;          // most keys per writer call
+    unsigned flush_ms;          // longest a key waits for a batch to fill
+    size_t max_dirty;           // dirty keys at which writers wait
+    unsigned max_wait_ms;       // longest a writer waits for room
+    unsigned retry_ms;          // first delay after a failed batch
+    unsigned retry_max_ms;      // longest delay between retries
+} kvs_writeback_config_t;
+
+/**
+ * Write-back counters
+ */
+typedef struct {
+    size_t dirty;               // keys not written yet, the batch out included
+    uint64_t writes;            // sets and deletes queued
+    uint64_t coalesced;         // of those, folded into a write still pending
+    uint64_t flushed;           // writes the writer took
+    uint64_t batches;           // writer calls that succeeded
+    uint64_t failures;          // writer calls that failed
+    uint64_t stalls;            // writers that waited for room
+    uint64_t timeouts;          // of those, failed after max_wait_ms
+} kvs_writeback_stats_t;
+
+typedef struct writeback writeback_t;
+
+/**
+ * Start the flusher
+ * @param config Settings, NULL for the defaults
+ * @return Pointer to the state or NULL on failure
+ */
+writeback_t* writeback_create(kvs_writer_fn writer, void* ctx, const kvs_writeback_config_t* config);
+
+/**
+ * Stop the flusher, giving what is dirty one more try first
+ */
+void writeback_destroy(writeback_t* wb);
+
+/**
+ * Wait until a write can be queued
+ * @return false with KVS_ERROR_BACKEND after max_wait_ms
+ */
+bool writeback_reserve(writeback_t* wb);
+
+/**
+ * Queue a set (value copied) or, with value NULL, a delete
+ */
+bool writeback_mark(writeback_t* wb, int key, const char* value, size_t len);
+
+/**
+ * Whether key has a write not flushed yet
+ */
+bool writeback_pending(writeback_t* wb, int key);
+
+/**
+ * Wait until every write queued so far has been written
+ * @param timeout_ms Limit, negative for none
+ * @return false with KVS_ERROR_BACKEND on timeout
+ */
+bool writeback_flush(writeback_t* wb, int timeout_ms);
+
+void writeback_stats(writeback_t* wb, kvs_writeback_stats_t* stats);
+
+#endif
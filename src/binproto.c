@@ -0,0 +1,121 @@
+/**
+ * Binary protocol implementation
+ */
+
+#include "binproto.h"
+
+resp_status_t kvs_bin_parse(const char* data, size_t len, kvs_bin_frame_t* frame, size_t* used) {
+    if (len == 0) {
+        return RESP_INCOMPLETE;
+    }
+    if ((unsigned char)data[0] != KVS_BIN_MAGIC) {
+        return RESP_PROTOCOL_ERROR;
+    }
+    if (len < KVS_BIN_HEADER_SIZE) {
+        return RESP_INCOMPLETE;
+    }
+
+    frame->code = (uint8_t)data[1];
+    frame->count = (uint16_t)((unsigned char)data[2] | (unsigned char)data[3] << 8);
+    frame->length = kvs_bin_read32(data + 4);
+    if (frame->count > KVS_BIN_MAX_KEYS || frame->length > KVS_BIN_MAX_BODY) {
+        return RESP_PROTOCOL_ERROR;
+    }
+    if (len - KVS_BIN_HEADER_SIZE < frame->length) {
+        return RESP_INCOMPLETE;
+    }
+    frame->body = data + KVS_BIN_HEADER_SIZE;
+    *used = KVS_BIN_HEADER_SIZE + (size_t)frame->length;
+    return RESP_OK;
+}
+
+bool kvs_bin_check_request(const kvs_bin_frame_t* frame) {
+    size_t count = frame->count;
+    switch (frame->code) {
+        case KVS_BIN_PING:
+            return count == 0 && frame->length == 0;
+        case KVS_BIN_GET:
+        case KVS_BIN_DEL:
+            return count > 0 && frame->length == 4 * count;
+        case KVS_BIN_SET: {
+            if (count == 0 || frame->length < 8 * count) {
+                return false;
+            }
+            uint64_t values = 0;
+            for (size_t i = 0; i < count; i++) {
+                values += kvs_bin_value_len(frame, i);
+            }
+            return values == frame->length - 8 * count;
+        }
+        default:
+            return false;
+    }
+}
+
+bool kvs_bin_add_header(resp_buf_t* buf, uint8_t code, uint16_t count, uint32_t length) {
+    if (!resp_buf_reserve(buf, KVS_BIN_HEADER_SIZE)) {
+        return false;
+    }
+    char* p = buf->data + buf->len;
+    p[0] = (char)KVS_BIN_MAGIC;
+    p[1] = (char)code;
+    p[2] = (char)(count & 0xff);
+    p[3] = (char)(count >> 8);
+    kvs_bin_write32(p + 4, length);
+    buf->len += KVS_BIN_HEADER_SIZE;
+    return true;
+}
+
+bool kvs_bin_add_request(resp_buf_t* buf, kvs_bin_opcode_t opcode, const int* keys, size_t count,
+                         const char* const* values, const size_t* lens) {
+    if (count > KVS_BIN_MAX_KEYS || (opcode == KVS_BIN_SET && !values)) {
+        return false;
+    }
+
+    size_t length = 4 * count;
+    if (opcode == KVS_BIN_SET) {
+        for (size_t i = 0; i < count; i++) {
+            length += 4 + (lens ? lens[i] : strlen(values[i]));
+        }
+    }
+    if (length > KVS_BIN_MAX_BODY ||
+        !kvs_bin_add_header(buf, (uint8_t)opcode, (uint16_t)count, (uint32_t)length) ||
+        !resp_buf_reserve(buf, length)) {
+        return false;
+    }
+
+    char* p = buf->data + buf->len;
+    for (size_t i = 0; i < count; i++, p += 4) {
+        kvs_bin_write32(p, (uint32_t)keys[i]);
+    }
+    if (opcode == KVS_BIN_SET) {
+        for (size_t i = 0; i < count; i++, p += 4) {
+            kvs_bin_write32(p, (uint32_t)(lens ? lens[i] : strlen(values[i])));
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t len = lens ? lens[i] : strlen(values[i]);
+            memcpy(p, values[i], len);
+            p += len;
+        }
+    }
+    buf->len += length;
+    return true;
+}
+
+bool kvs_bin_add_value(resp_buf_t* buf, const char* value, size_t len) {
+    if (!resp_buf_reserve(buf, 4 + (value ? len : 0))) {
+        return false;
+    }
+    char* p = buf->data + buf->len;
+    kvs_bin_write32(p, value ? (uint32_t)len : UINT32_MAX);
+    if (value) {
+        memcpy(p + 4, value, len);
+    }
+    buf->len += 4 + (value ? len : 0);
+    return true;
+}
+
+bool kvs_bin_add_error(resp_buf_t* buf, const char* msg) {
+    size_t len = strlen(msg);
+    return kvs_bin_add_header(buf, KVS_BIN_ERROR, 0, (uint32_t)len) && resp_add_raw(buf, msg, len);
+}
@@ -0,0 +1,129 @@
+/**
+ * Change feed implementation
+ *
+ * Every record carries an arena position, deletes included (the arena
+ * end at the time), so positions never decrease along the ring and the
+ * records whose values were overwritten are always the oldest ones.
+ */
+
+#include "changefeed.h"
+#include "error.h"
+#include <stdlib.h>
+#include <string.h>
+
+changefeed_t* changefeed_create(size_t records, size_t value_bytes) {
+    if (records == 0) {
+        records = CHANGEFEED_DEFAULT_RECORDS;
+    }
+    if (value_bytes == 0) {
+        value_bytes = CHANGEFEED_DEFAULT_VALUE_BYTES;
+    }
+    size_t capacity = 1;
+    while (capacity < records) {
+        capacity <<= 1;
+    }
+
+    changefeed_t* feed = calloc(1, sizeof(changefeed_t));
+    if (!feed) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    feed->records = malloc(capacity * sizeof(changefeed_record_t));
+    feed->values = malloc(value_bytes);
+    if (!feed->records || !feed->values) {
+        changefeed_destroy(feed);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    feed->record_capacity = capacity;
+    feed->value_capacity = value_bytes;
+    return feed;
+}
+
+void changefeed_destroy(changefeed_t* feed) {
+    if (!feed) {
+        return;
+    }
+    free(feed->records);
+    free(feed->values);
+    free(feed);
+}
+
+/**
+ * Copy a value into the arena, contiguously (skipping the tail of the
+ * arena if it would wrap)
+ * @return false if the value is bigger than the arena
+ */
+static bool store_value(changefeed_t* feed, const char* value, size_t len, uint64_t* pos) {
+    size_t need = len + 1;
+    if (need > feed->value_capacity) {
+        return false;
+    }
+
+    uint64_t start = feed->value_end;
+    size_t offset = (size_t)(start % feed->value_capacity);
+    if (offset + need > feed->value_capacity) {
+        start += feed->value_capacity - offset;
+        offset = 0;
+    }
+    memcpy(feed->values + offset, value, len);
+    feed->values[offset + len] = '\0';
+    feed->value_end = start + need;
+    *pos = start;
+    return true;
+}
+
+void changefeed_append(changefeed_t* feed, kvs_change_op_t op, int key, const char* value, size_t len) {
+    size_t mask = feed->record_capacity - 1;
+    changefeed_record_t* record = &feed->records[feed->next & mask];
+    record->op = (uint8_t)op;
+    record->key = key;
+    record->value_len = len;
+    record->value_pos = feed->value_end;
+    record->has_value = value && store_value(feed, value, len, &record->value_pos);
+    if (feed->first == feed->next) {
+        feed->first_pos = record->value_pos;
+    }
+    feed->next++;
+
+    if (feed->next - feed->first > feed->record_capacity) {
+        feed->first = feed->next - feed->record_capacity;
+        feed->first_pos = feed->records[feed->first & mask].value_pos;
+    }
+    // drop the records whose values were just overwritten (the position of
+    // the oldest is cached, its record is likely out of the cache by now)
+    while (feed->first_pos + feed->value_capacity < feed->value_end && feed->first < feed->next - 1) {
+        feed->first++;
+        feed->first_pos = feed->records[feed->first & mask].value_pos;
+    }
+}
+
+void changefeed_reset(changefeed_t* feed) {
+    feed->next++;
+    feed->first = feed->next;
+}
+
+bool changefeed_read(const changefeed_t* feed, uint64_t from, kvs_change_t* out, size_t max, size_t* count) {
+    *count = 0;
+    if (from < feed->first) {
+        kvs_set_error(KVS_ERROR_TRUNCATED);
+        return false;
+    }
+    if (from > feed->next) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    size_t available = (size_t)(feed->next - from);
+    size_t n = available < max ? available : max;
+    for (size_t i = 0; i < n; i++) {
+        const changefeed_record_t* record = &feed->records[(from + i) & (feed->record_capacity - 1)];
+        out[i].seq = from + i;
+        out[i].op = (kvs_change_op_t)record->op;
+        out[i].key = record->key;
+        out[i].value_len = record->op == KVS_CHANGE_SET ? record->value_len : 0;
+        out[i].value = record->has_value ? feed->values + record->value_pos % feed->value_capacity : NULL;
+    }
+    *count = n;
+    return true;
+}
@@ -0,0 +1,223 @@
+/**
+ * Command parsing implementation
+ */
+
+#include "command.h"
+#include <limits.h>
+#include <stdint.h>
+
+/**
+ * Perfect hash over command names
+ * The key packs the first, second and last characters (lowercased) and
+ * the length; multiplying by COMMAND_HASH_MULTIPLIER and keeping the top
+ * COMMAND_HASH_BITS bits sends every name below to its own slot. The
+ * multiplier was found by brute-force search over odd 32-bit constants;
+ * adding a name may require searching again (test_command_table checks
+ * every name resolves).
+ */
+#define COMMAND_HASH_MULTIPLIER 0xe42b0627u
+#define COMMAND_HASH_BITS 6
+#define MAX_COMMAND_LENGTH 16
+
+typedef struct {
+    const char* name;       // lowercase
+    size_t len;
+    kvs_command_id_t id;
+} command_entry_t;
+
+#define ENTRY(name, id) { name, sizeof(name) - 1, id }
+
+static const command_entry_t command_table[1 << COMMAND_HASH_BITS] = {
+    [1]  = ENTRY("get", KVS_CMD_GET),
+    [3]  = ENTRY("shm", KVS_CMD_SHM),
+    [9]  = ENTRY("del", KVS_CMD_DEL),
+    [10] = ENTRY("mdel", KVS_CMD_MDEL),
+    [12] = ENTRY("slowlog", KVS_CMD_SLOWLOG),
+    [16] = ENTRY("replconf", KVS_CMD_REPLCONF),
+    [18] = ENTRY("psync", KVS_CMD_PSYNC),
+    [19] = ENTRY("list", KVS_CMD_LIST),
+    [21] = ENTRY("waitkey", KVS_CMD_WAITKEY),
+    [22] = ENTRY("info", KVS_CMD_INFO),
+    [23] = ENTRY("command", KVS_CMD_COMMAND),
+    [24] = ENTRY("scan", KVS_CMD_SCAN),
+    [25] = ENTRY("?", KVS_CMD_HELP),
+    [26] = ENTRY("incr", KVS_CMD_INCR),
+    [28] = ENTRY("delete", KVS_CMD_DEL),
+    [32] = ENTRY("handoff", KVS_CMD_HANDOFF),
+    [33] = ENTRY("stats", KVS_CMD_STATS),
+    [34] = ENTRY("latency", KVS_CMD_LATENCY),
+    [35] = ENTRY("ping", KVS_CMD_PING),
+    [37] = ENTRY("exit", KVS_CMD_QUIT),
+    [41] = ENTRY("ls", KVS_CMD_LIST),
+    [45] = ENTRY("set", KVS_CMD_SET),
+    [49] = ENTRY("quit", KVS_CMD_QUIT),
+    [53] = ENTRY("save", KVS_CMD_SAVE),
+    [54] = ENTRY("mget", KVS_CMD_MGET),
+    [55] = ENTRY("mset", KVS_CMD_MSET),
+    [56] = ENTRY("clear", KVS_CMD_CLEAR),
+    [59] = ENTRY("load", KVS_CMD_LOAD),
+    [61] = ENTRY("help", KVS_CMD_HELP),
+};
+
+static const char* const command_names[KVS_CMD_COUNT] = {
+    [KVS_CMD_UNKNOWN] = "unknown",
+    [KVS_CMD_GET] = "get",
+    [KVS_CMD_SET] = "set",
+    [KVS_CMD_DEL] = "del",
+    [KVS_CMD_MGET] = "mget",
+    [KVS_CMD_MSET] = "mset",
+    [KVS_CMD_MDEL] = "mdel",
+    [KVS_CMD_INCR] = "incr",
+    [KVS_CMD_SCAN] = "scan",
+    [KVS_CMD_INFO] = "info",
+    [KVS_CMD_PING] = "ping",
+    [KVS_CMD_COMMAND] = "command",
+    [KVS_CMD_QUIT] = "quit",
+    [KVS_CMD_PSYNC] = "psync",
+    [KVS_CMD_REPLCONF] = "replconf",
+    [KVS_CMD_SHM] = "shm",
+    [KVS_CMD_WAITKEY] = "waitkey",
+    [KVS_CMD_LIST] = "list",
+    [KVS_CMD_STATS] = "stats",
+    [KVS_CMD_SAVE] = "save",
+    [KVS_CMD_LOAD] = "load",
+    [KVS_CMD_CLEAR] = "clear",
+    [KVS_CMD_HANDOFF] = "handoff",
+    [KVS_CMD_SLOWLOG] = "slowlog",
+    [KVS_CMD_LATENCY] = "latency",
+    [KVS_CMD_HELP] = "help",
+};
+
+/**
+ * ASCII lowercase, command names are plain letters
+ */
+static inline unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c | 0x20) : c;
+}
+
+kvs_command_id_t kvs_command_lookup(kvs_slice_t name) {
+    if (name.len == 0 || name.len > MAX_COMMAND_LENGTH) {
+        return KVS_CMD_UNKNOWN;
+    }
+
+    const unsigned char* p = (const unsigned char*)name.ptr;
+    uint32_t key = (uint32_t)fold(p[0]) |
+                   (uint32_t)fold(p[name.len > 1 ? 1 : 0]) << 8 |
+                   (uint32_t)fold(p[name.len - 1]) << 16 |
+                   (uint32_t)name.len << 24;
+    const command_entry_t* entry =
+        &command_table[(uint32_t)(key * COMMAND_HASH_MULTIPLIER) >> (32 - COMMAND_HASH_BITS)];
+
+    // the slot's name is the only candidate
+    if (entry->len != name.len) {
+        return KVS_CMD_UNKNOWN;
+    }
+    for (size_t i = 0; i < name.len; i++) {
+        if (fold(p[i]) != (unsigned char)entry->name[i]) {
+            return KVS_CMD_UNKNOWN;
+        }
+    }
+    return entry->id;
+}
+
+const char* kvs_command_name(kvs_command_id_t id) {
+    return (id > KVS_CMD_UNKNOWN && id < KVS_CMD_COUNT) ? command_names[id] : command_names[KVS_CMD_UNKNOWN];
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+void kvs_tokenizer_init(kvs_tokenizer_t* tok, char* line, size_t len) {
+    tok->pos = line;
+    tok->end = line + len;
+}
+
+bool kvs_next_token(kvs_tokenizer_t* tok, kvs_slice_t* token) {
+    char* p = tok->pos;
+    while (p < tok->end && is_space(*p)) {
+        p++;
+    }
+    if (p == tok->end) {
+        tok->pos = p;
+        return false;
+    }
+
+    char* start = p;
+    while (p < tok->end && !is_space(*p)) {
+        p++;
+    }
+
+    token->ptr = start;
+    token->len = (size_t)(p - start);
+    tok->pos = p;
+    return true;
+}
+
+kvs_slice_t kvs_rest_of_line(kvs_tokenizer_t* tok) {
+    char* start = tok->pos;
+    char* end = tok->end;
+    while (start < end && is_space(*start)) {
+        start++;
+    }
+    while (end > start && is_space(end[-1])) {
+        end--;
+    }
+
+    tok->pos = tok->end;
+    kvs_slice_t rest = { start, (size_t)(end - start) };
+    return rest;
+}
+
+bool kvs_slice_to_ll(kvs_slice_t slice, long long* out) {
+    // at most a sign and 19 digits
+    if (slice.len == 0 || slice.len > 20) {
+        return false;
+    }
+
+    size_t i = 0;
+    bool negative = slice.ptr[0] == '-';
+    if (negative) {
+        if (slice.len == 1) {
+            return false;
+        }
+        i = 1;
+    }
+
+    unsigned long long limit = negative ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+    unsigned long long value = 0;
+    for (; i < slice.len; i++) {
+        unsigned digit = (unsigned)(slice.ptr[i] - '0');
+        if (digit > 9 || value > (limit - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+
+    if (negative) {
+        // value may be LLONG_MAX + 1, so negate without overflowing
+        *out = value == 0 ? 0 : -(long long)(value - 1) - 1;
+    } else {
+        *out = (long long)value;
+    }
+    return true;
+}
+
+bool kvs_slice_to_int(kvs_slice_t slice, int* out) {
+    long long value;
+    if (!kvs_slice_to_ll(slice, &value) || value < INT32_MIN || value > INT32_MAX) {
+        return false;
+    }
+    *out = (int)value;
+    return true;
+}
+
+bool kvs_slice_equals(kvs_slice_t slice, const char* str) {
+    size_t i = 0;
+    for (; i < slice.len; i++) {
+        if (str[i] == '\0' || fold((unsigned char)slice.ptr[i]) != fold((unsigned char)str[i])) {
+            return false;
+        }
+    }
+    return str[i] == '\0';
+}
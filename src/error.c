@@ -1,26 +1,17 @@
 #include "error.h"
-#include <pthread.h>
 
-// Global error state
-static kvs_error_t global_error = KVS_SUCCESS;
+// Error state, one per thread like errno, so every store call
+// doesn't take a process-wide lock
+static __thread kvs_error_t thread_error = KVS_SUCCESS;
 
-// mutex for thread-safe error handling
-static pthread_mutex_t error_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Set global error state
+// Set the calling thread's error state
 void kvs_set_error(kvs_error_t error){
-    pthread_mutex_lock(&error_mutex);
-    global_error = error;
-    pthread_mutex_unlock(&error_mutex);
+    thread_error = error;
 }
 
 //Get the current error state
 kvs_error_t kvs_get_error(void) {
-    kvs_error_t error;
-    pthread_mutex_lock(&error_mutex);
-    error = global_error;
-    pthread_mutex_unlock(&error_mutex);
-    return error;
+    return thread_error;
 }
 
 // Human-redable desc of error
@@ -38,6 +29,12 @@ const char* kvs_error_string(kvs_error_t error) {
             return "File I/O error";
         case KVS_ERROR_CORRUPTION:
             return "Data corruption detected";
+        case KVS_ERROR_TRUNCATED:
+            return "Changes no longer kept, resync from a snapshot";
+        case KVS_ERROR_SERVER:
+            return "Server replied with an error";
+        case KVS_ERROR_BACKEND:
+            return "Backing store failed";
         case KVS_ERROR_UNKNOWN:
         default:
             return "Unknown Error";
@@ -0,0 +1,254 @@
+/**
+ * Hot restart implementation
+ *
+ * Passes the descriptor of a mapped table region between processes over
+ * a Unix domain socket using SCM_RIGHTS ancillary data.
+ */
+
+#define _GNU_SOURCE
+
+#include "handoff.h"
+#include "error.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Delay between connection attempts while waiting for the old process
+#define RETRY_INTERVAL_MS 50
+
+/**
+ * Fill a sockaddr_un for a path
+ */
+static bool make_address(const char* path, struct sockaddr_un* addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/**
+ * Send the handoff message with fd attached
+ */
+static bool send_fd(int sock, int fd, const kvs_handoff_msg_t* msg) {
+    struct iovec iov;
+    iov.iov_base = (void*)msg;
+    iov.iov_len = sizeof(*msg);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &hdr, 0) == (ssize_t)sizeof(*msg);
+}
+
+/**
+ * Receive the handoff message and the attached fd
+ * @return the received fd, or -1 on failure
+ */
+static int recv_fd(int sock, kvs_handoff_msg_t* msg) {
+    struct iovec iov;
+    iov.iov_base = msg;
+    iov.iov_len = sizeof(*msg);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        return -1;
+    }
+
+    // take the descriptor first, so every failure below can close it
+    int fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (n != (ssize_t)sizeof(*msg) || (hdr.msg_flags & MSG_CTRUNC)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Hand the store's table to the next process
+ */
+bool kvs_handoff_send(kvstore_t* kvs, const char* socket_path) {
+    struct sockaddr_un addr;
+    if (!kvs || !kvs->mapped || !socket_path || !make_address(socket_path, &addr)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    // a clean header lets the receiver skip the recovery pass
+    if (!mt_checkpoint(kvs->mapped)) {
+        return false;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        close(listener);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    int sock = accept(listener, NULL, NULL);
+    close(listener);
+    unlink(socket_path);
+    if (sock < 0) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    kvs_handoff_msg_t msg;
+    msg.magic = KVS_HANDOFF_MAGIC;
+    msg.layout_version = MT_LAYOUT_VERSION;
+    msg.entry_count = mt_size(kvs->mapped);
+
+    // wait for the receiver to confirm it mapped the table
+    char ack = 0;
+    bool ok = send_fd(sock, mt_fd(kvs->mapped), &msg) &&
+              read(sock, &ack, 1) == 1 && ack == 'K';
+    close(sock);
+
+    if (!ok) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    // the receiver owns the region now, drop it without a checkpoint
+    mt_release(kvs->mapped);
+    kvs->mapped = NULL;
+
+    kvs_clear_error();
+    return true;
+}
+
+/**
+ * Connect to the old process, retrying until the timeout expires
+ */
+static int connect_with_retry(const struct sockaddr_un* addr, int timeout_ms) {
+    int waited = 0;
+
+    while (true) {
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            return -1;
+        }
+        if (connect(sock, (const struct sockaddr*)addr, sizeof(*addr)) == 0) {
+            return sock;
+        }
+        close(sock);
+
+        if (waited >= timeout_ms) {
+            return -1;
+        }
+
+        struct timespec delay = { 0, RETRY_INTERVAL_MS * 1000000L };
+        nanosleep(&delay, NULL);
+        waited += RETRY_INTERVAL_MS;
+    }
+}
+
+/**
+ * Take over the table of a running process
+ */
+kvstore_t* kvs_handoff_receive(const char* socket_path, int timeout_ms) {
+    struct sockaddr_un addr;
+    if (!socket_path || !make_address(socket_path, &addr)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    int sock = connect_with_retry(&addr, timeout_ms);
+    if (sock < 0) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return NULL;
+    }
+
+    kvs_handoff_msg_t msg;
+    int fd = recv_fd(sock, &msg);
+    if (fd < 0) {
+        close(sock);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return NULL;
+    }
+
+    if (msg.magic != KVS_HANDOFF_MAGIC || msg.layout_version != MT_LAYOUT_VERSION) {
+        close(fd);
+        close(sock);
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return NULL;
+    }
+
+    kvstore_t* kvs = kvs_attach_fd(fd);
+    if (!kvs || kvs_count(kvs) != msg.entry_count) {
+        if (kvs) {
+            // keep the region intact for the sender, which still owns it
+            mt_release(kvs->mapped);
+            kvs->mapped = NULL;
+            kvs_destroy(kvs);
+        } else {
+            close(fd);
+        }
+        close(sock);
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return NULL;
+    }
+
+    char ack = 'K';
+    if (write(sock, &ack, 1) != 1) {
+        // the sender keeps serving, so do not touch the region
+        mt_release(kvs->mapped);
+        kvs->mapped = NULL;
+        kvs_destroy(kvs);
+        close(sock);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return NULL;
+    }
+
+    close(sock);
+    kvs_clear_error();
+    return kvs;
+}
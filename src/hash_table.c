@@ -4,11 +4,14 @@
  * prioritizes simplicity while maintaining good performance
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "hash_table.h"
 #include "error.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 
 // default init capacity for new HT (power of 2 for optimal performane)
 #define DEFAULT_CAPACITY 16
@@ -25,7 +28,7 @@
  * Simple, fast hash func with good distribution properties
  * for integer keys. Non-cryptographic but suitable for hash tables
  */
-static size_t hash_key(int key) {
+size_t ht_hash(int key) {
     //FNV-1a constants
     uint32_t hash = 2166136261u; 
     const uint8_t* data = (const uint8_t*)&key;
@@ -39,13 +42,21 @@ static size_t hash_key(int key) {
     return (size_t)hash;
 }
 
-// Find a slot for a key -> implement linear probing to handle collisions
-static size_t find_slot(hash_table_t* table, int key, bool for_insertion) {
-    if (table->capacity == 0) {
-        return SIZE_MAX;
+// Keep the longest probe sequence for the slow log, from the home slot
+// to the slot where probing stopped (only while it times an operation)
+static inline void note_probes(hash_table_t* table, size_t home, size_t index) {
+    if (!table->count_probes) {
+        return;
+    }
+    size_t probes = (index - home) & (table->capacity - 1);
+    if (probes > table->probe_max) {
+        table->probe_max = probes;
     }
+}
 
-    size_t index = hash_key(key) % table->capacity;
+// Find a slot for a key -> implement linear probing to handle collisions,
+// starting from the key's home slot
+static size_t find_slot_from(hash_table_t* table, int key, size_t index, bool for_insertion) {
     size_t original_index = index;
     size_t first_tombstone = SIZE_MAX; 
 
@@ -53,6 +64,7 @@ static size_t find_slot(hash_table_t* table, int key, bool for_insertion) {
         ht_entry_t* entry = &table->entries[index];
 
         if (!entry->occupied) {
+            note_probes(table, original_index, index);
             // Empty slot
             if (for_insertion && first_tombstone != SIZE_MAX) {
                 // return the first tombstone we found for insertion
@@ -69,12 +81,16 @@ static size_t find_slot(hash_table_t* table, int key, bool for_insertion) {
             //continue probing for lookups in case key exists later
         } else if (entry->key == key) {
             // Key found
+            note_probes(table, original_index, index);
             return index;
         }
 
         index = (index + 1) % table->capacity;
     } while (index != original_index);
 
+    if (table->count_probes) {
+        table->probe_max = table->capacity;
+    }
     if (for_insertion && first_tombstone != SIZE_MAX) {
         return first_tombstone;
     }
@@ -82,6 +98,13 @@ static size_t find_slot(hash_table_t* table, int key, bool for_insertion) {
     return SIZE_MAX;
 }
 
+static size_t find_slot(hash_table_t* table, int key, bool for_insertion) {
+    if (table->capacity == 0) {
+        return SIZE_MAX;
+    }
+    return find_slot_from(table, key, ht_hash(key) % table->capacity, for_insertion);
+}
+
 /**
  * Resize the hash table to a new capacity 
  * creates a new table and re-inserts all existing entries
@@ -92,6 +115,9 @@ static bool resize_table (hash_table_t* table, size_t new_capacity) {
         return false;
     }
 
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     //save old entries array
     ht_entry_t* old_entries = table->entries;
     size_t old_capacity = table->capacity;
@@ -131,6 +157,10 @@ static bool resize_table (hash_table_t* table, size_t new_capacity) {
     }
 
     free(old_entries);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    table->resizes++;
+    table->resize_ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t)end.tv_nsec -
+                        (uint64_t)start.tv_nsec;
     return true;
 }
 
@@ -143,6 +173,13 @@ hash_table_t* ht_create(size_t initial_capacity) {
     if (initial_capacity == 0) {
         initial_capacity = DEFAULT_CAPACITY;
     }
+    // keep it a power of two, so that a slot splits in exactly two on
+    // every resize (ht_visit_home / kvs_scan rely on it)
+    size_t capacity = 1;
+    while (capacity < initial_capacity) {
+        capacity <<= 1;
+    }
+    initial_capacity = capacity;
 
     // Allocate the hash table structure
     hash_table_t* table = malloc(sizeof(hash_table_t));
@@ -163,6 +200,10 @@ hash_table_t* ht_create(size_t initial_capacity) {
     table->capacity = initial_capacity;
     table->size = 0;
     table->tombstones = 0;
+    table->resizes = 0;
+    table->resize_ns = 0;
+    table->probe_max = 0;
+    table->count_probes = false;
 
     kvs_clear_error();
     return table;
@@ -174,6 +215,13 @@ hash_table_t* ht_create(size_t initial_capacity) {
  * if the key exists, its value is updated, otherwise a new entry is created
  */
 bool ht_set(hash_table_t* table, int key, const char* value) {
+    return ht_set_len(table, key, value, value ? strlen(value) : 0);
+}
+
+/**
+ * Insert or update a key-value pair from a value that is not NUL terminated
+ */
+bool ht_set_len(hash_table_t* table, int key, const char* value, size_t len) {
     // validate params
     if (!table || !value || key == DELETED_KEY) {
         kvs_set_error(KVS_ERROR_INVALID_PARAM);
@@ -198,14 +246,23 @@ bool ht_set(hash_table_t* table, int key, const char* value) {
     ht_entry_t* entry = &table->entries[index];
 
     // copy the value string
-    char* value_copy = malloc(strlen(value) + 1);
+    char* value_copy = malloc(len + 1);
     if (!value_copy) {
         kvs_set_error(KVS_ERROR_MEMORY);
         return false;
     }
-    strcpy(value_copy, value);
+    memcpy(value_copy, value, len);
+    value_copy[len] = '\0';
+
+    if (entry->occupied && entry->key == key) {
+        // updating an existing key, release the old value
+        free(entry->value);
+        entry->value = value_copy;
+        kvs_clear_error();
+        return true;
+    }
 
-    if (entry->occupied && entry->key == key && entry->key != DELETED_KEY) {
+    if (entry->occupied && entry->key == DELETED_KEY) {
         // reusing tombstones
         table->tombstones--;
     }
@@ -214,6 +271,9 @@ bool ht_set(hash_table_t* table, int key, const char* value) {
     entry->value = value_copy;
     entry->occupied = true;
     table->size++;
+
+    kvs_clear_error();
+    return true;
 }
 
 /**
@@ -244,6 +304,21 @@ const char* ht_get(hash_table_t* table, int key) {
     return entry->value;
 }
 
+/**
+ * Look up a key whose home slot is already known
+ */
+const char* ht_get_at(hash_table_t* table, int key, size_t slot) {
+    if (key == DELETED_KEY) {
+        return NULL;
+    }
+    size_t index = find_slot_from(table, key, slot, false);
+    if (index == SIZE_MAX) {
+        return NULL;
+    }
+    ht_entry_t* entry = &table->entries[index];
+    return entry->occupied && entry->key == key ? entry->value : NULL;
+}
+
 /**
  * Delete a key-value pair
  * uses tombstone deletion to maintain probe sequence
@@ -281,6 +356,29 @@ bool ht_delete(hash_table_t* table, int key) {
     return true;
 }
 
+/**
+ * Grow once ahead of a batch of insertions
+ * A resize drops the tombstones, so only live entries count toward
+ * the new capacity
+ */
+bool ht_reserve(hash_table_t* table, size_t count) {
+    if (!table) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    double load_factor = (double)(table->size + table->tombstones + count) / table->capacity;
+    if (load_factor < LOAD_FACTOR_THRESHOLD) {
+        return true;
+    }
+
+    size_t new_capacity = table->capacity * GROWTH_FACTOR;
+    while ((double)(table->size + count) / new_capacity >= LOAD_FACTOR_THRESHOLD) {
+        new_capacity *= GROWTH_FACTOR;
+    }
+    return resize_table(table, new_capacity);
+}
+
 /**
  * Get the number of key-value stores
  * Count of active entries
@@ -341,6 +439,48 @@ bool ht_iterator_next(ht_iterator_t* iter, int* key, const char** value) {
     return false;
 }
 
+/**
+ * Visit every entry whose home slot is slot
+ * With linear probing they all sit in the run of used slots (entries and
+ * tombstones) that starts there, so the walk stops at the first empty one
+ */
+size_t ht_visit_home(hash_table_t* table, size_t slot, ht_visit_fn visit, void* ctx) {
+    size_t mask = table->capacity - 1;
+    size_t visited = 0;
+    for (size_t index = slot, probes = 0; probes < table->capacity; index = (index + 1) & mask, probes++) {
+        ht_entry_t* entry = &table->entries[index];
+        if (!entry->occupied) {
+            break;
+        }
+        if (entry->key != DELETED_KEY && (ht_hash(entry->key) & mask) == slot) {
+            visit(ctx, entry->key, entry->value);
+            visited++;
+        }
+    }
+    return visited;
+}
+
+/**
+ * Walk every slot once: probe distances of live entries, value sizes
+ */
+void ht_stats(hash_table_t* table, ht_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->tombstones = table->tombstones;
+    stats->table_bytes = table->capacity * sizeof(ht_entry_t);
+    for (size_t i = 0; i < table->capacity; i++) {
+        ht_entry_t* entry = &table->entries[i];
+        if (!entry->occupied || entry->key == DELETED_KEY) {
+            continue;
+        }
+        size_t probes = (i + table->capacity - ht_hash(entry->key) % table->capacity) % table->capacity;
+        stats->probe_total += probes;
+        if (probes > stats->probe_max) {
+            stats->probe_max = probes;
+        }
+        stats->value_bytes += strlen(entry->value) + 1;
+    }
+}
+
 /**
  * Destroy the hash_table and free all memory 
  */
@@ -0,0 +1,79 @@
+/**
+ * Log-linear histogram implementation
+ */
+
+#include "histogram.h"
+#include <string.h>
+
+void histogram_reset(histogram_t* hist) {
+    memset(hist, 0, sizeof(*hist));
+}
+
+void histogram_merge(histogram_t* dst, const histogram_t* src) {
+    if (src->total == 0) {
+        return;
+    }
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    if (dst->total == 0 || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+}
+
+/**
+ * Highest value that falls in a bucket
+ */
+static uint64_t bucket_top(size_t bucket) {
+    if (bucket < 2 * HISTOGRAM_HALF) {
+        return bucket;
+    }
+    unsigned shift = (unsigned)(bucket / HISTOGRAM_HALF) - 1;
+    uint64_t sub = bucket - (uint64_t)shift * HISTOGRAM_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+uint64_t histogram_percentile(const histogram_t* hist, double percentile) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    if (percentile > 100.0) {
+        percentile = 100.0;
+    }
+
+    // rank of the value wanted, at least the first
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+uint64_t histogram_count_upto(const histogram_t* hist, uint64_t value) {
+    if (value >= hist->max) {
+        return hist->total;
+    }
+    uint64_t count = 0;
+    size_t last = histogram_bucket(value);
+    for (size_t i = 0; i <= last; i++) {
+        count += hist->counts[i];
+    }
+    return count;
+}
+
+double histogram_mean(const histogram_t* hist) {
+    return hist->total ? (double)hist->sum / (double)hist->total : 0.0;
+}
@@ -0,0 +1,86 @@
+/**
+ * Key versions and blocking waits implementation
+ */
+
+#define _GNU_SOURCE
+
+#include "keywait.h"
+#include "error.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static keywait_slot_t* slot_for(keywait_t* waits, int key) {
+    // Fibonacci hashing, the top bits pick the slot
+    uint32_t hash = (uint32_t)key * 0x9e3779b1u;
+    return &waits->slots[hash >> (32 - KEYWAIT_SLOT_BITS)];
+}
+
+keywait_t* keywait_create(void) {
+    keywait_t* waits = malloc(sizeof(keywait_t));
+    if (!waits) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    for (size_t i = 0; i < KEYWAIT_SLOTS; i++) {
+        waits->slots[i].version = 1;
+        waits->slots[i].sleepers = 0;
+    }
+    return waits;
+}
+
+void keywait_destroy(keywait_t* waits) {
+    free(waits);
+}
+
+static void bump_slot(keywait_slot_t* slot) {
+    // the add and the load pair with the sleeper's increment and check
+    if (__atomic_add_fetch(&slot->version, 1, __ATOMIC_SEQ_CST) == 0) {
+        __atomic_add_fetch(&slot->version, 1, __ATOMIC_SEQ_CST);
+    }
+    if (__atomic_load_n(&slot->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &slot->version, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+void keywait_bump(keywait_t* waits, int key) {
+    bump_slot(slot_for(waits, key));
+}
+
+void keywait_bump_all(keywait_t* waits) {
+    for (size_t i = 0; i < KEYWAIT_SLOTS; i++) {
+        bump_slot(&waits->slots[i]);
+    }
+}
+
+uint32_t keywait_version(keywait_t* waits, int key) {
+    return __atomic_load_n(&slot_for(waits, key)->version, __ATOMIC_ACQUIRE);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint32_t keywait_wait(keywait_t* waits, int key, uint32_t last_version, int timeout_ms) {
+    keywait_slot_t* slot = slot_for(waits, key);
+    long long deadline = now_ms() + timeout_ms;
+    while (true) {
+        uint32_t version = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+        long long left = timeout_ms < 0 ? -1 : deadline - now_ms();
+        if (version != last_version || (timeout_ms >= 0 && left <= 0)) {
+            return version;
+        }
+
+        struct timespec timeout = { (time_t)(left / 1000), (long)(left % 1000) * 1000000L };
+        __atomic_add_fetch(&slot->sleepers, 1, __ATOMIC_SEQ_CST);
+        // the kernel rechecks the word, so a bump since the load isn't missed
+        syscall(SYS_futex, &slot->version, FUTEX_WAIT_PRIVATE, last_version, left < 0 ? NULL : &timeout,
+                NULL, 0);
+        __atomic_sub_fetch(&slot->sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
@@ -0,0 +1,1242 @@
+/**
+ * Client library implementation
+ *
+ * The socket is non-blocking; blocking calls wait in poll() and keep
+ * reading while they write, so a long pipeline can't deadlock against a
+ * server whose replies fill the socket. Replies are measured first (the
+ * parser is restartable), then parsed into the node array once complete.
+ * On shared memory, write_out / read_in copy through the rings instead
+ * and pump_shm replaces poll().
+ */
+
+#define _GNU_SOURCE
+
+#include "kvsclient.h"
+#include "binproto.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+// Free space kept in the input buffer for each read
+#define READ_CHUNK (16 * 1024)
+
+// Outstanding request slots of a new connection, doubled as needed
+#define INITIAL_PENDING 64
+
+// Longest futex sleep between checks that the server is still there
+#define SHM_CHECK_MS 100
+
+/**
+ * Open the socket: "host:port", or a Unix socket path
+ * @return the connected non-blocking socket, -1 on failure
+ */
+static int dial(const char* target) {
+    const char* colon = strrchr(target, ':');
+    int fd = -1;
+
+    if (!colon || strchr(target, '/')) {
+        struct sockaddr_un addr;
+        if (strlen(target) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, target);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char host[256];
+        size_t host_len = (size_t)(colon - target);
+        if (host_len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, target, host_len);
+        host[host_len] = '\0';
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* result;
+        if (getaddrinfo(host, colon + 1, &hints, &result) != 0) {
+            return -1;
+        }
+        for (struct addrinfo* ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+
+        // requests go out as soon as a pipeline is flushed
+        int one = 1;
+        if (fd >= 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+
+    if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+kvsc_conn_t* kvsc_connect(const char* target, int timeout_ms) {
+    if (!target || timeout_ms < 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    kvsc_conn_t* conn = calloc(1, sizeof(kvsc_conn_t));
+    kvsc_pending_t* pending = malloc(INITIAL_PENDING * sizeof(kvsc_pending_t));
+    if (!conn || !pending) {
+        free(conn);
+        free(pending);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    conn->pending = pending;
+    conn->pending_capacity = INITIAL_PENDING;
+    conn->timeout_ms = timeout_ms;
+
+    conn->fd = dial(target);
+    if (conn->fd < 0) {
+        free(conn->pending);
+        free(conn);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return NULL;
+    }
+
+    kvs_clear_error();
+    return conn;
+}
+
+/**
+ * Mark the connection broken and drop what was outstanding
+ * @return false, for the caller to pass on
+ */
+static bool fail_conn(kvsc_conn_t* conn, kvs_error_t error) {
+    conn->broken = true;
+    while (conn->pending_count > 0) {
+        kvsc_pending_t request = conn->pending[conn->pending_head];
+        conn->pending_head = (conn->pending_head + 1) % conn->pending_capacity;
+        conn->pending_count--;
+        if (request.callback) {
+            request.callback(request.ctx, NULL);
+        }
+    }
+    conn->blocking = 0;
+    kvs_set_error(error);
+    return false;
+}
+
+void kvsc_close(kvsc_conn_t* conn) {
+    if (!conn) {
+        return;
+    }
+    fail_conn(conn, KVS_SUCCESS);
+    if (conn->shm.header) {
+        kvs_shm_detach(&conn->shm);
+        close(conn->shm_event_fd);
+    }
+    close(conn->fd);
+    resp_buf_free(&conn->out);
+    resp_buf_free(&conn->in);
+    free(conn->nodes);
+    free(conn->pending);
+    free(conn);
+}
+
+int kvsc_fd(const kvsc_conn_t* conn) {
+    return conn->fd;
+}
+
+size_t kvsc_pending(const kvsc_conn_t* conn) {
+    return conn->pending_count;
+}
+
+const char* kvsc_server_error(const kvsc_conn_t* conn) {
+    return conn->error;
+}
+
+/**
+ * Remember an outstanding request, growing the ring when full
+ */
+static bool push_pending(kvsc_conn_t* conn, kvsc_callback_fn callback, void* ctx) {
+    if (conn->pending_count == conn->pending_capacity) {
+        size_t capacity = conn->pending_capacity * 2;
+        kvsc_pending_t* ring = malloc(capacity * sizeof(kvsc_pending_t));
+        if (!ring) {
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return false;
+        }
+        for (size_t i = 0; i < conn->pending_count; i++) {
+            ring[i] = conn->pending[(conn->pending_head + i) % conn->pending_capacity];
+        }
+        free(conn->pending);
+        conn->pending = ring;
+        conn->pending_capacity = capacity;
+        conn->pending_head = 0;
+    }
+
+    kvsc_pending_t* slot = &conn->pending[(conn->pending_head + conn->pending_count) % conn->pending_capacity];
+    slot->callback = callback;
+    slot->ctx = ctx;
+    conn->pending_count++;
+    conn->blocking += callback == NULL;
+    return true;
+}
+
+static kvsc_pending_t pop_pending(kvsc_conn_t* conn) {
+    kvsc_pending_t request = conn->pending[conn->pending_head];
+    conn->pending_head = (conn->pending_head + 1) % conn->pending_capacity;
+    conn->pending_count--;
+    conn->blocking -= request.callback == NULL;
+    return request;
+}
+
+/**
+ * Encode a request at the end of the output buffer, or leave it
+ * untouched if out of memory
+ */
+static bool encode_request(kvsc_conn_t* conn, size_t argc, const char* const* argv, const size_t* lens) {
+    size_t start = conn->out.len;
+    bool ok = resp_add_array(&conn->out, argc);
+    for (size_t i = 0; ok && i < argc; i++) {
+        ok = resp_add_bulk(&conn->out, argv[i], lens ? lens[i] : strlen(argv[i]));
+    }
+    if (!ok) {
+        conn->out.len = start;
+        kvs_set_error(KVS_ERROR_MEMORY);
+    }
+    return ok;
+}
+
+/**
+ * Check that the connection can take a request
+ */
+static bool usable(kvsc_conn_t* conn) {
+    if (!conn || conn->broken) {
+        kvs_set_error(conn ? KVS_ERROR_FILE_IO : KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    return true;
+}
+
+bool kvsc_append(kvsc_conn_t* conn, size_t argc, const char* const* argv, const size_t* lens) {
+    if (!usable(conn)) {
+        return false;
+    }
+    if (argc == 0 || !argv) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    size_t start = conn->out.len;
+    if (!encode_request(conn, argc, argv, lens)) {
+        return false;
+    }
+    if (!push_pending(conn, NULL, NULL)) {
+        conn->out.len = start;
+        return false;
+    }
+    return true;
+}
+
+bool kvsc_async(kvsc_conn_t* conn, size_t argc, const char* const* argv, const size_t* lens,
+                kvsc_callback_fn callback, void* ctx) {
+    if (!usable(conn)) {
+        return false;
+    }
+    if (argc == 0 || !argv || !callback) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    size_t start = conn->out.len;
+    if (!encode_request(conn, argc, argv, lens)) {
+        return false;
+    }
+    if (!push_pending(conn, callback, ctx)) {
+        conn->out.len = start;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Write what the socket takes now
+ */
+static bool write_out(kvsc_conn_t* conn) {
+    if (conn->shm.header) {
+        kvs_shm_header_t* header = conn->shm.header;
+        size_t n = kvs_shm_write(&header->requests, conn->shm.requests, conn->shm.ring_size,
+                                 conn->out.data + conn->sent, conn->out.len - conn->sent);
+        conn->sent += n;
+        if (n > 0 && kvs_shm_unpark(&header->server_parked)) {
+            uint64_t one = 1;
+            if (write(conn->shm_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                return fail_conn(conn, KVS_ERROR_FILE_IO);
+            }
+        }
+        if (conn->sent == conn->out.len) {
+            conn->out.len = 0;
+            conn->sent = 0;
+        }
+        return true;
+    }
+
+    while (conn->sent < conn->out.len) {
+        ssize_t n = send(conn->fd, conn->out.data + conn->sent, conn->out.len - conn->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return fail_conn(conn, KVS_ERROR_FILE_IO);
+        }
+        conn->sent += (size_t)n;
+    }
+    conn->out.len = 0;
+    conn->sent = 0;
+    return true;
+}
+
+/**
+ * Read what has arrived
+ */
+static bool read_in(kvsc_conn_t* conn) {
+    if (conn->shm.header) {
+        kvs_shm_ring_t* replies = &conn->shm.header->replies;
+        size_t want = kvs_shm_readable(replies);
+        if (want > conn->shm.ring_size) {
+            want = conn->shm.ring_size;
+        }
+        if (!resp_buf_reserve(&conn->in, want > READ_CHUNK ? want : READ_CHUNK)) {
+            return fail_conn(conn, KVS_ERROR_MEMORY);
+        }
+        conn->in.len += kvs_shm_read(replies, conn->shm.replies, conn->shm.ring_size,
+                                     conn->in.data + conn->in.len, conn->in.capacity - conn->in.len);
+        return true;
+    }
+
+    for (;;) {
+        if (!resp_buf_reserve(&conn->in, READ_CHUNK)) {
+            return fail_conn(conn, KVS_ERROR_MEMORY);
+        }
+        ssize_t n = recv(conn->fd, conn->in.data + conn->in.len, conn->in.capacity - conn->in.len, 0);
+        if (n > 0) {
+            conn->in.len += (size_t)n;
+            if (conn->in.len < conn->in.capacity) {
+                return true;
+            }
+            continue;
+        }
+        if (n == 0) {
+            return fail_conn(conn, KVS_ERROR_FILE_IO);
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        }
+        if (errno != EINTR) {
+            return fail_conn(conn, KVS_ERROR_FILE_IO);
+        }
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * pump() on shared memory: move bytes through the rings until some move,
+ * polling for KVS_SHM_SPIN_NS, then sleeping on the futex (SHM_CHECK_MS
+ * at a time, to notice a server that went away) up to timeout_ms
+ */
+static bool pump_shm(kvsc_conn_t* conn, int timeout_ms, bool* idle) {
+    kvs_shm_header_t* header = conn->shm.header;
+    uint64_t start = now_ns();
+    for (;;) {
+        size_t received = conn->in.len;
+        size_t unsent = conn->out.len - conn->sent;
+        if (!write_out(conn) || !read_in(conn)) {
+            return false;
+        }
+        *idle = conn->in.len == received && conn->out.len - conn->sent == unsent;
+        uint64_t waited = now_ns() - start;
+        if (!*idle || (timeout_ms >= 0 && waited >= (uint64_t)timeout_ms * 1000000)) {
+            return true;
+        }
+        if (waited < KVS_SHM_SPIN_NS) {
+            kvs_shm_relax();
+            continue;
+        }
+
+        int slice = SHM_CHECK_MS;
+        if (timeout_ms >= 0 && (uint64_t)timeout_ms - waited / 1000000 < (uint64_t)slice) {
+            slice = timeout_ms - (int)(waited / 1000000);
+        }
+        // the server bumps the word after it moves bytes, then wakes a parked client
+        uint32_t seq = __atomic_load_n(&header->client_seq, __ATOMIC_ACQUIRE);
+        kvs_shm_park(&header->client_parked);
+        if (kvs_shm_readable(&header->replies) == 0) {
+            kvs_shm_futex_wait(&header->client_seq, seq, slice);
+        }
+        __atomic_store_n(&header->client_parked, 0, __ATOMIC_RELAXED);
+
+        // nothing comes on the socket any more but the hang-up
+        struct pollfd pfd = { conn->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) > 0) {
+            return fail_conn(conn, KVS_ERROR_FILE_IO);
+        }
+    }
+}
+
+/**
+ * Wait up to timeout_ms for the socket, then write and read what it allows
+ * @param idle Set when the wait timed out
+ */
+static bool pump(kvsc_conn_t* conn, int timeout_ms, bool* idle) {
+    if (conn->shm.header) {
+        return pump_shm(conn, timeout_ms, idle);
+    }
+    struct pollfd pfd = { conn->fd, POLLIN | (conn->sent < conn->out.len ? POLLOUT : 0), 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+    *idle = ready == 0;
+    if (ready < 0) {
+        return errno == EINTR ? true : fail_conn(conn, KVS_ERROR_FILE_IO);
+    }
+    if (ready == 0) {
+        return true;
+    }
+    if ((pfd.revents & (POLLOUT | POLLERR)) && !write_out(conn)) {
+        return false;
+    }
+    return !(pfd.revents & (POLLIN | POLLHUP | POLLERR)) || read_in(conn);
+}
+
+/**
+ * Wait for progress in a blocking call, failing after the timeout
+ */
+static bool wait_blocking(kvsc_conn_t* conn) {
+    bool idle;
+    if (!pump(conn, conn->timeout_ms > 0 ? conn->timeout_ms : -1, &idle)) {
+        return false;
+    }
+    return !idle || fail_conn(conn, KVS_ERROR_FILE_IO);
+}
+
+bool kvsc_flush(kvsc_conn_t* conn) {
+    if (!usable(conn)) {
+        return false;
+    }
+    if (!write_out(conn)) {
+        return false;
+    }
+    while (conn->sent < conn->out.len) {
+        if (!wait_blocking(conn)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Drop the bytes of the reply last handed out
+ */
+static void settle(kvsc_conn_t* conn) {
+    if (conn->parsed > 0) {
+        resp_buf_consume(&conn->in, conn->parsed);
+        conn->parsed = 0;
+    }
+}
+
+static bool reserve_nodes(kvsc_conn_t* conn, size_t count) {
+    if (count <= conn->node_capacity) {
+        return true;
+    }
+    size_t capacity = conn->node_capacity ? conn->node_capacity : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    resp_reply_t* nodes = realloc(conn->nodes, capacity * sizeof(resp_reply_t));
+    if (!nodes) {
+        return fail_conn(conn, KVS_ERROR_MEMORY);
+    }
+    conn->nodes = nodes;
+    conn->node_capacity = capacity;
+    return true;
+}
+
+/**
+ * Measure the reply at offset of the input buffer
+ * @return RESP_OK once complete, RESP_INCOMPLETE, or RESP_PROTOCOL_ERROR
+ *         after breaking the connection
+ */
+static resp_status_t measure(kvsc_conn_t* conn, size_t offset, size_t* nodes, size_t* len) {
+    resp_status_t status = resp_parse_reply(conn->in.data + offset, conn->in.len - offset, NULL, nodes, len);
+    if (status == RESP_PROTOCOL_ERROR) {
+        fail_conn(conn, KVS_ERROR_CORRUPTION);
+    }
+    return status;
+}
+
+/**
+ * Run the callbacks of the complete async replies at the head
+ * @param block Wait until a blocking request (or none) is at the head
+ * @return Number of callbacks run, -1 on failure
+ */
+static int dispatch(kvsc_conn_t* conn, bool block) {
+    int count = 0;
+    while (conn->pending_count > 0 && conn->pending[conn->pending_head].callback) {
+        size_t nodes;
+        size_t len;
+        resp_status_t status = measure(conn, 0, &nodes, &len);
+        if (status == RESP_PROTOCOL_ERROR) {
+            return -1;
+        }
+        if (status == RESP_INCOMPLETE) {
+            if (!block) {
+                break;
+            }
+            if (!wait_blocking(conn)) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (!reserve_nodes(conn, nodes)) {
+            return -1;
+        }
+        resp_parse_reply(conn->in.data, len, conn->nodes, &nodes, &len);
+        kvsc_pending_t request = pop_pending(conn);
+        request.callback(request.ctx, conn->nodes);
+        resp_buf_consume(&conn->in, len);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Wait for the replies of the count oldest blocking requests (which must
+ * be consecutive) and parse them all, so that they stay valid together
+ * @return The replies side by side, or NULL on failure
+ */
+static const kvsc_reply_t* take_replies(kvsc_conn_t* conn, size_t count) {
+    settle(conn);
+    if (!write_out(conn) || dispatch(conn, true) < 0) {
+        return NULL;
+    }
+    if (conn->blocking < count) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    // measure until all are in; the roots go first, elements after them
+    size_t total_nodes = count;
+    size_t offset = 0;
+    for (size_t i = 0; i < count;) {
+        size_t nodes;
+        size_t len;
+        resp_status_t status = measure(conn, offset, &nodes, &len);
+        if (status == RESP_PROTOCOL_ERROR) {
+            return NULL;
+        }
+        if (status == RESP_INCOMPLETE) {
+            if (!wait_blocking(conn)) {
+                return NULL;
+            }
+            continue;
+        }
+        total_nodes += nodes;
+        offset += len;
+        i++;
+    }
+    if (!reserve_nodes(conn, total_nodes)) {
+        return NULL;
+    }
+
+    size_t next_node = count;
+    offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t nodes;
+        size_t len;
+        resp_parse_reply(conn->in.data + offset, conn->in.len - offset, conn->nodes + next_node, &nodes, &len);
+        conn->nodes[i] = conn->nodes[next_node];
+        next_node += nodes;
+        offset += len;
+        pop_pending(conn);
+    }
+    conn->parsed = offset;
+    kvs_clear_error();
+    return conn->nodes;
+}
+
+const kvsc_reply_t* kvsc_read_reply(kvsc_conn_t* conn) {
+    if (!usable(conn)) {
+        return NULL;
+    }
+    return take_replies(conn, 1);
+}
+
+/**
+ * Check that no kvsc_append reply is left unread, as a blocking call
+ * takes the next blocking reply as its own
+ */
+static bool ready_for_blocking(kvsc_conn_t* conn) {
+    if (!usable(conn)) {
+        return false;
+    }
+    if (conn->blocking > 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    return true;
+}
+
+const kvsc_reply_t* kvsc_command(kvsc_conn_t* conn, size_t argc, const char* const* argv, const size_t* lens) {
+    if (!ready_for_blocking(conn) || !kvsc_append(conn, argc, argv, lens)) {
+        return NULL;
+    }
+    return take_replies(conn, 1);
+}
+
+int kvsc_poll(kvsc_conn_t* conn, int timeout_ms) {
+    if (!usable(conn)) {
+        return -1;
+    }
+    settle(conn);
+    bool idle;
+    if (!write_out(conn) || !pump(conn, timeout_ms, &idle)) {
+        return -1;
+    }
+    return dispatch(conn, false);
+}
+
+/**
+ * Turn an error reply into KVS_ERROR_SERVER, and a reply of another
+ * type than expected into KVS_ERROR_CORRUPTION
+ */
+static bool check_reply(kvsc_conn_t* conn, const kvsc_reply_t* reply, resp_reply_type_t type,
+                        resp_reply_type_t alternative) {
+    if (!reply) {
+        return false;
+    }
+    if (reply->type == RESP_REPLY_ERROR) {
+        snprintf(conn->error, sizeof(conn->error), "%s", reply->str);
+        kvs_set_error(KVS_ERROR_SERVER);
+        return false;
+    }
+    if (reply->type != type && reply->type != alternative) {
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Queue a blocking request for a command name and integer keys,
+ * each key followed by its value when values is not NULL
+ */
+static bool append_keys(kvsc_conn_t* conn, const char* name, const int* keys, size_t count,
+                        const char* const* values, const size_t* lens) {
+    size_t start = conn->out.len;
+    bool ok = resp_add_array(&conn->out, 1 + count * (values ? 2 : 1)) &&
+              resp_add_bulk(&conn->out, name, strlen(name));
+    for (size_t i = 0; ok && i < count; i++) {
+        char number[16];
+        int len = snprintf(number, sizeof(number), "%d", keys[i]);
+        ok = resp_add_bulk(&conn->out, number, (size_t)len) &&
+             (!values || resp_add_bulk(&conn->out, values[i], lens ? lens[i] : strlen(values[i])));
+    }
+    if (!ok) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+    }
+    if (!ok || !push_pending(conn, NULL, NULL)) {
+        conn->out.len = start;
+        return false;
+    }
+    return true;
+}
+
+bool kvsc_get(kvsc_conn_t* conn, int key, const char** value, size_t* len) {
+    if (!ready_for_blocking(conn)) {
+        return false;
+    }
+    if (!value) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    if (!append_keys(conn, "GET", &key, 1, NULL, NULL)) {
+        return false;
+    }
+    const kvsc_reply_t* reply = take_replies(conn, 1);
+    if (!check_reply(conn, reply, RESP_REPLY_BULK, RESP_REPLY_NULL)) {
+        return false;
+    }
+    *value = reply->type == RESP_REPLY_BULK ? reply->str : NULL;
+    if (len) {
+        *len = reply->type == RESP_REPLY_BULK ? reply->len : 0;
+    }
+    return true;
+}
+
+bool kvsc_set(kvsc_conn_t* conn, int key, const char* value, size_t len) {
+    if (!ready_for_blocking(conn)) {
+        return false;
+    }
+    if (!value) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    if (len == 0) {
+        len = strlen(value);
+    }
+    if (!append_keys(conn, "SET", &key, 1, &value, &len)) {
+        return false;
+    }
+    return check_reply(conn, take_replies(conn, 1), RESP_REPLY_STATUS, RESP_REPLY_STATUS);
+}
+
+bool kvsc_del(kvsc_conn_t* conn, int key, bool* deleted) {
+    if (!ready_for_blocking(conn) || !append_keys(conn, "DEL", &key, 1, NULL, NULL)) {
+        return false;
+    }
+    const kvsc_reply_t* reply = take_replies(conn, 1);
+    if (!check_reply(conn, reply, RESP_REPLY_INTEGER, RESP_REPLY_INTEGER)) {
+        return false;
+    }
+    if (deleted) {
+        *deleted = reply->integer > 0;
+    }
+    return true;
+}
+
+bool kvsc_wait(kvsc_conn_t* conn, int key, uint32_t last_version, int timeout_ms, uint32_t* version,
+               const char** value, size_t* len) {
+    if (!ready_for_blocking(conn)) {
+        return false;
+    }
+    if (!version) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    char numbers[3][16];
+    const char* argv[] = { "WAITKEY", numbers[0], numbers[1], numbers[2] };
+    snprintf(numbers[0], sizeof(numbers[0]), "%d", key);
+    snprintf(numbers[1], sizeof(numbers[1]), "%u", last_version);
+    snprintf(numbers[2], sizeof(numbers[2]), "%d", timeout_ms < 0 ? -1 : timeout_ms);
+    if (!kvsc_append(conn, 4, argv, NULL)) {
+        return false;
+    }
+
+    // the server holds the reply back for up to timeout_ms
+    int limit = conn->timeout_ms;
+    if (limit > 0) {
+        conn->timeout_ms = timeout_ms < 0 || timeout_ms > INT_MAX - limit ? 0 : limit + timeout_ms;
+    }
+    const kvsc_reply_t* reply = take_replies(conn, 1);
+    conn->timeout_ms = limit;
+    if (!check_reply(conn, reply, RESP_REPLY_ARRAY, RESP_REPLY_ARRAY)) {
+        return false;
+    }
+    if (reply->len != 2 || reply->elements[0].type != RESP_REPLY_INTEGER ||
+        (reply->elements[1].type != RESP_REPLY_BULK && reply->elements[1].type != RESP_REPLY_NULL)) {
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return false;
+    }
+
+    const kvsc_reply_t* current = &reply->elements[1];
+    *version = (uint32_t)reply->elements[0].integer;
+    if (value) {
+        *value = current->type == RESP_REPLY_BULK ? current->str : NULL;
+    }
+    if (len) {
+        *len = current->type == RESP_REPLY_BULK ? current->len : 0;
+    }
+    return true;
+}
+
+/**
+ * Queue the commands of a batch, one per KVSC_BATCH_KEYS keys
+ * @return Number of commands queued, 0 on failure (nothing is left queued)
+ */
+static size_t append_batch(kvsc_conn_t* conn, const char* name, const int* keys, size_t count,
+                           const char* const* values, const size_t* lens) {
+    size_t start = conn->out.len;
+    size_t commands = 0;
+    for (size_t base = 0; base < count; base += KVSC_BATCH_KEYS) {
+        size_t n = count - base < KVSC_BATCH_KEYS ? count - base : KVSC_BATCH_KEYS;
+        if (!append_keys(conn, name, keys + base, n, values ? values + base : NULL, lens ? lens + base : NULL)) {
+            // unqueue the commands already added
+            conn->out.len = start;
+            conn->pending_count -= commands;
+            conn->blocking -= commands;
+            return 0;
+        }
+        commands++;
+    }
+    return commands;
+}
+
+bool kvsc_mget(kvsc_conn_t* conn, const int* keys, size_t count, const char** values, size_t* lens) {
+    if (!ready_for_blocking(conn)) {
+        return false;
+    }
+    if (!keys || !values || count == 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    size_t commands = append_batch(conn, "MGET", keys, count, NULL, NULL);
+    const kvsc_reply_t* replies = commands ? take_replies(conn, commands) : NULL;
+    if (!replies) {
+        return false;
+    }
+
+    for (size_t c = 0; c < commands; c++) {
+        size_t base = c * KVSC_BATCH_KEYS;
+        size_t n = count - base < KVSC_BATCH_KEYS ? count - base : KVSC_BATCH_KEYS;
+        if (!check_reply(conn, &replies[c], RESP_REPLY_ARRAY, RESP_REPLY_ARRAY)) {
+            return false;
+        }
+        if (replies[c].len != n) {
+            kvs_set_error(KVS_ERROR_CORRUPTION);
+            return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            const kvsc_reply_t* element = &replies[c].elements[i];
+            values[base + i] = element->type == RESP_REPLY_BULK ? element->str : NULL;
+            if (lens) {
+                lens[base + i] = element->type == RESP_REPLY_BULK ? element->len : 0;
+            }
+        }
+    }
+    return true;
+}
+
+bool kvsc_mset(kvsc_conn_t* conn, const int* keys, const char* const* values, const size_t* lens,
+               size_t count) {
+    if (!ready_for_blocking(conn)) {
+        return false;
+    }
+    bool valid = keys && values && count > 0;
+    for (size_t i = 0; valid && i < count; i++) {
+        valid = values[i] != NULL;
+    }
+    if (!valid) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    size_t commands = append_batch(conn, "MSET", keys, count, values, lens);
+    const kvsc_reply_t* replies = commands ? take_replies(conn, commands) : NULL;
+    if (!replies) {
+        return false;
+    }
+    for (size_t c = 0; c < commands; c++) {
+        if (!check_reply(conn, &replies[c], RESP_REPLY_STATUS, RESP_REPLY_STATUS)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Read the SHM reply into the input buffer, keeping the descriptors that
+ * come with it
+ */
+static bool receive_fds(kvsc_conn_t* conn, int* fds, size_t count) {
+    for (;;) {
+        size_t nodes;
+        size_t len;
+        resp_status_t status = measure(conn, 0, &nodes, &len);
+        if (status != RESP_INCOMPLETE) {
+            return status == RESP_OK;
+        }
+
+        struct pollfd pfd = { conn->fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, conn->timeout_ms > 0 ? conn->timeout_ms : -1);
+        if (ready <= 0) {
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            return fail_conn(conn, KVS_ERROR_FILE_IO);
+        }
+        if (!resp_buf_reserve(&conn->in, READ_CHUNK)) {
+            return fail_conn(conn, KVS_ERROR_MEMORY);
+        }
+
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        struct iovec iov = { conn->in.data + conn->in.len, conn->in.capacity - conn->in.len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            return fail_conn(conn, KVS_ERROR_FILE_IO);
+        }
+        conn->in.len += (size_t)n;
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < received; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (i < count && fds[i] < 0) {
+                    fds[i] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+}
+
+kvsc_conn_t* kvsc_connect_shm(const char* path, int timeout_ms) {
+    kvsc_conn_t* conn = kvsc_connect(path, timeout_ms);
+    const char* argv[] = { "SHM" };
+    int fds[2] = { -1, -1 };
+    bool ok = conn && kvsc_append(conn, 1, argv, NULL) && kvsc_flush(conn) && receive_fds(conn, fds, 2);
+    ok = ok && check_reply(conn, take_replies(conn, 1), RESP_REPLY_STATUS, RESP_REPLY_STATUS);
+    if (ok && (fds[0] < 0 || fds[1] < 0)) {
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        ok = false;
+    }
+    ok = ok && kvs_shm_attach(&conn->shm, fds[0]);
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+
+    if (!ok) {
+        kvs_error_t error = kvs_get_error();
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        kvsc_close(conn);
+        kvs_set_error(error);
+        return NULL;
+    }
+    settle(conn);
+    conn->shm_event_fd = fds[1];
+    kvs_clear_error();
+    return conn;
+}
+
+/**
+ * Check that no reply at all is outstanding, binary replies are read
+ * straight from the input buffer
+ */
+static bool ready_for_binary(kvsc_conn_t* conn) {
+    if (!usable(conn)) {
+        return false;
+    }
+    if (conn->pending_count > 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    settle(conn);
+    return true;
+}
+
+/**
+ * Queue the frames of a batch, one per KVSC_BIN_BATCH_KEYS keys
+ * @return Number of frames queued, 0 on failure (nothing is left queued)
+ */
+static size_t append_bin_batch(kvsc_conn_t* conn, kvs_bin_opcode_t opcode, const int* keys, size_t count,
+                               const char* const* values, const size_t* lens) {
+    size_t start = conn->out.len;
+    size_t frames = 0;
+    for (size_t base = 0; base < count; base += KVSC_BIN_BATCH_KEYS) {
+        size_t n = count - base < KVSC_BIN_BATCH_KEYS ? count - base : KVSC_BIN_BATCH_KEYS;
+        if (!kvs_bin_add_request(&conn->out, opcode, keys + base, n, values ? values + base : NULL,
+                                 lens ? lens + base : NULL)) {
+            conn->out.len = start;
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return 0;
+        }
+        frames++;
+    }
+    return frames;
+}
+
+/**
+ * Send the queued frames and wait until all their replies are in, so
+ * that they stay valid together
+ */
+static bool take_bin_replies(kvsc_conn_t* conn, size_t frames) {
+    if (!write_out(conn)) {
+        return false;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < frames;) {
+        kvs_bin_frame_t frame;
+        size_t used;
+        resp_status_t status = kvs_bin_parse(conn->in.data + offset, conn->in.len - offset, &frame, &used);
+        if (status == RESP_PROTOCOL_ERROR) {
+            return fail_conn(conn, KVS_ERROR_CORRUPTION);
+        }
+        if (status == RESP_INCOMPLETE) {
+            if (!wait_blocking(conn)) {
+                return false;
+            }
+            continue;
+        }
+        offset += used;
+        i++;
+    }
+    conn->parsed = offset;
+    kvs_clear_error();
+    return true;
+}
+
+/**
+ * Take the reply frame at *offset of the input buffer
+ * Turns an error reply into KVS_ERROR_SERVER
+ */
+static bool next_bin_reply(kvsc_conn_t* conn, size_t* offset, kvs_bin_frame_t* frame) {
+    size_t used;
+    kvs_bin_parse(conn->in.data + *offset, conn->in.len - *offset, frame, &used);
+    *offset += used;
+    if (frame->code == KVS_BIN_ERROR) {
+        snprintf(conn->error, sizeof(conn->error), "%.*s", (int)frame->length, frame->body);
+        kvs_set_error(KVS_ERROR_SERVER);
+        return false;
+    }
+    if (frame->code != KVS_BIN_OK) {
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return false;
+    }
+    return true;
+}
+
+bool kvsc_bin_mget(kvsc_conn_t* conn, const int* keys, size_t count, const char** values, size_t* lens) {
+    if (!ready_for_binary(conn)) {
+        return false;
+    }
+    if (!keys || !values || !lens || count == 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    size_t frames = append_bin_batch(conn, KVS_BIN_GET, keys, count, NULL, NULL);
+    if (frames == 0 || !take_bin_replies(conn, frames)) {
+        return false;
+    }
+
+    size_t offset = 0;
+    for (size_t f = 0; f < frames; f++) {
+        size_t base = f * KVSC_BIN_BATCH_KEYS;
+        size_t n = count - base < KVSC_BIN_BATCH_KEYS ? count - base : KVSC_BIN_BATCH_KEYS;
+        kvs_bin_frame_t frame;
+        if (!next_bin_reply(conn, &offset, &frame)) {
+            return false;
+        }
+        if (frame.count != n) {
+            kvs_set_error(KVS_ERROR_CORRUPTION);
+            return false;
+        }
+        size_t pos = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (frame.length - pos < 4) {
+                kvs_set_error(KVS_ERROR_CORRUPTION);
+                return false;
+            }
+            uint32_t len = kvs_bin_read32(frame.body + pos);
+            pos += 4;
+            if (len == UINT32_MAX) {
+                values[base + i] = NULL;
+                lens[base + i] = 0;
+                continue;
+            }
+            if (frame.length - pos < len) {
+                kvs_set_error(KVS_ERROR_CORRUPTION);
+                return false;
+            }
+            values[base + i] = frame.body + pos;
+            lens[base + i] = len;
+            pos += len;
+        }
+    }
+    return true;
+}
+
+bool kvsc_bin_mset(kvsc_conn_t* conn, const int* keys, const char* const* values, const size_t* lens,
+                   size_t count) {
+    if (!ready_for_binary(conn)) {
+        return false;
+    }
+    bool valid = keys && values && count > 0;
+    for (size_t i = 0; valid && i < count; i++) {
+        valid = values[i] != NULL;
+    }
+    if (!valid) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    size_t frames = append_bin_batch(conn, KVS_BIN_SET, keys, count, values, lens);
+    if (frames == 0 || !take_bin_replies(conn, frames)) {
+        return false;
+    }
+    size_t offset = 0;
+    for (size_t f = 0; f < frames; f++) {
+        kvs_bin_frame_t frame;
+        if (!next_bin_reply(conn, &offset, &frame)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool kvsc_bin_mdel(kvsc_conn_t* conn, const int* keys, size_t count, size_t* deleted) {
+    if (!ready_for_binary(conn)) {
+        return false;
+    }
+    if (!keys || count == 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    size_t frames = append_bin_batch(conn, KVS_BIN_DEL, keys, count, NULL, NULL);
+    if (frames == 0 || !take_bin_replies(conn, frames)) {
+        return false;
+    }
+    size_t offset = 0;
+    size_t total = 0;
+    for (size_t f = 0; f < frames; f++) {
+        kvs_bin_frame_t frame;
+        if (!next_bin_reply(conn, &offset, &frame)) {
+            return false;
+        }
+        total += frame.count;
+    }
+    if (deleted) {
+        *deleted = total;
+    }
+    return true;
+}
+
+kvsc_pool_t* kvsc_pool_create(const char* target, size_t size, int timeout_ms) {
+    if (!target || size == 0 || timeout_ms < 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    kvsc_pool_t* pool = calloc(1, sizeof(kvsc_pool_t));
+    if (!pool) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    pool->target = malloc(strlen(target) + 1);
+    pool->conns = calloc(size, sizeof(kvsc_conn_t*));
+    pool->busy = calloc(size, sizeof(bool));
+    if (!pool->target || !pool->conns || !pool->busy) {
+        free(pool->target);
+        free(pool->conns);
+        free(pool->busy);
+        free(pool);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    strcpy(pool->target, target);
+    pool->size = size;
+    pool->timeout_ms = timeout_ms;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->released, NULL);
+
+    kvs_clear_error();
+    return pool;
+}
+
+void kvsc_pool_destroy(kvsc_pool_t* pool) {
+    if (!pool) {
+        return;
+    }
+    for (size_t i = 0; i < pool->size; i++) {
+        kvsc_close(pool->conns[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->released);
+    free(pool->target);
+    free(pool->conns);
+    free(pool->busy);
+    free(pool);
+}
+
+kvsc_conn_t* kvsc_pool_acquire(kvsc_pool_t* pool) {
+    if (!pool) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    // prefer an open connection over opening another
+    pthread_mutex_lock(&pool->lock);
+    size_t slot = pool->size;
+    while (slot == pool->size) {
+        for (size_t i = 0; i < pool->size; i++) {
+            if (!pool->busy[i] && (slot == pool->size || (pool->conns[i] && !pool->conns[slot]))) {
+                slot = i;
+            }
+        }
+        if (slot == pool->size) {
+            pthread_cond_wait(&pool->released, &pool->lock);
+        }
+    }
+    pool->busy[slot] = true;
+    kvsc_conn_t* conn = pool->conns[slot];
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!conn) {
+        conn = kvsc_connect(pool->target, pool->timeout_ms);
+        if (!conn) {
+            pthread_mutex_lock(&pool->lock);
+            pool->busy[slot] = false;
+            pthread_cond_signal(&pool->released);
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        conn->pool_slot = slot;
+    }
+    return conn;
+}
+
+void kvsc_pool_release(kvsc_pool_t* pool, kvsc_conn_t* conn) {
+    if (!pool || !conn) {
+        return;
+    }
+    size_t slot = conn->pool_slot;
+    if (conn->broken || conn->pending_count > 0) {
+        kvsc_close(conn);
+        conn = NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->conns[slot] = conn;
+    pool->busy[slot] = false;
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -10,12 +10,28 @@
 #include "persistence.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 
 // Default initial capacity for new stores
 #define DEFAULT_INITIAL_CAPACITY 16
 
+// Multi-key calls work through their keys in chunks of BATCH_CHUNK,
+// grouped into BATCH_REGIONS table regions, prefetching PREFETCH_AHEAD
+// keys ahead of the one being handled
+#define BATCH_CHUNK 64
+#define BATCH_REGIONS 16
+#define PREFETCH_AHEAD 8
+
+/**
+ * Check that a store has a backing table in either mode
+ */
+static bool kvs_valid(kvstore_t* kvs) {
+    return kvs && (kvs->table || kvs->mapped);
+}
+
 /**
  * Create a new key-value store
  * Allocates and init a new kvstore structure
@@ -39,25 +55,293 @@ kvstore_t* kvs_create(size_t initial_capacity) {
         return NULL;
     }
 
+    kvs->mapped = NULL;
+    kvs->merkle = NULL;
+    kvs->changes = NULL;
+    kvs->slowlog = NULL;
+    kvs->latency = NULL;
+    kvs->waits = NULL;
+    kvs->readthrough = NULL;
+    kvs->writeback = NULL;
+    kvs->filename = NULL;
+    memset(&kvs->stats, 0, sizeof(kvs->stats));
+
+    kvs_clear_error();
+    return kvs;
+}
+
+/**
+ * Wrap a mapped table in a store structure
+ */
+static kvstore_t* wrap_mapped(mapped_table_t* mapped) {
+    kvstore_t* kvs = malloc(sizeof(kvstore_t));
+    if (!kvs) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    kvs->table = NULL;
+    kvs->mapped = mapped;
+    kvs->merkle = NULL;
+    kvs->changes = NULL;
+    kvs->slowlog = NULL;
+    kvs->latency = NULL;
+    kvs->waits = NULL;
+    kvs->readthrough = NULL;
+    kvs->writeback = NULL;
     kvs->filename = NULL;
+    memset(&kvs->stats, 0, sizeof(kvs->stats));
+    return kvs;
+}
+
+/**
+ * Open a store backed by a memory-mapped file
+ * The file is created if missing, otherwise its table is reused as is
+ */
+kvstore_t* kvs_open_mapped(const char* path, size_t initial_capacity) {
+    mapped_table_t* mapped = mt_open(path, initial_capacity);
+    if (!mapped) {
+        return NULL;
+    }
+
+    kvstore_t* kvs = wrap_mapped(mapped);
+    if (!kvs) {
+        mt_close(mapped);
+        return NULL;
+    }
+
+    kvs->filename = malloc(strlen(path) + 1);
+    if (kvs->filename) {
+        strcpy(kvs->filename, path);
+    }
 
     kvs_clear_error();
     return kvs;
 }
 
+/**
+ * Create a store whose table lives in an anonymous memfd region
+ */
+kvstore_t* kvs_create_memfd(size_t initial_capacity) {
+    mapped_table_t* mapped = mt_create_memfd("kvstore", initial_capacity);
+    if (!mapped) {
+        return NULL;
+    }
+
+    kvstore_t* kvs = wrap_mapped(mapped);
+    if (!kvs) {
+        mt_close(mapped);
+    }
+    return kvs;
+}
+
+/**
+ * Attach to a table region handed over by another process
+ */
+kvstore_t* kvs_attach_fd(int fd) {
+    mapped_table_t* mapped = mt_attach_fd(fd);
+    if (!mapped) {
+        return NULL;
+    }
+
+    kvstore_t* kvs = wrap_mapped(mapped);
+    if (!kvs) {
+        // the region is still the sender's and fd the caller's: unmap
+        // without a checkpoint and leave fd open
+        mapped->fd = -1;
+        mt_release(mapped);
+    }
+    return kvs;
+}
+
+/**
+ * Value stored under key, without counting a get
+ */
+static const char* lookup(kvstore_t* kvs, int key) {
+    return kvs->mapped ? mt_get(kvs->mapped, key) : ht_get(kvs->table, key);
+}
+
+/**
+ * Merkle digest of the entry currently stored under key (0 if absent)
+ */
+static uint64_t current_digest(kvstore_t* kvs, int key) {
+    const char* value = lookup(kvs, key);
+    return value ? merkle_entry_digest(key, value) : 0;
+}
+
+static bool add_to_merkle(void* ctx, int key, const char* value) {
+    merkle_t* tree = ctx;
+    merkle_apply(tree, key, 0, merkle_entry_digest(key, value));
+    return true;
+}
+
+/**
+ * Recompute the merkle tree from scratch after a bulk change
+ */
+static void rebuild_merkle(kvstore_t* kvs) {
+    if (kvs->merkle) {
+        merkle_clear(kvs->merkle);
+        kvs_foreach(kvs, add_to_merkle, kvs->merkle);
+    }
+}
+
+/**
+ * Bring derived state up to date after a load: the merkle tree is
+ * rebuilt, change feed consumers have to resync
+ */
+static void bulk_changed(kvstore_t* kvs) {
+    if (kvs->changes) {
+        changefeed_reset(kvs->changes);
+    }
+    if (kvs->waits) {
+        keywait_bump_all(kvs->waits);
+    }
+    if (kvs->readthrough) {
+        readthrough_written_all(kvs->readthrough);
+    }
+    rebuild_merkle(kvs);
+}
+
+/**
+ * Start of an operation timed for the slow log and / or latency histograms
+ */
+typedef struct {
+    uint64_t start;
+    size_t resizes;         // table resizes before it
+    uint64_t ticks;         // latency clock at the start
+} slow_timer_t;
+
+/**
+ * Start timing an operation, if the store has a slow log or records latency
+ */
+static inline slow_timer_t slow_start(kvstore_t* kvs) {
+    slow_timer_t timer = { 0, 0, 0 };
+    if (kvs->latency) {
+        timer.ticks = latency_now(kvs->latency);
+    }
+    if (kvs->slowlog) {
+        // the tables only count probes between here and slow_finish
+        if (kvs->mapped) {
+            timer.resizes = kvs->mapped->resizes;
+            kvs->mapped->probe_max = 0;
+            kvs->mapped->count_probes = true;
+        } else {
+            timer.resizes = kvs->table->resizes;
+            kvs->table->probe_max = 0;
+            kvs->table->count_probes = true;
+        }
+        timer.start = slowlog_now();
+    }
+    return timer;
+}
+
+/**
+ * Record an operation's latency, and log it if it took at least the
+ * threshold, tagged with what the table did meanwhile
+ * @param causes Tags known up front (KVS_SLOW_IO)
+ */
+static void slow_finish(kvstore_t* kvs, const slow_timer_t* timer, kvs_op_t op, int key, size_t count,
+                        size_t value_len, unsigned causes) {
+    if (kvs->latency) {
+        latency_record(kvs->latency, op, timer->ticks);
+    }
+    if (!kvs->slowlog) {
+        return;
+    }
+    if (kvs->mapped) {
+        kvs->mapped->count_probes = false;
+    } else {
+        kvs->table->count_probes = false;
+    }
+    uint64_t elapsed = slowlog_now() - timer->start;
+    if (elapsed < kvs->slowlog->threshold_ns) {
+        return;
+    }
+
+    // a table replaced meanwhile (kvs_clear) starts counting from zero
+    size_t resizes = kvs->mapped ? kvs->mapped->resizes : kvs->table->resizes;
+    size_t probes = kvs->mapped ? kvs->mapped->probe_max : kvs->table->probe_max;
+    kvs_slow_entry_t entry = { 0 };
+    entry.duration_us = elapsed / 1000;
+    entry.op = op;
+    entry.key = key;
+    entry.count = count;
+    entry.value_len = value_len;
+    entry.probes = probes;
+    entry.causes = causes | (resizes > timer->resizes ? KVS_SLOW_RESIZE : 0) |
+                   (probes >= SLOWLOG_LONG_PROBE ? KVS_SLOW_PROBE : 0) |
+                   (value_len >= SLOWLOG_LARGE_VALUE ? KVS_SLOW_ALLOC : 0);
+    slowlog_record(kvs->slowlog, &entry);
+}
 
 /**
  * Set a key-value pair in the store
  * wrapper around the hash table set operation
  */
 bool kvs_set(kvstore_t* kvs, int key, const char* value) {
+    if (!value) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    return kvs_set_len(kvs, key, value, strlen(value));
+}
+
+/**
+ * Set one entry and update derived state (params already checked)
+ */
+static bool set_entry(kvstore_t* kvs, int key, const char* value, size_t len) {
+    // digest of the entry being replaced, for the merkle tree
+    uint64_t old_digest = kvs->merkle ? current_digest(kvs, key) : 0;
+
+    bool ok = kvs->mapped ? mt_set_len(kvs->mapped, key, value, len)
+                          : ht_set_len(kvs->table, key, value, len);
+
+    if (ok && kvs->merkle) {
+        merkle_apply(kvs->merkle, key, old_digest, merkle_entry_digest_len(key, value, len));
+    }
+    if (ok && kvs->changes) {
+        changefeed_append(kvs->changes, KVS_CHANGE_SET, key, value, len);
+    }
+    if (ok && kvs->waits) {
+        keywait_bump(kvs->waits, key);
+    }
+    if (ok && kvs->readthrough) {
+        readthrough_written(kvs->readthrough, key);
+    }
+    kvs->stats.sets++;
+    kvs->stats.changes_since_save += ok;
+    return ok;
+}
+
+/**
+ * Set an entry on the caller's behalf (not a load or a fill): in
+ * write-back mode it is queued for the backend too, once there is room
+ */
+static bool write_entry(kvstore_t* kvs, int key, const char* value, size_t len) {
+    if (kvs->writeback && !writeback_reserve(kvs->writeback)) {
+        return false;
+    }
+    bool ok = set_entry(kvs, key, value, len);
+    if (ok && kvs->writeback) {
+        ok = writeback_mark(kvs->writeback, key, value, len);
+    }
+    return ok;
+}
+
+/**
+ * Set a key-value pair from a value of known length
+ */
+bool kvs_set_len(kvstore_t* kvs, int key, const char* value, size_t len) {
     // validate params
-    if (!kvs || !kvs->table) {
+    if (!kvs_valid(kvs)) {
         kvs_set_error(KVS_ERROR_INVALID_PARAM);
         return false;
     }
 
-    return ht_set(kvs->table, key, value);
+    slow_timer_t timer = slow_start(kvs);
+    bool ok = write_entry(kvs, key, value, len);
+    slow_finish(kvs, &timer, KVS_OP_SET, key, 1, len, 0);
+    return ok;
 }
 
 
@@ -66,13 +350,87 @@ bool kvs_set(kvstore_t* kvs, int key, const char* value) {
  * wrapper aroudn the hash table get operationm
  */
 const char* kvs_get(kvstore_t* kvs, int key) {
+    const char* value = kvs_get_cached(kvs, key);
+    if (value || !kvs_valid(kvs) || !kvs->readthrough) {
+        return value;
+    }
+
+    // a miss in read-through mode: ask the backend, unless it was asked
+    // lately or has yet to get a write of the key
+    readthrough_t* rt = kvs->readthrough;
+    if (readthrough_known_missing(rt, key) || (kvs->writeback && writeback_pending(kvs->writeback, key))) {
+        return NULL;
+    }
+    char* loaded = NULL;
+    size_t len = 0;
+    uint32_t generation = readthrough_generation(rt, key);
+    kvs_load_result_t result = rt->loader(rt->ctx, key, &loaded, &len);
+    return kvs_readthrough_fill(kvs, key, generation, result, loaded, len) ? lookup(kvs, key) : NULL;
+}
+
+/**
+ * Get a value by key, a miss being a miss even in read-through mode
+ */
+const char* kvs_get_cached(kvstore_t* kvs, int key) {
     // validate params
-    if (!kvs || !kvs->table) {
+    if (!kvs_valid(kvs)) {
         kvs_set_error(KVS_ERROR_INVALID_PARAM);
         return NULL;
     }
 
-    return ht_get(kvs->table, key);
+    slow_timer_t timer = slow_start(kvs);
+    const char* value = lookup(kvs, key);
+    slow_finish(kvs, &timer, KVS_OP_GET, key, 1, 0, 0);
+    kvs->stats.gets++;
+    kvs->stats.get_hits += value != NULL;
+    return value;
+}
+
+/**
+ * Delete one entry and update derived state
+ */
+static bool delete_entry(kvstore_t* kvs, int key) {
+    uint64_t old_digest = kvs->merkle ? current_digest(kvs, key) : 0;
+
+    bool ok = kvs->mapped ? mt_delete(kvs->mapped, key)
+                          : ht_delete(kvs->table, key);
+
+    if (ok && kvs->merkle) {
+        merkle_apply(kvs->merkle, key, old_digest, 0);
+    }
+    if (ok && kvs->changes) {
+        changefeed_append(kvs->changes, KVS_CHANGE_DELETE, key, NULL, 0);
+    }
+    if (ok && kvs->waits) {
+        keywait_bump(kvs->waits, key);
+    }
+    if (ok && kvs->readthrough) {
+        readthrough_written(kvs->readthrough, key);
+    }
+    kvs->stats.deletes++;
+    kvs->stats.delete_hits += ok;
+    kvs->stats.changes_since_save += ok;
+    return ok;
+}
+
+/**
+ * Delete an entry on the caller's behalf; in write-back mode the delete
+ * is queued even for a key that is not cached, the backend may have it
+ * @param failed Set if it could not be queued (nothing deleted then),
+ *               may be NULL
+ */
+static bool erase_entry(kvstore_t* kvs, int key, bool* failed) {
+    bool queued = !kvs->writeback || writeback_reserve(kvs->writeback);
+    bool ok = queued && delete_entry(kvs, key);
+    queued = queued && (!kvs->writeback || writeback_mark(kvs->writeback, key, NULL, 0));
+    if (queued && !ok && kvs->writeback && kvs->readthrough) {
+        // the backend loses the key even though it wasn't cached
+        readthrough_written(kvs->readthrough, key);
+    }
+    if (!queued && failed) {
+        *failed = true;
+    }
+    return ok;
 }
 
 /**
@@ -80,12 +438,179 @@ const char* kvs_get(kvstore_t* kvs, int key) {
  */
 bool kvs_delete(kvstore_t* kvs, int key) {
     // validate params
-    if (!kvs || !kvs->table) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    slow_timer_t timer = slow_start(kvs);
+    bool ok = erase_entry(kvs, key, NULL);
+    slow_finish(kvs, &timer, KVS_OP_DELETE, key, 1, 0, 0);
+    return ok;
+}
+
+/**
+ * Order of a chunk of keys for a multi-key call
+ * Keys are grouped by the region of the table their home slot is in
+ * (a stable counting sort, so a key given twice keeps its order), so
+ * that the probes of a batch walk the table roughly front to back
+ */
+typedef struct {
+    size_t slot[BATCH_CHUNK];
+    unsigned char order[BATCH_CHUNK];
+} batch_order_t;
+
+static void order_chunk(kvstore_t* kvs, const int* keys, size_t count, batch_order_t* batch) {
+    if (!kvs->table) {
+        // the mapped table keeps its own layout, keys go in as given
+        for (size_t i = 0; i < count; i++) {
+            batch->order[i] = (unsigned char)i;
+        }
+        return;
+    }
+
+    size_t capacity = kvs->table->capacity;
+    unsigned char region[BATCH_CHUNK];
+    size_t start[BATCH_REGIONS + 1] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        batch->slot[i] = ht_hash(keys[i]) % capacity;
+        region[i] = (unsigned char)((uint64_t)batch->slot[i] * BATCH_REGIONS / capacity);
+        start[region[i] + 1]++;
+    }
+    for (size_t r = 1; r <= BATCH_REGIONS; r++) {
+        start[r] += start[r - 1];
+    }
+    for (size_t i = 0; i < count; i++) {
+        batch->order[start[region[i]]++] = (unsigned char)i;
+    }
+}
+
+/**
+ * Prefetch the home slot of the n-th key of a chunk, if there is one
+ */
+static inline void prefetch_key(kvstore_t* kvs, const batch_order_t* batch, size_t n, size_t count) {
+    if (kvs->table && n < count) {
+        __builtin_prefetch(&kvs->table->entries[batch->slot[batch->order[n]]]);
+    }
+}
+
+/**
+ * Get several keys
+ */
+size_t kvs_mget(kvstore_t* kvs, const int* keys, size_t count, const char** values) {
+    if (!kvs_valid(kvs) || (count > 0 && (!keys || !values))) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+
+    slow_timer_t timer = slow_start(kvs);
+    size_t found = 0;
+    batch_order_t batch;
+    for (size_t base = 0; base < count; base += BATCH_CHUNK) {
+        size_t n = count - base < BATCH_CHUNK ? count - base : BATCH_CHUNK;
+        order_chunk(kvs, keys + base, n, &batch);
+        for (size_t i = 0; i < PREFETCH_AHEAD; i++) {
+            prefetch_key(kvs, &batch, i, n);
+        }
+        for (size_t i = 0; i < n; i++) {
+            prefetch_key(kvs, &batch, i + PREFETCH_AHEAD, n);
+            size_t at = base + batch.order[i];
+            values[at] = kvs->mapped ? mt_get(kvs->mapped, keys[at])
+                                     : ht_get_at(kvs->table, keys[at], batch.slot[batch.order[i]]);
+            found += values[at] != NULL;
+        }
+    }
+    slow_finish(kvs, &timer, KVS_OP_MGET, count ? keys[0] : 0, count, 0, 0);
+    kvs->stats.mgets++;
+    kvs->stats.gets += count;
+    kvs->stats.get_hits += found;
+
+    kvs_clear_error();
+    return found;
+}
+
+/**
+ * Set several key-value pairs
+ * The table is grown once for the whole batch up front, so no insert
+ * in it rehashes the table
+ */
+bool kvs_mset(kvstore_t* kvs, const int* keys, const char* const* values, const size_t* lens, size_t count) {
+    if (!kvs_valid(kvs) || (count > 0 && (!keys || !values))) {
         kvs_set_error(KVS_ERROR_INVALID_PARAM);
         return false;
     }
+    for (size_t i = 0; i < count; i++) {
+        if (!values[i]) {
+            kvs_set_error(KVS_ERROR_INVALID_PARAM);
+            return false;
+        }
+    }
+    slow_timer_t timer = slow_start(kvs);
+    // a failed reserve still goes through slow_finish, which ends probe counting
+    bool ok = kvs->mapped ? mt_reserve(kvs->mapped, count) : ht_reserve(kvs->table, count);
+
+    size_t largest = 0;
+    batch_order_t batch;
+    for (size_t base = 0; ok && base < count; base += BATCH_CHUNK) {
+        size_t n = count - base < BATCH_CHUNK ? count - base : BATCH_CHUNK;
+        order_chunk(kvs, keys + base, n, &batch);
+        for (size_t i = 0; i < PREFETCH_AHEAD; i++) {
+            prefetch_key(kvs, &batch, i, n);
+        }
+        for (size_t i = 0; ok && i < n; i++) {
+            prefetch_key(kvs, &batch, i + PREFETCH_AHEAD, n);
+            size_t at = base + batch.order[i];
+            size_t len = lens ? lens[at] : strlen(values[at]);
+            largest = len > largest ? len : largest;
+            ok = write_entry(kvs, keys[at], values[at], len);
+        }
+    }
+    slow_finish(kvs, &timer, KVS_OP_MSET, count ? keys[0] : 0, count, largest, 0);
+    kvs->stats.msets++;
+    if (!ok) {
+        return false;
+    }
+
+    kvs_clear_error();
+    return true;
+}
+
+/**
+ * Delete several keys
+ */
+size_t kvs_mdel(kvstore_t* kvs, const int* keys, size_t count, bool* deleted) {
+    if (!kvs_valid(kvs) || (count > 0 && !keys)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+
+    slow_timer_t timer = slow_start(kvs);
+    size_t removed = 0;
+    bool failed = false;
+    batch_order_t batch;
+    for (size_t base = 0; base < count; base += BATCH_CHUNK) {
+        size_t n = count - base < BATCH_CHUNK ? count - base : BATCH_CHUNK;
+        order_chunk(kvs, keys + base, n, &batch);
+        for (size_t i = 0; i < PREFETCH_AHEAD; i++) {
+            prefetch_key(kvs, &batch, i, n);
+        }
+        for (size_t i = 0; i < n; i++) {
+            prefetch_key(kvs, &batch, i + PREFETCH_AHEAD, n);
+            size_t at = base + batch.order[i];
+            bool gone = erase_entry(kvs, keys[at], &failed);
+            removed += gone;
+            if (deleted) {
+                deleted[at] = gone;
+            }
+        }
+    }
+    slow_finish(kvs, &timer, KVS_OP_MDEL, count ? keys[0] : 0, count, 0, 0);
+    kvs->stats.mdels++;
 
-    return ht_delete(kvs->table, key);
+    if (!failed) {
+        kvs_clear_error();
+    }
+    return removed;
 }
 
 /**
@@ -93,22 +618,43 @@ bool kvs_delete(kvstore_t* kvs, int key) {
  */
 size_t kvs_count(kvstore_t* kvs) {
         // validate params
-    if (!kvs || !kvs->table) {
+    if (!kvs_valid(kvs)) {
         kvs_set_error(KVS_ERROR_INVALID_PARAM);
         return 0;
     }
 
+    if (kvs->mapped) {
+        return mt_size(kvs->mapped);
+    }
     return ht_size(kvs->table);
 }
 
 /**
- * Save the store contents to a file
+ * Record the outcome of a save or checkpoint that started at start
+ * @param filename File written (its size is recorded), NULL if unknown
  */
-bool kvs_save(kvstore_t* kvs, const char* filename) {
-        // validate params
-    if (!kvs || !kvs->table || !filename) {
-        kvs_set_error(KVS_ERROR_INVALID_PARAM);
-        return false;
+static void saved(kvstore_t* kvs, bool ok, uint64_t start, const char* filename) {
+    kvs_stats_t* stats = &kvs->stats;
+    stats->last_save_ok = ok;
+    if (!ok) {
+        stats->save_failures++;
+        return;
+    }
+    long long bytes = kvs_file_size(filename);
+    stats->saves++;
+    stats->changes_since_save = 0;
+    stats->last_save_time = (uint64_t)time(NULL);
+    stats->last_save_us = (slowlog_now() - start) / 1000;
+    stats->last_save_bytes = bytes > 0 ? (uint64_t)bytes : 0;
+}
+
+/**
+ * Save the store contents to a file (params already checked)
+ */
+static bool save_store(kvstore_t* kvs, const char* filename) {
+    // a mapped store keeps its mapping file as the associated file
+    if (kvs->mapped) {
+        return kvs_save_mapped_to_file(kvs->mapped, filename);
     }
 
     // save to file
@@ -126,18 +672,39 @@ bool kvs_save(kvstore_t* kvs, const char* filename) {
     return true;
 }
 
-/** 
- * Load store contents from a file
+/**
+ * Save the store contents to a file
  */
-bool kvs_load(kvstore_t* kvs, const char* filename) {
+bool kvs_save(kvstore_t* kvs, const char* filename) {
         // validate params
-    if (!kvs || !kvs->table || !filename) {
+    if (!kvs_valid(kvs) || !filename) {
         kvs_set_error(KVS_ERROR_INVALID_PARAM);
         return false;
     }
 
+    uint64_t start = slowlog_now();
+    slow_timer_t timer = slow_start(kvs);
+    bool ok = save_store(kvs, filename);
+    slow_finish(kvs, &timer, KVS_OP_SAVE, 0, kvs_count(kvs), 0, KVS_SLOW_IO);
+    saved(kvs, ok, start, filename);
+    return ok;
+}
+
+/** 
+ * Load store contents from a file (params already checked)
+ */
+static bool load_store(kvstore_t* kvs, const char* filename) {
+    // the loaders insert below kvs_set, so derived state is rebuilt after
+    if (kvs->mapped) {
+        bool ok = kvs_load_mapped_from_file(kvs->mapped, filename);
+        bulk_changed(kvs);
+        return ok;
+    }
+
     // load from file
-    if (!kvs_load_from_file(kvs->table, filename)) {
+    bool loaded = kvs_load_from_file(kvs->table, filename);
+    bulk_changed(kvs);
+    if (!loaded) {
         return false;
     }
 
@@ -151,55 +718,726 @@ bool kvs_load(kvstore_t* kvs, const char* filename) {
     return true;
 }
 
+/** 
+ * Load store contents from a file
+ */
+bool kvs_load(kvstore_t* kvs, const char* filename) {
+        // validate params
+    if (!kvs_valid(kvs) || !filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
 
-
-void kvs_print_stats(kvstore_t* kvs) {
-    if (!kvs || !kvs->table) {
-        printf("Invalid key-value store");
-        return;
+    slow_timer_t timer = slow_start(kvs);
+    bool ok = load_store(kvs, filename);
+    slow_finish(kvs, &timer, KVS_OP_LOAD, 0, kvs_count(kvs), 0, KVS_SLOW_IO);
+    kvs->stats.loads++;
+    if (ok) {
+        kvs->stats.changes_since_save = 0;
     }
+    return ok;
+}
 
-    size_t size = ht_size(kvs->table);
-    size_t capacity = ht_capacity(kvs->table);
-    double load_factor = capacity > 0 ? (double)size / capacity : 0.0;
+static bool insert_heap(void* table, int key, const char* value) {
+    return ht_set(table, key, value);
+}
 
-    printf("Key-Value Store Statistics:\n");
-    printf("  Entries: %zu\n", size);
-    printf("  Capacity: %zu\n", capacity);
-    printf("  Load Factor: %.2f%%\n", load_factor * 100);
-    
-    if (kvs->filename) {
-        printf(" Associated file: %s\n", kvs->filename);
-    } else {
-        printf(" Associated file: None\n");
-    }
-}   
+static bool insert_mapped(void* table, int key, const char* value) {
+    return mt_set(table, key, value);
+}
 
 /**
- * Print all key-value pairs 
+ * Load only the part of a snapshot that passes a filter
+ * Used when splitting a store: each node reads and allocates only its
+ * own share. The associated filename is left unchanged.
  */
-void kvs_print_all(kvstore_t* kvs) {
-    if (!kvs || !kvs->table) {
-        printf("Invalid key-value store");
-        return;
+bool kvs_load_range(kvstore_t* kvs, const char* filename, const kvs_load_filter_t* filter) {
+    if (!kvs_valid(kvs) || !filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
     }
 
-    size_t count = ht_size(kvs->table);
-    if (count == 0) {
-        printf("Key-value store is empty");
-        return;
-    }
+    bool ok = kvs->mapped ? kvs_load_filtered(filename, filter, insert_mapped, kvs->mapped)
+                          : kvs_load_filtered(filename, filter, insert_heap, kvs->table);
+    bulk_changed(kvs);
+    return ok;
+}
 
-    printf("key value store contents (%zu entries):\n", count);
+/**
+ * Iterator chaining the entries of several stores
+ */
+typedef struct {
+    kvstore_t** shards;
+    size_t count;
+    size_t current;
+    ht_iterator_t ht;
+    mt_iterator_t mt;
+} shard_iterator_t;
 
-    // use iterator to traverse all entries
-    ht_iterator_t iter = ht_iterator_init(kvs->table);
-    int key;
+static void shard_iterator_start(shard_iterator_t* it) {
+    kvstore_t* kvs = it->shards[it->current];
+    if (kvs->mapped) {
+        it->mt = mt_iterator_init(kvs->mapped);
+    } else {
+        it->ht = ht_iterator_init(kvs->table);
+    }
+}
+
+static bool shard_iterator_next(void* iter, int* key, const char** value) {
+    shard_iterator_t* it = iter;
+    while (it->current < it->count) {
+        kvstore_t* kvs = it->shards[it->current];
+        bool found = kvs->mapped ? mt_iterator_next(&it->mt, key, value)
+                                 : ht_iterator_next(&it->ht, key, value);
+        if (found) {
+            return true;
+        }
+        if (++it->current < it->count) {
+            shard_iterator_start(it);
+        }
+    }
+    return false;
+}
+
+/**
+ * Save shards as one snapshot
+ */
+bool kvs_save_sharded(kvstore_t** shards, size_t count, const char* filename) {
+    if (!shards || count == 0 || !filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!kvs_valid(shards[i])) {
+            kvs_set_error(KVS_ERROR_INVALID_PARAM);
+            return false;
+        }
+        total += kvs_count(shards[i]);
+    }
+
+    shard_iterator_t iter = { shards, count, 0, { 0 }, { 0 } };
+    shard_iterator_start(&iter);
+    return kvs_save_entries(filename, total, shard_iterator_next, &iter);
+}
+
+/**
+ * Write a snapshot of the store to fd with a writer sized beforehand
+ */
+bool kvs_save_fd(kvstore_t* kvs, int fd, kvs_snapshot_writer_t* writer) {
+    if (!kvs_valid(kvs) || fd < 0 || !writer) {
+        return false;
+    }
+    shard_iterator_t iter = { &kvs, 1, 0, { 0 }, { 0 } };
+    shard_iterator_start(&iter);
+    return kvs_snapshot_writer_save(writer, fd, shard_iterator_next, &iter);
+}
+
+/**
+ * Make all changes durable
+ */
+bool kvs_checkpoint(kvstore_t* kvs) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    if (!kvs->mapped && !kvs->filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    uint64_t start = slowlog_now();
+    slow_timer_t timer = slow_start(kvs);
+    bool ok = kvs->mapped ? mt_checkpoint(kvs->mapped) : kvs_save_to_file(kvs->table, kvs->filename);
+    slow_finish(kvs, &timer, KVS_OP_CHECKPOINT, 0, kvs_count(kvs), 0, KVS_SLOW_IO);
+    saved(kvs, ok, start, kvs->filename);
+    return ok;
+}
+
+/**
+ * Remove all entries
+ * A heap table is swapped for a fresh one; a mapped table is emptied in place
+ */
+static bool clear_store(kvstore_t* kvs) {
+    if (kvs->mapped) {
+        // deletes only leave tombstones, so iterating while deleting is safe
+        mt_iterator_t iter = mt_iterator_init(kvs->mapped);
+        int key;
+        const char* value;
+        while (mt_iterator_next(&iter, &key, &value)) {
+            mt_delete(kvs->mapped, key);
+        }
+        merkle_clear(kvs->merkle);
+        if (kvs->changes) {
+            changefeed_reset(kvs->changes);
+        }
+        if (kvs->waits) {
+            keywait_bump_all(kvs->waits);
+        }
+        if (kvs->readthrough) {
+            readthrough_written_all(kvs->readthrough);
+        }
+        kvs_clear_error();
+        return true;
+    }
+
+    hash_table_t* table = ht_create(DEFAULT_INITIAL_CAPACITY);
+    if (!table) {
+        return false;
+    }
+    ht_destroy(kvs->table);
+    kvs->table = table;
+    merkle_clear(kvs->merkle);
+    if (kvs->changes) {
+        changefeed_reset(kvs->changes);
+    }
+    if (kvs->waits) {
+        keywait_bump_all(kvs->waits);
+    }
+    if (kvs->readthrough) {
+        readthrough_written_all(kvs->readthrough);
+    }
+    return true;
+}
+
+bool kvs_clear(kvstore_t* kvs) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    size_t count = kvs_count(kvs);
+    slow_timer_t timer = slow_start(kvs);
+    bool ok = clear_store(kvs);
+    slow_finish(kvs, &timer, KVS_OP_CLEAR, 0, count, 0, 0);
+    kvs->stats.clears++;
+    kvs->stats.changes_since_save += ok ? count : 0;
+    return ok;
+}
+
+/**
+ * Visit every key-value pair in either mode
+ */
+void kvs_foreach(kvstore_t* kvs, kvs_visit_fn visit, void* ctx) {
+    if (!kvs_valid(kvs) || !visit) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return;
+    }
+
+    int key;
     const char* value;
 
+    if (kvs->mapped) {
+        mt_iterator_t iter = mt_iterator_init(kvs->mapped);
+        while (mt_iterator_next(&iter, &key, &value)) {
+            if (!visit(ctx, key, value)) {
+                return;
+            }
+        }
+        return;
+    }
+
+    ht_iterator_t iter = ht_iterator_init(kvs->table);
     while (ht_iterator_next(&iter, &key, &value)) {
-        printf("  %d: \"%s\"\n", key, value);
+        if (!visit(ctx, key, value)) {
+            return;
+        }
+    }
+}
+
+static uint64_t reverse_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0full) | ((v & 0x0f0f0f0f0f0f0f0full) << 4);
+    v = ((v >> 8) & 0x00ff00ff00ff00ffull) | ((v & 0x00ff00ff00ff00ffull) << 8);
+    v = ((v >> 16) & 0x0000ffff0000ffffull) | ((v & 0x0000ffff0000ffffull) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+/**
+ * Visit one page of the store from a cursor
+ * The cursor is incremented from its high bit down: once slot s of a
+ * table of 2^n slots is done, so are the slots s and s + 2^n it splits
+ * into when the table doubles, and the scan carries on where it was
+ */
+uint64_t kvs_scan(kvstore_t* kvs, uint64_t cursor, size_t count, ht_visit_fn visit, void* ctx) {
+    if (!kvs_valid(kvs) || !visit) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    if (count == 0) {
+        count = 1;
+    }
+
+    uint64_t mask = (kvs->mapped ? mt_capacity(kvs->mapped) : ht_capacity(kvs->table)) - 1;
+    size_t found = 0;
+    size_t empty = count < SIZE_MAX / 10 ? count * 10 : SIZE_MAX;
+    do {
+        size_t slot = (size_t)(cursor & mask);
+        size_t visited = kvs->mapped ? mt_visit_home(kvs->mapped, slot, visit, ctx)
+                                     : ht_visit_home(kvs->table, slot, visit, ctx);
+        found += visited;
+        if (visited == 0) {
+            empty--;
+        }
+
+        cursor |= ~mask;
+        cursor = reverse_bits(reverse_bits(cursor) + 1);
+    } while (cursor != 0 && found < count && empty > 0);
+    kvs->stats.scans++;
+
+    kvs_clear_error();
+    return cursor;
+}
+
+/**
+ * Start maintaining a merkle tree over the store
+ * The tree is built from the current contents, then kept up to date
+ * by kvs_set / kvs_delete
+ */
+bool kvs_merkle_enable(kvstore_t* kvs, unsigned depth) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    merkle_t* tree = merkle_create(depth);
+    if (!tree) {
+        return false;
+    }
+
+    merkle_destroy(kvs->merkle);
+    kvs->merkle = tree;
+    rebuild_merkle(kvs);
+
+    kvs_clear_error();
+    return true;
+}
+
+/**
+ * List hash ranges where two stores differ
+ */
+size_t kvs_merkle_diff(kvstore_t* a, kvstore_t* b, kvs_hash_range_t* ranges, size_t max_ranges) {
+    if (!a || !b || !a->merkle || !b->merkle) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    return merkle_diff(a->merkle, b->merkle, ranges, max_ranges);
+}
+
+/**
+ * Start recording changes
+ * A feed that was already enabled is replaced, which makes its
+ * consumers resync
+ */
+bool kvs_changefeed_enable(kvstore_t* kvs, size_t records, size_t value_bytes) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    changefeed_t* feed = changefeed_create(records, value_bytes);
+    if (!feed) {
+        return false;
+    }
+
+    // sequences carry on, so no consumer mistakes the new feed for the old one
+    if (kvs->changes) {
+        feed->first = feed->next = kvs->changes->next + 1;
+        changefeed_destroy(kvs->changes);
+    }
+    kvs->changes = feed;
+
+    kvs_clear_error();
+    return true;
+}
+
+uint64_t kvs_changefeed_seq(kvstore_t* kvs) {
+    if (!kvs || !kvs->changes) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    return kvs->changes->next;
+}
+
+bool kvs_changefeed_read(kvstore_t* kvs, uint64_t from, kvs_change_t* out, size_t max, size_t* count) {
+    if (!kvs || !kvs->changes || (!out && max > 0) || !count) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    return changefeed_read(kvs->changes, from, out, max, count);
+}
+
+/**
+ * Snapshot for a lagging consumer
+ * Saved like a shard so the store's associated file is left alone
+ */
+bool kvs_changefeed_snapshot(kvstore_t* kvs, const char* filename, uint64_t* seq) {
+    if (!kvs || !kvs->changes || !seq) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    *seq = kvs->changes->next;
+    return kvs_save_sharded(&kvs, 1, filename);
+}
+
+/**
+ * Start a slow log
+ * A log that was already enabled is replaced; ids carry on so entries
+ * read before are not mistaken for new ones
+ */
+bool kvs_slowlog_enable(kvstore_t* kvs, uint64_t threshold_us, size_t entries) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    slowlog_t* log = slowlog_create(entries, threshold_us);
+    if (!log) {
+        return false;
+    }
+    if (kvs->slowlog) {
+        log->first = log->next_id = kvs->slowlog->next_id;
+        slowlog_destroy(kvs->slowlog);
+    }
+    kvs->slowlog = log;
+
+    kvs_clear_error();
+    return true;
+}
+
+size_t kvs_slowlog_get(kvstore_t* kvs, kvs_slow_entry_t* out, size_t max) {
+    if (!kvs || (!out && max > 0)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    return kvs->slowlog ? slowlog_get(kvs->slowlog, out, max) : 0;
+}
+
+void kvs_slowlog_reset(kvstore_t* kvs) {
+    if (kvs && kvs->slowlog) {
+        slowlog_reset(kvs->slowlog);
+    }
+}
+
+bool kvs_latency_enable(kvstore_t* kvs) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    if (!kvs->latency) {
+        kvs->latency = latency_create();
+        if (!kvs->latency) {
+            return false;
+        }
+    }
+    kvs_clear_error();
+    return true;
+}
+
+void kvs_latency_disable(kvstore_t* kvs) {
+    if (kvs) {
+        latency_destroy(kvs->latency);
+        kvs->latency = NULL;
+    }
+}
+
+bool kvs_latency_merge(kvstore_t* kvs, latency_t* out) {
+    if (!kvs || !out) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    if (!kvs->latency) {
+        return false;
+    }
+    latency_merge(out, kvs->latency);
+    return true;
+}
+
+void kvs_latency_reset(kvstore_t* kvs) {
+    if (kvs && kvs->latency) {
+        latency_reset(kvs->latency);
+    }
+}
+
+/**
+ * Start keeping key versions
+ */
+bool kvs_wait_enable(kvstore_t* kvs) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    if (!kvs->waits) {
+        kvs->waits = keywait_create();
+        if (!kvs->waits) {
+            return false;
+        }
     }
+
+    kvs_clear_error();
+    return true;
+}
+
+uint32_t kvs_version(kvstore_t* kvs, int key) {
+    return kvs && kvs->waits ? keywait_version(kvs->waits, key) : 0;
+}
+
+/**
+ * Wait for a key to change
+ * Only the version slots are touched, never the table
+ */
+uint32_t kvs_wait(kvstore_t* kvs, int key, uint32_t last_version, int timeout_ms) {
+    if (!kvs || !kvs->waits) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    return keywait_wait(kvs->waits, key, last_version, timeout_ms);
+}
+
+/**
+ * Put a loader in front of kvs_get misses
+ */
+bool kvs_readthrough_enable(kvstore_t* kvs, kvs_loader_fn loader, void* ctx, unsigned negative_ttl_ms) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    readthrough_t* rt = readthrough_create(loader, ctx, negative_ttl_ms);
+    if (!rt) {
+        return false;
+    }
+
+    readthrough_destroy(kvs->readthrough);
+    kvs->readthrough = rt;
+    kvs_clear_error();
+    return true;
+}
+
+void kvs_readthrough_disable(kvstore_t* kvs) {
+    if (kvs) {
+        readthrough_destroy(kvs->readthrough);
+        kvs->readthrough = NULL;
+    }
+}
+
+bool kvs_readthrough_needed(kvstore_t* kvs, int key) {
+    return kvs_valid(kvs) && kvs->readthrough && !lookup(kvs, key) &&
+           !readthrough_known_missing(kvs->readthrough, key) &&
+           !(kvs->writeback && writeback_pending(kvs->writeback, key));
+}
+
+uint32_t kvs_readthrough_generation(kvstore_t* kvs, int key) {
+    return kvs_valid(kvs) && kvs->readthrough ? readthrough_generation(kvs->readthrough, key) : 0;
+}
+
+/**
+ * Queue writes for a backing service
+ */
+bool kvs_writeback_enable(kvstore_t* kvs, kvs_writer_fn writer, void* ctx, const kvs_writeback_config_t* config) {
+    if (!kvs_valid(kvs)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    writeback_t* wb = writeback_create(writer, ctx, config);
+    if (!wb) {
+        return false;
+    }
+
+    writeback_destroy(kvs->writeback);
+    kvs->writeback = wb;
+    kvs_clear_error();
+    return true;
+}
+
+void kvs_writeback_disable(kvstore_t* kvs) {
+    if (kvs) {
+        writeback_destroy(kvs->writeback);
+        kvs->writeback = NULL;
+    }
+}
+
+bool kvs_writeback_flush(kvstore_t* kvs, int timeout_ms) {
+    if (!kvs || !kvs->writeback) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    if (!writeback_flush(kvs->writeback, timeout_ms)) {
+        return false;
+    }
+    kvs_clear_error();
+    return true;
+}
+
+bool kvs_writeback_stats(kvstore_t* kvs, kvs_writeback_stats_t* stats) {
+    if (!kvs || !kvs->writeback || !stats) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+    writeback_stats(kvs->writeback, stats);
+    return true;
+}
+
+/**
+ * Apply what a load found
+ * Nothing is applied if the key was written (set or deleted) while the
+ * load was out, or has a write still queued for the backend: the store
+ * is newer than what the backend answered
+ */
+bool kvs_readthrough_fill(kvstore_t* kvs, int key, uint32_t generation, kvs_load_result_t result,
+                          char* value, size_t len) {
+    if (!kvs_valid(kvs) || !kvs->readthrough) {
+        free(value);
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    // a write queued for the backend is newer than what it answered too
+    bool unchanged = readthrough_generation(kvs->readthrough, key) == generation && !lookup(kvs, key) &&
+                     !(kvs->writeback && writeback_pending(kvs->writeback, key));
+    bool ok = true;
+    switch (result) {
+        case KVS_LOAD_FOUND:
+            if (!value || memchr(value, '\0', len)) {
+                kvs_set_error(KVS_ERROR_BACKEND);
+                ok = false;
+            } else if (unchanged) {
+                ok = set_entry(kvs, key, value, len);
+            }
+            break;
+        case KVS_LOAD_MISSING:
+            if (unchanged) {
+                readthrough_remember_missing(kvs->readthrough, key);
+            }
+            break;
+        default:
+            kvs_set_error(KVS_ERROR_BACKEND);
+            ok = false;
+            break;
+    }
+    free(value);
+    if (ok) {
+        kvs_clear_error();
+    }
+    return ok;
+}
+
+/**
+ * Gather statistics
+ * Counters are copied; the table figures come from one walk over it
+ */
+bool kvs_info_summary(kvstore_t* kvs, kvs_info_t* info) {
+    if (!kvs_valid(kvs) || !info) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->ops = kvs->stats;
+    info->hit_ratio = kvs->stats.gets ? (double)kvs->stats.get_hits / (double)kvs->stats.gets : 0.0;
+
+    if (kvs->mapped) {
+        info->mode = "mapped";
+        info->capacity = mt_capacity(kvs->mapped);
+        info->resizes = kvs->mapped->resizes;
+        info->resize_us = kvs->mapped->resize_ns / 1000;
+        info->mapped_bytes = kvs->mapped->map_size;
+        info->memory_table = info->capacity * sizeof(mt_entry_t);
+    } else {
+        info->mode = "heap";
+        info->capacity = ht_capacity(kvs->table);
+        info->resizes = kvs->table->resizes;
+        info->resize_us = kvs->table->resize_ns / 1000;
+        info->memory_table = info->capacity * sizeof(ht_entry_t);
+    }
+    info->entries = kvs_count(kvs);
+    if (info->capacity > 0) {
+        info->load_factor = (double)info->entries / (double)info->capacity;
+    }
+
+    if (kvs->merkle) {
+        size_t leaves = (size_t)1 << kvs->merkle->depth;
+        info->memory_merkle = 2 * leaves * sizeof(uint64_t) + leaves;
+    }
+    if (kvs->changes) {
+        info->memory_changefeed = kvs->changes->record_capacity * sizeof(changefeed_record_t) +
+                                  kvs->changes->value_capacity;
+    }
+    if (kvs->slowlog) {
+        info->memory_slowlog = kvs->slowlog->capacity * sizeof(kvs_slow_entry_t);
+    }
+    if (kvs->latency) {
+        info->memory_latency = sizeof(latency_t);
+    }
+    info->memory_total = info->memory_table + info->memory_merkle + info->memory_changefeed +
+                         info->memory_slowlog + info->memory_latency;
+    info->filename = kvs->filename;
+
+    kvs_clear_error();
+    return true;
+}
+
+bool kvs_info(kvstore_t* kvs, kvs_info_t* info) {
+    if (!kvs_info_summary(kvs, info)) {
+        return false;
+    }
+
+    ht_stats_t table;
+    if (kvs->mapped) {
+        mt_stats(kvs->mapped, &table);
+    } else {
+        ht_stats(kvs->table, &table);
+    }
+    info->tombstones = table.tombstones;
+    if (info->capacity > 0) {
+        info->effective_load_factor = (double)(info->entries + info->tombstones) / (double)info->capacity;
+    }
+    info->probe_mean = info->entries ? (double)table.probe_total / (double)info->entries : 0.0;
+    info->probe_max = table.probe_max;
+    info->memory_values = table.value_bytes;
+    info->memory_total += table.value_bytes;
+    return true;
+}
+
+void kvs_print_stats(kvstore_t* kvs) {
+    kvs_info_t info;
+    if (!kvs_info(kvs, &info)) {
+        printf("Invalid key-value store");
+        return;
+    }
+
+    char text[4096];
+    kvs_info_format(&info, false, text, sizeof(text));
+    fputs(text, stdout);
+}
+
+static bool print_entry(void* ctx, int key, const char* value) {
+    (void)ctx;
+    printf("  %d: \"%s\"\n", key, value);
+    return true;
+}
+
+/**
+ * Print all key-value pairs 
+ */
+void kvs_print_all(kvstore_t* kvs) {
+    if (!kvs_valid(kvs)) {
+        printf("Invalid key-value store");
+        return;
+    }
+
+    size_t count = kvs_count(kvs);
+    if (count == 0) {
+        printf("Key-value store is empty");
+        return;
+    }
+
+    printf("key value store contents (%zu entries):\n", count);
+
+    // visit every entry in either mode
+    kvs_foreach(kvs, print_entry, NULL);
 }
 
 
@@ -216,6 +1454,19 @@ void kvs_destroy(kvstore_t* kvs) {
         ht_destroy(kvs->table);
     }
 
+    // Checkpoint and unmap a mapped table
+    if (kvs->mapped) {
+        mt_close(kvs->mapped);
+    }
+
+    merkle_destroy(kvs->merkle);
+    changefeed_destroy(kvs->changes);
+    slowlog_destroy(kvs->slowlog);
+    latency_destroy(kvs->latency);
+    keywait_destroy(kvs->waits);
+    readthrough_destroy(kvs->readthrough);
+    writeback_destroy(kvs->writeback);
+
     // free the filename string
     free(kvs->filename);
 
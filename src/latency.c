@@ -0,0 +1,71 @@
+/**
+ * Latency recorder implementation
+ */
+
+#include "latency.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+
+// nanoseconds per tick, 0 if the counter can't be used
+static double tsc_tick_ns = 0.0;
+
+/**
+ * Measure the time-stamp counter against the monotonic clock, if the
+ * CPU says it runs at a constant rate in every power state
+ */
+static void calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+        return;
+    }
+
+    uint64_t start_ns = slowlog_now();
+    uint64_t start_ticks = __builtin_ia32_rdtsc();
+    uint64_t end_ns;
+    do {
+        end_ns = slowlog_now();
+    } while (end_ns - start_ns < LATENCY_CALIBRATE_NS);
+    uint64_t end_ticks = __builtin_ia32_rdtsc();
+
+    if (end_ticks > start_ticks) {
+        tsc_tick_ns = (double)(end_ns - start_ns) / (double)(end_ticks - start_ticks);
+    }
+#endif
+}
+
+latency_t* latency_create(void) {
+    pthread_once(&calibrate_once, calibrate);
+
+    latency_t* latency = malloc(sizeof(latency_t));
+    if (!latency) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    latency_reset(latency);
+    latency->tsc = tsc_tick_ns > 0.0;
+    latency->tick_ns = latency->tsc ? tsc_tick_ns : 1.0;
+    return latency;
+}
+
+void latency_destroy(latency_t* latency) {
+    free(latency);
+}
+
+void latency_reset(latency_t* latency) {
+    for (size_t i = 0; i < KVS_OP_COUNT; i++) {
+        histogram_reset(&latency->ops[i]);
+    }
+}
+
+void latency_merge(latency_t* dst, const latency_t* src) {
+    for (size_t i = 0; i < KVS_OP_COUNT; i++) {
+        histogram_merge(&dst->ops[i], &src->ops[i]);
+    }
+}
@@ -1,17 +1,55 @@
 /**
  * User-friendly CLI that demonstrates all features of the key-value store
+ * Also runs scripts non-interactively with --batch / -f
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "kvstore.h"
 #include "persistence.h"
+#include "handoff.h"
+#include "command.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 
 #define  MAX_LINE_LENGTH 1024
 #define  MAX_VALUE_LENGTH 512
+#define  MAX_MULTI_KEYS (MAX_LINE_LENGTH / 2)
+#define  SCAN_DEFAULT_COUNT 10
+#define  SLOWLOG_SHOW_COUNT 10
 #define  DEFAULT_FILENAME "kvstore_data.bin"
+#define  TAKEOVER_TIMEOUT_MS 60000
+
+// stdio buffers used in batch mode
+#define  BATCH_INPUT_BUFFER (1024 * 1024)
+#define  BATCH_OUTPUT_BUFFER (256 * 1024)
+
+/**
+ * Set once the table has been handed to a new process; the old one
+ * then exits without auto-saving
+ */
+static bool handed_off = false;
+
+/**
+ * Quiet mode: confirmations of successful changes are not printed,
+ * only query results and errors
+ */
+static bool quiet = false;
+
+/**
+ * Per-command timings collected in batch mode, indexed by command id
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} command_timing_t;
+
+static command_timing_t timings[KVS_CMD_COUNT];
 
 /**
  * Print the help message showing available commands
@@ -21,103 +59,91 @@ static void print_help(void) {
     printf("  set <key> <value>  - Set a key-value pair\n");
     printf("  get <key>          - Get value for a key\n");
     printf("  delete <key>       - Delete a key-value pair\n");
+    printf("  mget <key>...      - Get the values of several keys\n");
+    printf("  mset <k> <v>...    - Set several pairs (single-word values)\n");
+    printf("  mdel <key>...      - Delete several keys\n");
     printf("  list               - List all key-value pairs\n");
-    printf("  stats              - Show store statistics\n");
+    printf("  scan <cursor> [n]  - List about n pairs from a cursor (0 to start)\n");
+    printf("  stats [json]       - Show store statistics, as text or JSON\n");
     printf("  save [filename]    - Save store to file (default: %s)\n", DEFAULT_FILENAME);
     printf("  load [filename]    - Load store from file (default: %s)\n", DEFAULT_FILENAME);
     printf("  clear              - Clear all entries\n");
+    printf("  handoff <socket>   - Hand the table to a new process and exit\n");
+    printf("  slowlog [n]        - Show the n slowest recent operations (default %d)\n", SLOWLOG_SHOW_COUNT);
+    printf("  slowlog reset      - Drop the slow log entries\n");
+    printf("  slowlog threshold <us> - Log operations taking at least <us> microseconds\n");
+    printf("  latency [json]     - Show p50 / p99 / p99.9 latency per operation type\n");
+    printf("  latency on|off|reset - Start, stop or restart latency recording\n");
     printf("  help               - Show this help message\n");
     printf("  quit               - Exit the program\n");
     printf("\n");
 }
 
-/** 
- * Trim whitespaces from the beg and end of a string
- */
-static char* trim_whitespaces(char* str) {
-    while (isspace((unsigned char)*str)) {
-        str++;
-    }
-
-    if (*str == '\0'){
-        return str;
-    }
-
-    // Trim trailing whitespaces
-    char* end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) {
-        end--;
-    }
-
-    // null-terminate after last non-whitespace character
-    end[1] = '\0';
-
-    return str;
-}
-
 /**
- * Parse an integer from a string without error checking 
+ * Parse the single key argument of get / delete
  */
-static bool parse_int (const char* str, int* result) {
-    if (!str || !result) {
-        return false;
-    }
-
-    char* endptr;
-    long val = strtol(str, &endptr, 10);
-
-    // check for parsing errors
-    if (endptr == str || *endptr != '\0') {
+static bool parse_key_arg(kvs_tokenizer_t* args, const char* usage, int* key) {
+    kvs_slice_t key_str = kvs_rest_of_line(args);
+    if (key_str.len == 0) {
+        printf("Error: Missing key. Usage: %s\n", usage);
         return false;
     }
 
-    // integer overflow
-    if (val > INT32_MAX || val < INT32_MIN) {
+    if (!kvs_slice_to_int(key_str, key)) {
+        printf("Error: Invalid key. Key must be an integer.\n");
         return false;
     }
-
-    *result = (int) val;
     return true;
 }
 
+/**
+ * Copy the rest of the line into buf as a C string (for paths)
+ * @return buf, or fallback if the rest of the line is empty
+ */
+static const char* path_arg(kvs_tokenizer_t* args, char* buf, size_t size, const char* fallback) {
+    kvs_slice_t rest = kvs_rest_of_line(args);
+    if (rest.len == 0 || rest.len >= size) {
+        return fallback;
+    }
+    memcpy(buf, rest.ptr, rest.len);
+    buf[rest.len] = '\0';
+    return buf;
+}
+
 /**
  * Handle the 'set' command
  */
-static void handle_set_command(kvstore_t* kvs, char* args) {
+static void handle_set_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
     // parse key
-    char* key_str = strtok(args, " \t");
-    if (!key_str) {
+    kvs_slice_t key_str;
+    if (!kvs_next_token(args, &key_str)) {
         printf("Error: Missing key. Usage: set <key> <value>\n");
         return;
     }
 
     int key;
-    if (!parse_int(key_str, &key)) {
+    if (!kvs_slice_to_int(key_str, &key)) {
         printf("Error: Invalid key. Key must be an integer.\n");
         return;
     }
 
     // Parse value (rest of the line)
-    char* value = strtok(NULL, "");
-    if (!value) {
+    kvs_slice_t value = kvs_rest_of_line(args);
+    if (value.len == 0) {
         printf("Error: missing value. Usage: set <key> <value>\n");
         return;
     }
 
-    value = trim_whitespaces(value);
-    if (strlen(value) == 0) {
-        printf("Error: Value cannot be empty.\n");
-        return;
-    }
-
-    if (strlen(value) > MAX_VALUE_LENGTH) {
+    if (value.len > MAX_VALUE_LENGTH) {
         printf("Error: Value too long (max %d characters).\n", MAX_VALUE_LENGTH);
         return;
     }
 
-    // Set the key-value pair
-    if (kvs_set(kvs, key, value)) {
-        printf("Set: %d = \"%s\"\n", key, value);
+    // Set the key-value pair straight from the line buffer
+    if (kvs_set_len(kvs, key, value.ptr, value.len)) {
+        if (!quiet) {
+            printf("Set: %d = \"%.*s\"\n", key, (int)value.len, value.ptr);
+        }
     } else {
         printf("Error: Failed to set key-value pair: %s\n", kvs_error_string(kvs_get_error()));
     }
@@ -126,17 +152,9 @@ static void handle_set_command(kvstore_t* kvs, char* args) {
 /**
  * Handle the 'get' command
  */
-static void handle_get_command(kvstore_t* kvs, char* args) {
-    // parse key
-    char* key_str = trim_whitespaces(args);
-    if (strlen(key_str) == 0){
-        printf("Error: Missing key. Usage: get <key>\n");
-        return;
-    }
-
+static void handle_get_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
     int key;
-    if (!parse_int(key_str, &key)) {
-        printf("Error: Invalid key. Key must be an integer.\n");
+    if (!parse_key_arg(args, "get <key>", &key)) {
         return;
     }
 
@@ -152,41 +170,184 @@ static void handle_get_command(kvstore_t* kvs, char* args) {
 /**
  * Handle the 'delete' command
  */
-static void handle_delete_command(kvstore_t* kvs, char* args) {
-    // parse key
-    char* key_str = trim_whitespaces(args);
-    if (strlen(key_str) == 0) {
-        printf("Error: Missing key. Usage: delete <key>\n");
-        return;
-    }
-
+static void handle_delete_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
     int key;
-    if (!parse_int(key_str, &key)) {
-        printf("Error: Invalid key. Key must be an integer.\n");
+    if (!parse_key_arg(args, "delete <key>", &key)) {
         return;
     }
 
     // Delete the key
     if (kvs_delete(kvs, key)) {
-        printf("Deleted key: %d\n", key);
-    } else {
+        if (!quiet) {
+            printf("Deleted key: %d\n", key);
+        }
+    } else if (!quiet) {
         printf("Key %d not found.\n", key);
     }
 }
 
+/**
+ * Parse the key list of mget / mdel
+ * @return number of keys, 0 after printing an error
+ */
+static size_t parse_key_list(kvs_tokenizer_t* args, const char* usage, int* keys) {
+    size_t count = 0;
+    kvs_slice_t token;
+    while (count < MAX_MULTI_KEYS && kvs_next_token(args, &token)) {
+        if (!kvs_slice_to_int(token, &keys[count])) {
+            printf("Error: Invalid key '%.*s'. Key must be an integer.\n", (int)token.len, token.ptr);
+            return 0;
+        }
+        count++;
+    }
+    if (count == 0) {
+        printf("Error: Missing key. Usage: %s\n", usage);
+    }
+    return count;
+}
+
+/**
+ * Handle the 'mget' command, one batched lookup for all keys
+ */
+static void handle_mget_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    int keys[MAX_MULTI_KEYS];
+    const char* values[MAX_MULTI_KEYS];
+    size_t count = parse_key_list(args, "mget <key> [key...]", keys);
+    if (count == 0) {
+        return;
+    }
+
+    kvs_mget(kvs, keys, count, values);
+    for (size_t i = 0; i < count; i++) {
+        if (values[i]) {
+            printf("Get: %d = \"%s\"\n", keys[i], values[i]);
+        } else {
+            printf("Key %d not found.\n", keys[i]);
+        }
+    }
+}
+
+/**
+ * Handle the 'mset' command: key value pairs, values are single words
+ */
+static void handle_mset_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    int keys[MAX_MULTI_KEYS];
+    const char* values[MAX_MULTI_KEYS];
+    size_t lens[MAX_MULTI_KEYS];
+    size_t count = 0;
+
+    kvs_slice_t key_str;
+    kvs_slice_t value;
+    while (count < MAX_MULTI_KEYS && kvs_next_token(args, &key_str)) {
+        if (!kvs_slice_to_int(key_str, &keys[count])) {
+            printf("Error: Invalid key '%.*s'. Key must be an integer.\n", (int)key_str.len, key_str.ptr);
+            return;
+        }
+        if (!kvs_next_token(args, &value)) {
+            printf("Error: missing value for key %d. Usage: mset <key> <value> [key value...]\n", keys[count]);
+            return;
+        }
+        if (value.len > MAX_VALUE_LENGTH) {
+            printf("Error: Value too long (max %d characters).\n", MAX_VALUE_LENGTH);
+            return;
+        }
+        values[count] = value.ptr;
+        lens[count] = value.len;
+        count++;
+    }
+    if (count == 0) {
+        printf("Error: Missing key. Usage: mset <key> <value> [key value...]\n");
+        return;
+    }
+
+    if (!kvs_mset(kvs, keys, values, lens, count)) {
+        printf("Error: Failed to set key-value pairs: %s\n", kvs_error_string(kvs_get_error()));
+        return;
+    }
+    for (size_t i = 0; !quiet && i < count; i++) {
+        printf("Set: %d = \"%.*s\"\n", keys[i], (int)lens[i], values[i]);
+    }
+}
+
+/**
+ * Handle the 'mdel' command
+ */
+static void handle_mdel_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    int keys[MAX_MULTI_KEYS];
+    size_t count = parse_key_list(args, "mdel <key> [key...]", keys);
+    if (count == 0) {
+        return;
+    }
+
+    size_t deleted = kvs_mdel(kvs, keys, count, NULL);
+    if (!quiet) {
+        printf("Deleted %zu of %zu keys\n", deleted, count);
+    }
+}
+
+static void print_scanned(void* ctx, int key, const char* value) {
+    (void)ctx;
+    printf("  %d: \"%s\"\n", key, value);
+}
+
+/**
+ * Handle the 'scan' command: one page, then the cursor to continue from
+ */
+static void handle_scan_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    kvs_slice_t token;
+    long long cursor;
+    long long count = SCAN_DEFAULT_COUNT;
+    if (!kvs_next_token(args, &token) || !kvs_slice_to_ll(token, &cursor) || cursor < 0) {
+        printf("Error: Invalid cursor. Usage: scan <cursor> [count]\n");
+        return;
+    }
+    if (kvs_next_token(args, &token) && (!kvs_slice_to_ll(token, &count) || count < 1)) {
+        printf("Error: Invalid count. Usage: scan <cursor> [count]\n");
+        return;
+    }
+
+    uint64_t next = kvs_scan(kvs, (uint64_t)cursor, (size_t)count, print_scanned, NULL);
+    printf("Next cursor: %llu%s\n", (unsigned long long)next, next == 0 ? " (done)" : "");
+}
+
+/**
+ * Handle the 'stats' command
+ */
+static void handle_stats_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    kvs_slice_t token;
+    bool json = kvs_next_token(args, &token);
+    if (json && !kvs_slice_equals(token, "json")) {
+        printf("Error: Unknown format. Usage: stats [json]\n");
+        return;
+    }
+    if (!json) {
+        kvs_print_stats(kvs);
+        return;
+    }
+
+    kvs_info_t info;
+    char text[4096];
+    if (!kvs_info(kvs, &info)) {
+        printf("Error: %s\n", kvs_error_string(kvs_get_error()));
+        return;
+    }
+    kvs_info_format(&info, true, text, sizeof(text));
+    printf("%s\n", text);
+}
+
 /**
  * Handle the save
  */
-static void handle_save_command(kvstore_t* kvs, char *args) {
+static void handle_save_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
     // parse filname
-    char* filename = trim_whitespaces(args);
-    if (strlen(filename) == 0) {
-        filename = DEFAULT_FILENAME;
-    }
+    char buf[MAX_LINE_LENGTH];
+    const char* filename = path_arg(args, buf, sizeof(buf), DEFAULT_FILENAME);
 
     // save to file
     if (kvs_save(kvs, filename)) {
-        printf("Saved %zu entries to '%s'\n", kvs_count(kvs), filename);
+        if (!quiet) {
+            printf("Saved %zu entries to '%s'\n", kvs_count(kvs), filename);
+        }
     } else {
         printf("Errro: Failed to save to file: %s\n", kvs_error_string(kvs_get_error()));
     }
@@ -195,12 +356,10 @@ static void handle_save_command(kvstore_t* kvs, char *args) {
 /**
  * Handle the 'load' command
  */
-static void handle_load_command(kvstore_t* kvs, char* args) {
+static void handle_load_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
     // parse filename
-    char* filename = trim_whitespaces(args);
-    if (strlen(filename) == 0) {
-        filename = DEFAULT_FILENAME;
-    }
+    char buf[MAX_LINE_LENGTH];
+    const char* filename = path_arg(args, buf, sizeof(buf), DEFAULT_FILENAME);
 
     // check if file exists 
     if (!kvs_file_exists(filename)) {
@@ -210,7 +369,9 @@ static void handle_load_command(kvstore_t* kvs, char* args) {
 
     // Load from file
     if (kvs_load(kvs, filename)) {
-        printf("Loaded %zu entries from '%s'\n", kvs_count(kvs), filename);
+        if (!quiet) {
+            printf("Loaded %zu entries from '%s'\n", kvs_count(kvs), filename);
+        }
     } else {
         printf("Error: Failed to load from file: %s\n", 
                kvs_error_string(kvs_get_error()));
@@ -222,101 +383,327 @@ static void handle_load_command(kvstore_t* kvs, char* args) {
  */
 static void handle_clear_command(kvstore_t* kvs) {
     size_t count = kvs_count(kvs);
-    
-    // create a new empty store to replace the current one
-    hash_table_t* old_table = kvs->table;
-    kvs->table = ht_create(16);
-
-    if (kvs->table) {
-        ht_destroy(old_table);
-        printf("Cleared %zu entries\n", count);
+
+    if (kvs_clear(kvs)) {
+        if (!quiet) {
+            printf("Cleared %zu entries\n", count);
+        }
     } else {
-        kvs->table = old_table;
         printf("Error: Failed to clear store: %s\n", 
                kvs_error_string(kvs_get_error()));
     }
 }
 
 /**
- * Process a single command line
+ * Handle the 'slowlog' command: show the latest entries, reset the
+ * log or change its threshold
  */
-static bool process_command(kvstore_t* kvs, char* line) {
-    // trim whitespaces and check for emtpy line
-    line = trim_whitespaces(line);
-    if (strlen(line) == 0) {
+static void handle_slowlog_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    kvs_slice_t token;
+    long long count = SLOWLOG_SHOW_COUNT;
+    if (kvs_next_token(args, &token)) {
+        if (kvs_slice_equals(token, "reset")) {
+            kvs_slowlog_reset(kvs);
+            if (!quiet) {
+                printf("Slow log reset\n");
+            }
+            return;
+        }
+        if (kvs_slice_equals(token, "threshold")) {
+            long long us;
+            if (!kvs_next_token(args, &token) || !kvs_slice_to_ll(token, &us) || us < 0) {
+                printf("Error: Invalid threshold. Usage: slowlog threshold <us>\n");
+            } else if (!kvs_slowlog_enable(kvs, (uint64_t)us, 0)) {
+                printf("Error: Failed to set the threshold: %s\n", kvs_error_string(kvs_get_error()));
+            } else if (!quiet) {
+                printf("Logging operations of %lld us or more\n", us);
+            }
+            return;
+        }
+        if (!kvs_slice_to_ll(token, &count) || count < 1) {
+            printf("Error: Invalid count. Usage: slowlog [n | reset | threshold <us>]\n");
+            return;
+        }
+    }
+
+    kvs_slow_entry_t* entries = malloc((size_t)count * sizeof(kvs_slow_entry_t));
+    if (!entries) {
+        printf("Error: Out of memory\n");
+        return;
+    }
+    size_t found = kvs_slowlog_get(kvs, entries, (size_t)count);
+    if (found == 0) {
+        printf("Slow log is empty\n");
+    }
+    for (size_t i = 0; i < found; i++) {
+        const kvs_slow_entry_t* e = &entries[i];
+        char when[32];
+        char causes[64];
+        time_t seconds = (time_t)(e->time_us / 1000000);
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+        slowlog_format_causes(e->causes, causes, sizeof(causes));
+        printf("  #%llu %s %s", (unsigned long long)e->id, when, slowlog_op_name(e->op));
+        if (e->op <= KVS_OP_MDEL) {
+            printf(" key %d", e->key);
+        }
+        if (e->count != 1) {
+            printf(" (%zu entries)", e->count);
+        }
+        printf(": %llu us, probes %zu", (unsigned long long)e->duration_us, e->probes);
+        if (e->value_len > 0) {
+            printf(", value %zu bytes", e->value_len);
+        }
+        printf(", causes %s\n", causes);
+    }
+    free(entries);
+}
+
+/**
+ * Handle the 'latency' command: show the histograms, or start, stop or
+ * reset recording
+ */
+static void handle_latency_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    kvs_slice_t token;
+    bool json = false;
+    if (kvs_next_token(args, &token)) {
+        if (kvs_slice_equals(token, "on")) {
+            if (!kvs_latency_enable(kvs)) {
+                printf("Error: Failed to start recording: %s\n", kvs_error_string(kvs_get_error()));
+            } else if (!quiet) {
+                printf("Recording operation latency\n");
+            }
+            return;
+        }
+        if (kvs_slice_equals(token, "off")) {
+            kvs_latency_disable(kvs);
+            if (!quiet) {
+                printf("Latency recording stopped\n");
+            }
+            return;
+        }
+        if (kvs_slice_equals(token, "reset")) {
+            kvs_latency_reset(kvs);
+            if (!quiet) {
+                printf("Latency histograms reset\n");
+            }
+            return;
+        }
+        if (!kvs_slice_equals(token, "json")) {
+            printf("Error: Unknown option. Usage: latency [json | on | off | reset]\n");
+            return;
+        }
+        json = true;
+    }
+
+    latency_t* latency = latency_create();
+    if (!latency) {
+        printf("Error: Out of memory\n");
+        return;
+    }
+    if (kvs_latency_merge(kvs, latency)) {
+        char text[2048];
+        kvs_latency_format(latency, json, text, sizeof(text));
+        printf(json ? "%s\n" : "%s", text);
+    } else {
+        printf("Latency recording is off (start it with 'latency on')\n");
+    }
+    latency_destroy(latency);
+}
+
+/**
+ * Handle the 'handoff' command
+ * Blocks until a process started with --takeover connects
+ */
+static bool handle_handoff_command(kvstore_t* kvs, kvs_tokenizer_t* args) {
+    char buf[MAX_LINE_LENGTH];
+    const char* socket_path = path_arg(args, buf, sizeof(buf), NULL);
+    if (!socket_path) {
+        printf("Error: Missing socket. Usage: handoff <socket>\n");
         return true;
     }
 
-    // parse command
-    char* command = strtok(line, " \t");
-    if (!command) {
+    if (!kvs->mapped) {
+        printf("Error: handoff needs a store started with --memfd or --mapped\n");
         return true;
     }
 
-    // Get argument (rest of the line)
-    char* args = strtok(NULL, "");
-    if (!args) {
-        args = "";
+    size_t count = kvs_count(kvs);
+    printf("Waiting for a new process on '%s'...\n", socket_path);
+    fflush(stdout);
+
+    if (!kvs_handoff_send(kvs, socket_path)) {
+        printf("Error: Handoff failed: %s\n", kvs_error_string(kvs_get_error()));
+        return true;
     }
 
-    // process commands
-    if (strcmp(command, "set") == 0) {
-        handle_set_command(kvs, args);
-    } else if (strcmp(command, "get") == 0) {
-        handle_get_command(kvs, args);
-    } else if (strcmp(command, "delete") == 0 || strcmp(command, "del") == 0) {
-        handle_delete_command(kvs, args);
-    } else if (strcmp(command, "list") == 0 || strcmp(command, "ls") == 0) {
-        kvs_print_all(kvs);
-    } else if (strcmp(command, "stats") == 0) {
-        kvs_print_stats(kvs);
-    } else if (strcmp(command, "save") == 0) {
-        handle_save_command(kvs, args);
-    } else if (strcmp(command, "load") == 0) {
-        handle_load_command(kvs, args);
-    } else if (strcmp(command, "clear") == 0) {
-        handle_clear_command(kvs);
-    } else if (strcmp(command, "help") == 0 || strcmp(command, "?") == 0) {
-        print_help();
-    } else if (strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0) {
-        return false;
-    } else {
-        printf("Unknown command: %s (type 'help' for available commands)\n", command);
+    printf("Handed off %zu entries, exiting\n", count);
+    handed_off = true;
+    return false;
+}
+
+/**
+ * Run one resolved command on the rest of its line
+ * @return false if the shell should exit
+ */
+static bool execute_command(kvstore_t* kvs, kvs_command_id_t id, kvs_slice_t name, kvs_tokenizer_t* args) {
+    switch (id) {
+        case KVS_CMD_SET:
+            handle_set_command(kvs, args);
+            break;
+        case KVS_CMD_GET:
+            handle_get_command(kvs, args);
+            break;
+        case KVS_CMD_DEL:
+            handle_delete_command(kvs, args);
+            break;
+        case KVS_CMD_MGET:
+            handle_mget_command(kvs, args);
+            break;
+        case KVS_CMD_MSET:
+            handle_mset_command(kvs, args);
+            break;
+        case KVS_CMD_MDEL:
+            handle_mdel_command(kvs, args);
+            break;
+        case KVS_CMD_LIST:
+            kvs_print_all(kvs);
+            break;
+        case KVS_CMD_SCAN:
+            handle_scan_command(kvs, args);
+            break;
+        case KVS_CMD_STATS:
+            handle_stats_command(kvs, args);
+            break;
+        case KVS_CMD_SAVE:
+            handle_save_command(kvs, args);
+            break;
+        case KVS_CMD_LOAD:
+            handle_load_command(kvs, args);
+            break;
+        case KVS_CMD_CLEAR:
+            handle_clear_command(kvs);
+            break;
+        case KVS_CMD_HANDOFF:
+            return handle_handoff_command(kvs, args);
+        case KVS_CMD_SLOWLOG:
+            handle_slowlog_command(kvs, args);
+            break;
+        case KVS_CMD_LATENCY:
+            handle_latency_command(kvs, args);
+            break;
+        case KVS_CMD_HELP:
+            print_help();
+            break;
+        case KVS_CMD_QUIT:
+            return false;
+        default:
+            printf("Unknown command: %.*s (type 'help' for available commands)\n",
+                   (int)name.len, name.ptr);
+            break;
     }
 
     return true;
+}
 
+/**
+ * Process a single command line
+ * The line is tokenized in place, without copies or modifications
+ */
+static bool process_command(kvstore_t* kvs, char* line, size_t len) {
+    kvs_tokenizer_t args;
+    kvs_tokenizer_init(&args, line, len);
+
+    // skip empty lines
+    kvs_slice_t name;
+    if (!kvs_next_token(&args, &name)) {
+        return true;
+    }
+
+    return execute_command(kvs, kvs_command_lookup(name), name, &args);
 }
 
 /**
- * Entry point of the program 
- * Sets up the key-value store and runs the interactive loop
+ * Monotonic clock in nanoseconds
  */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
- int main(int argc, char*argv[]) {
-    printf("Key-value Store Interactive Shell\n");
-    printf("Type 'help' for available commands, 'quit' or 'exit'.\n\n");
+/**
+ * Add one command execution to the timing table
+ */
+static void record_timing(kvs_command_id_t id, uint64_t elapsed_ns) {
+    command_timing_t* timing = &timings[id];
+    timing->count++;
+    timing->total_ns += elapsed_ns;
+    if (elapsed_ns > timing->max_ns) {
+        timing->max_ns = elapsed_ns;
+    }
+}
 
-    // create the key-value store
-    kvstore_t* kvs = kvs_create(0); 
-    if (!kvs) {
-        printf("Error: Failed to create key-value store: %s\n", kvs_error_string(kvs_get_error()));
-        return 1;
+/**
+ * Print throughput and per-command latency of a batch run to stderr
+ */
+static void print_batch_summary(uint64_t commands, uint64_t elapsed_ns) {
+    double seconds = elapsed_ns / 1e9;
+    fprintf(stderr, "\nBatch summary: %llu commands in %.3f s (%.0f ops/s)\n",
+            (unsigned long long)commands, seconds, seconds > 0 ? commands / seconds : 0.0);
+    if (commands == 0) {
+        return;
     }
 
-    // Try to load data from default file if it exists
-    if (kvs_file_exists(DEFAULT_FILENAME)){
-        if (kvs_load(kvs,DEFAULT_FILENAME)) {
-            printf("Loaded %zu entries from '%s'\n",
-            kvs_count(kvs), DEFAULT_FILENAME);
-        } else {
-            printf("Warning: Could not load '%s': %s\n",
-            DEFAULT_FILENAME, kvs_error_string(kvs_get_error()));
+    fprintf(stderr, "  %-12s %12s %12s %12s\n", "command", "count", "avg us", "max us");
+    for (int i = 0; i < KVS_CMD_COUNT; i++) {
+        if (timings[i].count == 0) {
+            continue;
         }
-        printf("\n");
+        fprintf(stderr, "  %-12s %12llu %12.3f %12.3f\n", kvs_command_name((kvs_command_id_t)i),
+                (unsigned long long)timings[i].count,
+                timings[i].total_ns / 1e3 / timings[i].count,
+                timings[i].max_ns / 1e3);
     }
+}
+
+/**
+ * Run commands from a script or pipe: no prompt, block-buffered output,
+ * timing summary at the end
+ */
+static void run_batch(kvstore_t* kvs, FILE* input) {
+    char line[MAX_LINE_LENGTH];
+    uint64_t commands = 0;
+    uint64_t start = now_ns();
+
+    while (fgets(line, sizeof(line), input)) {
+        kvs_tokenizer_t args;
+        kvs_tokenizer_init(&args, line, strlen(line));
+
+        kvs_slice_t name;
+        if (!kvs_next_token(&args, &name)) {
+            continue;
+        }
+
+        kvs_command_id_t id = kvs_command_lookup(name);
+        uint64_t before = now_ns();
+        bool keep_going = execute_command(kvs, id, name, &args);
+        record_timing(id, now_ns() - before);
+        commands++;
 
-    // main interactive loop
+        if (!keep_going) {
+            break;
+        }
+    }
+
+    fflush(stdout);
+    print_batch_summary(commands, now_ns() - start);
+}
+
+/**
+ * Run the interactive prompt loop
+ */
+static void run_interactive(kvstore_t* kvs) {
     char line[MAX_LINE_LENGTH];
     while (true) {
         printf("kvs> ");
@@ -328,18 +715,157 @@ static bool process_command(kvstore_t* kvs, char* line) {
             break;
         }
 
-        // remove newline character
-        line[strcspn(line, "\n")] = '\0';
-
-        // process the command 
-        if (!process_command(kvs, line)) {
+        // process the command (the tokenizer treats the newline as whitespace)
+        if (!process_command(kvs, line, strlen(line))) {
             break;
         }
     }
+}
+
+/**
+ * Print command line usage
+ */
+static void print_usage(const char* prog) {
+    printf("Usage: %s [--memfd | --mapped <file> | --takeover <socket>] [--batch | -f <script>] [-q]\n"
+           "       [--slowlog <us>] [--latency]\n", prog);
+    printf("  --memfd              Keep the table in a memfd region (enables handoff)\n");
+    printf("  --mapped <file>      Keep the table in a memory-mapped file\n");
+    printf("  --takeover <socket>  Take over the table of a process running 'handoff'\n");
+    printf("  --batch              Read commands from stdin without a prompt\n");
+    printf("  -f <script>          Read commands from a file (implies --batch)\n");
+    printf("  -q, --quiet          Only print query results and errors\n");
+    printf("  --slowlog <us>       Slow log threshold in microseconds (default %d)\n",
+           SLOWLOG_DEFAULT_THRESHOLD_US);
+    printf("  --latency            Record per-operation latency from the start\n");
+}
+
+/**
+ * Entry point of the program 
+ * Sets up the key-value store and runs the interactive loop
+ */
+
+ int main(int argc, char*argv[]) {
+    bool use_memfd = false;
+    bool batch = false;
+    const char* mapped_path = NULL;
+    const char* takeover_socket = NULL;
+    const char* script_path = NULL;
+    long long slowlog_us = SLOWLOG_DEFAULT_THRESHOLD_US;
+    bool record_latency = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--memfd") == 0) {
+            use_memfd = true;
+        } else if (strcmp(argv[i], "--mapped") == 0 && i + 1 < argc) {
+            mapped_path = argv[++i];
+        } else if (strcmp(argv[i], "--takeover") == 0 && i + 1 < argc) {
+            takeover_socket = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+            batch = true;
+        } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "--slowlog") == 0 && i + 1 < argc) {
+            char* end;
+            errno = 0;
+            slowlog_us = strtoll(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || errno != 0 || slowlog_us < 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            record_latency = true;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
 
-    // Auto-save on exit if there's data
-    if (kvs_count(kvs) > 0) {
-        printf("Auto-saving data to '%s'....\n", DEFAULT_FILENAME);
+    FILE* input = stdin;
+    if (script_path) {
+        input = fopen(script_path, "r");
+        if (!input) {
+            fprintf(stderr, "Error: Cannot open script '%s'\n", script_path);
+            return 1;
+        }
+    }
+
+    // must happen before the first read or write on the streams
+    if (batch) {
+        setvbuf(input, NULL, _IOFBF, BATCH_INPUT_BUFFER);
+        setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+    } else {
+        printf("Key-value Store Interactive Shell\n");
+        printf("Type 'help' for available commands, 'quit' or 'exit'.\n\n");
+    }
+
+    // create the key-value store
+    kvstore_t* kvs;
+    if (takeover_socket) {
+        printf("Waiting to take over from '%s'...\n", takeover_socket);
+        fflush(stdout);
+        kvs = kvs_handoff_receive(takeover_socket, TAKEOVER_TIMEOUT_MS);
+        if (kvs) {
+            printf("Took over %zu entries\n\n", kvs_count(kvs));
+        }
+    } else if (mapped_path) {
+        kvs = kvs_open_mapped(mapped_path, 0);
+        if (kvs && !quiet) {
+            printf("Mapped %zu entries from '%s'\n\n", kvs_count(kvs), mapped_path);
+        }
+    } else if (use_memfd) {
+        kvs = kvs_create_memfd(0);
+    } else {
+        kvs = kvs_create(0);
+    }
+    if (!kvs) {
+        printf("Error: Failed to create key-value store: %s\n", kvs_error_string(kvs_get_error()));
+        if (script_path) {
+            fclose(input);
+        }
+        return 1;
+    }
+
+    // the slow log and latency histograms also cover the initial load
+    kvs_slowlog_enable(kvs, slowlog_us > 0 ? (uint64_t)slowlog_us : 0, 0);
+    if (record_latency) {
+        kvs_latency_enable(kvs);
+    }
+
+    // Try to load data from default file if it exists
+    if (!takeover_socket && !mapped_path && kvs_file_exists(DEFAULT_FILENAME)){
+        if (kvs_load(kvs,DEFAULT_FILENAME)) {
+            if (!quiet) {
+                printf("Loaded %zu entries from '%s'\n\n",
+                kvs_count(kvs), DEFAULT_FILENAME);
+            }
+        } else {
+            printf("Warning: Could not load '%s': %s\n\n",
+            DEFAULT_FILENAME, kvs_error_string(kvs_get_error()));
+        }
+    }
+
+    if (batch) {
+        run_batch(kvs, input);
+    } else {
+        run_interactive(kvs);
+    }
+
+    if (script_path) {
+        fclose(input);
+    }
+
+    // Auto-save on exit if there's data (a mapped file is its own storage)
+    if (handed_off) {
+        // the new process owns the table now
+    } else if (kvs->mapped && kvs->filename) {
+        kvs_checkpoint(kvs);
+    } else if (kvs_count(kvs) > 0) {
+        if (!quiet) {
+            printf("Auto-saving data to '%s'....\n", DEFAULT_FILENAME);
+        }
         if (!kvs_save(kvs, DEFAULT_FILENAME)) {
             printf("Warning: Could not save data: %s\n",
             kvs_error_string(kvs_get_error()));
@@ -348,7 +874,9 @@ static bool process_command(kvstore_t* kvs, char* line) {
 
     //clean up
     kvs_destroy(kvs);
-    printf("Goodbye!\n");
+    if (!batch) {
+        printf("Goodbye!\n");
+    }
 
     return 0;
- }
\ No newline at end of file
+ }
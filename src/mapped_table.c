@@ -0,0 +1,866 @@
+/**
+ * Memory-mapped hash table implementation
+ *
+ * Same open addressing / linear probing scheme as hash_table.c, but all
+ * state lives in a MAP_SHARED file mapping. Values and the entries array
+ * are carved out of an arena with power-of-two size classes and a free
+ * list per class. Everything is addressed by offset so the mapping can
+ * move when the file grows.
+ */
+
+#define _GNU_SOURCE
+
+#include "mapped_table.h"
+#include "hash_table.h"
+#include "error.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// default number of slots for a new file
+#define MT_DEFAULT_CAPACITY 16
+
+// (size + tombstones) / capacity threshold that triggers a resize
+#define MT_LOAD_FACTOR_THRESHOLD 0.75
+
+// initial size of a new backing file
+#define MT_INITIAL_FILE_SIZE (64 * 1024)
+
+// first arena offset, leaves room for the header
+#define MT_DATA_START 512
+
+// smallest block (header + payload) handed out by the arena
+#define MT_MIN_BLOCK 16
+
+/**
+ * Header in front of every arena block
+ */
+typedef struct {
+    uint32_t size_class;    // block size is MT_MIN_BLOCK << size_class
+    uint32_t length;        // payload bytes in use
+} mt_block_t;
+
+static inline mt_header_t* header(mapped_table_t* mt) {
+    return (mt_header_t*)mt->base;
+}
+
+static inline mt_block_t* block_at(mapped_table_t* mt, uint64_t off) {
+    return (mt_block_t*)(mt->base + off);
+}
+
+static inline mt_entry_t* entries(mapped_table_t* mt) {
+    return (mt_entry_t*)(mt->base + header(mt)->entries_off + sizeof(mt_block_t));
+}
+
+static inline size_t block_size(uint32_t size_class) {
+    return (size_t)MT_MIN_BLOCK << size_class;
+}
+
+/**
+ * Record that [off, off + len) was written since the last checkpoint
+ * The first write after a checkpoint also clears the clean flag on disk,
+ * so a crash before the next checkpoint is detected on open
+ */
+static void mark_dirty(mapped_table_t* mt, uint64_t off, size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    if (header(mt)->clean) {
+        header(mt)->clean = 0;
+        msync(mt->base, mt->page_size, MS_SYNC);
+    }
+
+    size_t first = off / mt->page_size;
+    size_t last = (off + len - 1) / mt->page_size;
+    for (size_t page = first; page <= last && page < mt->dirty_pages; page++) {
+        mt->dirty[page] = 1;
+    }
+}
+
+/**
+ * Grow the backing file (and mapping) to at least min_size bytes
+ */
+static bool grow_file(mapped_table_t* mt, size_t min_size) {
+    size_t new_size = mt->map_size * 2;
+    while (new_size < min_size) {
+        new_size *= 2;
+    }
+
+    if (ftruncate(mt->fd, (off_t)new_size) != 0) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    // The bitmap grows first: once mremap moved the mapping there is no
+    // way back, so nothing may fail after it
+    size_t pages = new_size / mt->page_size;
+    uint8_t* dirty = realloc(mt->dirty, pages);
+    if (!dirty) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+    memset(dirty + mt->dirty_pages, 0, pages - mt->dirty_pages);
+    mt->dirty = dirty;
+
+    void* base = mremap(mt->base, mt->map_size, new_size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+
+    mt->base = base;
+    mt->map_size = new_size;
+    mt->dirty_pages = pages;
+
+    header(mt)->file_size = new_size;
+    mark_dirty(mt, 0, sizeof(mt_header_t));
+    return true;
+}
+
+/**
+ * Allocate an arena block with room for payload_len bytes
+ * May grow and remap the file, so callers must re-derive pointers
+ * @return offset of the block, or 0 on failure
+ */
+static uint64_t arena_alloc(mapped_table_t* mt, size_t payload_len) {
+    size_t needed = payload_len + sizeof(mt_block_t);
+    uint32_t size_class = 0;
+    while (block_size(size_class) < needed) {
+        if (++size_class >= MT_SIZE_CLASSES) {
+            kvs_set_error(KVS_ERROR_INVALID_PARAM);
+            return 0;
+        }
+    }
+
+    mt_header_t* hdr = header(mt);
+    uint64_t off = hdr->free_lists[size_class];
+
+    if (off != 0) {
+        // reuse a freed block, its payload holds the next free offset
+        memcpy(&hdr->free_lists[size_class], mt->base + off + sizeof(mt_block_t), sizeof(uint64_t));
+    } else {
+        size_t size = block_size(size_class);
+        if (hdr->heap_top + size > mt->map_size) {
+            if (!grow_file(mt, hdr->heap_top + size)) {
+                return 0;
+            }
+            hdr = header(mt);
+        }
+        off = hdr->heap_top;
+        hdr->heap_top += size;
+    }
+
+    mt_block_t* block = block_at(mt, off);
+    block->size_class = size_class;
+    block->length = 0;
+
+    mark_dirty(mt, 0, sizeof(mt_header_t));
+    mark_dirty(mt, off, sizeof(mt_block_t) + sizeof(uint64_t));
+    return off;
+}
+
+/**
+ * Return a block to its size class free list
+ */
+static void arena_free(mapped_table_t* mt, uint64_t off) {
+    mt_header_t* hdr = header(mt);
+    mt_block_t* block = block_at(mt, off);
+
+    memcpy(mt->base + off + sizeof(mt_block_t), &hdr->free_lists[block->size_class], sizeof(uint64_t));
+    hdr->free_lists[block->size_class] = off;
+
+    mark_dirty(mt, 0, sizeof(mt_header_t));
+    mark_dirty(mt, off, sizeof(mt_block_t) + sizeof(uint64_t));
+}
+
+// Find a slot for a key using linear probing (capacity is a power of 2)
+static size_t find_slot(mapped_table_t* mt, int key, bool for_insertion) {
+    size_t capacity = header(mt)->capacity;
+    size_t mask = capacity - 1;
+    size_t index = ht_hash(key) & mask;
+    size_t first_tombstone = SIZE_MAX;
+    mt_entry_t* slots = entries(mt);
+
+    size_t probes = 0;
+    for (; probes < capacity; probes++) {
+        mt_entry_t* entry = &slots[index];
+
+        if (!entry->occupied) {
+            if (for_insertion && first_tombstone != SIZE_MAX) {
+                index = first_tombstone;
+            }
+            break;
+        }
+
+        if (entry->key == DELETED_KEY) {
+            if (for_insertion && first_tombstone == SIZE_MAX) {
+                first_tombstone = index;
+            }
+        } else if (entry->key == key) {
+            break;
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    // the slow log's longest probe sequence, only while it times an operation
+    if (mt->count_probes && probes > mt->probe_max) {
+        mt->probe_max = probes;
+    }
+    if (probes == capacity) {
+        return for_insertion ? first_tombstone : SIZE_MAX;
+    }
+    return index;
+}
+
+/**
+ * Move every live entry into a new, larger entries array
+ * Values are not copied, only their offsets move
+ */
+static bool resize_table(mapped_table_t* mt, size_t new_capacity) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t new_off = arena_alloc(mt, new_capacity * sizeof(mt_entry_t));
+    if (new_off == 0) {
+        return false;
+    }
+
+    mt_header_t* hdr = header(mt);
+    uint64_t old_off = hdr->entries_off;
+    size_t old_capacity = hdr->capacity;
+    mt_entry_t* old_slots = entries(mt);
+    mt_entry_t* new_slots = (mt_entry_t*)(mt->base + new_off + sizeof(mt_block_t));
+    size_t mask = new_capacity - 1;
+
+    memset(new_slots, 0, new_capacity * sizeof(mt_entry_t));
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].occupied && old_slots[i].key != DELETED_KEY) {
+            size_t index = ht_hash(old_slots[i].key) & mask;
+            while (new_slots[index].occupied) {
+                index = (index + 1) & mask;
+            }
+            new_slots[index] = old_slots[i];
+        }
+    }
+
+    hdr->entries_off = new_off;
+    hdr->capacity = new_capacity;
+    hdr->tombstones = 0;
+    mark_dirty(mt, new_off, sizeof(mt_block_t) + new_capacity * sizeof(mt_entry_t));
+
+    arena_free(mt, old_off);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    mt->resizes++;
+    mt->resize_ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t)end.tv_nsec -
+                     (uint64_t)start.tv_nsec;
+    return true;
+}
+
+/**
+ * Check that a value offset points at a sane block inside the arena
+ */
+static bool valid_value(mapped_table_t* mt, uint64_t off) {
+    mt_header_t* hdr = header(mt);
+    if (off < MT_DATA_START || off + sizeof(mt_block_t) > hdr->heap_top) {
+        return false;
+    }
+    mt_block_t* block = block_at(mt, off);
+    if (block->size_class >= MT_SIZE_CLASSES || block->length == 0 ||
+        off + block_size(block->size_class) > hdr->heap_top ||
+        block->length + sizeof(mt_block_t) > block_size(block->size_class)) {
+        return false;
+    }
+    return mt->base[off + sizeof(mt_block_t) + block->length - 1] == '\0';
+}
+
+static int compare_offsets(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Rebuild the free lists from the heap: every block no slot references
+ * (nor the entries array) is free. The walk stops at the first header
+ * that doesn't look like a block, leaking the rest rather than freeing
+ * something in use; so does a block a value offset points inside of.
+ */
+static void rebuild_free_lists(mapped_table_t* mt, size_t live) {
+    mt_header_t* hdr = header(mt);
+    memset(hdr->free_lists, 0, sizeof(hdr->free_lists));
+
+    uint64_t* used = malloc((live + 1) * sizeof(uint64_t));
+    if (!used) {
+        return;
+    }
+    size_t count = 0;
+    used[count++] = hdr->entries_off;
+    mt_entry_t* slots = entries(mt);
+    for (size_t i = 0; i < hdr->capacity; i++) {
+        if (slots[i].occupied && slots[i].key != DELETED_KEY) {
+            used[count++] = slots[i].value_off;
+        }
+    }
+    qsort(used, count, sizeof(uint64_t), compare_offsets);
+
+    size_t next = 0;
+    uint64_t off = MT_DATA_START;
+    while (off + sizeof(mt_block_t) <= hdr->heap_top) {
+        mt_block_t* block = block_at(mt, off);
+        if (block->size_class >= MT_SIZE_CLASSES || off + block_size(block->size_class) > hdr->heap_top) {
+            break;
+        }
+        uint64_t end = off + block_size(block->size_class);
+        bool in_use = false;
+        while (next < count && used[next] < end) {
+            in_use = in_use || used[next] >= off;
+            next++;
+        }
+        if (!in_use) {
+            arena_free(mt, off);
+        }
+        off = end;
+    }
+    free(used);
+}
+
+/**
+ * Validate a table that was not closed cleanly
+ * Slots whose value blocks look torn become tombstones, counters and
+ * free lists are rebuilt
+ */
+static bool recover_table(mapped_table_t* mt) {
+    mt_header_t* hdr = header(mt);
+
+    if (hdr->heap_top < MT_DATA_START || hdr->heap_top > mt->map_size ||
+        hdr->capacity == 0 || (hdr->capacity & (hdr->capacity - 1)) != 0 ||
+        hdr->entries_off < MT_DATA_START ||
+        hdr->entries_off + sizeof(mt_block_t) + hdr->capacity * sizeof(mt_entry_t) > hdr->heap_top) {
+        return false;
+    }
+
+    size_t size = 0;
+    size_t tombstones = 0;
+    mt_entry_t* slots = entries(mt);
+
+    for (size_t i = 0; i < hdr->capacity; i++) {
+        mt_entry_t* entry = &slots[i];
+        if (!entry->occupied) {
+            continue;
+        }
+        if (entry->key != DELETED_KEY && !valid_value(mt, entry->value_off)) {
+            entry->key = DELETED_KEY;
+            entry->value_off = 0;
+        }
+        if (entry->key == DELETED_KEY) {
+            tombstones++;
+        } else {
+            size++;
+        }
+    }
+
+    hdr->size = size;
+    hdr->tombstones = tombstones;
+    rebuild_free_lists(mt, size);
+    mark_dirty(mt, 0, mt->map_size);
+    return true;
+}
+
+/**
+ * Map an open file descriptor as a table
+ * An empty file is formatted; an existing one is validated
+ */
+static mapped_table_t* map_fd(int fd, size_t initial_capacity) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return NULL;
+    }
+
+    mapped_table_t* mt = calloc(1, sizeof(mapped_table_t));
+    if (!mt) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    mt->fd = fd;
+    mt->page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    bool fresh = st.st_size == 0;
+    size_t map_size = fresh ? MT_INITIAL_FILE_SIZE : (size_t)st.st_size;
+
+    if (!fresh && map_size < MT_DATA_START) {
+        free(mt);
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return NULL;
+    }
+    if (fresh && ftruncate(fd, (off_t)map_size) != 0) {
+        free(mt);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return NULL;
+    }
+
+    void* base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(mt);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    mt->base = base;
+    mt->map_size = map_size;
+    mt->dirty_pages = map_size / mt->page_size;
+    mt->dirty = calloc(mt->dirty_pages, 1);
+    if (!mt->dirty) {
+        munmap(base, map_size);
+        free(mt);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    mt_header_t* hdr = header(mt);
+
+    if (fresh) {
+        // round the capacity up to a power of 2 for mask-based probing
+        size_t capacity = MT_DEFAULT_CAPACITY;
+        while (capacity < initial_capacity) {
+            capacity *= 2;
+        }
+
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->magic = MT_MAGIC_NUMBER;
+        hdr->layout_version = MT_LAYOUT_VERSION;
+        hdr->file_size = map_size;
+        hdr->heap_top = MT_DATA_START;
+
+        uint64_t off = arena_alloc(mt, capacity * sizeof(mt_entry_t));
+        if (off == 0) {
+            munmap(mt->base, mt->map_size);
+            free(mt->dirty);
+            free(mt);
+            return NULL;
+        }
+        hdr = header(mt);
+        memset(mt->base + off + sizeof(mt_block_t), 0, capacity * sizeof(mt_entry_t));
+        hdr->entries_off = off;
+        hdr->capacity = capacity;
+        mark_dirty(mt, 0, mt->map_size);
+    } else {
+        bool ok = hdr->magic == MT_MAGIC_NUMBER &&
+                  hdr->layout_version == MT_LAYOUT_VERSION &&
+                  hdr->file_size <= map_size &&
+                  (hdr->clean || recover_table(mt));
+        if (!ok) {
+            munmap(mt->base, mt->map_size);
+            free(mt->dirty);
+            free(mt);
+            kvs_set_error(KVS_ERROR_CORRUPTION);
+            return NULL;
+        }
+    }
+
+    if (!mt_checkpoint(mt)) {
+        munmap(mt->base, mt->map_size);
+        free(mt->dirty);
+        free(mt);
+        return NULL;
+    }
+
+    kvs_clear_error();
+    return mt;
+}
+
+/**
+ * Open (or create) a mapped table file
+ */
+mapped_table_t* mt_open(const char* path, size_t initial_capacity) {
+    if (!path) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return NULL;
+    }
+
+    mapped_table_t* mt = map_fd(fd, initial_capacity);
+    if (!mt) {
+        close(fd);
+    }
+    return mt;
+}
+
+/**
+ * Create a table in an anonymous memfd region
+ */
+mapped_table_t* mt_create_memfd(const char* name, size_t initial_capacity) {
+    int fd = memfd_create(name ? name : "kvstore", MFD_CLOEXEC);
+    if (fd < 0) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    mapped_table_t* mt = map_fd(fd, initial_capacity);
+    if (!mt) {
+        close(fd);
+    }
+    return mt;
+}
+
+/**
+ * Map a table from a handed-over descriptor
+ * An empty region is rejected rather than formatted
+ */
+mapped_table_t* mt_attach_fd(int fd) {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+    return map_fd(fd, 0);
+}
+
+/**
+ * Get the descriptor backing the table
+ */
+int mt_fd(mapped_table_t* mt) {
+    if (!mt) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    return mt->fd;
+}
+
+/**
+ * Insert or update a key-value pair
+ * Values go to a fresh block and the slot is switched to it, so an
+ * update interrupted by a crash never leaves a torn value
+ */
+bool mt_set(mapped_table_t* mt, int key, const char* value) {
+    return mt_set_len(mt, key, value, value ? strlen(value) : 0);
+}
+
+/**
+ * Grow once ahead of a batch of insertions
+ * A resize drops the tombstones, so only live entries count toward
+ * the new capacity
+ */
+bool mt_reserve(mapped_table_t* mt, size_t count) {
+    if (!mt) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    mt_header_t* hdr = header(mt);
+    double load_factor = (double)(hdr->size + hdr->tombstones + count) / hdr->capacity;
+    if (load_factor < MT_LOAD_FACTOR_THRESHOLD) {
+        return true;
+    }
+
+    size_t new_capacity = hdr->capacity * 2;
+    while ((double)(hdr->size + count) / new_capacity >= MT_LOAD_FACTOR_THRESHOLD) {
+        new_capacity *= 2;
+    }
+    return resize_table(mt, new_capacity);
+}
+
+bool mt_set_len(mapped_table_t* mt, int key, const char* value, size_t value_len) {
+    if (!mt || !value || key == DELETED_KEY) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    mt_header_t* hdr = header(mt);
+    double load_factor = (double)(hdr->size + hdr->tombstones) / hdr->capacity;
+    if (load_factor >= MT_LOAD_FACTOR_THRESHOLD) {
+        if (!resize_table(mt, hdr->capacity * 2)) {
+            return false;
+        }
+    }
+
+    size_t index = find_slot(mt, key, true);
+    if (index == SIZE_MAX) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+
+    // The value always goes to a fresh block and the slot is switched to
+    // it afterwards, so a crash leaves the slot on the old value or the
+    // new one, never on a mix of both
+    size_t len = value_len + 1;
+    uint64_t off = arena_alloc(mt, len);
+    if (off == 0) {
+        return false;
+    }
+
+    // the arena may have been remapped, derive pointers afterwards
+    hdr = header(mt);
+    mt_entry_t* entry = &entries(mt)[index];
+    bool exists = entry->occupied && entry->key == key;
+    uint64_t old_off = exists ? entry->value_off : 0;
+
+    mt_block_t* block = block_at(mt, off);
+    memcpy(mt->base + off + sizeof(mt_block_t), value, value_len);
+    mt->base[off + sizeof(mt_block_t) + value_len] = '\0';
+    block->length = (uint32_t)len;
+    mark_dirty(mt, off, sizeof(mt_block_t) + len);
+
+    if (exists) {
+        entry->value_off = off;
+        mark_dirty(mt, (uint64_t)((uint8_t*)entry - mt->base), sizeof(mt_entry_t));
+        arena_free(mt, old_off);
+    } else {
+        if (entry->occupied && entry->key == DELETED_KEY) {
+            hdr->tombstones--;
+        }
+        entry->value_off = off;
+        entry->key = key;
+        entry->occupied = 1;
+        hdr->size++;
+        mark_dirty(mt, 0, sizeof(mt_header_t));
+        mark_dirty(mt, (uint64_t)((uint8_t*)entry - mt->base), sizeof(mt_entry_t));
+    }
+
+    kvs_clear_error();
+    return true;
+}
+
+/**
+ * Retrieve a value by key
+ */
+const char* mt_get(mapped_table_t* mt, int key) {
+    if (!mt || key == DELETED_KEY) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    size_t index = find_slot(mt, key, false);
+    if (index == SIZE_MAX) {
+        kvs_set_error(KVS_ERROR_KEY_NOT_FOUND);
+        return NULL;
+    }
+
+    mt_entry_t* entry = &entries(mt)[index];
+    if (!entry->occupied || entry->key != key) {
+        kvs_set_error(KVS_ERROR_KEY_NOT_FOUND);
+        return NULL;
+    }
+
+    kvs_clear_error();
+    return (const char*)(mt->base + entry->value_off + sizeof(mt_block_t));
+}
+
+/**
+ * Delete a key-value pair (tombstone deletion, as in hash_table.c)
+ */
+bool mt_delete(mapped_table_t* mt, int key) {
+    if (!mt || key == DELETED_KEY) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    size_t index = find_slot(mt, key, false);
+    if (index == SIZE_MAX) {
+        kvs_set_error(KVS_ERROR_KEY_NOT_FOUND);
+        return false;
+    }
+
+    mt_entry_t* entry = &entries(mt)[index];
+    if (!entry->occupied || entry->key != key) {
+        kvs_set_error(KVS_ERROR_KEY_NOT_FOUND);
+        return false;
+    }
+
+    arena_free(mt, entry->value_off);
+    entry->value_off = 0;
+    entry->key = DELETED_KEY;
+    mark_dirty(mt, (uint64_t)((uint8_t*)entry - mt->base), sizeof(mt_entry_t));
+
+    mt_header_t* hdr = header(mt);
+    hdr->size--;
+    hdr->tombstones++;
+    mark_dirty(mt, 0, sizeof(mt_header_t));
+
+    kvs_clear_error();
+    return true;
+}
+
+/**
+ * Get the number of key-value pairs
+ */
+size_t mt_size(mapped_table_t* mt) {
+    if (!mt) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    return header(mt)->size;
+}
+
+/**
+ * Get the table capacity
+ */
+size_t mt_capacity(mapped_table_t* mt) {
+    if (!mt) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    return header(mt)->capacity;
+}
+
+/**
+ * Walk every slot once: probe distances of live entries, value blocks
+ */
+void mt_stats(mapped_table_t* mt, ht_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    mt_header_t* hdr = header(mt);
+    size_t mask = hdr->capacity - 1;
+    mt_entry_t* slots = entries(mt);
+    stats->tombstones = hdr->tombstones;
+    stats->table_bytes = hdr->capacity * sizeof(mt_entry_t);
+    for (size_t i = 0; i < hdr->capacity; i++) {
+        if (!slots[i].occupied || slots[i].key == DELETED_KEY) {
+            continue;
+        }
+        size_t probes = (i - (ht_hash(slots[i].key) & mask)) & mask;
+        stats->probe_total += probes;
+        if (probes > stats->probe_max) {
+            stats->probe_max = probes;
+        }
+        stats->value_bytes += block_size(block_at(mt, slots[i].value_off)->size_class);
+    }
+}
+
+/**
+ * Flush dirty page ranges, then mark the header clean
+ */
+bool mt_checkpoint(mapped_table_t* mt) {
+    if (!mt) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    bool ok = true;
+    size_t page = 0;
+    while (page < mt->dirty_pages) {
+        if (!mt->dirty[page]) {
+            page++;
+            continue;
+        }
+
+        // coalesce a run of dirty pages into one msync
+        size_t start = page;
+        while (page < mt->dirty_pages && mt->dirty[page]) {
+            mt->dirty[page++] = 0;
+        }
+        if (msync(mt->base + start * mt->page_size, (page - start) * mt->page_size, MS_SYNC) != 0) {
+            ok = false;
+        }
+    }
+
+    if (ok && !header(mt)->clean) {
+        header(mt)->clean = 1;
+        ok = msync(mt->base, mt->page_size, MS_SYNC) == 0;
+    }
+
+    if (!ok) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    kvs_clear_error();
+    return true;
+}
+
+/**
+ * Checkpoint and release the table
+ */
+void mt_close(mapped_table_t* mt) {
+    if (!mt) {
+        return;
+    }
+
+    mt_checkpoint(mt);
+    munmap(mt->base, mt->map_size);
+    close(mt->fd);
+    free(mt->dirty);
+    free(mt);
+}
+
+/**
+ * Release the table without touching the shared header
+ */
+void mt_release(mapped_table_t* mt) {
+    if (!mt) {
+        return;
+    }
+
+    munmap(mt->base, mt->map_size);
+    if (mt->fd >= 0) {
+        close(mt->fd);
+    }
+    free(mt->dirty);
+    free(mt);
+}
+
+/**
+ * Initialize an iterator for the mapped table
+ */
+mt_iterator_t mt_iterator_init(mapped_table_t* mt) {
+    mt_iterator_t iter;
+    iter.table = mt;
+    iter.index = 0;
+    return iter;
+}
+
+/**
+ * Get the next key-value pair from the iterator
+ */
+bool mt_iterator_next(mt_iterator_t* iter, int* key, const char** value) {
+    if (!iter || !iter->table || !key || !value) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    mapped_table_t* mt = iter->table;
+    mt_entry_t* slots = entries(mt);
+    size_t capacity = header(mt)->capacity;
+
+    while (iter->index < capacity) {
+        mt_entry_t* entry = &slots[iter->index++];
+        if (entry->occupied && entry->key != DELETED_KEY) {
+            *key = entry->key;
+            *value = (const char*)(mt->base + entry->value_off + sizeof(mt_block_t));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Visit every entry whose home slot is slot (see ht_visit_home)
+ */
+size_t mt_visit_home(mapped_table_t* mt, size_t slot, ht_visit_fn visit, void* ctx) {
+    mt_entry_t* slots = entries(mt);
+    size_t capacity = header(mt)->capacity;
+    size_t mask = capacity - 1;
+    size_t visited = 0;
+    for (size_t index = slot, probes = 0; probes < capacity; index = (index + 1) & mask, probes++) {
+        mt_entry_t* entry = &slots[index];
+        if (!entry->occupied) {
+            break;
+        }
+        if (entry->key != DELETED_KEY && (ht_hash(entry->key) & mask) == slot) {
+            visit(ctx, entry->key, (const char*)(mt->base + entry->value_off + sizeof(mt_block_t)));
+            visited++;
+        }
+    }
+    return visited;
+}
@@ -0,0 +1,234 @@
+/**
+ * Merkle tree implementation
+ *
+ * Leaves are additive (sum mod 2^64) multiset digests so single entries
+ * can be added and removed without touching the rest of the leaf.
+ * Interior nodes mix their children in order, so moving data between
+ * ranges changes the root.
+ */
+
+#include "merkle.h"
+#include "hash_table.h"
+#include "error.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * splitmix64 finalizer, spreads bits of a 64-bit value
+ */
+static uint64_t mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static inline size_t leaf_count(merkle_t* tree) {
+    return (size_t)1 << tree->depth;
+}
+
+/**
+ * Leaf node index for a key hash (top depth bits of the hash)
+ */
+static inline size_t leaf_for_hash(merkle_t* tree, uint32_t hash) {
+    return leaf_count(tree) + (hash >> (32 - tree->depth));
+}
+
+/**
+ * Hash range covered by a node at a given level
+ */
+static kvs_hash_range_t node_range(unsigned level, size_t index_in_level) {
+    kvs_hash_range_t range;
+    unsigned shift = 32 - level;
+    uint64_t start = (uint64_t)index_in_level << shift;
+    uint64_t end = start + ((uint64_t)1 << shift) - 1;
+    range.start = (uint32_t)start;
+    range.end = (uint32_t)end;
+    return range;
+}
+
+merkle_t* merkle_create(unsigned depth) {
+    if (depth == 0) {
+        depth = MERKLE_DEFAULT_DEPTH;
+    }
+    if (depth > MERKLE_MAX_DEPTH) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    merkle_t* tree = malloc(sizeof(merkle_t));
+    if (!tree) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    size_t leaves = (size_t)1 << depth;
+    tree->depth = depth;
+    tree->nodes = calloc(2 * leaves, sizeof(uint64_t));
+    tree->dirty = calloc(leaves, 1);
+    if (!tree->nodes || !tree->dirty) {
+        merkle_destroy(tree);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    // every interior node starts out needing a first computation
+    memset(tree->dirty, 1, leaves);
+    return tree;
+}
+
+void merkle_destroy(merkle_t* tree) {
+    if (!tree) {
+        return;
+    }
+    free(tree->nodes);
+    free(tree->dirty);
+    free(tree);
+}
+
+void merkle_clear(merkle_t* tree) {
+    if (!tree) {
+        return;
+    }
+    size_t leaves = leaf_count(tree);
+    memset(tree->nodes, 0, 2 * leaves * sizeof(uint64_t));
+    memset(tree->dirty, 1, leaves);
+}
+
+uint64_t merkle_entry_digest(int key, const char* value) {
+    return merkle_entry_digest_len(key, value, value ? strlen(value) : 0);
+}
+
+/**
+ * FNV-1a (64-bit) over the key and value bytes, then finalized
+ */
+uint64_t merkle_entry_digest_len(int key, const char* value, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    const uint8_t* data = (const uint8_t*)&key;
+
+    for (size_t i = 0; i < sizeof(int); i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)value[i];
+        hash *= 1099511628211ull;
+    }
+
+    return mix64(hash);
+}
+
+void merkle_apply(merkle_t* tree, int key, uint64_t old_digest, uint64_t new_digest) {
+    if (!tree || old_digest == new_digest) {
+        return;
+    }
+
+    size_t node = leaf_for_hash(tree, (uint32_t)ht_hash(key));
+    tree->nodes[node] += new_digest - old_digest;
+
+    // mark the path to the root, stopping where it is already dirty
+    for (node >>= 1; node >= 1 && !tree->dirty[node]; node >>= 1) {
+        tree->dirty[node] = 1;
+    }
+}
+
+/**
+ * Recompute a dirty interior node from its children
+ */
+static uint64_t refresh(merkle_t* tree, size_t node) {
+    if (node >= leaf_count(tree) || !tree->dirty[node]) {
+        return tree->nodes[node];
+    }
+
+    uint64_t left = refresh(tree, 2 * node);
+    uint64_t right = refresh(tree, 2 * node + 1);
+    tree->nodes[node] = mix64(left ^ mix64(right + node));
+    tree->dirty[node] = 0;
+    return tree->nodes[node];
+}
+
+uint64_t merkle_root(merkle_t* tree) {
+    if (!tree) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+    return refresh(tree, 1);
+}
+
+size_t merkle_level_digests(merkle_t* tree, unsigned level, uint64_t* out) {
+    if (!tree || !out || level > tree->depth) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+
+    size_t first = (size_t)1 << level;
+    for (size_t i = 0; i < first; i++) {
+        out[i] = refresh(tree, first + i);
+    }
+    return first;
+}
+
+/**
+ * Append a range, merging it with the previous one when adjacent
+ */
+static void add_range(kvs_hash_range_t range, kvs_hash_range_t* ranges, size_t max_ranges, size_t* count) {
+    if (*count > 0 && *count <= max_ranges &&
+        ranges[*count - 1].end != UINT32_MAX && ranges[*count - 1].end + 1 == range.start) {
+        ranges[*count - 1].end = range.end;
+        return;
+    }
+    if (*count < max_ranges) {
+        ranges[*count] = range;
+    }
+    (*count)++;
+}
+
+/**
+ * Descend into both trees wherever the digests differ
+ */
+static void diff_nodes(merkle_t* a, merkle_t* b, size_t node, unsigned level,
+                       kvs_hash_range_t* ranges, size_t max_ranges, size_t* count) {
+    if (refresh(a, node) == refresh(b, node)) {
+        return;
+    }
+
+    if (level == a->depth) {
+        add_range(node_range(level, node - leaf_count(a)), ranges, max_ranges, count);
+        return;
+    }
+
+    diff_nodes(a, b, 2 * node, level + 1, ranges, max_ranges, count);
+    diff_nodes(a, b, 2 * node + 1, level + 1, ranges, max_ranges, count);
+}
+
+size_t merkle_diff(merkle_t* a, merkle_t* b, kvs_hash_range_t* ranges, size_t max_ranges) {
+    if (!a || !b || a->depth != b->depth) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+
+    size_t count = 0;
+    diff_nodes(a, b, 1, 0, ranges, max_ranges, &count);
+    return count;
+}
+
+size_t merkle_diff_level(merkle_t* tree, unsigned level, const uint64_t* remote,
+                         kvs_hash_range_t* ranges, size_t max_ranges) {
+    if (!tree || !remote || level > tree->depth) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return 0;
+    }
+
+    size_t first = (size_t)1 << level;
+    size_t count = 0;
+    for (size_t i = 0; i < first; i++) {
+        if (refresh(tree, first + i) != remote[i]) {
+            add_range(node_range(level, i), ranges, max_ranges, &count);
+        }
+    }
+    return count;
+}
+
+bool kvs_hash_in_range(const kvs_hash_range_t* range, uint32_t hash) {
+    return range && hash >= range->start && hash <= range->end;
+}
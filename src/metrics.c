@@ -0,0 +1,544 @@
+/**
+ * Metrics exporter implementation
+ *
+ * The exporter thread waits in poll() on its listener and a stop eventfd,
+ * with a timeout that brings it back for the next textfile write. Scrapes
+ * are answered one at a time on that thread: read the request headers,
+ * render, send, close.
+ */
+
+#define _GNU_SOURCE
+
+#include "metrics.h"
+#include "error.h"
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define HTTP_REQUEST_MAX 4096
+#define HTTP_TIMEOUT_MS 2000
+
+#define OPENMETRICS_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define PROMETHEUS_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+/**
+ * Upper bounds of the exported latency buckets (the full histogram is far
+ * too fine for a scrape)
+ */
+static const struct {
+    uint64_t ns;
+    const char* le;
+} latency_buckets[] = {
+    { 1000, "0.000001" },      { 2500, "0.0000025" },     { 5000, "0.000005" },
+    { 10000, "0.00001" },      { 25000, "0.000025" },     { 50000, "0.00005" },
+    { 100000, "0.0001" },      { 250000, "0.00025" },     { 500000, "0.0005" },
+    { 1000000, "0.001" },      { 2500000, "0.0025" },     { 5000000, "0.005" },
+    { 10000000, "0.01" },      { 25000000, "0.025" },     { 50000000, "0.05" },
+    { 100000000, "0.1" },      { 250000000, "0.25" },     { 500000000, "0.5" },
+    { 1000000000, "1.0" },
+};
+
+kvs_metrics_sample_t* kvs_metrics_begin(kvs_metrics_shard_t* shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    // the odd sequence number is visible before any of the sample changes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return &shard->sample;
+}
+
+void kvs_metrics_end(kvs_metrics_shard_t* shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+void kvs_metrics_read(const kvs_metrics_shard_t* shard, kvs_metrics_sample_t* out) {
+    while (true) {
+        uint64_t before = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, &shard->sample, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == before) {
+            return;
+        }
+    }
+}
+
+typedef struct {
+    char* buf;
+    size_t size;
+    int len;                // full length so far, may exceed size
+    bool openmetrics;
+} writer_t;
+
+static void emit(writer_t* w, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    size_t used = (size_t)w->len;
+    int n = vsnprintf(used < w->size ? w->buf + used : NULL, used < w->size ? w->size - used : 0, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        w->len += n;
+    }
+}
+
+/**
+ * Metadata of a metric family
+ * OpenMetrics names a counter family without its _total suffix, the
+ * Prometheus format with it
+ */
+static void family(writer_t* w, const char* name, const char* type, const char* unit, const char* help) {
+    if (w->openmetrics) {
+        emit(w, "# TYPE %s %s\n", name, type);
+        if (unit) {
+            emit(w, "# UNIT %s %s\n", name, unit);
+        }
+        emit(w, "# HELP %s %s\n", name, help);
+        return;
+    }
+    const char* suffix = strcmp(type, "counter") == 0 ? "_total" : "";
+    emit(w, "# HELP %s%s %s\n", name, suffix, help);
+    emit(w, "# TYPE %s%s %s\n", name, suffix, type);
+}
+
+static void counter(writer_t* w, const char* name, const char* help, uint64_t value) {
+    family(w, name, "counter", NULL, help);
+    emit(w, "%s_total %llu\n", name, (unsigned long long)value);
+}
+
+static void gauge(writer_t* w, const char* name, const char* help, uint64_t value) {
+    family(w, name, "gauge", NULL, help);
+    emit(w, "%s %llu\n", name, (unsigned long long)value);
+}
+
+int kvs_metrics_format(const kvs_metrics_sample_t* samples, size_t count, bool openmetrics,
+                       char* buf, size_t size) {
+    writer_t w = { buf, size, 0, openmetrics };
+    if (buf && size > 0) {
+        buf[0] = '\0';
+    }
+
+    kvs_stats_t ops;
+    memset(&ops, 0, sizeof(ops));
+    kvs_info_t total;
+    memset(&total, 0, sizeof(total));
+    uint64_t commands = 0;
+    uint64_t connections = 0;
+    uint64_t connected = 0;
+    histogram_t latency;
+    histogram_reset(&latency);
+
+    for (size_t i = 0; i < count; i++) {
+        const kvs_metrics_sample_t* s = &samples[i];
+        ops.gets += s->info.ops.gets;
+        ops.get_hits += s->info.ops.get_hits;
+        ops.sets += s->info.ops.sets;
+        ops.deletes += s->info.ops.deletes;
+        ops.delete_hits += s->info.ops.delete_hits;
+        ops.mgets += s->info.ops.mgets;
+        ops.msets += s->info.ops.msets;
+        ops.mdels += s->info.ops.mdels;
+        ops.scans += s->info.ops.scans;
+        ops.clears += s->info.ops.clears;
+        ops.loads += s->info.ops.loads;
+        ops.saves += s->info.ops.saves;
+        ops.save_failures += s->info.ops.save_failures;
+        ops.changes_since_save += s->info.ops.changes_since_save;
+        if (s->info.ops.last_save_time > ops.last_save_time) {
+            ops.last_save_time = s->info.ops.last_save_time;
+        }
+        total.entries += s->info.entries;
+        total.capacity += s->info.capacity;
+        total.resizes += s->info.resizes;
+        total.resize_us += s->info.resize_us;
+        total.memory_table += s->info.memory_table;
+        total.memory_merkle += s->info.memory_merkle;
+        total.memory_changefeed += s->info.memory_changefeed;
+        total.memory_slowlog += s->info.memory_slowlog;
+        total.mapped_bytes += s->info.mapped_bytes;
+        commands += s->commands;
+        connections += s->connections;
+        connected += s->connected;
+        histogram_merge(&latency, &s->latency);
+    }
+
+    counter(&w, "kvs_commands", "Commands executed.", commands);
+    counter(&w, "kvs_connections", "Client connections accepted.", connections);
+    gauge(&w, "kvs_connected_clients", "Open client connections.", connected);
+
+    family(&w, "kvs_operations", "counter", NULL, "Store operations, keys for get / set / delete.");
+    emit(&w, "kvs_operations_total{op=\"get\"} %llu\n", (unsigned long long)ops.gets);
+    emit(&w, "kvs_operations_total{op=\"set\"} %llu\n", (unsigned long long)ops.sets);
+    emit(&w, "kvs_operations_total{op=\"delete\"} %llu\n", (unsigned long long)ops.deletes);
+    emit(&w, "kvs_operations_total{op=\"mget\"} %llu\n", (unsigned long long)ops.mgets);
+    emit(&w, "kvs_operations_total{op=\"mset\"} %llu\n", (unsigned long long)ops.msets);
+    emit(&w, "kvs_operations_total{op=\"mdel\"} %llu\n", (unsigned long long)ops.mdels);
+    emit(&w, "kvs_operations_total{op=\"scan\"} %llu\n", (unsigned long long)ops.scans);
+    emit(&w, "kvs_operations_total{op=\"clear\"} %llu\n", (unsigned long long)ops.clears);
+    counter(&w, "kvs_get_hits", "Keys looked up that were present.", ops.get_hits);
+    counter(&w, "kvs_delete_hits", "Keys deleted that were present.", ops.delete_hits);
+
+    family(&w, "kvs_keys", "gauge", NULL, "Keys stored, per shard.");
+    for (size_t i = 0; i < count; i++) {
+        emit(&w, "kvs_keys{shard=\"%zu\"} %zu\n", i, samples[i].info.entries);
+    }
+    family(&w, "kvs_capacity", "gauge", NULL, "Table slots, per shard.");
+    for (size_t i = 0; i < count; i++) {
+        emit(&w, "kvs_capacity{shard=\"%zu\"} %zu\n", i, samples[i].info.capacity);
+    }
+    counter(&w, "kvs_resizes", "Table resizes.", total.resizes);
+    family(&w, "kvs_resize_seconds", "counter", "seconds", "Time spent resizing tables.");
+    emit(&w, "kvs_resize_seconds_total %.6f\n", (double)total.resize_us / 1e6);
+
+    family(&w, "kvs_memory_bytes", "gauge", "bytes", "Memory by area, values not included.");
+    emit(&w, "kvs_memory_bytes{area=\"table\"} %zu\n", total.memory_table);
+    emit(&w, "kvs_memory_bytes{area=\"merkle\"} %zu\n", total.memory_merkle);
+    emit(&w, "kvs_memory_bytes{area=\"changefeed\"} %zu\n", total.memory_changefeed);
+    emit(&w, "kvs_memory_bytes{area=\"slowlog\"} %zu\n", total.memory_slowlog);
+    family(&w, "kvs_mapped_bytes", "gauge", "bytes", "Size of the table file mappings.");
+    emit(&w, "kvs_mapped_bytes %zu\n", total.mapped_bytes);
+
+    gauge(&w, "kvs_changes_since_save", "Keys changed since the last save or load.", ops.changes_since_save);
+    counter(&w, "kvs_saves", "Saves and checkpoints that succeeded.", ops.saves);
+    counter(&w, "kvs_save_failures", "Saves and checkpoints that failed.", ops.save_failures);
+    counter(&w, "kvs_loads", "Snapshots loaded.", ops.loads);
+    family(&w, "kvs_last_save_timestamp_seconds", "gauge", "seconds", "Time of the last save, 0 if none.");
+    emit(&w, "kvs_last_save_timestamp_seconds %llu\n", (unsigned long long)ops.last_save_time);
+
+    family(&w, "kvs_request_latency_seconds", "histogram", "seconds",
+           "Request latency from parse to reply, across shards.");
+    for (size_t i = 0; i < sizeof(latency_buckets) / sizeof(latency_buckets[0]); i++) {
+        emit(&w, "kvs_request_latency_seconds_bucket{le=\"%s\"} %llu\n", latency_buckets[i].le,
+             (unsigned long long)histogram_count_upto(&latency, latency_buckets[i].ns));
+    }
+    emit(&w, "kvs_request_latency_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)latency.total);
+    emit(&w, "kvs_request_latency_seconds_count %llu\n", (unsigned long long)latency.total);
+    emit(&w, "kvs_request_latency_seconds_sum %.9f\n", (double)latency.sum / 1e9);
+
+    if (openmetrics) {
+        emit(&w, "# EOF\n");
+    }
+    return w.len;
+}
+
+char* kvs_metrics_render(const kvs_metrics_shard_t* shards, size_t count, bool openmetrics) {
+    kvs_metrics_sample_t* samples = malloc(count * sizeof(kvs_metrics_sample_t));
+    if (!samples) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        kvs_metrics_read(&shards[i], &samples[i]);
+    }
+
+    int len = kvs_metrics_format(samples, count, openmetrics, NULL, 0);
+    char* text = malloc((size_t)len + 1);
+    if (text) {
+        kvs_metrics_format(samples, count, openmetrics, text, (size_t)len + 1);
+        kvs_clear_error();
+    } else {
+        kvs_set_error(KVS_ERROR_MEMORY);
+    }
+    free(samples);
+    return text;
+}
+
+bool kvs_metrics_write_textfile(const kvs_metrics_shard_t* shards, size_t count, const char* path) {
+    if (!shards || !path) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    char* text = kvs_metrics_render(shards, count, false);
+    char* temp = malloc(strlen(path) + 5);
+    if (!text || !temp) {
+        free(text);
+        free(temp);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+    sprintf(temp, "%s.tmp", path);
+
+    FILE* file = fopen(temp, "w");
+    bool ok = file != NULL;
+    if (file) {
+        ok = fputs(text, file) >= 0;
+        ok = fclose(file) == 0 && ok;
+    }
+    ok = ok && rename(temp, path) == 0;
+    if (!ok) {
+        unlink(temp);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+    } else {
+        kvs_clear_error();
+    }
+    free(text);
+    free(temp);
+    return ok;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Open a non-blocking TCP listener for the HTTP endpoint
+ * @return the socket, or -1 on failure
+ */
+static int listen_http(const char* address, int port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo* result;
+    if (getaddrinfo(address, service, &hints, &result) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+    return fd;
+}
+
+/**
+ * Wait for fd to be ready for events, until the deadline
+ */
+static bool wait_ready(int fd, short events, long long deadline) {
+    while (true) {
+        long long left = deadline - now_ms();
+        if (left <= 0) {
+            return false;
+        }
+        struct pollfd pfd = { fd, events, 0 };
+        int n = poll(&pfd, 1, (int)left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n > 0;
+    }
+}
+
+static bool send_all(int fd, const char* data, size_t len, long long deadline) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!wait_ready(fd, POLLOUT, deadline)) {
+                return false;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/**
+ * Answer one HTTP request and close the connection
+ * GET /metrics gets OpenMetrics if the Accept header asks for it, else
+ * the Prometheus text format. The whole exchange has HTTP_TIMEOUT_MS:
+ * a client still sending its request then is dropped unanswered, so one
+ * that trickles bytes can't hold the exporter thread
+ */
+static void serve_client(kvs_metrics_exporter_t* exporter, int fd) {
+    long long deadline = now_ms() + HTTP_TIMEOUT_MS;
+
+    char request[HTTP_REQUEST_MAX];
+    size_t len = 0;
+    request[0] = '\0';
+    while (len < sizeof(request) - 1 && !strstr(request, "\r\n\r\n")) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!wait_ready(fd, POLLIN, deadline)) {
+                close(fd);
+                return;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+        request[len] = '\0';
+    }
+
+    const char* status = "200 OK";
+    const char* type = "text/plain; charset=utf-8";
+    char* body = NULL;
+    if (strncmp(request, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    } else if (strncmp(request + 4, "/metrics", 8) != 0 ||
+               (request[12] != ' ' && request[12] != '?')) {
+        status = "404 Not Found";
+    } else {
+        bool openmetrics = strstr(request, "application/openmetrics-text") != NULL;
+        body = kvs_metrics_render(exporter->shards, exporter->count, openmetrics);
+        if (body) {
+            type = openmetrics ? OPENMETRICS_TYPE : PROMETHEUS_TYPE;
+        } else {
+            status = "500 Internal Server Error";
+        }
+    }
+
+    const char* text = body ? body : status;
+    size_t text_len = strlen(text);
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n",
+                              status, type, text_len);
+    if (send_all(fd, header, (size_t)header_len, deadline)) {
+        send_all(fd, text, text_len, deadline);
+    }
+    free(body);
+    close(fd);
+}
+
+static void* exporter_main(void* arg) {
+    kvs_metrics_exporter_t* exporter = arg;
+    long long next_write = now_ms();
+
+    while (true) {
+        int timeout = -1;
+        if (exporter->textfile) {
+            long long now = now_ms();
+            if (now >= next_write) {
+                kvs_metrics_write_textfile(exporter->shards, exporter->count, exporter->textfile);
+                next_write = now + exporter->interval_ms;
+            }
+            timeout = (int)(next_write - now);
+        }
+
+        struct pollfd fds[2] = { { exporter->wake_fd, POLLIN, 0 }, { exporter->listen_fd, POLLIN, 0 } };
+        int n = poll(fds, exporter->listen_fd >= 0 ? 2 : 1, timeout);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        if (n <= 0) {
+            continue;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd = accept4(exporter->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                serve_client(exporter, fd);
+            }
+        }
+    }
+
+    if (exporter->textfile) {
+        kvs_metrics_write_textfile(exporter->shards, exporter->count, exporter->textfile);
+    }
+    return NULL;
+}
+
+static void free_exporter(kvs_metrics_exporter_t* exporter) {
+    if (exporter->listen_fd >= 0) close(exporter->listen_fd);
+    if (exporter->wake_fd >= 0) close(exporter->wake_fd);
+    free(exporter->textfile);
+    free(exporter);
+}
+
+kvs_metrics_exporter_t* kvs_metrics_exporter_start(const kvs_metrics_shard_t* shards, size_t count,
+                                                   const kvs_metrics_config_t* config) {
+    if (!shards || count == 0 || !config || (config->port <= 0 && !config->textfile)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    kvs_metrics_exporter_t* exporter = calloc(1, sizeof(kvs_metrics_exporter_t));
+    if (!exporter) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    exporter->shards = shards;
+    exporter->count = count;
+    exporter->listen_fd = -1;
+    exporter->interval_ms = config->interval_ms > 0 ? config->interval_ms : KVS_METRICS_DEFAULT_INTERVAL_MS;
+    exporter->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (exporter->wake_fd < 0) {
+        free_exporter(exporter);
+        kvs_set_error(KVS_ERROR_UNKNOWN);
+        return NULL;
+    }
+
+    if (config->textfile) {
+        exporter->textfile = malloc(strlen(config->textfile) + 1);
+        if (!exporter->textfile) {
+            free_exporter(exporter);
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return NULL;
+        }
+        strcpy(exporter->textfile, config->textfile);
+    }
+
+    if (config->port > 0) {
+        const char* address = config->bind_address ? config->bind_address : "127.0.0.1";
+        exporter->listen_fd = listen_http(address, config->port);
+        if (exporter->listen_fd < 0) {
+            free_exporter(exporter);
+            kvs_set_error(KVS_ERROR_FILE_IO);
+            return NULL;
+        }
+    }
+
+    if (pthread_create(&exporter->thread, NULL, exporter_main, exporter) != 0) {
+        free_exporter(exporter);
+        kvs_set_error(KVS_ERROR_UNKNOWN);
+        return NULL;
+    }
+    kvs_clear_error();
+    return exporter;
+}
+
+void kvs_metrics_exporter_stop(kvs_metrics_exporter_t* exporter) {
+    if (!exporter) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t written = write(exporter->wake_fd, &one, sizeof(one));
+    (void)written;
+    pthread_join(exporter->thread, NULL);
+    free_exporter(exporter);
+}
@@ -6,88 +6,541 @@
  * followed by key-value pairs
  */
 
+ #define _POSIX_C_SOURCE 200809L
+
  #include "persistence.h"
  #include "error.h"
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
  #include <errno.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/stat.h>
+
+ // Write function used while saving (fwrite unless a test replaced it)
+ static kvs_write_fn write_fn = fwrite;
 
  /**
-  * Save the hash table contents to a file
-  * File format consists of:
-  * 1. File header (magic number, version, entry count)
-  * 2. Series of entries (key length, key, value length, value)
+  * Replace the write function used while saving
   */
-bool kvs_save_to_file (hash_table_t* table, const char* filename) {
-    // validate params
-    if (!table || !filename) {
-        kvs_set_error(KVS_ERROR_INVALID_PARAM);
-        return false;
+void kvs_set_write_fn(kvs_write_fn fn) {
+    write_fn = fn ? fn : fwrite;
+}
+
+/**
+ * fsync the directory containing filename so the rename is durable
+ */
+static void sync_parent_dir(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    char dir[4096];
+
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == filename) {
+        strcpy(dir, "/");
+    } else {
+        size_t len = (size_t)(slash - filename);
+        if (len >= sizeof(dir)) {
+            return;
+        }
+        memcpy(dir, filename, len);
+        dir[len] = '\0';
     }
 
-    // open file for binary writing
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        kvs_set_error(KVS_ERROR_FILE_IO);
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Entry gathered for writing, ordered by key hash
+ */
+typedef struct {
+    uint32_t hash;
+    int key;
+    const char* value;
+} snapshot_record_t;
+
+// buckets used to order records by the top bits of their hash
+#define SORT_BUCKET_BITS 16
+
+// bytes a descriptor writer gathers before each write(2)
+#define SNAPSHOT_WRITE_BUFFER (64 * 1024)
+
+/**
+ * Where snapshot bytes go: a FILE through write_fn, or a descriptor
+ * through a buffer allocated beforehand (no stdio, no malloc)
+ */
+typedef struct {
+    FILE* file;
+    int fd;
+    char* buf;
+    size_t used;
+} snapshot_sink_t;
+
+/**
+ * Memory for writing a snapshot of up to capacity records, taken before
+ * the write so the write itself only needs write(2)
+ */
+struct kvs_snapshot_writer {
+    size_t capacity;
+    snapshot_record_t* unsorted;
+    snapshot_record_t* sorted;
+    uint32_t* offsets;
+    char* buf;
+};
+
+/**
+ * Write out what a descriptor sink has gathered
+ */
+static bool sink_flush(snapshot_sink_t* sink) {
+    size_t done = 0;
+    while (done < sink->used) {
+        ssize_t n = write(sink->fd, sink->buf + done, sink->used - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += (size_t)n;
+    }
+    sink->used = 0;
+    return true;
+}
+
+/**
+ * fwrite-style write of count items of size bytes to a sink
+ */
+static bool sink_write(snapshot_sink_t* sink, const void* ptr, size_t size, size_t count) {
+    if (sink->file) {
+        return write_fn(ptr, size, count, sink->file) == count;
+    }
+    const char* bytes = ptr;
+    size_t left = size * count;
+    while (left > 0) {
+        if (sink->used == SNAPSHOT_WRITE_BUFFER && !sink_flush(sink)) {
+            return false;
+        }
+        size_t chunk = SNAPSHOT_WRITE_BUFFER - sink->used;
+        if (chunk > left) {
+            chunk = left;
+        }
+        memcpy(sink->buf + sink->used, bytes, chunk);
+        sink->used += chunk;
+        bytes += chunk;
+        left -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Gather up to count entries into unsorted and order them by hash into
+ * sorted (counting sort on the top bits, offsets must start zeroed), so
+ * every block covers a narrow slice of the hash space
+ * @return number of entries gathered
+ */
+static size_t sort_records(snapshot_record_t* unsorted, snapshot_record_t* sorted, uint32_t* offsets,
+                           size_t count, kvs_entry_next_fn next, void* iter) {
+    size_t n = 0;
+    int key;
+    const char* value;
+    while (n < count && next(iter, &key, &value)) {
+        unsorted[n].hash = (uint32_t)ht_hash(key);
+        unsorted[n].key = key;
+        unsorted[n].value = value;
+        offsets[unsorted[n].hash >> (32 - SORT_BUCKET_BITS)]++;
+        n++;
+    }
+
+    // turn bucket counts into starting offsets
+    uint32_t total = 0;
+    for (size_t b = 0; b < ((size_t)1 << SORT_BUCKET_BITS); b++) {
+        uint32_t bucket = offsets[b];
+        offsets[b] = total;
+        total += bucket;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        sorted[offsets[unsorted[i].hash >> (32 - SORT_BUCKET_BITS)]++] = unsorted[i];
+    }
+    return n;
+}
+
+/**
+ * Gather all entries ordered by hash (see sort_records)
+ * @return sorted array (caller frees) or NULL on allocation failure
+ */
+static snapshot_record_t* collect_sorted(size_t count, kvs_entry_next_fn next, void* iter, size_t* out_count) {
+    snapshot_record_t* unsorted = malloc((count ? count : 1) * sizeof(snapshot_record_t));
+    snapshot_record_t* sorted = malloc((count ? count : 1) * sizeof(snapshot_record_t));
+    uint32_t* offsets = calloc((size_t)1 << SORT_BUCKET_BITS, sizeof(uint32_t));
+    if (!unsorted || !sorted || !offsets) {
+        free(unsorted);
+        free(sorted);
+        free(offsets);
+        return NULL;
+    }
+
+    size_t n = sort_records(unsorted, sorted, offsets, count, next, iter);
+    free(unsorted);
+    free(offsets);
+    *out_count = n;
+    return sorted;
+}
+
+/**
+ * Write one block: header with bounds, then its records
+ */
+static bool write_block(const snapshot_record_t* records, size_t count, snapshot_sink_t* sink) {
+    kvs_block_header_t block;
+    block.record_count = (uint32_t)count;
+    block.byte_length = 0;
+    block.min_key = records[0].key;
+    block.max_key = records[0].key;
+    block.min_hash = records[0].hash;
+    block.max_hash = records[0].hash;
+
+    for (size_t i = 0; i < count; i++) {
+        block.byte_length += (uint32_t)(sizeof(int) + sizeof(uint32_t) + strlen(records[i].value));
+        if (records[i].key < block.min_key) block.min_key = records[i].key;
+        if (records[i].key > block.max_key) block.max_key = records[i].key;
+        if (records[i].hash < block.min_hash) block.min_hash = records[i].hash;
+        if (records[i].hash > block.max_hash) block.max_hash = records[i].hash;
+    }
+
+    if (!sink_write(sink, &block, sizeof(block), 1)) {
         return false;
     }
 
+    for (size_t i = 0; i < count; i++) {
+        // Write key
+        if (!sink_write(sink, &records[i].key, sizeof(int), 1)) {
+            return false;
+        }
+
+        // write value length
+        uint32_t value_len = (uint32_t)strlen(records[i].value);
+        if (!sink_write(sink, &value_len, sizeof(value_len), 1)) {
+            return false;
+        }
+
+        // Write value string
+        if (!sink_write(sink, records[i].value, 1, value_len)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Write the header and n records sorted by hash to a sink
+ * File format (version 2) consists of:
+ * 1. File header (magic number, version, entry count, records per block)
+ * 2. Blocks of records ordered by key hash, each starting with a block
+ *    header (record count, byte length, key and hash bounds)
+ * 3. Records inside a block: key, value length, value
+ */
+static bool write_records(const snapshot_record_t* records, size_t n, snapshot_sink_t* sink) {
     // Prepare and write file header
     kvs_file_header_t header;
     header.magic = KVS_MAGIC_NUMBER;
     header.version = KVS_FILE_VERSION;
-    header.entry_count = (uint32_t)ht_size(table);
-    header.reserved = 0;
+    header.entry_count = (uint32_t)n;
+    header.reserved = KVS_BLOCK_RECORDS;
 
-    if (fwrite(&header, sizeof(header), 1, file) != 1) {
-        fclose(file);
+    bool ok = sink_write(sink, &header, sizeof(header), 1);
+
+    for (size_t i = 0; ok && i < n; i += KVS_BLOCK_RECORDS) {
+        size_t block_count = n - i < KVS_BLOCK_RECORDS ? n - i : KVS_BLOCK_RECORDS;
+        ok = write_block(records + i, block_count, sink);
+    }
+    return ok;
+}
+
+/**
+ * Write all entries to an open file
+ */
+static bool write_entries(size_t count, kvs_entry_next_fn next, void* iter, FILE* file) {
+    size_t n = 0;
+    snapshot_record_t* records = collect_sorted(count, next, iter, &n);
+    if (!records) {
+        return false;
+    }
+
+    snapshot_sink_t sink = { file, -1, NULL, 0 };
+    bool ok = write_records(records, n, &sink);
+    free(records);
+    return ok;
+}
+
+/**
+ * Allocate a snapshot writer for up to capacity entries
+ */
+kvs_snapshot_writer_t* kvs_snapshot_writer_create(size_t capacity) {
+    kvs_snapshot_writer_t* writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    writer->capacity = capacity;
+    writer->unsorted = malloc((capacity ? capacity : 1) * sizeof(snapshot_record_t));
+    writer->sorted = malloc((capacity ? capacity : 1) * sizeof(snapshot_record_t));
+    writer->offsets = malloc(((size_t)1 << SORT_BUCKET_BITS) * sizeof(uint32_t));
+    writer->buf = malloc(SNAPSHOT_WRITE_BUFFER);
+    if (!writer->unsorted || !writer->sorted || !writer->offsets || !writer->buf) {
+        kvs_snapshot_writer_destroy(writer);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    return writer;
+}
+
+/**
+ * Write up to the writer's capacity of entries to fd
+ * Only memset, memcpy, strlen and write(2): nothing that allocates or
+ * locks, and no error state is set
+ */
+bool kvs_snapshot_writer_save(kvs_snapshot_writer_t* writer, int fd, kvs_entry_next_fn next, void* iter) {
+    memset(writer->offsets, 0, ((size_t)1 << SORT_BUCKET_BITS) * sizeof(uint32_t));
+    size_t n = sort_records(writer->unsorted, writer->sorted, writer->offsets, writer->capacity, next, iter);
+
+    snapshot_sink_t sink = { NULL, fd, writer->buf, 0 };
+    return write_records(writer->sorted, n, &sink) && sink_flush(&sink);
+}
+
+void kvs_snapshot_writer_destroy(kvs_snapshot_writer_t* writer) {
+    if (!writer) {
+        return;
+    }
+    free(writer->unsorted);
+    free(writer->sorted);
+    free(writer->offsets);
+    free(writer->buf);
+    free(writer);
+}
+
+ /**
+  * Save entries produced by an iterator to a file
+  * Writes a temporary file first and renames it into place once it
+  * is fully on disk, so readers only ever see a complete snapshot
+  */
+bool kvs_save_entries(const char* filename, size_t count, kvs_entry_next_fn next, void* iter) {
+    if (!filename || !next) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    char* tmp_name = malloc(strlen(filename) + sizeof(".tmp"));
+    if (!tmp_name) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+    strcpy(tmp_name, filename);
+    strcat(tmp_name, ".tmp");
+
+    // open temp file for binary writing
+    FILE* file = fopen(tmp_name, "wb");
+    if (!file) {
+        free(tmp_name);
         kvs_set_error(KVS_ERROR_FILE_IO);
         return false;
     }
 
-    // Write each key-value pair
-    ht_iterator_t iter = ht_iterator_init(table);
+    bool ok = write_entries(count, next, iter, file);
+
+    // make sure the data reached the disk before it becomes visible
+    if (ok && (fflush(file) != 0 || fsync(fileno(file)) != 0)) {
+        ok = false;
+    }
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (ok && rename(tmp_name, filename) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        unlink(tmp_name);
+        free(tmp_name);
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    sync_parent_dir(filename);
+    free(tmp_name);
+    kvs_clear_error();
+    return true;
+}
+
+
+/**
+ * Check whether a key passes the filter (NULL filter passes everything)
+ */
+static bool key_matches(const kvs_load_filter_t* filter, int key) {
+    if (!filter) {
+        return true;
+    }
+
+    switch (filter->kind) {
+        case KVS_FILTER_HASH_RANGE:
+            return kvs_hash_in_range(&filter->hash_range, (uint32_t)ht_hash(key));
+        case KVS_FILTER_KEY_RANGE:
+            return key >= filter->key_min && key <= filter->key_max;
+        case KVS_FILTER_PREDICATE:
+            return filter->predicate(filter->ctx, key);
+        case KVS_FILTER_ALL:
+        default:
+            return true;
+    }
+}
+
+/**
+ * Check whether any record of a block can pass the filter
+ */
+static bool block_may_match(const kvs_load_filter_t* filter, const kvs_block_header_t* block) {
+    if (!filter) {
+        return true;
+    }
+
+    switch (filter->kind) {
+        case KVS_FILTER_HASH_RANGE:
+            return block->max_hash >= filter->hash_range.start &&
+                   block->min_hash <= filter->hash_range.end;
+        case KVS_FILTER_KEY_RANGE:
+            return block->max_key >= filter->key_min && block->min_key <= filter->key_max;
+        default:
+            return true;
+    }
+}
+
+/**
+ * Skip bytes of the input
+ * Small skips are read through the stdio buffer, large ones seek
+ */
+static bool skip_bytes(FILE* file, size_t count) {
+    char scratch[4096];
+
+    if (count > sizeof(scratch)) {
+        return fseek(file, (long)count, SEEK_CUR) == 0;
+    }
+    return fread(scratch, 1, count, file) == count;
+}
+
+/**
+ * Reusable buffer for value bytes, grown on demand
+ */
+typedef struct {
+    char* data;
+    size_t capacity;
+} value_buffer_t;
+
+/**
+ * Read one record; insert it if the key passes the filter, skip it otherwise
+ */
+static bool load_record(FILE* file, const kvs_load_filter_t* filter, value_buffer_t* buf,
+                        kvs_insert_fn set, void* table) {
     int key;
-    const char* value;
+    if (fread(&key, sizeof(key), 1, file) != 1) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
 
-    while (ht_iterator_next(&iter, &key, &value)) {
-        // Write key
-        if (fwrite(&key, sizeof(key), 1, file) != 1) {
-            fclose(file);
+    // read value length
+    uint32_t value_len;
+    if (fread(&value_len, sizeof(value_len), 1, file) != 1) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    //validate value length 
+    if (value_len > KVS_MAX_VALUE_LENGTH) {
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return false;
+    }
+
+    // records outside our share are never allocated
+    if (!key_matches(filter, key)) {
+        if (!skip_bytes(file, value_len)) {
             kvs_set_error(KVS_ERROR_FILE_IO);
             return false;
         }
+        return true;
+    }
 
-        // write value length
-        uint32_t value_len = (uint32_t)strlen(value);
-        if (fwrite(&value_len, sizeof(value_len), 1, file) != 1) {
-            fclose(file);
-            kvs_set_error(KVS_ERROR_FILE_IO);
+    if (value_len + 1 > buf->capacity) {
+        char* data = realloc(buf->data, value_len + 1);
+        if (!data) {
+            kvs_set_error(KVS_ERROR_MEMORY);
             return false;
         }
+        buf->data = data;
+        buf->capacity = value_len + 1;
+    }
 
-        // Write value string
-        if (fwrite(value, 1, value_len, file) != value_len) {
-            fclose(file);
+    // Read value string
+    if (fread(buf->data, 1, value_len, file) != value_len) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    // null-terminate the string
+    buf->data[value_len] = '\0';
+
+    // insert into the table
+    return set(table, key, buf->data);
+}
+
+/**
+ * Read a version 2 file: skip whole blocks whose bounds miss the filter
+ */
+static bool load_blocks(FILE* file, const kvs_file_header_t* header, const kvs_load_filter_t* filter,
+                        value_buffer_t* buf, kvs_insert_fn set, void* table) {
+    uint32_t records = 0;
+
+    while (records < header->entry_count) {
+        kvs_block_header_t block;
+        if (fread(&block, sizeof(block), 1, file) != 1) {
             kvs_set_error(KVS_ERROR_FILE_IO);
             return false;
         }
+
+        if (block.record_count == 0 || block.record_count > header->entry_count - records) {
+            kvs_set_error(KVS_ERROR_CORRUPTION);
+            return false;
+        }
+        records += block.record_count;
+
+        if (!block_may_match(filter, &block)) {
+            if (fseek(file, (long)block.byte_length, SEEK_CUR) != 0) {
+                kvs_set_error(KVS_ERROR_FILE_IO);
+                return false;
+            }
+            continue;
+        }
+
+        for (uint32_t i = 0; i < block.record_count; i++) {
+            if (!load_record(file, filter, buf, set, table)) {
+                return false;
+            }
+        }
     }
 
-    fclose(file);
-    kvs_clear_error();
     return true;
 }
 
-
 /**
- * Load hash table from a file
- * reads the file format and populates the hash table
+ * Load the entries of a file that pass a filter through an insert callback
+ * Supports version 1 (flat records) and version 2 (blocks) files
  */
-bool kvs_load_from_file(hash_table_t* table, const char* filename) {
-    // validate params
-    if (!table || !filename) {
+bool kvs_load_filtered(const char* filename, const kvs_load_filter_t* filter,
+                       kvs_insert_fn insert, void* table) {
+    if (!filename || !insert ||
+        (filter && filter->kind == KVS_FILTER_PREDICATE && !filter->predicate)) {
         kvs_set_error(KVS_ERROR_INVALID_PARAM);
         return false;
     }
@@ -115,69 +568,100 @@ bool kvs_load_from_file(hash_table_t* table, const char* filename) {
     }
 
     // check version compatibility
-    if (header.version != KVS_FILE_VERSION) {
+    if (header.version != KVS_FILE_VERSION && header.version != KVS_FILE_VERSION_FLAT) {
         fclose(file);
         kvs_set_error(KVS_ERROR_CORRUPTION);
         return false;
     }
 
-    // Read each key-value pair
-    for (uint32_t i = 0; i < header.entry_count; i++) {
-        int key;
-        if (fread(&key, sizeof(key), 1, file) != 1) {
-            fclose(file);
-            kvs_set_error(KVS_ERROR_FILE_IO);
-            return false;
-        }
+    value_buffer_t buf = { NULL, 0 };
+    bool ok = true;
 
-        // read value length
-        uint32_t value_len;
-        if (fread(&value_len, sizeof(value_len), 1, file) != 1) {
-            fclose(file);
-            kvs_set_error(KVS_ERROR_FILE_IO);
-            return false;
+    if (header.version == KVS_FILE_VERSION) {
+        ok = load_blocks(file, &header, filter, &buf, insert, table);
+    } else {
+        // Read each key-value pair
+        for (uint32_t i = 0; ok && i < header.entry_count; i++) {
+            ok = load_record(file, filter, &buf, insert, table);
         }
+    }
 
-        //validate value length 
-        if (value_len > 100000) {
-            fclose(file);
-            kvs_set_error(KVS_ERROR_CORRUPTION);
-            return false;
-        }
+    free(buf.data);
+    fclose(file);
+    if (ok) {
+        kvs_clear_error();
+    }
+    return ok;
+}
 
-        char* value = malloc(value_len + 1);
-        if (!value) {
-            fclose(file);
-            kvs_set_error(KVS_ERROR_MEMORY);
-            return false;
-        }
 
-        // Read value string
-        if (fread(value, 1, value_len, file) != value_len) {
-            free(value);
-            fclose(file);
-            kvs_set_error(KVS_ERROR_FILE_IO);
-            return false;
-        }
+static bool ht_next(void* iter, int* key, const char** value) {
+    return ht_iterator_next(iter, key, value);
+}
 
-        // null-terminate the string
-        value[value_len] = '\0';
+static bool ht_insert(void* table, int key, const char* value) {
+    return ht_set(table, key, value);
+}
 
-        // insert into hash table
-        if (!ht_set(table, key, value)) {
-            free(value);
-            fclose(file);
-            return false;
-        }
+static bool mt_next(void* iter, int* key, const char** value) {
+    return mt_iterator_next(iter, key, value);
+}
+
+static bool mt_insert(void* table, int key, const char* value) {
+    return mt_set(table, key, value);
+}
 
-        free(value);
+/**
+ * Save the hash table contents to a file
+ */
+bool kvs_save_to_file(hash_table_t* table, const char* filename) {
+    // validate params
+    if (!table || !filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
     }
 
-    fclose(file);
-    kvs_clear_error();
-    return true;
+    ht_iterator_t iter = ht_iterator_init(table);
+    return kvs_save_entries(filename, ht_size(table), ht_next, &iter);
 }
 
+/**
+ * Load hash table from a file
+ */
+bool kvs_load_from_file(hash_table_t* table, const char* filename) {
+    // validate params
+    if (!table || !filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    return kvs_load_filtered(filename, NULL, ht_insert, table);
+}
+
+/**
+ * Save the mapped table contents to a snapshot file
+ */
+bool kvs_save_mapped_to_file(mapped_table_t* table, const char* filename) {
+    if (!table || !filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    mt_iterator_t iter = mt_iterator_init(table);
+    return kvs_save_entries(filename, mt_size(table), mt_next, &iter);
+}
+
+/**
+ * Load a snapshot file into a mapped table
+ */
+bool kvs_load_mapped_from_file(mapped_table_t* table, const char* filename) {
+    if (!table || !filename) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    return kvs_load_filtered(filename, NULL, mt_insert, table);
+}
 
 /**
  * check if a file exists and is readable
@@ -194,4 +678,12 @@ bool kvs_file_exists(const char* filename) {
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+long long kvs_file_size(const char* filename) {
+    struct stat st;
+    if (!filename || stat(filename, &st) != 0) {
+        return -1;
+    }
+    return (long long)st.st_size;
+}
@@ -0,0 +1,243 @@
+/**
+ * Read-through cache implementation
+ */
+
+#define _GNU_SOURCE
+
+#include "readthrough.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct load_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // signalled when a load is queued or on stop
+    kvs_load_t* head;           // queued loads, oldest first
+    kvs_load_t* tail;
+    kvs_load_t** done;          // per queue, finished loads
+    int* wake_fds;
+    pthread_t* threads;
+    unsigned thread_count;      // threads started
+    bool stopping;
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t key_slot(int key) {
+    // Fibonacci hashing, the top bits pick the slot
+    uint32_t hash = (uint32_t)key * 0x9e3779b1u;
+    return hash >> (32 - READTHROUGH_MISS_BITS);
+}
+
+static readthrough_miss_t* miss_slot(readthrough_t* rt, int key) {
+    return &rt->misses[key_slot(key)];
+}
+
+readthrough_t* readthrough_create(kvs_loader_fn loader, void* ctx, unsigned negative_ttl_ms) {
+    if (!loader) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    readthrough_t* rt = calloc(1, sizeof(readthrough_t));
+    if (!rt) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    rt->loader = loader;
+    rt->ctx = ctx;
+    rt->negative_ttl_ms = negative_ttl_ms;
+    rt->generations = calloc(READTHROUGH_MISS_SLOTS, sizeof(uint32_t));
+    if (!rt->generations) {
+        free(rt);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    if (negative_ttl_ms > 0) {
+        rt->misses = calloc(READTHROUGH_MISS_SLOTS, sizeof(readthrough_miss_t));
+        if (!rt->misses) {
+            free(rt->generations);
+            free(rt);
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return NULL;
+        }
+    }
+    return rt;
+}
+
+void readthrough_destroy(readthrough_t* rt) {
+    if (rt) {
+        free(rt->misses);
+        free(rt->generations);
+        free(rt);
+    }
+}
+
+bool readthrough_known_missing(readthrough_t* rt, int key) {
+    if (!rt->misses) {
+        return false;
+    }
+    readthrough_miss_t* slot = miss_slot(rt, key);
+    if (slot->expires_ms == 0 || slot->key != key) {
+        return false;
+    }
+    if (now_ms() < slot->expires_ms) {
+        return true;
+    }
+    slot->expires_ms = 0;
+    return false;
+}
+
+void readthrough_remember_missing(readthrough_t* rt, int key) {
+    if (rt->misses) {
+        readthrough_miss_t* slot = miss_slot(rt, key);
+        slot->key = key;
+        slot->expires_ms = now_ms() + rt->negative_ttl_ms;
+    }
+}
+
+void readthrough_written(readthrough_t* rt, int key) {
+    rt->generations[key_slot(key)]++;
+    if (rt->misses) {
+        readthrough_miss_t* slot = miss_slot(rt, key);
+        if (slot->key == key) {
+            slot->expires_ms = 0;
+        }
+    }
+}
+
+void readthrough_written_all(readthrough_t* rt) {
+    rt->epoch++;
+}
+
+uint32_t readthrough_generation(readthrough_t* rt, int key) {
+    return rt->generations[key_slot(key)] + rt->epoch;
+}
+
+/**
+ * Load thread: run queued loads and hand them to their done queue
+ */
+static void* run_loads(void* arg) {
+    load_pool_t* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        kvs_load_t* load = pool->head;
+        pool->head = load->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        load->value = NULL;
+        load->len = 0;
+        load->result = load->loader(load->ctx, load->key, &load->value, &load->len);
+
+        pthread_mutex_lock(&pool->lock);
+        load->next = pool->done[load->queue];
+        pool->done[load->queue] = load;
+        // can only fail if the counter is saturated, i.e. a wakeup is pending
+        uint64_t one = 1;
+        ssize_t written = write(pool->wake_fds[load->queue], &one, sizeof(one));
+        (void)written;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+load_pool_t* load_pool_create(unsigned threads, const int* wake_fds, unsigned queues) {
+    if (threads == 0 || !wake_fds || queues == 0) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    load_pool_t* pool = calloc(1, sizeof(load_pool_t));
+    if (!pool) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pool->done = calloc(queues, sizeof(kvs_load_t*));
+    pool->wake_fds = malloc(queues * sizeof(int));
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if (!pool->done || !pool->wake_fds || !pool->threads) {
+        load_pool_destroy(pool);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    for (unsigned i = 0; i < queues; i++) {
+        pool->wake_fds[i] = wake_fds[i];
+    }
+
+    for (; pool->thread_count < threads; pool->thread_count++) {
+        if (pthread_create(&pool->threads[pool->thread_count], NULL, run_loads, pool) != 0) {
+            load_pool_destroy(pool);
+            kvs_set_error(KVS_ERROR_UNKNOWN);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void load_pool_submit(load_pool_t* pool, kvs_load_t* load) {
+    load->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = load;
+    } else {
+        pool->head = load;
+    }
+    pool->tail = load;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+kvs_load_t* load_pool_take(load_pool_t* pool, unsigned queue) {
+    pthread_mutex_lock(&pool->lock);
+    kvs_load_t* done = pool->done[queue];
+    pool->done[queue] = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+void load_pool_stop(load_pool_t* pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->thread_count = 0;
+}
+
+void load_pool_destroy(load_pool_t* pool) {
+    if (!pool) {
+        return;
+    }
+
+    load_pool_stop(pool);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+
+    free(pool->threads);
+    free(pool->wake_fds);
+    free(pool->done);
+    free(pool);
+}
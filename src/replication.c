@@ -0,0 +1,93 @@
+/**
+ * Replication log implementation
+ */
+
+#define _GNU_SOURCE
+
+#include "replication.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+bool kvs_repl_log_init(kvs_repl_log_t* log, size_t capacity, uint64_t offset) {
+    log->data = capacity > 0 ? malloc(capacity) : NULL;
+    log->capacity = capacity;
+    log->start = offset;
+    log->end = offset;
+    return log->data != NULL;
+}
+
+void kvs_repl_log_free(kvs_repl_log_t* log) {
+    free(log->data);
+    log->data = NULL;
+    log->capacity = 0;
+}
+
+/**
+ * Append, keeping only the newest capacity bytes
+ */
+void kvs_repl_log_append(kvs_repl_log_t* log, const char* data, size_t len) {
+    log->end += len;
+
+    // only the tail of an oversized append survives
+    if (len > log->capacity) {
+        data += len - log->capacity;
+        len = log->capacity;
+    }
+
+    size_t pos = (size_t)((log->end - len) % log->capacity);
+    size_t first = log->capacity - pos < len ? log->capacity - pos : len;
+    memcpy(log->data + pos, data, first);
+    memcpy(log->data, data + first, len - first);
+
+    if (log->end - log->start > log->capacity) {
+        log->start = log->end - log->capacity;
+    }
+}
+
+bool kvs_repl_log_has(const kvs_repl_log_t* log, uint64_t offset) {
+    return offset >= log->start && offset <= log->end;
+}
+
+size_t kvs_repl_log_read(const kvs_repl_log_t* log, uint64_t offset, const char** data) {
+    if (!kvs_repl_log_has(log, offset) || offset == log->end) {
+        return 0;
+    }
+
+    size_t pos = (size_t)(offset % log->capacity);
+    size_t len = (size_t)(log->end - offset);
+    if (len > log->capacity - pos) {
+        len = log->capacity - pos;
+    }
+    *data = log->data + pos;
+    return len;
+}
+
+/**
+ * Random id from /dev/urandom, or the clock and pid if that fails
+ */
+void kvs_repl_new_id(char id[KVS_REPL_ID_LENGTH + 1]) {
+    unsigned char bytes[KVS_REPL_ID_LENGTH / 2];
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && read(fd, bytes, sizeof(bytes)) == (ssize_t)sizeof(bytes);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t seed = (uint64_t)ts.tv_sec * 1000000007u ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 32);
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            bytes[i] = (unsigned char)(seed >> 56);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        snprintf(id + i * 2, 3, "%02x", bytes[i]);
+    }
+    id[KVS_REPL_ID_LENGTH] = '\0';
+}
@@ -0,0 +1,351 @@
+/**
+ * RESP protocol implementation
+ *
+ * The parser is restartable rather than incremental: an incomplete
+ * request is parsed again from its start once more bytes arrive. Requests
+ * are small and bounded, so this keeps the parser stateless.
+ */
+
+#include "resp.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest "*<count>" / "$<length>" header line we accept
+#define MAX_HEADER_LENGTH 32
+
+// Initial size of a buffer, doubled as needed
+#define INITIAL_BUFFER_CAPACITY 4096
+
+/**
+ * Find the CRLF ending the line that starts at data
+ * @return offset of '\r', or -1 if the line is not complete yet
+ */
+static long find_crlf(const char* data, size_t len) {
+    const char* cr = memchr(data, '\r', len);
+    if (!cr || (size_t)(cr - data) + 1 >= len) {
+        return -1;
+    }
+    return cr - data;
+}
+
+/**
+ * Parse a "*<count>" or "$<length>" header line
+ * @return RESP_OK with the value and the offset after the CRLF
+ */
+static resp_status_t parse_header(char* data, size_t len, long long* value, size_t* next) {
+    long cr = find_crlf(data, len);
+    if (cr < 0) {
+        return len > MAX_HEADER_LENGTH ? RESP_PROTOCOL_ERROR : RESP_INCOMPLETE;
+    }
+
+    kvs_slice_t number = { data + 1, (size_t)cr - 1 };
+    if (data[cr + 1] != '\n' || !kvs_slice_to_ll(number, value)) {
+        return RESP_PROTOCOL_ERROR;
+    }
+
+    *next = (size_t)cr + 2;
+    return RESP_OK;
+}
+
+/**
+ * Parse an array of bulk strings
+ */
+static resp_status_t parse_multibulk(char* data, size_t len, kvs_slice_t* argv, size_t max_args,
+                                     size_t* argc, size_t* consumed) {
+    long long count;
+    size_t pos;
+    resp_status_t status = parse_header(data, len, &count, &pos);
+    if (status != RESP_OK) {
+        return status;
+    }
+
+    // "*0" and "*-1" are empty requests
+    if (count <= 0) {
+        *argc = 0;
+        *consumed = pos;
+        return RESP_OK;
+    }
+    if ((unsigned long long)count > max_args) {
+        return RESP_PROTOCOL_ERROR;
+    }
+
+    for (long long i = 0; i < count; i++) {
+        if (pos >= len) {
+            return RESP_INCOMPLETE;
+        }
+        if (data[pos] != '$') {
+            return RESP_PROTOCOL_ERROR;
+        }
+
+        long long bulk_len;
+        size_t header_len;
+        status = parse_header(data + pos, len - pos, &bulk_len, &header_len);
+        if (status != RESP_OK) {
+            return status;
+        }
+        if (bulk_len < 0 || bulk_len > RESP_MAX_BULK_LENGTH) {
+            return RESP_PROTOCOL_ERROR;
+        }
+
+        pos += header_len;
+        if (len - pos < (size_t)bulk_len + 2) {
+            return RESP_INCOMPLETE;
+        }
+        if (data[pos + bulk_len] != '\r' || data[pos + bulk_len + 1] != '\n') {
+            return RESP_PROTOCOL_ERROR;
+        }
+
+        argv[i].ptr = data + pos;
+        argv[i].len = (size_t)bulk_len;
+        pos += (size_t)bulk_len + 2;
+    }
+
+    *argc = (size_t)count;
+    *consumed = pos;
+    return RESP_OK;
+}
+
+/**
+ * Parse an inline command: one line of whitespace-separated words
+ */
+static resp_status_t parse_inline(char* data, size_t len, kvs_slice_t* argv, size_t max_args,
+                                  size_t* argc, size_t* consumed) {
+    char* newline = memchr(data, '\n', len);
+    if (!newline) {
+        return len > RESP_MAX_INLINE_LENGTH ? RESP_PROTOCOL_ERROR : RESP_INCOMPLETE;
+    }
+
+    kvs_tokenizer_t tok;
+    kvs_tokenizer_init(&tok, data, (size_t)(newline - data));
+
+    size_t count = 0;
+    kvs_slice_t word;
+    while (kvs_next_token(&tok, &word)) {
+        if (count == max_args) {
+            return RESP_PROTOCOL_ERROR;
+        }
+        argv[count++] = word;
+    }
+
+    *argc = count;
+    *consumed = (size_t)(newline - data) + 1;
+    return RESP_OK;
+}
+
+resp_status_t resp_parse_request(char* data, size_t len, kvs_slice_t* argv, size_t max_args,
+                                 size_t* argc, size_t* consumed) {
+    if (len == 0) {
+        return RESP_INCOMPLETE;
+    }
+
+    if (data[0] == '*') {
+        return parse_multibulk(data, len, argv, max_args, argc, consumed);
+    }
+    return parse_inline(data, len, argv, max_args, argc, consumed);
+}
+
+/**
+ * Parse the reply at *pos into node (NULL when measuring)
+ * Array elements take the next free nodes, counted in *used
+ */
+static resp_status_t parse_reply_at(char* data, size_t len, size_t* pos, resp_reply_t* node,
+                                    resp_reply_t* nodes, size_t* used, int depth) {
+    if (*pos >= len) {
+        return RESP_INCOMPLETE;
+    }
+    char* line = data + *pos;
+    long cr = find_crlf(line, len - *pos);
+    if (cr < 0) {
+        return len - *pos > RESP_MAX_INLINE_LENGTH ? RESP_PROTOCOL_ERROR : RESP_INCOMPLETE;
+    }
+    if (line[cr + 1] != '\n') {
+        return RESP_PROTOCOL_ERROR;
+    }
+    size_t next = *pos + (size_t)cr + 2;
+    kvs_slice_t text = { line + 1, (size_t)cr - 1 };
+    long long number = 0;
+    if ((line[0] == ':' || line[0] == '$' || line[0] == '*') && !kvs_slice_to_ll(text, &number)) {
+        return RESP_PROTOCOL_ERROR;
+    }
+
+    switch (line[0]) {
+        case '+':
+        case '-':
+            if (node) {
+                node->type = line[0] == '+' ? RESP_REPLY_STATUS : RESP_REPLY_ERROR;
+                node->str = text.ptr;
+                node->len = text.len;
+                line[cr] = '\0';
+            }
+            break;
+        case ':':
+            if (node) {
+                node->type = RESP_REPLY_INTEGER;
+                node->integer = number;
+            }
+            break;
+        case '$':
+            if (number == -1) {
+                if (node) {
+                    node->type = RESP_REPLY_NULL;
+                }
+                break;
+            }
+            if (number < 0 || number > RESP_MAX_BULK_LENGTH) {
+                return RESP_PROTOCOL_ERROR;
+            }
+            if (len - next < (size_t)number + 2) {
+                return RESP_INCOMPLETE;
+            }
+            if (data[next + number] != '\r' || data[next + number + 1] != '\n') {
+                return RESP_PROTOCOL_ERROR;
+            }
+            if (node) {
+                node->type = RESP_REPLY_BULK;
+                node->str = data + next;
+                node->len = (size_t)number;
+                data[next + number] = '\0';
+            }
+            next += (size_t)number + 2;
+            break;
+        case '*': {
+            if (number == -1) {
+                if (node) {
+                    node->type = RESP_REPLY_NULL;
+                }
+                break;
+            }
+            if (number < 0 || depth >= RESP_MAX_REPLY_DEPTH) {
+                return RESP_PROTOCOL_ERROR;
+            }
+            // the elements sit side by side, their own elements after them
+            size_t first = *used;
+            *used += (size_t)number;
+            if (node) {
+                node->type = RESP_REPLY_ARRAY;
+                node->len = (size_t)number;
+                node->elements = nodes + first;
+            }
+            for (long long i = 0; i < number; i++) {
+                resp_status_t status = parse_reply_at(data, len, &next, node ? nodes + first + i : NULL,
+                                                      nodes, used, depth + 1);
+                if (status != RESP_OK) {
+                    return status;
+                }
+            }
+            break;
+        }
+        default:
+            return RESP_PROTOCOL_ERROR;
+    }
+
+    *pos = next;
+    return RESP_OK;
+}
+
+resp_status_t resp_parse_reply(char* data, size_t len, resp_reply_t* nodes, size_t* used, size_t* consumed) {
+    size_t pos = 0;
+    *used = 1;
+    resp_status_t status = parse_reply_at(data, len, &pos, nodes, nodes, used, 0);
+    *consumed = pos;
+    return status;
+}
+
+bool resp_buf_reserve(resp_buf_t* buf, size_t extra) {
+    if (buf->capacity - buf->len >= extra) {
+        return true;
+    }
+
+    size_t capacity = buf->capacity ? buf->capacity : INITIAL_BUFFER_CAPACITY;
+    while (capacity - buf->len < extra) {
+        capacity *= 2;
+    }
+
+    char* data = realloc(buf->data, capacity);
+    if (!data) {
+        return false;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return true;
+}
+
+void resp_buf_consume(resp_buf_t* buf, size_t count) {
+    if (count >= buf->len) {
+        buf->len = 0;
+        return;
+    }
+    memmove(buf->data, buf->data + count, buf->len - count);
+    buf->len -= count;
+}
+
+void resp_buf_free(resp_buf_t* buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->capacity = 0;
+}
+
+/**
+ * Append raw bytes
+ */
+static bool append(resp_buf_t* buf, const char* data, size_t len) {
+    if (!resp_buf_reserve(buf, len)) {
+        return false;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+/**
+ * Append a type byte, a number and CRLF
+ */
+static bool append_number(resp_buf_t* buf, char type, long long value) {
+    char line[MAX_HEADER_LENGTH];
+    int len = snprintf(line, sizeof(line), "%c%lld\r\n", type, value);
+    return append(buf, line, (size_t)len);
+}
+
+bool resp_add_simple(resp_buf_t* buf, const char* str) {
+    size_t len = strlen(str);
+    if (!resp_buf_reserve(buf, len + 3)) {
+        return false;
+    }
+    buf->data[buf->len++] = '+';
+    return append(buf, str, len) && append(buf, "\r\n", 2);
+}
+
+bool resp_add_error(resp_buf_t* buf, const char* msg) {
+    size_t len = strlen(msg);
+    if (!resp_buf_reserve(buf, len + 3)) {
+        return false;
+    }
+    buf->data[buf->len++] = '-';
+    return append(buf, msg, len) && append(buf, "\r\n", 2);
+}
+
+bool resp_add_integer(resp_buf_t* buf, long long value) {
+    return append_number(buf, ':', value);
+}
+
+bool resp_add_bulk(resp_buf_t* buf, const char* data, size_t len) {
+    return resp_buf_reserve(buf, len + MAX_HEADER_LENGTH) &&
+           append_number(buf, '$', (long long)len) &&
+           append(buf, data, len) &&
+           append(buf, "\r\n", 2);
+}
+
+bool resp_add_null(resp_buf_t* buf) {
+    return append(buf, "$-1\r\n", 5);
+}
+
+bool resp_add_array(resp_buf_t* buf, size_t count) {
+    return append_number(buf, '*', (long long)count);
+}
+
+bool resp_add_raw(resp_buf_t* buf, const char* data, size_t len) {
+    return append(buf, data, len);
+}
@@ -0,0 +1,3592 @@
+/**
+ * Network server implementation
+ *
+ * Level-triggered epoll loops. Listeners and the wake eventfd are told
+ * apart from connections by the address stored in the epoll data.
+ *
+ * Data commands become single-key operations (shard_op_t) held by the
+ * connection. Operations on the loop's own shard run when the command
+ * completes; the others are pushed to the owning loop, which runs them
+ * and pushes them back. A connection waiting on forwarded operations is
+ * not read from until they return, which keeps its replies in order.
+ *
+ * The io_uring backend replaces the readiness loop (read_input,
+ * flush_output, update_interest) with completions: a multishot recv per
+ * connection fills kernel-picked buffers that are copied into the input,
+ * and output is double-buffered so replies can be appended while the
+ * previous batch is still being sent. All other code is shared.
+ *
+ * Binary frames (binproto.h) are told from RESP by their first byte.
+ * Their GET, SET and DEL become the same operations as MGET, MSET and
+ * DEL; only the reply is encoded differently.
+ *
+ * WAITKEY parks its operation on the loop owning the key, which answers
+ * it once the key's version (keywait.h) has moved or its deadline has
+ * passed; the check runs after each round of events and forwarded
+ * operations, which is where the writes it waits for happen.
+ *
+ * GET, MGET and INCR of a key missing from a read-through shard park on
+ * a load instead (load_flight_t): the first miss hands the key to the
+ * load pool, later ones join it, and the owning loop sets the result and
+ * answers them all when the pool wakes it.
+ *
+ * A shared-memory client (shmring.h) keeps its connection: read_input
+ * and flush_output copy between its rings and the usual buffers. Its
+ * eventfd is watched edge-triggered under one address per loop, and the
+ * loop serves all such clients after each round of events, polling them
+ * for KVS_SHM_SPIN_NS after the last request before it lets epoll sleep.
+ */
+
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "error.h"
+#include "uring.h"
+#include "replication.h"
+#include "binproto.h"
+#include "shmring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+
+#define MAX_EVENTS 128
+#define READ_CHUNK (16 * 1024)
+#define LISTEN_BACKLOG 511
+
+// Idle buffers above this size are released instead of kept around
+#define IDLE_BUFFER_LIMIT (64 * 1024)
+
+// Default number of keys returned by SCAN
+#define SCAN_DEFAULT_COUNT 10
+
+// Operation slots a connection keeps between commands
+#define IDLE_OPS_LIMIT 64
+
+// Keys handed to one batched store call by MGET / MSET / DEL
+#define BATCH_KEYS 64
+
+// Read-through: threads loading misses, and per loop the buckets of the
+// table of loads out (by key)
+#define LOAD_THREADS 4
+#define LOAD_FLIGHT_BITS 8
+
+// io_uring backend: submission queue size and receive buffers per loop
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE (8 * 1024)
+#define URING_BUFFER_GROUP 0
+
+// Output batches from this size on are sent zero-copy (TCP only)
+#define URING_ZERO_COPY_THRESHOLD (32 * 1024)
+
+/**
+ * io_uring completion kinds, kept in the low bits of the user data
+ * (connections and loops are at least 8-byte aligned)
+ */
+enum {
+    EV_RECV = 0,
+    EV_SEND,
+    EV_ACCEPT_TCP,
+    EV_ACCEPT_UNIX,
+    EV_WAKE,
+    EV_CANCEL,
+    EV_CONNECT
+};
+#define EV_KIND_MASK 7
+
+#define ERR_KEY "ERR key is not an integer"
+#define ERR_VALUE "ERR value too long or contains a NUL byte"
+
+// snapshot bytes moved per read while streaming it to a replica
+#define REPL_SNAPSHOT_CHUNK (64 * 1024)
+
+// how often the loop checks on a snapshot being written for replicas
+#define REPL_SNAPSHOT_POLL_MS 10
+
+// most replicas listed one by one in INFO
+#define INFO_MAX_REPLICAS 16
+
+// Loop counters are written by their own loop and read by INFO on any
+// loop, so they are relaxed atomics rather than lock-protected
+#define STAT_SET(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) STAT_SET(field, (field) + (n))
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+typedef enum {
+    OP_GET,
+    OP_SET,
+    OP_DEL,
+    OP_INCR,
+    OP_SCAN,
+    OP_WAIT
+} op_type_t;
+
+typedef enum {
+    OP_OK = 0,
+    OP_MISSING,             // GET of an absent key
+    OP_NOT_INTEGER,         // INCR of a non-numeric value
+    OP_OVERFLOW,            // INCR past LLONG_MAX
+    OP_FAILED               // store error, see error
+} op_status_t;
+
+/**
+ * Single-key operation, run by the loop owning the key's shard
+ * While forwarded it belongs to that loop; the origin doesn't touch it
+ * until it comes back
+ */
+typedef struct shard_op {
+    kvs_conn_t* conn;       // connection that issued it
+    unsigned origin;        // loop the connection lives on
+    unsigned shard;         // loop that runs it
+    op_type_t type;
+    op_status_t status;
+    kvs_error_t error;      // OP_FAILED
+    int key;
+    bool owned;             // value is a copy freed on completion
+    char* value;            // SET input, GET result
+    size_t len;             // value length; SCAN: keys wanted, then found
+    long long number;       // DEL / INCR result; SCAN: position, then next; WAIT: version
+    long long deadline_ms;  // WAIT: when it gives up, -1 for never
+    int* keys;              // SCAN result
+    bool answered;          // failed where it was parked (its load), not run again
+    struct shard_op* next;  // backlog, waiter or load link
+} shard_op_t;
+
+/**
+ * Read-through load of one key, and the operations waiting for it
+ */
+typedef struct load_flight {
+    kvs_load_t load;            // first: the pool hands back the load
+    uint32_t generation;        // the key's write generation at the start
+    struct shard_op* ops;
+    struct load_flight* next;   // bucket chain
+} load_flight_t;
+
+/**
+ * Operations waiting for room in a full ring, oldest first
+ */
+typedef struct {
+    shard_op_t* head;
+    shard_op_t* tail;
+} op_queue_t;
+
+/**
+ * Client connection
+ */
+struct kvs_conn {
+    int fd;                 // -1 once closed
+    uint32_t events;        // epoll interest currently registered
+    bool closing;           // close once the output is flushed
+    resp_buf_t in;          // received, not yet executed
+    resp_buf_t out;         // replies not yet sent
+    kvs_command_id_t command;   // command the operations belong to
+    bool binary;            // and it came in a binary frame
+    shard_op_t* ops;
+    size_t op_count;
+    size_t op_capacity;
+    size_t pending;         // operations out on other loops (or parked, for WAITKEY)
+    bool abandoned;         // closed with operations out (atomic, loops holding them read it)
+    uint64_t started_ns;    // when the command waiting on them started (with metrics)
+    kvs_conn_t* prev;
+    kvs_conn_t* next;
+
+    // io_uring backend only
+    resp_buf_t sending;     // output handed to the kernel, untouched until sent
+    size_t sent;            // bytes of sending already sent
+    unsigned inflight;      // kernel requests that point at the connection
+    bool zero_copy;         // TCP to another host, where zero-copy send pays off
+    bool recv_armed;        // multishot recv outstanding
+    bool recv_cancelling;   // and asked to stop
+    bool send_busy;         // sending is in use (send or zero-copy notification out)
+    bool zc_notify;         // waiting for the zero-copy notification
+
+    // a client on the shared-memory transport
+    kvs_shm_t shm;          // header NULL on the socket
+    int shm_event_fd;       // the client writes it when the loop is parked
+    kvs_conn_t* shm_next;   // loop's list of shared-memory clients
+
+    // a replica attached to this primary
+    bool replica;
+    uint64_t repl_offset;   // next log byte to send
+    uint64_t ack_offset;    // last offset the replica acknowledged
+    bool snapshot_wait;     // FULLRESYNC sent, its snapshot still being written
+    int snapshot_fd;        // snapshot still being streamed, -1 when done
+    uint64_t snapshot_left;
+};
+
+/**
+ * State of a replica's link to its primary
+ */
+typedef enum {
+    LINK_DOWN,              // not connected, retried at retry_ms
+    LINK_CONNECTING,        // connect() in progress, waiting for the socket to be writable
+    LINK_HANDSHAKE,         // PSYNC sent, waiting for the answer
+    LINK_SNAPSHOT,          // receiving a snapshot
+    LINK_STREAMING          // applying the log
+} link_state_t;
+
+/**
+ * Replication state, single event loop servers only
+ */
+struct kvs_repl {
+    // as a primary
+    char id[KVS_REPL_ID_LENGTH + 1];
+    kvs_repl_log_t log;         // allocated when the first replica attaches
+    size_t log_size;
+    kvs_conn_t** replicas;
+    size_t replica_count;
+    size_t replica_capacity;
+    resp_buf_t scratch;         // one encoded write
+    uint64_t full_syncs;
+    uint64_t partial_syncs;
+    bool resync;                // the log lost a write, replicas must start over
+    pid_t save_pid;             // child writing a snapshot for replicas, 0 if none, -1 if written
+    uint64_t save_offset;       // log offset the snapshot was taken at
+    char save_path[PATH_MAX];
+
+    // as a replica
+    char* primary;              // "host:port" or a Unix socket path, NULL on a primary
+    link_state_t state;
+    kvs_conn_t* link;
+    char primary_id[KVS_REPL_ID_LENGTH + 1];    // stream applied so far, "" before the first sync
+    uint64_t offset;
+    uint64_t acked;
+    long long ack_ms;           // when the last ACK went out
+    long long retry_ms;         // next connection attempt
+    long long connect_ms;       // when a connect in progress is given up
+    char pending_id[KVS_REPL_ID_LENGTH + 1];    // announced by FULLRESYNC
+    uint64_t pending_offset;
+    int snapshot_fd;            // snapshot being received, -1 if none
+    uint64_t snapshot_left;
+    char snapshot_path[64];
+};
+
+/**
+ * Event loop, one per shard
+ * Cache-line aligned so one loop's counters don't share a line with
+ * the next loop's hot fields
+ */
+struct kvs_worker {
+    kvs_server_t* server;
+    unsigned index;
+    kvstore_t* kvs;             // shard owned by this loop (not owned)
+    int epoll_fd;
+    int tcp_fd;                 // -1 if not listening on TCP
+    int unix_fd;                // -1 if not listening on a Unix socket
+    int wake_fd;                // eventfd for stop requests and forwarded operations
+    kvs_slice_t* argv;          // scratch for parsed arguments
+    kvs_conn_t* conns;          // list of open connections
+    kvs_conn_t* shm_conns;      // those on the shared-memory transport
+    shard_op_t* waiters;        // WAITKEY operations parked on this shard
+    load_flight_t** flights;    // loads out by key, NULL unless the shard has a loader
+    size_t loading;             // loads out
+    uint64_t shm_active_ns;     // when one last moved bytes
+    uring_t* uring;             // io_uring backend while running, NULL with epoll
+    uring_buffers_t buffers;    // receive buffers the kernel picks from
+    op_queue_t* backlog;        // per loop, operations its ring had no room for
+    bool* notify;               // per loop, pushed to since it was last woken
+    bool backlogged;            // some backlog is not empty
+    pthread_t thread;
+    bool started;               // thread was created
+    bool failed;                // loop stopped on an error
+    size_t connected;           // open connections
+    uint64_t total_connections; // connections accepted since start
+    uint64_t total_commands;    // commands executed since start
+    size_t keys;                // shard size, published for other loops
+    size_t capacity;
+    histogram_t* latency;       // request latency, NULL without metrics
+    long long metrics_ms;       // last published to the metrics shard
+} __attribute__((aligned(SPSC_CACHE_LINE)));
+
+/**
+ * Command handler, returns false if the reply could not be encoded
+ */
+typedef bool (*command_fn)(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc);
+
+/**
+ * Command table entry, indexed by command id
+ * arity is the exact argument count including the name, or -N for "at least N"
+ */
+typedef struct {
+    command_fn handler;     // NULL for CLI-only commands
+    int arity;
+} command_t;
+
+static bool watch(kvs_worker_t* worker, int fd, uint32_t events, void* ptr) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ptr;
+    return epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static spsc_ring_t* ring_between(kvs_server_t* server, unsigned from, unsigned to) {
+    return &server->rings[from * server->worker_count + to];
+}
+
+/**
+ * Open a non-blocking TCP listener
+ * @param reuse_port Let every loop bind its own listener to the port
+ * @return the socket, or -1 on failure
+ */
+static int listen_tcp(const char* address, int port, bool reuse_port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo* result;
+    if (getaddrinfo(address, service, &hints, &result) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, LISTEN_BACKLOG) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+    return fd;
+}
+
+/**
+ * Open a non-blocking Unix socket listener, replacing a stale socket file
+ * @return the socket, or -1 on failure
+ */
+static int listen_unix(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, LISTEN_BACKLOG) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Hash range of a shard: the hashes h with h * count / 2^32 == shard
+ */
+kvs_hash_range_t kvs_shard_hash_range(unsigned shard, unsigned count) {
+    kvs_hash_range_t range;
+    range.start = (uint32_t)((((uint64_t)shard << 32) + count - 1) / count);
+    range.end = (uint32_t)(((((uint64_t)shard + 1) << 32) + count - 1) / count - 1);
+    return range;
+}
+
+/**
+ * Set up one event loop and its listeners
+ */
+static bool init_worker(kvs_server_t* server, unsigned index, kvstore_t* kvs,
+                        const kvs_server_config_t* config) {
+    kvs_worker_t* worker = &server->workers[index];
+    unsigned count = server->worker_count;
+
+    worker->server = server;
+    worker->index = index;
+    worker->kvs = kvs;
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->argv = malloc(SERVER_MAX_ARGS * sizeof(kvs_slice_t));
+    worker->backlog = calloc(count, sizeof(op_queue_t));
+    worker->notify = calloc(count, sizeof(bool));
+    if (config->metrics) {
+        worker->latency = malloc(sizeof(histogram_t));
+    }
+    if (!worker->argv || !worker->backlog || !worker->notify || (config->metrics && !worker->latency)) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+    if (worker->latency) {
+        histogram_reset(worker->latency);
+    }
+
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    bool ok = worker->epoll_fd >= 0 && worker->wake_fd >= 0 &&
+              watch(worker, worker->wake_fd, EPOLLIN, &worker->wake_fd);
+
+    if (ok && config->port > 0) {
+        const char* address = config->bind_address ? config->bind_address : "127.0.0.1";
+        worker->tcp_fd = listen_tcp(address, config->port, count > 1);
+        ok = worker->tcp_fd >= 0 && watch(worker, worker->tcp_fd, EPOLLIN, &worker->tcp_fd);
+    }
+
+    // a Unix socket can't be shared out by the kernel, the first loop serves it
+    if (ok && config->unix_path && index == 0) {
+        worker->unix_fd = listen_unix(config->unix_path);
+        ok = worker->unix_fd >= 0 && watch(worker, worker->unix_fd, EPOLLIN, &worker->unix_fd);
+    }
+
+    if (!ok) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+    }
+    return ok;
+}
+
+static kvs_repl_t* create_repl(const kvs_server_config_t* config) {
+    kvs_repl_t* repl = calloc(1, sizeof(kvs_repl_t));
+    if (!repl) {
+        return NULL;
+    }
+    kvs_repl_new_id(repl->id);
+    repl->log_size = config->repl_log_size > 0 ? config->repl_log_size : KVS_REPL_LOG_DEFAULT_SIZE;
+    repl->snapshot_fd = -1;
+
+    if (config->replica_of) {
+        repl->primary = malloc(strlen(config->replica_of) + 1);
+        if (!repl->primary) {
+            free(repl);
+            return NULL;
+        }
+        strcpy(repl->primary, config->replica_of);
+    }
+    return repl;
+}
+
+/**
+ * Drop a snapshot being received (the store is only touched once it is complete)
+ */
+static void discard_snapshot(kvs_repl_t* repl) {
+    if (repl->snapshot_fd >= 0) {
+        close(repl->snapshot_fd);
+        unlink(repl->snapshot_path);
+        repl->snapshot_fd = -1;
+    }
+}
+
+/**
+ * Stop a snapshot being written for replicas, which won't be sent
+ */
+static void abandon_save(kvs_repl_t* repl) {
+    if (repl->save_pid > 0) {
+        kill(repl->save_pid, SIGKILL);
+        waitpid(repl->save_pid, NULL, 0);
+    }
+    if (repl->save_pid != 0) {
+        unlink(repl->save_path);
+        repl->save_pid = 0;
+    }
+}
+
+static void destroy_repl(kvs_repl_t* repl) {
+    if (!repl) {
+        return;
+    }
+    discard_snapshot(repl);
+    abandon_save(repl);
+    kvs_repl_log_free(&repl->log);
+    resp_buf_free(&repl->scratch);
+    free(repl->replicas);
+    free(repl->primary);
+    free(repl);
+}
+
+const char* kvs_server_backend_name(kvs_server_backend_t backend) {
+    return backend == KVS_BACKEND_IO_URING ? "io_uring" : "epoll";
+}
+
+/**
+ * Create a server around a single store
+ */
+kvs_server_t* kvs_server_create(kvstore_t* kvs, const kvs_server_config_t* config) {
+    return kvs_server_create_sharded(&kvs, 1, config);
+}
+
+/**
+ * Create a sharded server and start listening
+ */
+kvs_server_t* kvs_server_create_sharded(kvstore_t** shards, unsigned count,
+                                        const kvs_server_config_t* config) {
+    if (!shards || count == 0 || count > SERVER_MAX_SHARDS || !config ||
+        (config->port <= 0 && !config->unix_path) || (config->replica_of && count > 1)) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (!shards[i]) {
+            kvs_set_error(KVS_ERROR_INVALID_PARAM);
+            return NULL;
+        }
+    }
+
+    kvs_server_t* server = calloc(1, sizeof(kvs_server_t));
+    if (!server) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    void* workers = NULL;
+    void* rings = NULL;
+    if (posix_memalign(&workers, SPSC_CACHE_LINE, count * sizeof(kvs_worker_t)) != 0 ||
+        (count > 1 && posix_memalign(&rings, SPSC_CACHE_LINE,
+                                     (size_t)count * count * sizeof(spsc_ring_t)) != 0)) {
+        free(workers);
+        free(server);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    memset(workers, 0, count * sizeof(kvs_worker_t));
+    server->workers = workers;
+    if (config->metrics) {
+        void* metrics = NULL;
+        if (posix_memalign(&metrics, SPSC_CACHE_LINE, count * sizeof(kvs_metrics_shard_t)) != 0) {
+            free(workers);
+            free(rings);
+            free(server);
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return NULL;
+        }
+        memset(metrics, 0, count * sizeof(kvs_metrics_shard_t));
+        server->metrics = metrics;
+    }
+    server->worker_count = count;
+    server->pin_threads = config->pin_threads;
+    server->backend = config->backend;
+    if (server->backend == KVS_BACKEND_IO_URING && !uring_available()) {
+        server->backend = KVS_BACKEND_EPOLL;
+    }
+    if (rings) {
+        memset(rings, 0, (size_t)count * count * sizeof(spsc_ring_t));
+        server->rings = rings;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        server->workers[i].epoll_fd = -1;
+        server->workers[i].tcp_fd = -1;
+        server->workers[i].unix_fd = -1;
+        server->workers[i].wake_fd = -1;
+    }
+
+    // replication needs the whole keyspace on one loop
+    if (count == 1) {
+        server->repl = create_repl(config);
+        if (!server->repl) {
+            kvs_server_destroy(server);
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return NULL;
+        }
+    }
+
+    if (config->unix_path) {
+        server->unix_path = malloc(strlen(config->unix_path) + 1);
+        if (!server->unix_path) {
+            kvs_server_destroy(server);
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return NULL;
+        }
+        strcpy(server->unix_path, config->unix_path);
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if (!init_worker(server, i, shards[i], config)) {
+            kvs_error_t error = kvs_get_error();
+            // only unlink a socket file we created
+            if (server->workers[0].unix_fd < 0) {
+                free(server->unix_path);
+                server->unix_path = NULL;
+            }
+            kvs_server_destroy(server);
+            kvs_set_error(error);
+            return NULL;
+        }
+    }
+
+    kvs_clear_error();
+    return server;
+}
+
+/**
+ * Free the operations of the last command
+ */
+static void release_ops(kvs_conn_t* conn) {
+    for (size_t i = 0; i < conn->op_count; i++) {
+        if (conn->ops[i].owned) {
+            free(conn->ops[i].value);
+        }
+        free(conn->ops[i].keys);
+    }
+    conn->op_count = 0;
+
+    if (conn->op_capacity > IDLE_OPS_LIMIT) {
+        free(conn->ops);
+        conn->ops = NULL;
+        conn->op_capacity = 0;
+    }
+}
+
+static bool add_replica(kvs_repl_t* repl, kvs_conn_t* conn) {
+    if (repl->replica_count == repl->replica_capacity) {
+        size_t capacity = repl->replica_capacity ? repl->replica_capacity * 2 : 4;
+        kvs_conn_t** replicas = realloc(repl->replicas, capacity * sizeof(kvs_conn_t*));
+        if (!replicas) {
+            return false;
+        }
+        repl->replicas = replicas;
+        repl->replica_capacity = capacity;
+    }
+    repl->replicas[repl->replica_count++] = conn;
+    conn->replica = true;
+    return true;
+}
+
+static void remove_replica(kvs_repl_t* repl, kvs_conn_t* conn) {
+    for (size_t i = 0; i < repl->replica_count; i++) {
+        if (repl->replicas[i] == conn) {
+            repl->replicas[i] = repl->replicas[--repl->replica_count];
+            break;
+        }
+    }
+    conn->replica = false;
+    if (conn->snapshot_fd >= 0) {
+        close(conn->snapshot_fd);
+        conn->snapshot_fd = -1;
+    }
+}
+
+/**
+ * Close a connection
+ * The memory stays until operations forwarded on its behalf, and any
+ * io_uring requests on it, are back
+ */
+static void close_conn(kvs_worker_t* worker, kvs_conn_t* conn) {
+    kvs_repl_t* repl = worker->server->repl;
+    if (conn->replica) {
+        remove_replica(repl, conn);
+    }
+    if (repl && conn == repl->link) {
+        if (worker->uring && repl->state == LINK_CONNECTING) {
+            // the poll still points at the connection
+            struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+            if (sqe) {
+                uring_prep_cancel(sqe, (uint64_t)(uintptr_t)conn | EV_CONNECT, EV_CANCEL);
+            }
+        }
+        // keep the id and offset applied so far, for a partial resync
+        discard_snapshot(repl);
+        repl->link = NULL;
+        repl->state = LINK_DOWN;
+        repl->retry_ms = now_ms() + KVS_REPL_RETRY_MS;
+    }
+
+    if (conn->shm.header) {
+        kvs_conn_t** link = &worker->shm_conns;
+        while (*link != conn) {
+            link = &(*link)->shm_next;
+        }
+        *link = conn->shm_next;
+        close(conn->shm_event_fd);
+        kvs_shm_detach(&conn->shm);
+    }
+
+    if (conn->fd >= 0) {
+        // the kernel keeps its own reference, so the recv must be cancelled
+        if (worker->uring && conn->recv_armed && !conn->recv_cancelling) {
+            struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+            if (sqe) {
+                uring_prep_cancel(sqe, (uint64_t)(uintptr_t)conn | EV_RECV, EV_CANCEL);
+                conn->recv_cancelling = true;
+            }
+        }
+        close(conn->fd);
+        conn->fd = -1;
+        STAT_SET(worker->connected, worker->connected - 1);
+    }
+    if (conn->pending > 0) {
+        // a parked WAITKEY then comes back without waiting out its
+        // deadline, once the loop holding it is woken
+        __atomic_store_n(&conn->abandoned, true, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < conn->op_count; i++) {
+            if (conn->ops[i].type == OP_WAIT && conn->ops[i].shard != worker->index) {
+                worker->notify[conn->ops[i].shard] = true;
+            }
+        }
+    }
+    if (conn->pending > 0 || conn->inflight > 0) {
+        return;
+    }
+
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    release_ops(conn);
+    free(conn->ops);
+    resp_buf_free(&conn->in);
+    resp_buf_free(&conn->out);
+    resp_buf_free(&conn->sending);
+    free(conn);
+}
+
+/**
+ * Start tracking an accepted client
+ * @return the connection, NULL if out of memory (fd is then closed)
+ */
+static kvs_conn_t* add_conn(kvs_worker_t* worker, int fd, bool tcp) {
+    if (tcp) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // loopback copies anyway, so zero-copy there only adds the notification
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    bool remote = tcp && getsockname(fd, (struct sockaddr*)&local, &local_len) == 0;
+    if (remote && local.ss_family == AF_INET) {
+        remote = (ntohl(((struct sockaddr_in*)&local)->sin_addr.s_addr) >> 24) != 127;
+    } else if (remote && local.ss_family == AF_INET6) {
+        struct in6_addr* addr = &((struct sockaddr_in6*)&local)->sin6_addr;
+        remote = !IN6_IS_ADDR_LOOPBACK(addr) &&
+                 !(IN6_IS_ADDR_V4MAPPED(addr) && addr->s6_addr[12] == 127);
+    }
+
+    kvs_conn_t* conn = calloc(1, sizeof(kvs_conn_t));
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->zero_copy = remote;
+    conn->snapshot_fd = -1;
+
+    conn->next = worker->conns;
+    if (worker->conns) {
+        worker->conns->prev = conn;
+    }
+    worker->conns = conn;
+    STAT_ADD(worker->connected, 1);
+    STAT_ADD(worker->total_connections, 1);
+    return conn;
+}
+
+/**
+ * Accept every pending client on a listener
+ */
+static void accept_clients(kvs_worker_t* worker, int listener) {
+    while (true) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            // EAGAIN, or a transient error retried on the next event
+            return;
+        }
+
+        kvs_conn_t* conn = add_conn(worker, fd, listener == worker->tcp_fd);
+        if (!conn) {
+            continue;
+        }
+        conn->events = EPOLLIN;
+        if (!watch(worker, fd, conn->events, conn)) {
+            close_conn(worker, conn);
+        }
+    }
+}
+
+static bool valid_value(kvs_slice_t arg) {
+    return arg.len <= KVS_MAX_VALUE_LENGTH && !memchr(arg.ptr, '\0', arg.len);
+}
+
+/**
+ * Check that every argument from first on (every step-th) is a key
+ */
+static bool valid_keys(kvs_slice_t* argv, size_t argc, size_t first, size_t step) {
+    int key;
+    for (size_t i = first; i < argc; i += step) {
+        if (!kvs_slice_to_int(argv[i], &key)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool reply_store_error(resp_buf_t* out, kvs_error_t error) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "ERR %s", kvs_error_string(error));
+    return resp_add_error(out, msg);
+}
+
+static bool reply_binary_store_error(resp_buf_t* out, kvs_error_t error) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "ERR %s", kvs_error_string(error));
+    return kvs_bin_add_error(out, msg);
+}
+
+/**
+ * Start the operation list of a command, with room for count operations
+ */
+static bool reset_ops(kvs_conn_t* conn, kvs_command_id_t command, size_t count) {
+    release_ops(conn);
+    if (count > conn->op_capacity) {
+        shard_op_t* ops = realloc(conn->ops, count * sizeof(shard_op_t));
+        if (!ops) {
+            return false;
+        }
+        conn->ops = ops;
+        conn->op_capacity = count;
+    }
+    conn->command = command;
+    return true;
+}
+
+static shard_op_t* add_op(kvs_worker_t* worker, kvs_conn_t* conn, op_type_t type, unsigned shard) {
+    shard_op_t* op = &conn->ops[conn->op_count++];
+    memset(op, 0, sizeof(*op));
+    op->conn = conn;
+    op->origin = worker->index;
+    op->shard = shard;
+    op->type = type;
+    return op;
+}
+
+static shard_op_t* add_key_op(kvs_worker_t* worker, kvs_conn_t* conn, op_type_t type, int key) {
+    unsigned count = worker->server->worker_count;
+    shard_op_t* op = add_op(worker, conn, type, count > 1 ? kvs_shard_for_key(key, count) : 0);
+    op->key = key;
+    return op;
+}
+
+static void fail_op(shard_op_t* op) {
+    op->status = OP_FAILED;
+    op->error = kvs_get_error();
+}
+
+/**
+ * Keys of one SCAN page, collected through kvs_scan
+ * (whole slots are visited, so a page can hold a few more than asked)
+ */
+typedef struct {
+    int* keys;
+    size_t found;
+    size_t capacity;
+    bool failed;
+} scan_page_t;
+
+static void scan_visit(void* ctx, int key, const char* value) {
+    (void)value;
+    scan_page_t* page = ctx;
+    if (page->failed) {
+        return;
+    }
+    if (page->found == page->capacity) {
+        size_t capacity = page->capacity * 2;
+        int* keys = realloc(page->keys, capacity * sizeof(int));
+        if (!keys) {
+            page->failed = true;
+            return;
+        }
+        page->keys = keys;
+        page->capacity = capacity;
+    }
+    page->keys[page->found++] = key;
+}
+
+/**
+ * Run an operation against the shard owning it
+ * @param copy Copy GET results, for operations that travel back to
+ *             another loop (the value may change under them otherwise)
+ */
+static void run_op(kvstore_t* kvs, shard_op_t* op, bool copy) {
+    switch (op->type) {
+        case OP_WAIT:
+            if (!kvs->waits) {
+                op->status = OP_FAILED;
+                op->error = KVS_ERROR_MEMORY;
+                break;
+            }
+            // then the value as of that version
+            op->number = kvs_version(kvs, op->key);
+            // fall through
+        case OP_GET: {
+            // misses were loaded (or found known missing) before
+            const char* value = kvs_get_cached(kvs, op->key);
+            if (!value) {
+                op->status = OP_MISSING;
+                break;
+            }
+            op->len = strlen(value);
+            op->value = (char*)value;
+            if (copy) {
+                op->value = malloc(op->len + 1);
+                if (!op->value) {
+                    op->status = OP_FAILED;
+                    op->error = KVS_ERROR_MEMORY;
+                    break;
+                }
+                memcpy(op->value, value, op->len + 1);
+                op->owned = true;
+            }
+            op->status = OP_OK;
+            break;
+        }
+        case OP_SET:
+            if (kvs_set_len(kvs, op->key, op->value, op->len)) {
+                op->status = OP_OK;
+            } else {
+                fail_op(op);
+            }
+            break;
+        case OP_DEL:
+            op->number = kvs_delete(kvs, op->key);
+            op->status = OP_OK;
+            break;
+        case OP_INCR: {
+            long long number = 0;
+            const char* value = kvs_get_cached(kvs, op->key);
+            if (value) {
+                kvs_slice_t current = { (char*)value, strlen(value) };
+                if (!kvs_slice_to_ll(current, &number)) {
+                    op->status = OP_NOT_INTEGER;
+                    break;
+                }
+            }
+            if (number == LLONG_MAX) {
+                op->status = OP_OVERFLOW;
+                break;
+            }
+            number++;
+
+            char text[32];
+            snprintf(text, sizeof(text), "%lld", number);
+            if (!kvs_set(kvs, op->key, text)) {
+                fail_op(op);
+                break;
+            }
+            op->number = number;
+            op->status = OP_OK;
+            break;
+        }
+        case OP_SCAN: {
+            // COUNT is client-controlled, the page grows as keys arrive
+            size_t count = op->len;
+            size_t capacity = count < SCAN_DEFAULT_COUNT * 8 ? count : SCAN_DEFAULT_COUNT * 8;
+            scan_page_t page = { malloc(capacity * sizeof(int)), 0, capacity, false };
+            unsigned long long next = 0;
+            if (page.keys) {
+                next = kvs_scan(kvs, (unsigned long long)op->number, count, scan_visit, &page);
+            }
+            if (!page.keys || page.failed) {
+                free(page.keys);
+                op->status = OP_FAILED;
+                op->error = KVS_ERROR_MEMORY;
+                break;
+            }
+            op->keys = page.keys;
+            op->len = page.found;
+            op->number = (long long)next;
+            op->status = OP_OK;
+            break;
+        }
+    }
+}
+
+static bool reply_value(resp_buf_t* out, const shard_op_t* op) {
+    switch (op->status) {
+        case OP_OK:
+            return resp_add_bulk(out, op->value, op->len);
+        case OP_MISSING:
+            return resp_add_null(out);
+        default:
+            return reply_store_error(out, op->error);
+    }
+}
+
+/**
+ * SCAN reply
+ * With several shards the cursor is shard cursor * shards + shard, so a
+ * scan walks the shards one after the other; with one it is the
+ * kvs_scan cursor
+ */
+static bool reply_scan(kvs_worker_t* worker, resp_buf_t* out, const shard_op_t* op) {
+    if (op->status != OP_OK) {
+        return reply_store_error(out, op->error);
+    }
+
+    unsigned count = worker->server->worker_count;
+    unsigned long long next;
+    if (op->number != 0) {
+        next = (unsigned long long)op->number * count + op->shard;
+    } else {
+        next = op->shard + 1 < count ? op->shard + 1 : 0;
+    }
+
+    char number[32];
+    snprintf(number, sizeof(number), "%llu", next);
+    bool ok = resp_add_array(out, 2) &&
+              resp_add_bulk(out, number, strlen(number)) &&
+              resp_add_array(out, op->len);
+    for (size_t i = 0; ok && i < op->len; i++) {
+        int len = snprintf(number, sizeof(number), "%d", op->keys[i]);
+        ok = resp_add_bulk(out, number, (size_t)len);
+    }
+    return ok;
+}
+
+/**
+ * Reply to a binary request: the values of a GET, or how many keys a
+ * SET or DEL changed
+ */
+static bool reply_binary(kvs_conn_t* conn) {
+    shard_op_t* ops = conn->ops;
+    size_t count = conn->op_count;
+    resp_buf_t* out = &conn->out;
+
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].status == OP_FAILED) {
+            return reply_binary_store_error(out, ops[i].error);
+        }
+    }
+
+    switch (conn->command) {
+        case KVS_CMD_MGET: {
+            size_t length = 0;
+            for (size_t i = 0; i < count; i++) {
+                length += 4 + (ops[i].status == OP_OK ? ops[i].len : 0);
+            }
+            // more than a frame can carry: the client would take it for garbage
+            if (length > KVS_BIN_MAX_BODY) {
+                return kvs_bin_add_error(out, "ERR reply too large, ask for fewer keys");
+            }
+            bool ok = kvs_bin_add_header(out, KVS_BIN_OK, (uint16_t)count, (uint32_t)length);
+            for (size_t i = 0; ok && i < count; i++) {
+                ok = kvs_bin_add_value(out, ops[i].status == OP_OK ? ops[i].value : NULL, ops[i].len);
+            }
+            return ok;
+        }
+        case KVS_CMD_MSET:
+            return kvs_bin_add_header(out, KVS_BIN_OK, (uint16_t)count, 0);
+        case KVS_CMD_DEL: {
+            size_t deleted = 0;
+            for (size_t i = 0; i < count; i++) {
+                deleted += (size_t)ops[i].number;
+            }
+            return kvs_bin_add_header(out, KVS_BIN_OK, (uint16_t)deleted, 0);
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * Encode the reply of a command whose operations have all run
+ */
+static bool reply_ops(kvs_worker_t* worker, kvs_conn_t* conn) {
+    shard_op_t* ops = conn->ops;
+    size_t count = conn->op_count;
+    resp_buf_t* out = &conn->out;
+
+    if (conn->binary) {
+        return reply_binary(conn);
+    }
+    switch (conn->command) {
+        case KVS_CMD_GET:
+            return reply_value(out, &ops[0]);
+        case KVS_CMD_MGET: {
+            bool ok = resp_add_array(out, count);
+            for (size_t i = 0; ok && i < count; i++) {
+                ok = reply_value(out, &ops[i]);
+            }
+            return ok;
+        }
+        case KVS_CMD_SET:
+        case KVS_CMD_MSET:
+            // arguments are checked up front, so only a store failure shows up here
+            for (size_t i = 0; i < count; i++) {
+                if (ops[i].status == OP_FAILED) {
+                    return reply_store_error(out, ops[i].error);
+                }
+            }
+            return resp_add_simple(out, "OK");
+        case KVS_CMD_DEL: {
+            long long deleted = 0;
+            for (size_t i = 0; i < count; i++) {
+                deleted += ops[i].number;
+            }
+            return resp_add_integer(out, deleted);
+        }
+        case KVS_CMD_INCR:
+            switch (ops[0].status) {
+                case OP_OK:
+                    return resp_add_integer(out, ops[0].number);
+                case OP_NOT_INTEGER:
+                    return resp_add_error(out, "ERR value is not an integer or out of range");
+                case OP_OVERFLOW:
+                    return resp_add_error(out, "ERR increment or decrement would overflow");
+                default:
+                    return reply_store_error(out, ops[0].error);
+            }
+        case KVS_CMD_SCAN:
+            return reply_scan(worker, out, &ops[0]);
+        case KVS_CMD_WAITKEY:
+            if (ops[0].status == OP_FAILED) {
+                return reply_store_error(out, ops[0].error);
+            }
+            return resp_add_array(out, 2) && resp_add_integer(out, ops[0].number) && reply_value(out, &ops[0]);
+        default:
+            return false;
+    }
+}
+
+/**
+ * The stream misses a write: start a new one, replicas resync in full
+ */
+static void log_lost(kvs_repl_t* repl) {
+    kvs_repl_new_id(repl->id);
+    repl->log.start = repl->log.end;
+    repl->resync = true;
+    abandon_save(repl);
+}
+
+/**
+ * Add a write that took effect to the replication log
+ * INCR goes in as a SET of the result, replicas don't redo the arithmetic
+ */
+static void log_write(kvs_repl_t* repl, const shard_op_t* op) {
+    if (op->status != OP_OK || (op->type == OP_DEL && op->number == 0)) {
+        return;
+    }
+
+    char key[16];
+    char number[32];
+    int key_len = snprintf(key, sizeof(key), "%d", op->key);
+    resp_buf_t* buf = &repl->scratch;
+    buf->len = 0;
+
+    bool ok;
+    switch (op->type) {
+        case OP_SET:
+            ok = resp_add_array(buf, 3) && resp_add_bulk(buf, "SET", 3) &&
+                 resp_add_bulk(buf, key, (size_t)key_len) && resp_add_bulk(buf, op->value, op->len);
+            break;
+        case OP_INCR: {
+            int len = snprintf(number, sizeof(number), "%lld", op->number);
+            ok = resp_add_array(buf, 3) && resp_add_bulk(buf, "SET", 3) &&
+                 resp_add_bulk(buf, key, (size_t)key_len) && resp_add_bulk(buf, number, (size_t)len);
+            break;
+        }
+        case OP_DEL:
+            ok = resp_add_array(buf, 2) && resp_add_bulk(buf, "DEL", 3) &&
+                 resp_add_bulk(buf, key, (size_t)key_len);
+            break;
+        default:
+            return;
+    }
+
+    if (ok) {
+        kvs_repl_log_append(&repl->log, buf->data, buf->len);
+    } else {
+        log_lost(repl);
+    }
+}
+
+/**
+ * Run the local operations of a multi-key command through the batched
+ * store calls, BATCH_KEYS at a time
+ * @return false if a batch of writes failed part way (some of it may
+ *         have been applied, all of it is reported failed)
+ */
+static bool run_local_batch(kvs_worker_t* worker, kvs_conn_t* conn) {
+    int keys[BATCH_KEYS];
+    const char* values[BATCH_KEYS];
+    size_t lens[BATCH_KEYS];
+    bool deleted[BATCH_KEYS];
+    shard_op_t* batch[BATCH_KEYS];
+    bool ok = true;
+
+    size_t i = 0;
+    while (i < conn->op_count) {
+        size_t n = 0;
+        for (; i < conn->op_count && n < BATCH_KEYS; i++) {
+            shard_op_t* op = &conn->ops[i];
+            if (op->shard == worker->index && !op->answered) {
+                batch[n] = op;
+                keys[n] = op->key;
+                values[n] = op->value;
+                lens[n] = op->len;
+                n++;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+
+        switch (batch[0]->type) {
+            case OP_GET:
+                kvs_mget(worker->kvs, keys, n, values);
+                for (size_t j = 0; j < n; j++) {
+                    batch[j]->status = values[j] ? OP_OK : OP_MISSING;
+                    batch[j]->value = (char*)values[j];
+                    batch[j]->len = values[j] ? strlen(values[j]) : 0;
+                }
+                break;
+            case OP_SET: {
+                bool set = kvs_mset(worker->kvs, keys, values, lens, n);
+                for (size_t j = 0; j < n; j++) {
+                    if (set) {
+                        batch[j]->status = OP_OK;
+                    } else {
+                        fail_op(batch[j]);
+                    }
+                }
+                ok = ok && set;
+                break;
+            }
+            case OP_DEL:
+                kvs_mdel(worker->kvs, keys, n, deleted);
+                for (size_t j = 0; j < n; j++) {
+                    batch[j]->number = deleted[j];
+                    batch[j]->status = OP_OK;
+                }
+                break;
+            default:
+                for (size_t j = 0; j < n; j++) {
+                    run_op(worker->kvs, batch[j], false);
+                }
+                break;
+        }
+    }
+    return ok;
+}
+
+/**
+ * Run the local operations of a command and write its reply
+ * Local operations run last, so GET results can point into the shard
+ */
+static bool finish_ops(kvs_worker_t* worker, kvs_conn_t* conn) {
+    kvs_repl_t* repl = worker->server->repl;
+    bool logging = repl && repl->log.data;
+    bool multi = conn->command == KVS_CMD_MGET || conn->command == KVS_CMD_MSET ||
+                 conn->command == KVS_CMD_DEL;
+
+    if (multi && conn->op_count > 1) {
+        if (!run_local_batch(worker, conn) && logging) {
+            log_lost(repl);
+            logging = false;
+        }
+    } else {
+        for (size_t i = 0; i < conn->op_count; i++) {
+            if (conn->ops[i].shard == worker->index && !conn->ops[i].answered) {
+                run_op(worker->kvs, &conn->ops[i], false);
+            }
+        }
+    }
+
+    for (size_t i = 0; logging && i < conn->op_count; i++) {
+        if (conn->ops[i].shard == worker->index) {
+            log_write(repl, &conn->ops[i]);
+        }
+    }
+
+    bool ok = reply_ops(worker, conn);
+    release_ops(conn);
+    return ok;
+}
+
+/**
+ * Hand an operation to another loop, queueing it if the ring is full
+ */
+static void send_op(kvs_worker_t* worker, unsigned to, shard_op_t* op) {
+    op_queue_t* queue = &worker->backlog[to];
+    if (queue->head || !spsc_push(ring_between(worker->server, worker->index, to), op)) {
+        op->next = NULL;
+        if (queue->tail) {
+            queue->tail->next = op;
+        } else {
+            queue->head = op;
+        }
+        queue->tail = op;
+        worker->backlogged = true;
+    }
+    worker->notify[to] = true;
+}
+
+/**
+ * Whether a WAITKEY can be answered: the key's version moved past the
+ * one given, or the deadline passed (the shard starts keeping versions
+ * on first use; failing that, the failure is the answer)
+ */
+static bool wait_over(kvs_worker_t* worker, const shard_op_t* op, long long now) {
+    if (!worker->kvs->waits && !kvs_wait_enable(worker->kvs)) {
+        return true;
+    }
+    return kvs_version(worker->kvs, op->key) != (uint32_t)op->number ||
+           (op->deadline_ms >= 0 && now >= op->deadline_ms);
+}
+
+static void park_op(kvs_worker_t* worker, shard_op_t* op) {
+    op->next = worker->waiters;
+    worker->waiters = op;
+}
+
+/**
+ * Whether an operation reads a key the shard has to load first
+ */
+static bool needs_load(kvs_worker_t* worker, const shard_op_t* op) {
+    return worker->flights && (op->type == OP_GET || op->type == OP_INCR) &&
+           kvs_readthrough_needed(worker->kvs, op->key);
+}
+
+/**
+ * Park an operation on the load of its key, starting one if none is out
+ * @return false if there was no memory to start it
+ */
+static bool join_load(kvs_worker_t* worker, shard_op_t* op) {
+    uint32_t hash = (uint32_t)op->key * 0x9e3779b1u;
+    load_flight_t** bucket = &worker->flights[hash >> (32 - LOAD_FLIGHT_BITS)];
+    load_flight_t* flight = *bucket;
+    while (flight && flight->load.key != op->key) {
+        flight = flight->next;
+    }
+
+    if (!flight) {
+        flight = calloc(1, sizeof(load_flight_t));
+        if (!flight) {
+            return false;
+        }
+        readthrough_t* rt = worker->kvs->readthrough;
+        flight->load.loader = rt->loader;
+        flight->load.ctx = rt->ctx;
+        flight->load.key = op->key;
+        flight->load.queue = worker->index;
+        flight->generation = kvs_readthrough_generation(worker->kvs, op->key);
+        flight->next = *bucket;
+        *bucket = flight;
+        worker->loading++;
+        load_pool_submit(worker->server->loads, &flight->load);
+    }
+    op->next = flight->ops;
+    flight->ops = op;
+    return true;
+}
+
+/**
+ * Answer an operation whose load failed with the failure
+ */
+static void fail_load(shard_op_t* op, kvs_error_t error) {
+    op->status = OP_FAILED;
+    op->error = error;
+    op->answered = true;
+}
+
+/**
+ * Run or forward the operations of the current command
+ * Replies right away when every operation is local and none waits or
+ * loads; otherwise the reply is written once the others come back
+ */
+static bool start_ops(kvs_worker_t* worker, kvs_conn_t* conn) {
+    size_t remote = 0;
+    long long now = now_ms();
+    for (size_t i = 0; i < conn->op_count; i++) {
+        shard_op_t* op = &conn->ops[i];
+        remote += op->shard != worker->index || (op->type == OP_WAIT && !wait_over(worker, op, now)) ||
+                  needs_load(worker, op);
+    }
+    if (remote == 0) {
+        return finish_ops(worker, conn);
+    }
+
+    // the input buffer moves on while we wait, so SET values are copied
+    for (size_t i = 0; i < conn->op_count; i++) {
+        shard_op_t* op = &conn->ops[i];
+        if (op->type == OP_SET) {
+            char* copy = malloc(op->len + 1);
+            if (!copy) {
+                return false;
+            }
+            memcpy(copy, op->value, op->len);
+            copy[op->len] = '\0';
+            op->value = copy;
+            op->owned = true;
+        }
+    }
+
+    conn->pending = remote;
+    for (size_t i = 0; i < conn->op_count; i++) {
+        shard_op_t* op = &conn->ops[i];
+        if (op->shard != worker->index) {
+            send_op(worker, op->shard, op);
+        } else if (op->type == OP_WAIT && !wait_over(worker, op, now)) {
+            park_op(worker, op);
+        } else if (needs_load(worker, op) && !join_load(worker, op)) {
+            fail_load(op, KVS_ERROR_MEMORY);
+            conn->pending--;
+        }
+    }
+    return conn->pending > 0 || finish_ops(worker, conn);
+}
+
+static bool cmd_ping(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)worker;
+    if (argc > 2) {
+        return resp_add_error(&conn->out, "ERR wrong number of arguments for 'ping' command");
+    }
+    return argc == 2 ? resp_add_bulk(&conn->out, argv[1].ptr, argv[1].len)
+                     : resp_add_simple(&conn->out, "PONG");
+}
+
+static bool cmd_get(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)argc;
+    int key;
+    if (!kvs_slice_to_int(argv[1], &key)) {
+        return resp_add_error(&conn->out, ERR_KEY);
+    }
+
+    if (!reset_ops(conn, KVS_CMD_GET, 1)) {
+        return false;
+    }
+    add_key_op(worker, conn, OP_GET, key);
+    return start_ops(worker, conn);
+}
+
+static bool cmd_set(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)argc;
+    int key;
+    if (!kvs_slice_to_int(argv[1], &key)) {
+        return resp_add_error(&conn->out, ERR_KEY);
+    }
+    if (!valid_value(argv[2])) {
+        return resp_add_error(&conn->out, ERR_VALUE);
+    }
+
+    if (!reset_ops(conn, KVS_CMD_SET, 1)) {
+        return false;
+    }
+    shard_op_t* op = add_key_op(worker, conn, OP_SET, key);
+    op->value = argv[2].ptr;
+    op->len = argv[2].len;
+    return start_ops(worker, conn);
+}
+
+/**
+ * One operation per key argument, for DEL and MGET
+ */
+static bool cmd_keys(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc,
+                     kvs_command_id_t command, op_type_t type) {
+    if (!valid_keys(argv, argc, 1, 1)) {
+        return resp_add_error(&conn->out, ERR_KEY);
+    }
+
+    if (!reset_ops(conn, command, argc - 1)) {
+        return false;
+    }
+    for (size_t i = 1; i < argc; i++) {
+        int key;
+        kvs_slice_to_int(argv[i], &key);
+        add_key_op(worker, conn, type, key);
+    }
+    return start_ops(worker, conn);
+}
+
+static bool cmd_del(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    return cmd_keys(worker, conn, argv, argc, KVS_CMD_DEL, OP_DEL);
+}
+
+static bool cmd_mget(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    return cmd_keys(worker, conn, argv, argc, KVS_CMD_MGET, OP_GET);
+}
+
+static bool cmd_mset(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    if (argc % 2 == 0) {
+        return resp_add_error(&conn->out, "ERR wrong number of arguments for 'mset' command");
+    }
+    if (!valid_keys(argv, argc, 1, 2)) {
+        return resp_add_error(&conn->out, ERR_KEY);
+    }
+    for (size_t i = 2; i < argc; i += 2) {
+        if (!valid_value(argv[i])) {
+            return resp_add_error(&conn->out, ERR_VALUE);
+        }
+    }
+
+    if (!reset_ops(conn, KVS_CMD_MSET, argc / 2)) {
+        return false;
+    }
+    for (size_t i = 1; i < argc; i += 2) {
+        int key;
+        kvs_slice_to_int(argv[i], &key);
+        shard_op_t* op = add_key_op(worker, conn, OP_SET, key);
+        op->value = argv[i + 1].ptr;
+        op->len = argv[i + 1].len;
+    }
+    return start_ops(worker, conn);
+}
+
+static bool cmd_incr(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)argc;
+    int key;
+    if (!kvs_slice_to_int(argv[1], &key)) {
+        return resp_add_error(&conn->out, ERR_KEY);
+    }
+
+    // the read-modify-write runs on the owning loop, so it can't interleave
+    if (!reset_ops(conn, KVS_CMD_INCR, 1)) {
+        return false;
+    }
+    add_key_op(worker, conn, OP_INCR, key);
+    return start_ops(worker, conn);
+}
+
+/**
+ * WAITKEY key version timeout-ms
+ * Replies [version, value] once the key's version differs from the one
+ * given (0 answers at once), or with the version unchanged when the
+ * timeout passes (negative: none); other commands of the connection
+ * wait behind it
+ */
+static bool cmd_waitkey(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)argc;
+    int key;
+    long long version;
+    long long timeout;
+    if (!kvs_slice_to_int(argv[1], &key)) {
+        return resp_add_error(&conn->out, ERR_KEY);
+    }
+    if (!kvs_slice_to_ll(argv[2], &version) || version < 0 || version > UINT32_MAX) {
+        return resp_add_error(&conn->out, "ERR invalid version");
+    }
+    if (!kvs_slice_to_ll(argv[3], &timeout)) {
+        return resp_add_error(&conn->out, "ERR invalid timeout");
+    }
+
+    if (!reset_ops(conn, KVS_CMD_WAITKEY, 1)) {
+        return false;
+    }
+    shard_op_t* op = add_key_op(worker, conn, OP_WAIT, key);
+    op->number = version;
+    // a deadline past what the clock can reach is no deadline
+    long long now = now_ms();
+    op->deadline_ms = timeout < 0 || timeout > LLONG_MAX - now ? -1 : now + timeout;
+    return start_ops(worker, conn);
+}
+
+/**
+ * SCAN cursor [COUNT n]
+ * Within a shard the cursor is a kvs_scan cursor: a page costs O(count)
+ * and a scan across resizes misses no key (it may repeat some)
+ */
+static bool cmd_scan(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    long long cursor;
+    long long count = SCAN_DEFAULT_COUNT;
+    if (!kvs_slice_to_ll(argv[1], &cursor) || cursor < 0) {
+        return resp_add_error(&conn->out, "ERR invalid cursor");
+    }
+    if (argc == 4 && kvs_slice_equals(argv[2], "COUNT")) {
+        if (!kvs_slice_to_ll(argv[3], &count) || count < 1) {
+            return resp_add_error(&conn->out, "ERR syntax error");
+        }
+    } else if (argc != 2) {
+        return resp_add_error(&conn->out, "ERR syntax error");
+    }
+
+    unsigned shards = worker->server->worker_count;
+    if (!reset_ops(conn, KVS_CMD_SCAN, 1)) {
+        return false;
+    }
+    shard_op_t* op = add_op(worker, conn, OP_SCAN, (unsigned)(cursor % shards));
+    op->number = cursor / shards;
+    op->len = (size_t)count;
+    return start_ops(worker, conn);
+}
+
+static size_t shard_capacity(kvstore_t* kvs) {
+    return kvs->mapped ? mt_capacity(kvs->mapped) : ht_capacity(kvs->table);
+}
+
+/**
+ * Replication section of INFO
+ * @return bytes written
+ */
+static int info_replication(kvs_repl_t* repl, char* text, size_t size) {
+    int len;
+    if (repl->primary) {
+        len = snprintf(text, size,
+                       "\r\n# Replication\r\n"
+                       "role:replica\r\n"
+                       "primary:%s\r\n"
+                       "link:%s\r\n"
+                       "replication_id:%s\r\n"
+                       "replication_offset:%llu\r\n",
+                       repl->primary,
+                       repl->state == LINK_STREAMING ? "up" : repl->link ? "syncing" : "down",
+                       repl->primary_id,
+                       (unsigned long long)repl->offset);
+        return len < (int)size ? len : (int)size - 1;
+    }
+
+    len = snprintf(text, size,
+                   "\r\n# Replication\r\n"
+                   "role:primary\r\n"
+                   "replication_id:%s\r\n"
+                   "replication_offset:%llu\r\n"
+                   "log_bytes:%llu\r\n"
+                   "full_syncs:%llu\r\n"
+                   "partial_syncs:%llu\r\n"
+                   "connected_replicas:%zu\r\n",
+                   repl->id,
+                   (unsigned long long)repl->log.end,
+                   (unsigned long long)(repl->log.end - repl->log.start),
+                   (unsigned long long)repl->full_syncs,
+                   (unsigned long long)repl->partial_syncs,
+                   repl->replica_count);
+    for (size_t i = 0; i < repl->replica_count && i < INFO_MAX_REPLICAS && len < (int)size; i++) {
+        kvs_conn_t* replica = repl->replicas[i];
+        len += snprintf(text + len, size - (size_t)len, "replica%zu:state=%s,acked=%llu,lag=%llu\r\n", i,
+                        replica->snapshot_fd >= 0 ? "sync" : "online",
+                        (unsigned long long)replica->ack_offset,
+                        (unsigned long long)(repl->log.end - replica->ack_offset));
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/**
+ * INFO, summed over all loops
+ * Other loops' figures are the ones they last published
+ */
+static bool cmd_info(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)argv;
+    (void)argc;
+    kvs_server_t* server = worker->server;
+
+    size_t connected = 0;
+    size_t keys = 0;
+    size_t capacity = 0;
+    unsigned long long connections = 0;
+    unsigned long long commands = 0;
+    for (unsigned i = 0; i < server->worker_count; i++) {
+        kvs_worker_t* other = &server->workers[i];
+        connected += STAT_GET(other->connected);
+        connections += STAT_GET(other->total_connections);
+        commands += STAT_GET(other->total_commands);
+        if (other == worker) {
+            keys += kvs_count(worker->kvs);
+            capacity += shard_capacity(worker->kvs);
+        } else {
+            keys += STAT_GET(other->keys);
+            capacity += STAT_GET(other->capacity);
+        }
+    }
+
+    char text[4096];
+    int len = snprintf(text, sizeof(text),
+                       "# Server\r\n"
+                       "process_id:%ld\r\n"
+                       "mode:%s\r\n"
+                       "event_loops:%u\r\n"
+                       "io_backend:%s\r\n"
+                       "\r\n# Clients\r\n"
+                       "connected_clients:%zu\r\n"
+                       "\r\n# Stats\r\n"
+                       "total_connections_received:%llu\r\n"
+                       "total_commands_processed:%llu\r\n"
+                       "\r\n# Keyspace\r\n"
+                       "keys:%zu\r\n"
+                       "capacity:%zu\r\n",
+                       (long)getpid(),
+                       worker->kvs->mapped ? "mapped" : "heap",
+                       server->worker_count,
+                       kvs_server_backend_name(server->backend),
+                       connected,
+                       connections,
+                       commands,
+                       keys,
+                       capacity);
+    if (server->repl) {
+        len += info_replication(server->repl, text + len, sizeof(text) - (size_t)len);
+    }
+    return resp_add_bulk(&conn->out, text, (size_t)len);
+}
+
+/**
+ * COMMAND, answered with an empty list so redis-cli starts up quietly
+ */
+static bool cmd_command(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)worker;
+    (void)argv;
+    (void)argc;
+    return resp_add_array(&conn->out, 0);
+}
+
+/**
+ * The snapshot for replicas is written (ok) or failed: start streaming
+ * it to the replicas waiting for it, or drop them
+ */
+static void finish_save(kvs_worker_t* worker, kvs_repl_t* repl, bool ok) {
+    // closing a replica swaps the last one into its slot, so walk backwards
+    for (size_t i = repl->replica_count; i-- > 0;) {
+        kvs_conn_t* conn = repl->replicas[i];
+        if (!conn->snapshot_wait) {
+            continue;
+        }
+        conn->snapshot_wait = false;
+
+        struct stat st;
+        int fd = ok ? open(repl->save_path, O_RDONLY | O_CLOEXEC) : -1;
+        char header[32];
+        int len = 0;
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+            len = snprintf(header, sizeof(header), "$%llu\r\n", (unsigned long long)st.st_size);
+        }
+        if (len == 0 || !resp_add_raw(&conn->out, header, (size_t)len)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            close_conn(worker, conn);
+            continue;
+        }
+        conn->snapshot_fd = fd;
+        conn->snapshot_left = (uint64_t)st.st_size;
+    }
+    unlink(repl->save_path);
+    repl->save_pid = 0;
+}
+
+/**
+ * Start writing a snapshot for replicas, at the current log offset
+ * A child process saves the store as it was when forked (copy-on-write)
+ * while the loop carries on and the log buffers the writes after it.
+ * A mapped table is shared with the child rather than copied, so it is
+ * still saved on the loop
+ */
+static bool start_save(kvs_worker_t* worker, kvs_repl_t* repl) {
+    const char* dir = getenv("TMPDIR");
+    snprintf(repl->save_path, sizeof(repl->save_path), "%s/kvs-sync-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(repl->save_path);
+    if (fd < 0) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+    repl->save_offset = repl->log.end;
+
+    if (worker->kvs->mapped) {
+        close(fd);
+        if (!kvs_save_sharded(&worker->kvs, 1, repl->save_path)) {
+            unlink(repl->save_path);
+            return false;
+        }
+        repl->save_pid = -1;
+        return true;
+    }
+
+    // The load pool, write-back flusher and metrics threads keep running
+    // across the fork, and the child gets a copy of any lock they held
+    // (malloc's included). Rather than stop them, the child relies only on
+    // memory taken here and on write(2) and _exit: the writer is sized for
+    // every entry, and the store's own loop is this thread, so nothing
+    // changes the table between here and the fork
+    kvs_snapshot_writer_t* writer = kvs_snapshot_writer_create(kvs_count(worker->kvs));
+    if (!writer) {
+        close(fd);
+        unlink(repl->save_path);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(kvs_save_fd(worker->kvs, fd, writer) ? 0 : 1);
+    }
+    close(fd);
+    kvs_snapshot_writer_destroy(writer);
+    if (pid < 0) {
+        unlink(repl->save_path);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+    repl->save_pid = pid;
+    return true;
+}
+
+/**
+ * See whether the child writing the snapshot for replicas is done
+ * @return true if it is (the snapshot is then on its way or failed)
+ */
+static bool poll_save(kvs_worker_t* worker, kvs_repl_t* repl) {
+    if (repl->save_pid < 0) {
+        finish_save(worker, repl, true);
+        return true;
+    }
+    int status;
+    pid_t pid = waitpid(repl->save_pid, &status, WNOHANG);
+    if (pid == 0) {
+        return false;
+    }
+    finish_save(worker, repl, pid == repl->save_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return true;
+}
+
+/**
+ * PSYNC <id> <offset>, from a replica
+ * Continues from offset if the log still has it, otherwise sends a
+ * snapshot and the log from the offset it was taken at. The snapshot is
+ * written off the loop (start_save), shared by the replicas that ask
+ * for one meanwhile, then streamed as each replica reads it
+ */
+static bool cmd_psync(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)argc;
+    kvs_repl_t* repl = worker->server->repl;
+    if (!repl) {
+        return resp_add_error(&conn->out, "ERR replication needs a single event loop");
+    }
+    if (repl->primary) {
+        return resp_add_error(&conn->out, "ERR a replica can't have replicas");
+    }
+    long long offset;
+    if (conn->replica || !kvs_slice_to_ll(argv[2], &offset)) {
+        return resp_add_error(&conn->out, "ERR syntax error");
+    }
+    if (!repl->log.data && !kvs_repl_log_init(&repl->log, repl->log_size, 0)) {
+        return false;
+    }
+    if (!add_replica(repl, conn)) {
+        return false;
+    }
+
+    char line[128];
+    if (argv[1].len == KVS_REPL_ID_LENGTH && memcmp(argv[1].ptr, repl->id, KVS_REPL_ID_LENGTH) == 0 &&
+        offset >= 0 && kvs_repl_log_has(&repl->log, (uint64_t)offset)) {
+        conn->repl_offset = (uint64_t)offset;
+        repl->partial_syncs++;
+        snprintf(line, sizeof(line), "CONTINUE %s", repl->id);
+        return resp_add_simple(&conn->out, line);
+    }
+
+    if (repl->save_pid == 0 && !start_save(worker, repl)) {
+        remove_replica(repl, conn);
+        return reply_store_error(&conn->out, kvs_get_error());
+    }
+    conn->snapshot_wait = true;
+    conn->repl_offset = repl->save_offset;
+    repl->full_syncs++;
+
+    snprintf(line, sizeof(line), "FULLRESYNC %s %llu", repl->id, (unsigned long long)repl->save_offset);
+    return resp_add_simple(&conn->out, line);
+}
+
+/**
+ * REPLCONF ACK <offset> from a replica, which gets no reply;
+ * other REPLCONF options are accepted and ignored
+ */
+static bool cmd_replconf(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)worker;
+    if (argc == 3 && kvs_slice_equals(argv[1], "ACK")) {
+        long long offset;
+        if (conn->replica && kvs_slice_to_ll(argv[2], &offset) && offset >= 0) {
+            conn->ack_offset = (uint64_t)offset;
+        }
+        return true;
+    }
+    return resp_add_simple(&conn->out, "OK");
+}
+
+/**
+ * Send a reply with descriptors attached
+ */
+static bool send_fds(int sock, const char* data, size_t len, const int* fds, size_t count) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { (void*)data, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+/**
+ * SHM: move the connection onto a shared-memory ring pair
+ * The +OK carries the segment and the eventfd, so it goes out here
+ * rather than through the output buffer
+ */
+static bool cmd_shm(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)argv;
+    (void)argc;
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    if (worker->uring) {
+        return resp_add_error(&conn->out, "ERR SHM needs the epoll backend");
+    }
+    if (getsockname(conn->fd, (struct sockaddr*)&local, &local_len) != 0 || local.ss_family != AF_UNIX) {
+        return resp_add_error(&conn->out, "ERR SHM needs a Unix socket connection");
+    }
+    if (conn->shm.header || conn->out.len > 0) {
+        return resp_add_error(&conn->out, "ERR SHM must be the only request in flight");
+    }
+
+    int fds[2] = { -1, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) };
+    if (fds[1] < 0 || !kvs_shm_create(&conn->shm, &fds[0])) {
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        return resp_add_error(&conn->out, "ERR could not create the shared segment");
+    }
+    bool ok = send_fds(conn->fd, "+OK\r\n", 5, fds, 2) &&
+              watch(worker, fds[1], EPOLLIN | EPOLLET, &worker->shm_conns);
+    close(fds[0]);
+    if (!ok) {
+        // the client may have switched already, hanging up tells it
+        close(fds[1]);
+        kvs_shm_detach(&conn->shm);
+        conn->closing = true;
+        return true;
+    }
+
+    conn->shm_event_fd = fds[1];
+    conn->shm_next = worker->shm_conns;
+    worker->shm_conns = conn;
+    worker->shm_active_ns = now_ns();
+    return true;
+}
+
+static bool cmd_quit(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    (void)worker;
+    (void)argv;
+    (void)argc;
+    conn->closing = true;
+    return resp_add_simple(&conn->out, "OK");
+}
+
+static const command_t commands[KVS_CMD_COUNT] = {
+    [KVS_CMD_GET] = { cmd_get, 2 },
+    [KVS_CMD_SET] = { cmd_set, 3 },
+    [KVS_CMD_DEL] = { cmd_del, -2 },
+    [KVS_CMD_MGET] = { cmd_mget, -2 },
+    [KVS_CMD_MSET] = { cmd_mset, -3 },
+    [KVS_CMD_MDEL] = { cmd_del, -2 },
+    [KVS_CMD_INCR] = { cmd_incr, 2 },
+    [KVS_CMD_SCAN] = { cmd_scan, -2 },
+    [KVS_CMD_INFO] = { cmd_info, -1 },
+    [KVS_CMD_PING] = { cmd_ping, -1 },
+    [KVS_CMD_COMMAND] = { cmd_command, -1 },
+    [KVS_CMD_QUIT] = { cmd_quit, 1 },
+    [KVS_CMD_PSYNC] = { cmd_psync, 3 },
+    [KVS_CMD_REPLCONF] = { cmd_replconf, -2 },
+    [KVS_CMD_SHM] = { cmd_shm, 1 },
+    [KVS_CMD_WAITKEY] = { cmd_waitkey, 4 },
+};
+
+static bool is_write(kvs_command_id_t id) {
+    return id == KVS_CMD_SET || id == KVS_CMD_DEL || id == KVS_CMD_MDEL || id == KVS_CMD_MSET ||
+           id == KVS_CMD_INCR;
+}
+
+/**
+ * Execute one request and append its reply
+ * (or start it, if it waits on other loops)
+ */
+static bool execute(kvs_worker_t* worker, kvs_conn_t* conn, kvs_slice_t* argv, size_t argc) {
+    STAT_ADD(worker->total_commands, 1);
+
+    kvs_command_id_t id = kvs_command_lookup(argv[0]);
+    const command_t* cmd = &commands[id];
+    if (cmd->handler) {
+        if ((cmd->arity > 0 && argc != (size_t)cmd->arity) ||
+            (cmd->arity < 0 && argc < (size_t)-cmd->arity)) {
+            char msg[96];
+            snprintf(msg, sizeof(msg), "ERR wrong number of arguments for '%s' command",
+                     kvs_command_name(id));
+            return resp_add_error(&conn->out, msg);
+        }
+        kvs_repl_t* repl = worker->server->repl;
+        if (repl && repl->primary && is_write(id)) {
+            return resp_add_error(&conn->out, "READONLY You can't write against a read only replica");
+        }
+        return cmd->handler(worker, conn, argv, argc);
+    }
+
+    char msg[96];
+    int name_len = argv[0].len > 32 ? 32 : (int)argv[0].len;
+    snprintf(msg, sizeof(msg), "ERR unknown command '%.*s'", name_len, argv[0].ptr);
+    return resp_add_error(&conn->out, msg);
+}
+
+/**
+ * Execute one binary request and append its reply
+ * (or start it, if it waits on other loops)
+ */
+static bool execute_binary(kvs_worker_t* worker, kvs_conn_t* conn, const kvs_bin_frame_t* frame) {
+    STAT_ADD(worker->total_commands, 1);
+
+    if (!kvs_bin_check_request(frame)) {
+        return kvs_bin_add_error(&conn->out, "ERR malformed request");
+    }
+    if (frame->code == KVS_BIN_PING) {
+        return kvs_bin_add_header(&conn->out, KVS_BIN_OK, 0, 0);
+    }
+    kvs_repl_t* repl = worker->server->repl;
+    if (repl && repl->primary && frame->code != KVS_BIN_GET) {
+        return kvs_bin_add_error(&conn->out, "READONLY You can't write against a read only replica");
+    }
+
+    size_t count = frame->count;
+    const char* value = kvs_bin_values(frame);
+    if (frame->code == KVS_BIN_SET) {
+        for (size_t i = 0; i < count; i++) {
+            size_t len = kvs_bin_value_len(frame, i);
+            if (len > KVS_MAX_VALUE_LENGTH || memchr(value, '\0', len)) {
+                return kvs_bin_add_error(&conn->out, ERR_VALUE);
+            }
+            value += len;
+        }
+        value = kvs_bin_values(frame);
+    }
+
+    kvs_command_id_t command = frame->code == KVS_BIN_GET ? KVS_CMD_MGET :
+                               frame->code == KVS_BIN_SET ? KVS_CMD_MSET : KVS_CMD_DEL;
+    op_type_t type = frame->code == KVS_BIN_GET ? OP_GET : frame->code == KVS_BIN_SET ? OP_SET : OP_DEL;
+    if (!reset_ops(conn, command, count)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        shard_op_t* op = add_key_op(worker, conn, type, kvs_bin_key(frame, i));
+        if (type == OP_SET) {
+            // the frame stays in the input buffer until the command is done
+            op->value = (char*)value;
+            op->len = kvs_bin_value_len(frame, i);
+            value += op->len;
+        }
+    }
+    return start_ops(worker, conn);
+}
+
+/**
+ * Apply a write from the primary's log
+ */
+static void apply_write(kvstore_t* kvs, kvs_slice_t* argv, size_t argc) {
+    int key;
+    switch (kvs_command_lookup(argv[0])) {
+        case KVS_CMD_SET:
+            if (argc == 3 && kvs_slice_to_int(argv[1], &key)) {
+                kvs_set_len(kvs, key, argv[2].ptr, argv[2].len);
+            }
+            break;
+        case KVS_CMD_DEL:
+            for (size_t i = 1; i < argc; i++) {
+                if (kvs_slice_to_int(argv[i], &key)) {
+                    kvs_delete(kvs, key);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Replace the store with the snapshot just received
+ */
+static bool load_snapshot(kvs_worker_t* worker, kvs_repl_t* repl) {
+    close(repl->snapshot_fd);
+    repl->snapshot_fd = -1;
+
+    kvs_load_filter_t all = { KVS_FILTER_ALL, { 0, 0 }, 0, 0, NULL, NULL };
+    bool ok = kvs_clear(worker->kvs) && kvs_load_range(worker->kvs, repl->snapshot_path, &all);
+    unlink(repl->snapshot_path);
+
+    // a failed load leaves a partial store, only a full resync fixes that
+    if (!ok) {
+        repl->primary_id[0] = '\0';
+        return false;
+    }
+    memcpy(repl->primary_id, repl->pending_id, sizeof(repl->primary_id));
+    repl->offset = repl->pending_offset;
+    repl->acked = UINT64_MAX;
+    repl->ack_ms = 0;
+    repl->state = LINK_STREAMING;
+    return true;
+}
+
+/**
+ * A line from the primary: its PSYNC answer, or the snapshot length
+ */
+static bool link_line(kvs_repl_t* repl, const char* data, size_t len) {
+    char line[128];
+    if (len >= sizeof(line)) {
+        return false;
+    }
+    memcpy(line, data, len);
+    line[len] = '\0';
+
+    char id[KVS_REPL_ID_LENGTH + 1];
+    unsigned long long number;
+    if (repl->state == LINK_HANDSHAKE) {
+        if (sscanf(line, "+FULLRESYNC %40s %llu", id, &number) == 2 &&
+            strlen(id) == KVS_REPL_ID_LENGTH) {
+            memcpy(repl->pending_id, id, sizeof(id));
+            repl->pending_offset = number;
+            repl->state = LINK_SNAPSHOT;
+            return true;
+        }
+        if (sscanf(line, "+CONTINUE %40s", id) == 1 && strcmp(id, repl->primary_id) == 0) {
+            repl->state = LINK_STREAMING;
+            return true;
+        }
+        return false;
+    }
+
+    // LINK_SNAPSHOT, before the snapshot: $<length>
+    if (sscanf(line, "$%llu", &number) != 1) {
+        return false;
+    }
+    const char* dir = getenv("TMPDIR");
+    snprintf(repl->snapshot_path, sizeof(repl->snapshot_path), "%s/kvs-replica-XXXXXX",
+             dir && *dir && strlen(dir) < 32 ? dir : "/tmp");
+    repl->snapshot_fd = mkstemp(repl->snapshot_path);
+    repl->snapshot_left = number;
+    return repl->snapshot_fd >= 0;
+}
+
+/**
+ * Acknowledge the applied offset, at most every KVS_REPL_ACK_INTERVAL_MS
+ */
+static bool send_ack(kvs_repl_t* repl, kvs_conn_t* link, long long now) {
+    if (repl->state != LINK_STREAMING || repl->offset == repl->acked ||
+        now - repl->ack_ms < KVS_REPL_ACK_INTERVAL_MS) {
+        return true;
+    }
+
+    char offset[32];
+    int len = snprintf(offset, sizeof(offset), "%llu", (unsigned long long)repl->offset);
+    repl->acked = repl->offset;
+    repl->ack_ms = now;
+    return resp_add_array(&link->out, 3) && resp_add_bulk(&link->out, "REPLCONF", 8) &&
+           resp_add_bulk(&link->out, "ACK", 3) && resp_add_bulk(&link->out, offset, (size_t)len);
+}
+
+/**
+ * Consume what the primary sent: the PSYNC answer, a snapshot (written
+ * to a file as it arrives), then the log
+ */
+static void process_link(kvs_worker_t* worker, kvs_conn_t* conn) {
+    kvs_repl_t* repl = worker->server->repl;
+    size_t pos = 0;
+    bool ok = true;
+
+    while (ok && pos < conn->in.len) {
+        char* data = conn->in.data + pos;
+        size_t avail = conn->in.len - pos;
+
+        if (repl->state == LINK_STREAMING) {
+            size_t argc;
+            size_t used;
+            resp_status_t status = resp_parse_request(data, avail, worker->argv, SERVER_MAX_ARGS,
+                                                      &argc, &used);
+            if (status == RESP_INCOMPLETE) {
+                break;
+            }
+            ok = status == RESP_OK;
+            if (ok) {
+                if (argc > 0) {
+                    apply_write(worker->kvs, worker->argv, argc);
+                }
+                pos += used;
+                repl->offset += used;
+            }
+        } else if (repl->state == LINK_SNAPSHOT && repl->snapshot_fd >= 0) {
+            size_t n = avail < repl->snapshot_left ? avail : (size_t)repl->snapshot_left;
+            ok = write(repl->snapshot_fd, data, n) == (ssize_t)n;
+            pos += n;
+            repl->snapshot_left -= n;
+            if (ok && repl->snapshot_left == 0) {
+                ok = load_snapshot(worker, repl);
+            }
+        } else {
+            char* end = memchr(data, '\n', avail);
+            if (!end) {
+                ok = avail < 128;
+                break;
+            }
+            size_t len = (size_t)(end - data);
+            ok = link_line(repl, data, len > 0 && data[len - 1] == '\r' ? len - 1 : len);
+            pos += len + 1;
+            if (ok && repl->snapshot_fd >= 0 && repl->snapshot_left == 0) {
+                ok = load_snapshot(worker, repl);
+            }
+        }
+    }
+
+    resp_buf_consume(&conn->in, pos);
+    if (conn->in.len == 0 && conn->in.capacity > IDLE_BUFFER_LIMIT) {
+        resp_buf_free(&conn->in);
+    }
+    if (!ok || !send_ack(repl, conn, now_ms())) {
+        conn->out.len = 0;
+        conn->closing = true;
+    }
+}
+
+/**
+ * Execute every complete request in the input buffer
+ * Stops early when the pending output reaches SERVER_OUTPUT_LIMIT, or
+ * when a request waits on other loops; the rest runs later
+ */
+static void process_input(kvs_worker_t* worker, kvs_conn_t* conn) {
+    kvs_repl_t* repl = worker->server->repl;
+    if (repl && conn == repl->link) {
+        process_link(worker, conn);
+        return;
+    }
+
+    size_t pos = 0;
+
+    while (pos < conn->in.len && !conn->closing && conn->pending == 0 &&
+           conn->out.len < SERVER_OUTPUT_LIMIT) {
+        bool binary = (unsigned char)conn->in.data[pos] == KVS_BIN_MAGIC;
+        kvs_bin_frame_t frame;
+        size_t argc = 0;
+        size_t used;
+        resp_status_t status =
+            binary ? kvs_bin_parse(conn->in.data + pos, conn->in.len - pos, &frame, &used)
+                   : resp_parse_request(conn->in.data + pos, conn->in.len - pos,
+                                        worker->argv, SERVER_MAX_ARGS, &argc, &used);
+        if (status == RESP_INCOMPLETE) {
+            break;
+        }
+        if (status == RESP_PROTOCOL_ERROR) {
+            // the stream can't be resynchronized, answer and hang up
+            if (binary) {
+                kvs_bin_add_error(&conn->out, "ERR Protocol error");
+            } else {
+                resp_add_error(&conn->out, "ERR Protocol error");
+            }
+            conn->closing = true;
+            break;
+        }
+
+        pos += used;
+        if (!binary && argc == 0) {
+            continue;
+        }
+        uint64_t start = worker->latency ? now_ns() : 0;
+        conn->binary = binary;
+        bool ok = binary ? execute_binary(worker, conn, &frame) : execute(worker, conn, worker->argv, argc);
+        if (!ok) {
+            // out of memory mid-reply: drop the output rather than send half of it
+            conn->out.len = 0;
+            conn->closing = true;
+        }
+        if (worker->latency) {
+            // a command waiting on other loops is timed when it completes
+            if (conn->pending > 0) {
+                conn->started_ns = start;
+            } else {
+                histogram_record(worker->latency, now_ns() - start);
+            }
+        }
+    }
+
+    resp_buf_consume(&conn->in, pos);
+    if (conn->in.len == 0 && conn->in.capacity > IDLE_BUFFER_LIMIT) {
+        resp_buf_free(&conn->in);
+    }
+}
+
+/**
+ * Read what the socket has
+ * @return false if the connection was closed
+ */
+static bool read_input(kvs_worker_t* worker, kvs_conn_t* conn) {
+    if (!resp_buf_reserve(&conn->in, READ_CHUNK)) {
+        close_conn(worker, conn);
+        return false;
+    }
+
+    if (conn->shm.header) {
+        kvs_shm_header_t* header = conn->shm.header;
+        size_t n = kvs_shm_read(&header->requests, conn->shm.requests, conn->shm.ring_size,
+                                conn->in.data + conn->in.len, conn->in.capacity - conn->in.len);
+        conn->in.len += n;
+        if (n > 0) {
+            // the client may be waiting for room
+            __atomic_add_fetch(&header->client_seq, 1, __ATOMIC_RELEASE);
+            if (kvs_shm_unpark(&header->client_parked)) {
+                kvs_shm_futex_wake(&header->client_seq);
+            }
+        }
+        return true;
+    }
+
+    ssize_t n = recv(conn->fd, conn->in.data + conn->in.len, conn->in.capacity - conn->in.len, 0);
+    if (n > 0) {
+        conn->in.len += (size_t)n;
+        return true;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return true;
+    }
+
+    close_conn(worker, conn);
+    return false;
+}
+
+/**
+ * Send as much pending output as the socket takes
+ * @return false if the connection was closed
+ */
+static bool flush_output(kvs_worker_t* worker, kvs_conn_t* conn) {
+    size_t sent = 0;
+
+    if (conn->shm.header) {
+        kvs_shm_header_t* header = conn->shm.header;
+        sent = kvs_shm_write(&header->replies, conn->shm.replies, conn->shm.ring_size,
+                             conn->out.data, conn->out.len);
+        if (sent > 0) {
+            __atomic_add_fetch(&header->client_seq, 1, __ATOMIC_RELEASE);
+            if (kvs_shm_unpark(&header->client_parked)) {
+                kvs_shm_futex_wake(&header->client_seq);
+            }
+        }
+    }
+
+    while (!conn->shm.header && sent < conn->out.len) {
+        ssize_t n = send(conn->fd, conn->out.data + sent, conn->out.len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            close_conn(worker, conn);
+            return false;
+        }
+        sent += (size_t)n;
+    }
+
+    resp_buf_consume(&conn->out, sent);
+    if (conn->out.len == 0) {
+        if (conn->closing) {
+            close_conn(worker, conn);
+            return false;
+        }
+        if (conn->out.capacity > IDLE_BUFFER_LIMIT) {
+            resp_buf_free(&conn->out);
+        }
+    }
+    return true;
+}
+
+/**
+ * Wait for input unless output is backed up or a request is out on
+ * other loops, and for writability while output is pending
+ */
+static void update_interest(kvs_worker_t* worker, kvs_conn_t* conn) {
+    // the socket of a shared-memory client only reports the hang-up
+    if (conn->shm.header) {
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!conn->closing && conn->pending == 0 && conn->out.len < SERVER_OUTPUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (conn->out.len > 0) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != conn->events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = conn;
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+static uint64_t uring_data(void* ptr, unsigned kind) {
+    return (uint64_t)(uintptr_t)ptr | kind;
+}
+
+/**
+ * Send the unsent part of conn->sending
+ */
+static bool uring_send(kvs_worker_t* worker, kvs_conn_t* conn) {
+    struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+    if (!sqe) {
+        return false;
+    }
+
+    size_t len = conn->sending.len - conn->sent;
+    bool zero_copy = conn->zero_copy && len >= URING_ZERO_COPY_THRESHOLD;
+    uring_prep_send(sqe, conn->fd, conn->sending.data + conn->sent, len, zero_copy,
+                    uring_data(conn, EV_SEND));
+    conn->send_busy = true;
+    conn->inflight++;
+    return true;
+}
+
+/**
+ * io_uring counterpart of flush_output + update_interest: start sending
+ * waiting output, keep a recv armed unless the client is backed up, and
+ * close a closing connection once everything is sent
+ * @return false if the connection was closed
+ */
+static bool uring_update(kvs_worker_t* worker, kvs_conn_t* conn) {
+    if (!conn->send_busy && conn->out.len > 0) {
+        // swap, so replies can be appended while the kernel sends these
+        resp_buf_t batch = conn->out;
+        conn->out = conn->sending;
+        conn->out.len = 0;
+        conn->sending = batch;
+        conn->sent = 0;
+        if (!uring_send(worker, conn)) {
+            close_conn(worker, conn);
+            return false;
+        }
+    }
+    if (conn->closing && !conn->send_busy) {
+        close_conn(worker, conn);
+        return false;
+    }
+
+    // input piling up behind forwarded operations is the other reason to pause
+    bool want = !conn->closing && conn->out.len < SERVER_OUTPUT_LIMIT &&
+                !(conn->pending > 0 && conn->in.len >= SERVER_OUTPUT_LIMIT);
+    if (want && !conn->recv_armed) {
+        struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+        if (!sqe) {
+            close_conn(worker, conn);
+            return false;
+        }
+        uring_prep_recv_multishot(sqe, conn->fd, URING_BUFFER_GROUP, uring_data(conn, EV_RECV));
+        conn->recv_armed = true;
+        conn->inflight++;
+    } else if (!want && conn->recv_armed && !conn->recv_cancelling) {
+        struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+        if (sqe) {
+            uring_prep_cancel(sqe, uring_data(conn, EV_RECV), EV_CANCEL);
+            conn->recv_cancelling = true;
+        }
+    }
+    return true;
+}
+
+/**
+ * Run what can run of the input, then send the replies
+ */
+static void resume_conn(kvs_worker_t* worker, kvs_conn_t* conn) {
+    process_input(worker, conn);
+    if (worker->uring) {
+        uring_update(worker, conn);
+    } else if (flush_output(worker, conn)) {
+        update_interest(worker, conn);
+    }
+}
+
+/**
+ * Top up each replica's output from its snapshot file or from the log,
+ * up to SERVER_OUTPUT_LIMIT, and send it
+ * A replica the log has moved past is dropped, also while its snapshot
+ * is still being written; it resyncs in full
+ */
+static void feed_replicas(kvs_worker_t* worker) {
+    kvs_repl_t* repl = worker->server->repl;
+    bool resync = repl->resync;
+    repl->resync = false;
+
+    // closing a replica swaps the last one into its slot, so walk backwards
+    for (size_t i = repl->replica_count; i-- > 0;) {
+        kvs_conn_t* conn = repl->replicas[i];
+        if (conn->fd < 0 || conn->closing) {
+            continue;
+        }
+        if (resync || (conn->snapshot_wait && !kvs_repl_log_has(&repl->log, conn->repl_offset))) {
+            close_conn(worker, conn);
+            continue;
+        }
+        if (conn->snapshot_wait || (conn->snapshot_fd < 0 && conn->repl_offset == repl->log.end)) {
+            continue;
+        }
+
+        bool ok = true;
+        while (ok && conn->snapshot_fd >= 0 && conn->out.len < SERVER_OUTPUT_LIMIT) {
+            size_t chunk = conn->snapshot_left < REPL_SNAPSHOT_CHUNK ? (size_t)conn->snapshot_left
+                                                                     : REPL_SNAPSHOT_CHUNK;
+            ok = resp_buf_reserve(&conn->out, chunk);
+            ssize_t n = ok ? read(conn->snapshot_fd, conn->out.data + conn->out.len, chunk) : -1;
+            ok = chunk == 0 || n > 0;
+            if (ok) {
+                conn->out.len += (size_t)n;
+                conn->snapshot_left -= (size_t)n;
+            }
+            if (ok && conn->snapshot_left == 0) {
+                close(conn->snapshot_fd);
+                conn->snapshot_fd = -1;
+            }
+        }
+
+        while (ok && conn->snapshot_fd < 0 && conn->out.len < SERVER_OUTPUT_LIMIT &&
+               conn->repl_offset < repl->log.end) {
+            const char* data;
+            size_t len = kvs_repl_log_read(&repl->log, conn->repl_offset, &data);
+            ok = len > 0 && resp_add_raw(&conn->out, data, len);
+            conn->repl_offset += len;
+        }
+
+        if (!ok) {
+            close_conn(worker, conn);
+            continue;
+        }
+        resume_conn(worker, conn);
+    }
+}
+
+/**
+ * Start connecting to "host:port", or to a Unix socket path
+ * The connect doesn't block the loop: a TCP socket comes back with the
+ * connection in progress (only the first address that gets that far is
+ * tried), and is writable once it is done, SO_ERROR telling how it went.
+ * The name lookup itself still blocks
+ * @return the non-blocking socket, -1 on failure
+ */
+static int dial(const char* target, bool* tcp) {
+    const char* colon = strrchr(target, ':');
+    int fd = -1;
+    *tcp = colon && !strchr(target, '/');
+
+    if (!*tcp) {
+        struct sockaddr_un addr;
+        if (strlen(target) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, target);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char host[256];
+        size_t host_len = (size_t)(colon - target);
+        if (host_len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, target, host_len);
+        host[host_len] = '\0';
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* result;
+        if (getaddrinfo(host, colon + 1, &hints, &result) != 0) {
+            return -1;
+        }
+        for (struct addrinfo* ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+    }
+    return fd;
+}
+
+/**
+ * Start opening the link to the primary; link_connected follows once
+ * the socket is writable
+ */
+static void connect_primary(kvs_worker_t* worker, kvs_repl_t* repl) {
+    repl->retry_ms = now_ms() + KVS_REPL_RETRY_MS;
+
+    bool tcp;
+    int fd = dial(repl->primary, &tcp);
+    kvs_conn_t* conn = fd >= 0 ? add_conn(worker, fd, tcp) : NULL;
+    if (!conn) {
+        return;
+    }
+    repl->link = conn;
+    repl->state = LINK_CONNECTING;
+    repl->connect_ms = now_ms() + KVS_REPL_CONNECT_TIMEOUT_MS;
+
+    bool ok;
+    if (worker->uring) {
+        struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+        ok = sqe != NULL;
+        if (ok) {
+            uring_prep_poll(sqe, fd, POLLOUT, uring_data(conn, EV_CONNECT));
+            conn->inflight++;
+        }
+    } else {
+        ok = watch(worker, fd, EPOLLOUT, conn);
+        conn->events = EPOLLOUT;
+    }
+    if (!ok) {
+        close_conn(worker, conn);
+    }
+}
+
+/**
+ * The link's connect is done: ask for the stream where we left it, or
+ * give up until the next retry
+ */
+static void link_connected(kvs_worker_t* worker, kvs_conn_t* conn) {
+    kvs_repl_t* repl = worker->server->repl;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0) {
+        close_conn(worker, conn);
+        return;
+    }
+    repl->state = LINK_HANDSHAKE;
+
+    char offset[32];
+    bool known = repl->primary_id[0] != '\0';
+    int len = snprintf(offset, sizeof(offset), "%lld", known ? (long long)repl->offset : -1LL);
+    const char* id = known ? repl->primary_id : "?";
+    bool ok = resp_add_array(&conn->out, 3) && resp_add_bulk(&conn->out, "PSYNC", 5) &&
+              resp_add_bulk(&conn->out, id, strlen(id)) &&
+              resp_add_bulk(&conn->out, offset, (size_t)len);
+
+    if (!ok) {
+        close_conn(worker, conn);
+        return;
+    }
+    resume_conn(worker, conn);
+}
+
+/**
+ * Replication upkeep, once per loop iteration: on a primary, check on
+ * the snapshot being written for replicas; on a replica, reconnect a
+ * link that is down, give up a connect that takes too long, send an
+ * acknowledgement that is due
+ * @return how long the loop may wait for events, -1 for no limit
+ */
+static int repl_tick(kvs_worker_t* worker) {
+    kvs_repl_t* repl = worker->server->repl;
+    if (repl && repl->save_pid != 0) {
+        // once written, the snapshot goes out on this iteration
+        return poll_save(worker, repl) ? 0 : REPL_SNAPSHOT_POLL_MS;
+    }
+    if (!repl || !repl->primary) {
+        return -1;
+    }
+
+    long long now = now_ms();
+    if (!repl->link && now >= repl->retry_ms) {
+        connect_primary(worker, repl);
+    }
+    if (!repl->link) {
+        return (int)(repl->retry_ms - now > 0 ? repl->retry_ms - now : 0);
+    }
+    if (repl->state == LINK_CONNECTING) {
+        if (now < repl->connect_ms) {
+            return (int)(repl->connect_ms - now);
+        }
+        // an unreachable host can leave the SYN unanswered for minutes
+        close_conn(worker, repl->link);
+        return 0;
+    }
+
+    if (repl->state == LINK_STREAMING && repl->offset != repl->acked &&
+        now - repl->ack_ms >= KVS_REPL_ACK_INTERVAL_MS) {
+        resume_conn(worker, repl->link);
+    }
+    return KVS_REPL_ACK_INTERVAL_MS;
+}
+
+static void handle_conn(kvs_worker_t* worker, kvs_conn_t* conn, uint32_t events) {
+    kvs_repl_t* repl = worker->server->repl;
+    if (repl && conn == repl->link && repl->state == LINK_CONNECTING) {
+        link_connected(worker, conn);
+        return;
+    }
+    if (conn->shm.header) {
+        // nothing more comes on the socket but the hang-up
+        char byte;
+        ssize_t n = recv(conn->fd, &byte, 1, 0);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close_conn(worker, conn);
+        }
+        return;
+    }
+    if ((events & EPOLLOUT) && !flush_output(worker, conn)) {
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !read_input(worker, conn)) {
+        return;
+    }
+    resume_conn(worker, conn);
+}
+
+/**
+ * A forwarded operation is back; finish its command once it is the last
+ */
+static void complete_op(kvs_worker_t* worker, shard_op_t* op) {
+    kvs_conn_t* conn = op->conn;
+    if (--conn->pending > 0) {
+        return;
+    }
+
+    // closed while waiting: nothing points at it any more
+    if (conn->fd < 0) {
+        close_conn(worker, conn);
+        return;
+    }
+
+    // the time a WAITKEY blocks is the client's choice, not latency
+    bool timed = worker->latency && conn->command != KVS_CMD_WAITKEY;
+    if (!finish_ops(worker, conn)) {
+        conn->out.len = 0;
+        conn->closing = true;
+    }
+    if (timed) {
+        histogram_record(worker->latency, now_ns() - conn->started_ns);
+    }
+    resume_conn(worker, conn);
+}
+
+/**
+ * Take operations other loops pushed to us: run requests against our
+ * shard and send them back, complete the ones we sent out
+ */
+static void drain_rings(kvs_worker_t* worker) {
+    kvs_server_t* server = worker->server;
+    for (unsigned from = 0; from < server->worker_count; from++) {
+        if (from == worker->index) {
+            continue;
+        }
+
+        spsc_ring_t* ring = ring_between(server, from, worker->index);
+        shard_op_t* op;
+        while ((op = spsc_pop(ring))) {
+            if (op->origin == worker->index) {
+                complete_op(worker, op);
+            } else if (op->type == OP_WAIT && !wait_over(worker, op, now_ms())) {
+                park_op(worker, op);
+            } else if (needs_load(worker, op)) {
+                if (!join_load(worker, op)) {
+                    fail_load(op, KVS_ERROR_MEMORY);
+                    send_op(worker, op->origin, op);
+                }
+            } else {
+                run_op(worker->kvs, op, true);
+                send_op(worker, op->origin, op);
+            }
+        }
+    }
+}
+
+/**
+ * Answer the parked WAITKEYs whose key changed or whose deadline passed,
+ * and drop those of closed connections
+ * Answering one can run more of its connection's input, writes
+ * included, so the list is gone over again until nothing is answered
+ */
+static void wake_waiters(kvs_worker_t* worker) {
+    bool woke = true;
+    while (woke) {
+        woke = false;
+        long long now = now_ms();
+        shard_op_t** link = &worker->waiters;
+        while (*link) {
+            shard_op_t* op = *link;
+            bool abandoned = __atomic_load_n(&op->conn->abandoned, __ATOMIC_ACQUIRE);
+            if (!abandoned && !wait_over(worker, op, now)) {
+                link = &op->next;
+                continue;
+            }
+
+            // unlinked first: completing may park new waiters at the head
+            *link = op->next;
+            woke = true;
+            if (op->origin == worker->index) {
+                complete_op(worker, op);
+            } else {
+                if (!abandoned) {
+                    run_op(worker->kvs, op, true);
+                }
+                send_op(worker, op->origin, op);
+            }
+        }
+    }
+}
+
+/**
+ * Take a finished load's flight out of the loop's table
+ */
+static void unlink_flight(kvs_worker_t* worker, load_flight_t* flight) {
+    uint32_t hash = (uint32_t)flight->load.key * 0x9e3779b1u;
+    load_flight_t** link = &worker->flights[hash >> (32 - LOAD_FLIGHT_BITS)];
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    worker->loading--;
+}
+
+/**
+ * Set what the finished loads found and answer the operations that
+ * waited for them, each run just before it is answered (answering one
+ * can run more of its connection's input, writes included)
+ */
+static void finish_loads(kvs_worker_t* worker) {
+    kvs_load_t* load = load_pool_take(worker->server->loads, worker->index);
+    while (load) {
+        kvs_load_t* next_load = load->next;
+        load_flight_t* flight = (load_flight_t*)load;
+        unlink_flight(worker, flight);
+
+        bool filled = kvs_readthrough_fill(worker->kvs, load->key, flight->generation, load->result,
+                                           load->value, load->len);
+        kvs_error_t error = kvs_get_error();
+        shard_op_t* op = flight->ops;
+        free(flight);
+        while (op) {
+            shard_op_t* next = op->next;
+            if (!filled) {
+                fail_load(op, error);
+            }
+            if (op->origin == worker->index) {
+                complete_op(worker, op);
+            } else {
+                if (filled) {
+                    run_op(worker->kvs, op, true);
+                }
+                send_op(worker, op->origin, op);
+            }
+            op = next;
+        }
+        load = next_load;
+    }
+}
+
+/**
+ * Shorten the loop's timeout to the nearest WAITKEY deadline
+ */
+static int wait_timeout(kvs_worker_t* worker, int timeout) {
+    long long now = now_ms();
+    for (shard_op_t* op = worker->waiters; op; op = op->next) {
+        if (op->deadline_ms >= 0) {
+            long long left = op->deadline_ms > now ? op->deadline_ms - now : 0;
+            if (left > INT_MAX) {
+                left = INT_MAX;
+            }
+            if (timeout < 0 || left < timeout) {
+                timeout = (int)left;
+            }
+        }
+    }
+    return timeout;
+}
+
+/**
+ * Retry operations that found their ring full
+ */
+static void flush_backlogs(kvs_worker_t* worker) {
+    if (!worker->backlogged) {
+        return;
+    }
+
+    worker->backlogged = false;
+    for (unsigned to = 0; to < worker->server->worker_count; to++) {
+        op_queue_t* queue = &worker->backlog[to];
+        spsc_ring_t* ring = ring_between(worker->server, worker->index, to);
+        while (queue->head) {
+            // read the link first, the op belongs to the other loop once pushed
+            shard_op_t* next = queue->head->next;
+            if (!spsc_push(ring, queue->head)) {
+                break;
+            }
+            queue->head = next;
+            worker->notify[to] = true;
+        }
+        if (queue->head) {
+            worker->backlogged = true;
+        } else {
+            queue->tail = NULL;
+        }
+    }
+}
+
+/**
+ * Wake the loops we pushed operations to, once per loop iteration
+ */
+static void notify_workers(kvs_worker_t* worker) {
+    kvs_server_t* server = worker->server;
+    for (unsigned to = 0; to < server->worker_count; to++) {
+        if (worker->notify[to]) {
+            worker->notify[to] = false;
+            uint64_t one = 1;
+            ssize_t written = write(server->workers[to].wake_fd, &one, sizeof(one));
+            (void)written;
+        }
+    }
+}
+
+/**
+ * End of a loop iteration: take forwarded operations and finished loads,
+ * answer the WAITKEYs that can be (after those, whose writes may be what
+ * they wait for), then pass on what this loop forwarded
+ */
+static void exchange_ops(kvs_worker_t* worker) {
+    bool sharded = worker->server->worker_count > 1;
+    if (sharded) {
+        drain_rings(worker);
+    }
+    if (worker->loading > 0) {
+        finish_loads(worker);
+    }
+    if (worker->waiters) {
+        wake_waiters(worker);
+    }
+    if (sharded) {
+        flush_backlogs(worker);
+        notify_workers(worker);
+        STAT_SET(worker->keys, kvs_count(worker->kvs));
+        STAT_SET(worker->capacity, shard_capacity(worker->kvs));
+    }
+}
+
+/**
+ * Copy the loop's figures to its metrics shard
+ */
+static void publish_metrics(kvs_worker_t* worker) {
+    kvs_metrics_sample_t* sample = kvs_metrics_begin(&worker->server->metrics[worker->index]);
+    kvs_info_summary(worker->kvs, &sample->info);
+    // the store may free its filename, readers only get the sample
+    sample->info.filename = NULL;
+    sample->commands = worker->total_commands;
+    sample->connections = worker->total_connections;
+    sample->connected = worker->connected;
+    sample->latency = *worker->latency;
+    kvs_metrics_end(&worker->server->metrics[worker->index]);
+}
+
+/**
+ * Publish metrics when they are due
+ * @return timeout capped so that an idle loop still publishes on time
+ */
+static int metrics_tick(kvs_worker_t* worker, int timeout) {
+    if (!worker->latency) {
+        return timeout;
+    }
+    long long now = now_ms();
+    if (now - worker->metrics_ms >= KVS_METRICS_PUBLISH_MS) {
+        publish_metrics(worker);
+        worker->metrics_ms = now;
+    }
+    int wait = (int)(worker->metrics_ms + KVS_METRICS_PUBLISH_MS - now);
+    return timeout < 0 || wait < timeout ? wait : timeout;
+}
+
+/**
+ * Whether a shared-memory client has requests to take now (a connection
+ * waiting on other loops or on output isn't read, as with a socket)
+ */
+static bool shm_ready(kvs_conn_t* conn) {
+    return !conn->closing && conn->pending == 0 && conn->out.len < SERVER_OUTPUT_LIMIT &&
+           kvs_shm_readable(&conn->shm.header->requests) > 0;
+}
+
+/**
+ * Serve every shared-memory client: take what its ring holds, run it and
+ * put the replies in its ring
+ */
+static void poll_shm(kvs_worker_t* worker) {
+    kvs_conn_t* next;
+    for (kvs_conn_t* conn = worker->shm_conns; conn; conn = next) {
+        next = conn->shm_next;
+        bool reading = shm_ready(conn);
+        if (!reading && conn->out.len == 0) {
+            continue;
+        }
+        worker->shm_active_ns = now_ns();
+        if (reading && !read_input(worker, conn)) {
+            continue;
+        }
+        process_input(worker, conn);
+        flush_output(worker, conn);
+    }
+}
+
+/**
+ * Keep polling the shared-memory clients until KVS_SHM_SPIN_NS after the
+ * last activity, then mark them parked, so that a request makes the
+ * client write the eventfd
+ * @return 0 while polling, 1 while replies wait for ring space, else timeout
+ */
+static int shm_timeout(kvs_worker_t* worker, int timeout) {
+    if (now_ns() - worker->shm_active_ns < KVS_SHM_SPIN_NS) {
+        kvs_shm_relax();
+        return 0;
+    }
+
+    bool ready = false;
+    bool blocked = false;
+    for (kvs_conn_t* conn = worker->shm_conns; conn; conn = conn->shm_next) {
+        kvs_shm_park(&conn->shm.header->server_parked);
+        ready = ready || shm_ready(conn);
+        blocked = blocked || conn->out.len > 0;
+    }
+    if (ready) {
+        return 0;
+    }
+    return blocked && (timeout < 0 || timeout > 1) ? 1 : timeout;
+}
+
+/**
+ * Run one event loop until the server is stopped
+ */
+static bool run_loop(kvs_worker_t* worker) {
+    kvs_server_t* server = worker->server;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        // a backlog is retried shortly even if nothing else happens
+        int timeout = metrics_tick(worker, repl_tick(worker));
+        if (worker->waiters) {
+            timeout = wait_timeout(worker, timeout);
+        }
+        if (worker->shm_conns) {
+            timeout = shm_timeout(worker, timeout);
+        }
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, worker->backlogged ? 1 : timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            kvs_set_error(KVS_ERROR_UNKNOWN);
+            return false;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+
+            if (ptr == &worker->wake_fd) {
+                uint64_t count;
+                ssize_t drained = read(worker->wake_fd, &count, sizeof(count));
+                (void)drained;
+                if (__atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE)) {
+                    kvs_clear_error();
+                    return true;
+                }
+            } else if (ptr == &worker->tcp_fd || ptr == &worker->unix_fd) {
+                accept_clients(worker, *(int*)ptr);
+            } else if (ptr == &worker->shm_conns) {
+                // served below; edge-triggered, so the count needn't be read
+            } else {
+                handle_conn(worker, ptr, events[i].events);
+            }
+        }
+
+        if (server->repl && server->repl->replica_count > 0) {
+            feed_replicas(worker);
+        }
+
+        // before the rings, so that operations it forwards are notified now
+        if (worker->shm_conns) {
+            poll_shm(worker);
+        }
+
+        exchange_ops(worker);
+    }
+}
+
+/**
+ * Data arrived in a provided buffer (or the multishot recv ended)
+ */
+static void uring_recv_done(kvs_worker_t* worker, kvs_conn_t* conn, int res, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+        conn->recv_cancelling = false;
+        conn->inflight--;
+    }
+
+    bool ok = res > 0 || res == -ENOBUFS || res == -ECANCELED;
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && conn->fd >= 0) {
+            ok = resp_buf_reserve(&conn->in, (size_t)res);
+            if (ok) {
+                memcpy(conn->in.data + conn->in.len, uring_buffer(&worker->buffers, bid), (size_t)res);
+                conn->in.len += (size_t)res;
+            }
+        }
+        uring_buffer_return(&worker->buffers, bid);
+    }
+
+    // EOF, an error, or closed already (this may be the last reference)
+    if (!ok || conn->fd < 0) {
+        close_conn(worker, conn);
+        return;
+    }
+    resume_conn(worker, conn);
+}
+
+/**
+ * A send, or the notification that a zero-copy send let go of the buffer
+ */
+static void uring_send_done(kvs_worker_t* worker, kvs_conn_t* conn, int res, uint32_t flags) {
+    conn->inflight--;
+    if (flags & IORING_CQE_F_NOTIF) {
+        conn->zc_notify = false;
+    } else {
+        if (flags & IORING_CQE_F_MORE) {
+            // zero-copy: the buffer stays in use until the notification
+            conn->zc_notify = true;
+            conn->inflight++;
+        }
+        if (res == -EOPNOTSUPP && conn->zero_copy) {
+            // no zero-copy for this socket, resend the same bytes plainly
+            conn->zero_copy = false;
+        } else if (res < 0) {
+            close_conn(worker, conn);
+            return;
+        } else {
+            conn->sent += (size_t)res;
+        }
+    }
+
+    if (conn->fd < 0) {
+        close_conn(worker, conn);
+        return;
+    }
+    if (conn->zc_notify) {
+        return;
+    }
+
+    if (conn->sent < conn->sending.len) {
+        if (!uring_send(worker, conn)) {
+            close_conn(worker, conn);
+        }
+        return;
+    }
+
+    conn->send_busy = false;
+    conn->sending.len = 0;
+    conn->sent = 0;
+    if (conn->sending.capacity > IDLE_BUFFER_LIMIT) {
+        resp_buf_free(&conn->sending);
+    }
+
+    // output may have held up the input
+    resume_conn(worker, conn);
+}
+
+/**
+ * The replica link's socket became writable (or the poll was cancelled)
+ */
+static void uring_connect_done(kvs_worker_t* worker, kvs_conn_t* conn, int res) {
+    conn->inflight--;
+    if (res < 0 || conn->fd < 0) {
+        close_conn(worker, conn);
+        return;
+    }
+    link_connected(worker, conn);
+}
+
+/**
+ * A client from a multishot accept
+ * @return false if the listener could not be re-armed
+ */
+static bool uring_accept_done(kvs_worker_t* worker, unsigned kind, int res, uint32_t flags) {
+    if (res >= 0) {
+        kvs_conn_t* conn = add_conn(worker, res, kind == EV_ACCEPT_TCP);
+        if (conn) {
+            uring_update(worker, conn);
+        }
+    }
+
+    if (flags & IORING_CQE_F_MORE) {
+        return true;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+    if (!sqe) {
+        return false;
+    }
+    int listener = kind == EV_ACCEPT_TCP ? worker->tcp_fd : worker->unix_fd;
+    uring_prep_accept_multishot(sqe, listener, uring_data(worker, kind));
+    return true;
+}
+
+/**
+ * Queue the long-lived requests: accepts and the wake eventfd poll
+ */
+static bool uring_arm(kvs_worker_t* worker, unsigned kind) {
+    struct io_uring_sqe* sqe = uring_get_sqe(worker->uring);
+    if (!sqe) {
+        return false;
+    }
+    if (kind == EV_WAKE) {
+        uring_prep_poll_multishot(sqe, worker->wake_fd, uring_data(worker, EV_WAKE));
+    } else {
+        int listener = kind == EV_ACCEPT_TCP ? worker->tcp_fd : worker->unix_fd;
+        uring_prep_accept_multishot(sqe, listener, uring_data(worker, kind));
+    }
+    return true;
+}
+
+/**
+ * Run one io_uring event loop until the server is stopped
+ * The ring is created here, on the thread that submits to it
+ */
+static bool run_uring_loop(kvs_worker_t* worker) {
+    kvs_server_t* server = worker->server;
+    uring_t ring;
+    if (!uring_init(&ring, URING_ENTRIES)) {
+        kvs_set_error(KVS_ERROR_UNKNOWN);
+        return false;
+    }
+    if (!uring_buffers_init(&ring, &worker->buffers, URING_BUFFER_GROUP,
+                            URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+        uring_exit(&ring);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+    worker->uring = &ring;
+
+    bool ok = uring_arm(worker, EV_WAKE) &&
+              (worker->tcp_fd < 0 || uring_arm(worker, EV_ACCEPT_TCP)) &&
+              (worker->unix_fd < 0 || uring_arm(worker, EV_ACCEPT_UNIX));
+    bool stop = false;
+
+    while (ok && !stop) {
+        // one syscall submits everything queued and waits for completions
+        int timeout = metrics_tick(worker, repl_tick(worker));
+        if (worker->waiters) {
+            timeout = wait_timeout(worker, timeout);
+        }
+        int rc = uring_submit_and_wait(&ring, 1, worker->backlogged ? 1 : timeout);
+        if (rc < 0 && rc != -EINTR && rc != -ETIME && rc != -EBUSY) {
+            ok = false;
+            break;
+        }
+
+        struct io_uring_cqe* cqe;
+        while (ok && !stop && (cqe = uring_peek_cqe(&ring))) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_cqe_seen(&ring);
+
+            void* ptr = (void*)(uintptr_t)(data & ~(uint64_t)EV_KIND_MASK);
+            switch (data & EV_KIND_MASK) {
+                case EV_RECV:
+                    uring_recv_done(worker, ptr, res, flags);
+                    break;
+                case EV_SEND:
+                    uring_send_done(worker, ptr, res, flags);
+                    break;
+                case EV_CONNECT:
+                    uring_connect_done(worker, ptr, res);
+                    break;
+                case EV_ACCEPT_TCP:
+                case EV_ACCEPT_UNIX:
+                    ok = uring_accept_done(worker, (unsigned)(data & EV_KIND_MASK), res, flags);
+                    break;
+                case EV_WAKE: {
+                    uint64_t count;
+                    ssize_t drained = read(worker->wake_fd, &count, sizeof(count));
+                    (void)drained;
+                    stop = __atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE);
+                    if (!stop && !(flags & IORING_CQE_F_MORE)) {
+                        ok = uring_arm(worker, EV_WAKE);
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        if (ok && !stop && server->repl && server->repl->replica_count > 0) {
+            feed_replicas(worker);
+        }
+        if (ok && !stop) {
+            exchange_ops(worker);
+        }
+    }
+
+    // tearing down the ring cancels what is still in flight; the
+    // connections it pointed at are freed by kvs_server_destroy
+    worker->uring = NULL;
+    uring_exit(&ring);
+    uring_buffers_free(&worker->buffers);
+
+    if (!ok) {
+        kvs_set_error(KVS_ERROR_UNKNOWN);
+        return false;
+    }
+    kvs_clear_error();
+    return true;
+}
+
+static bool run_worker(kvs_worker_t* worker) {
+    if (worker->latency) {
+        publish_metrics(worker);
+        worker->metrics_ms = now_ms();
+    }
+    bool ok = worker->server->backend == KVS_BACKEND_IO_URING ? run_uring_loop(worker) : run_loop(worker);
+    // the last figures, for an exporter that outlives the loops
+    if (worker->latency) {
+        publish_metrics(worker);
+    }
+    return ok;
+}
+
+/**
+ * Pin the calling thread to one CPU (best effort)
+ */
+static void pin_to_cpu(unsigned index) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (unsigned)cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void* worker_main(void* arg) {
+    kvs_worker_t* worker = arg;
+    if (worker->server->pin_threads) {
+        pin_to_cpu(worker->index);
+    }
+
+    if (!run_worker(worker)) {
+        worker->failed = true;
+        kvs_server_stop(worker->server);
+    }
+    return NULL;
+}
+
+/**
+ * Start the load pool if some shard is in read-through mode, with a
+ * table of loads out on each loop that owns such a shard
+ */
+static bool start_loads(kvs_server_t* server) {
+    int wake_fds[SERVER_MAX_SHARDS];
+    bool needed = false;
+    for (unsigned i = 0; i < server->worker_count; i++) {
+        kvs_worker_t* worker = &server->workers[i];
+        wake_fds[i] = worker->wake_fd;
+        if (worker->kvs->readthrough) {
+            worker->flights = calloc(1u << LOAD_FLIGHT_BITS, sizeof(load_flight_t*));
+            if (!worker->flights) {
+                kvs_set_error(KVS_ERROR_MEMORY);
+                return false;
+            }
+            needed = true;
+        }
+    }
+    if (needed) {
+        server->loads = load_pool_create(LOAD_THREADS, wake_fds, server->worker_count);
+    }
+    return !needed || server->loads;
+}
+
+/**
+ * Stop the load pool once the loops are down, dropping the loads out
+ * (their operations go with their connections): first the finished
+ * ones no loop took, with what they found, then those never started
+ */
+static void stop_loads(kvs_server_t* server) {
+    load_pool_stop(server->loads);
+    for (unsigned i = 0; server->loads && i < server->worker_count; i++) {
+        kvs_worker_t* worker = &server->workers[i];
+        kvs_load_t* load = load_pool_take(server->loads, i);
+        while (load) {
+            kvs_load_t* next = load->next;
+            load_flight_t* flight = (load_flight_t*)load;
+            unlink_flight(worker, flight);
+            free(flight->load.value);
+            free(flight);
+            load = next;
+        }
+    }
+    load_pool_destroy(server->loads);
+    server->loads = NULL;
+
+    for (unsigned i = 0; i < server->worker_count; i++) {
+        kvs_worker_t* worker = &server->workers[i];
+        for (size_t b = 0; worker->flights && b < (1u << LOAD_FLIGHT_BITS); b++) {
+            while (worker->flights[b]) {
+                load_flight_t* flight = worker->flights[b];
+                worker->flights[b] = flight->next;
+                free(flight);
+            }
+        }
+        free(worker->flights);
+        worker->flights = NULL;
+        worker->loading = 0;
+    }
+}
+
+/**
+ * Run the event loops
+ */
+bool kvs_server_run(kvs_server_t* server) {
+    if (!server) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return false;
+    }
+
+    bool ok = start_loads(server);
+    for (unsigned i = 1; ok && i < server->worker_count; i++) {
+        kvs_worker_t* worker = &server->workers[i];
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            ok = false;
+            break;
+        }
+        worker->started = true;
+    }
+
+    if (ok) {
+        if (server->pin_threads) {
+            pin_to_cpu(0);
+        }
+        ok = run_worker(&server->workers[0]);
+    }
+
+    // whichever way the first loop ended, bring the others down with it
+    kvs_server_stop(server);
+    for (unsigned i = 1; i < server->worker_count; i++) {
+        kvs_worker_t* worker = &server->workers[i];
+        if (worker->started) {
+            pthread_join(worker->thread, NULL);
+            worker->started = false;
+            ok = ok && !worker->failed;
+        }
+    }
+    stop_loads(server);
+
+    if (ok) {
+        kvs_clear_error();
+    } else if (kvs_get_error() == KVS_SUCCESS) {
+        kvs_set_error(KVS_ERROR_UNKNOWN);
+    }
+    return ok;
+}
+
+/**
+ * Ask the event loops to return
+ */
+void kvs_server_stop(kvs_server_t* server) {
+    if (!server) {
+        return;
+    }
+
+    __atomic_store_n(&server->stopping, 1, __ATOMIC_RELEASE);
+
+    // can only fail if the counter is saturated, i.e. a wakeup is pending
+    for (unsigned i = 0; i < server->worker_count; i++) {
+        uint64_t one = 1;
+        ssize_t written = write(server->workers[i].wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+/**
+ * Destroy a server
+ */
+void kvs_server_destroy(kvs_server_t* server) {
+    if (!server) {
+        return;
+    }
+
+    for (unsigned i = 0; i < server->worker_count; i++) {
+        kvs_worker_t* worker = &server->workers[i];
+
+        // the loops are stopped, operations still out will never come back
+        while (worker->conns) {
+            worker->conns->pending = 0;
+            worker->conns->inflight = 0;
+            close_conn(worker, worker->conns);
+        }
+
+        if (worker->tcp_fd >= 0) close(worker->tcp_fd);
+        if (worker->unix_fd >= 0) close(worker->unix_fd);
+        if (worker->wake_fd >= 0) close(worker->wake_fd);
+        if (worker->epoll_fd >= 0) close(worker->epoll_fd);
+
+        free(worker->argv);
+        free(worker->backlog);
+        free(worker->notify);
+        free(worker->latency);
+    }
+
+    if (server->unix_path) {
+        unlink(server->unix_path);
+        free(server->unix_path);
+    }
+
+    destroy_repl(server->repl);
+    free(server->metrics);
+    free(server->workers);
+    free(server->rings);
+    free(server);
+}
@@ -0,0 +1,210 @@
+/**
+ * kvstore-server: serves a store over TCP and/or a Unix socket
+ * With -t N the keys are split into N shards, one event loop each
+ * With --metrics-port / --metrics-file a metrics exporter runs alongside
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "kvstore.h"
+#include "server.h"
+#include "replication.h"
+#include "metrics.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Server being run, for the signal handler
+ */
+static kvs_server_t* running_server = NULL;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    kvs_server_stop(running_server);
+}
+
+/**
+ * Print command line usage
+ */
+static void print_usage(const char* prog) {
+    printf("Usage: %s [-b <addr>] [-p <port>] [-s <socket>] [-t <threads> [--pin]]\n"
+           "       %*s [--io-uring] [-d <file> | --mapped <file>]\n"
+           "       %*s [--replica-of <host:port | socket>] [--repl-log <bytes>]\n"
+           "       %*s [--metrics-port <port>] [--metrics-file <file> [--metrics-interval <ms>]]\n",
+           prog, (int)strlen(prog), "", (int)strlen(prog), "", (int)strlen(prog), "");
+    printf("  -b <addr>        TCP address to listen on (default 127.0.0.1)\n");
+    printf("  -p <port>        TCP port (default %d, 0 disables TCP)\n", KVS_SERVER_DEFAULT_PORT);
+    printf("  -s <socket>      Also listen on a Unix socket\n");
+    printf("  -t <threads>     Event loops, each owning a shard of the keys (default 1)\n");
+    printf("  --pin            Pin event loop i to CPU i\n");
+    printf("  --io-uring       Use io_uring for network I/O (falls back to epoll)\n");
+    printf("  -d <file>        Snapshot loaded at start and saved on shutdown\n");
+    printf("  --mapped <file>  Keep the table in a memory-mapped file (single loop only)\n");
+    printf("  --replica-of <primary>  Follow a primary and serve reads (single loop only)\n");
+    printf("  --repl-log <bytes>      Log kept for replicas' partial resyncs (default %d)\n",
+           KVS_REPL_LOG_DEFAULT_SIZE);
+    printf("  --metrics-port <port>   Serve OpenMetrics at http://<addr>:<port>/metrics\n");
+    printf("  --metrics-file <file>   Keep a node_exporter textfile up to date\n");
+    printf("  --metrics-interval <ms> Textfile rewrite interval (default %d)\n",
+           KVS_METRICS_DEFAULT_INTERVAL_MS);
+}
+
+static void destroy_shards(kvstore_t** shards, unsigned count) {
+    for (unsigned i = 0; i < count; i++) {
+        kvs_destroy(shards[i]);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    kvs_server_config_t config = { "127.0.0.1", KVS_SERVER_DEFAULT_PORT, NULL, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    kvs_metrics_config_t metrics_config = { NULL, 0, NULL, 0 };
+    const char* snapshot_path = NULL;
+    const char* mapped_path = NULL;
+    int threads = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            config.bind_address = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            config.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            config.unix_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            config.pin_threads = true;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            config.backend = KVS_BACKEND_IO_URING;
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--mapped") == 0 && i + 1 < argc) {
+            mapped_path = argv[++i];
+        } else if (strcmp(argv[i], "--replica-of") == 0 && i + 1 < argc) {
+            config.replica_of = argv[++i];
+        } else if (strcmp(argv[i], "--repl-log") == 0 && i + 1 < argc) {
+            config.repl_log_size = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_config.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+            metrics_config.textfile = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_config.interval_ms = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((snapshot_path && mapped_path) || threads < 1 || threads > SERVER_MAX_SHARDS ||
+        ((mapped_path || config.replica_of) && threads > 1)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    config.metrics = metrics_config.port > 0 || metrics_config.textfile;
+    metrics_config.bind_address = config.bind_address;
+    unsigned shard_count = (unsigned)threads;
+    kvstore_t* shards[SERVER_MAX_SHARDS] = { NULL };
+    for (unsigned i = 0; i < shard_count; i++) {
+        shards[i] = mapped_path ? kvs_open_mapped(mapped_path, 0) : kvs_create(0);
+        if (!shards[i]) {
+            fprintf(stderr, "Error: Failed to create key-value store: %s\n",
+                    kvs_error_string(kvs_get_error()));
+            destroy_shards(shards, i);
+            return 1;
+        }
+    }
+
+    // each shard loads only its own hash range of the snapshot
+    if (snapshot_path && kvs_file_exists(snapshot_path)) {
+        for (unsigned i = 0; i < shard_count; i++) {
+            kvs_load_filter_t filter = { KVS_FILTER_ALL, { 0, 0 }, 0, 0, NULL, NULL };
+            if (shard_count > 1) {
+                filter.kind = KVS_FILTER_HASH_RANGE;
+                filter.hash_range = kvs_shard_hash_range(i, shard_count);
+            }
+            if (!kvs_load_range(shards[i], snapshot_path, &filter)) {
+                fprintf(stderr, "Error: Could not load '%s': %s\n", snapshot_path,
+                        kvs_error_string(kvs_get_error()));
+                destroy_shards(shards, shard_count);
+                return 1;
+            }
+        }
+    }
+
+    kvs_server_t* server = kvs_server_create_sharded(shards, shard_count, &config);
+    if (!server) {
+        fprintf(stderr, "Error: Failed to start server: %s\n", kvs_error_string(kvs_get_error()));
+        destroy_shards(shards, shard_count);
+        return 1;
+    }
+
+    kvs_metrics_exporter_t* exporter = NULL;
+    if (config.metrics) {
+        exporter = kvs_metrics_exporter_start(server->metrics, shard_count, &metrics_config);
+        if (!exporter) {
+            fprintf(stderr, "Error: Failed to start metrics exporter: %s\n",
+                    kvs_error_string(kvs_get_error()));
+            kvs_server_destroy(server);
+            destroy_shards(shards, shard_count);
+            return 1;
+        }
+    }
+
+    size_t entries = 0;
+    for (unsigned i = 0; i < shard_count; i++) {
+        entries += kvs_count(shards[i]);
+    }
+
+    running_server = server;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving %zu entries", entries);
+    if (config.port > 0) {
+        printf(" on %s:%d", config.bind_address, config.port);
+    }
+    if (config.unix_path) {
+        printf(" on %s", config.unix_path);
+    }
+    if (shard_count > 1) {
+        printf(" with %u event loops", shard_count);
+    }
+    printf(" using %s", kvs_server_backend_name(server->backend));
+    if (config.replica_of) {
+        printf(", replica of %s", config.replica_of);
+    }
+    if (metrics_config.port > 0) {
+        printf(", metrics on %s:%d", config.bind_address, metrics_config.port);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    bool ok = kvs_server_run(server);
+    kvs_metrics_exporter_stop(exporter);
+    kvs_server_destroy(server);
+    running_server = NULL;
+
+    if (mapped_path) {
+        ok = kvs_checkpoint(shards[0]) && ok;
+    } else if (snapshot_path) {
+        entries = 0;
+        for (unsigned i = 0; i < shard_count; i++) {
+            entries += kvs_count(shards[i]);
+        }
+        printf("Saving %zu entries to '%s'\n", entries, snapshot_path);
+        ok = kvs_save_sharded(shards, shard_count, snapshot_path) && ok;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: %s\n", kvs_error_string(kvs_get_error()));
+    }
+
+    destroy_shards(shards, shard_count);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+/**
+ * Shared-memory transport implementation
+ */
+
+#define _GNU_SOURCE
+
+#include "shmring.h"
+#include "error.h"
+#include <limits.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static size_t segment_size(size_t ring_size) {
+    return KVS_SHM_DATA_OFFSET + 2 * ring_size;
+}
+
+static void map_rings(kvs_shm_t* shm, void* base, size_t ring_size) {
+    shm->header = base;
+    shm->requests = (char*)base + KVS_SHM_DATA_OFFSET;
+    shm->replies = shm->requests + ring_size;
+    shm->ring_size = ring_size;
+}
+
+bool kvs_shm_create(kvs_shm_t* shm, int* fd) {
+    size_t size = segment_size(KVS_SHM_RING_SIZE);
+    int segment = memfd_create("kvs-shm", MFD_CLOEXEC);
+    if (segment < 0 || ftruncate(segment, (off_t)size) != 0) {
+        if (segment >= 0) {
+            close(segment);
+        }
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+
+    // a fresh memfd reads as zeros, so the indexes start at 0
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment, 0);
+    if (base == MAP_FAILED) {
+        close(segment);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+    map_rings(shm, base, KVS_SHM_RING_SIZE);
+    shm->header->magic = KVS_SHM_MAGIC;
+    shm->header->ring_size = KVS_SHM_RING_SIZE;
+    *fd = segment;
+    return true;
+}
+
+bool kvs_shm_attach(kvs_shm_t* shm, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < KVS_SHM_DATA_OFFSET) {
+        kvs_set_error(KVS_ERROR_FILE_IO);
+        return false;
+    }
+    void* base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return false;
+    }
+
+    const kvs_shm_header_t* header = base;
+    size_t ring_size = header->ring_size;
+    if (header->magic != KVS_SHM_MAGIC || ring_size == 0 || (ring_size & (ring_size - 1)) != 0 ||
+        segment_size(ring_size) != (size_t)st.st_size) {
+        munmap(base, (size_t)st.st_size);
+        kvs_set_error(KVS_ERROR_CORRUPTION);
+        return false;
+    }
+    map_rings(shm, base, ring_size);
+    return true;
+}
+
+void kvs_shm_detach(kvs_shm_t* shm) {
+    if (shm->header) {
+        munmap(shm->header, segment_size(shm->ring_size));
+        shm->header = NULL;
+    }
+}
+
+size_t kvs_shm_write(kvs_shm_ring_t* ring, char* data, size_t size, const char* src, size_t len) {
+    uint64_t head = ring->head;
+    size_t used = (size_t)(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    size_t room = used < size ? size - used : 0;
+    if (len > room) {
+        len = room;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t pos = (size_t)head & (size - 1);
+    size_t first = size - pos < len ? size - pos : len;
+    memcpy(data + pos, src, first);
+    memcpy(data, src + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+size_t kvs_shm_read(kvs_shm_ring_t* ring, const char* data, size_t size, char* dst, size_t len) {
+    uint64_t tail = ring->tail;
+    size_t available = (size_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail);
+    // the other side is another process: never trust it past the ring
+    if (available > size) {
+        available = size;
+    }
+    if (len > available) {
+        len = available;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t pos = (size_t)tail & (size - 1);
+    size_t first = size - pos < len ? size - pos : len;
+    memcpy(dst, data + pos, first);
+    memcpy(dst + first, data, len - first);
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+void kvs_shm_relax(void) {
+    static int cpus;
+    if (cpus == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = online > 0 ? (int)online : 1;
+    }
+    if (cpus == 1) {
+        sched_yield();
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void kvs_shm_futex_wait(uint32_t* word, uint32_t expected, int timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L };
+    // shared futex: the word is mapped by two processes
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+}
+
+void kvs_shm_futex_wake(uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
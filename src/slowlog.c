@@ -0,0 +1,97 @@
+/**
+ * Slow-operation log implementation
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "slowlog.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+slowlog_t* slowlog_create(size_t entries, uint64_t threshold_us) {
+    if (entries == 0) {
+        entries = SLOWLOG_DEFAULT_ENTRIES;
+    }
+
+    slowlog_t* log = calloc(1, sizeof(slowlog_t));
+    if (!log) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    log->entries = malloc(entries * sizeof(kvs_slow_entry_t));
+    if (!log->entries) {
+        free(log);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    log->capacity = entries;
+    log->threshold_ns = threshold_us * 1000;
+    return log;
+}
+
+void slowlog_destroy(slowlog_t* log) {
+    if (!log) {
+        return;
+    }
+    free(log->entries);
+    free(log);
+}
+
+uint64_t slowlog_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void slowlog_record(slowlog_t* log, const kvs_slow_entry_t* entry) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    kvs_slow_entry_t* slot = &log->entries[log->next_id % log->capacity];
+    *slot = *entry;
+    slot->id = log->next_id++;
+    slot->time_us = (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000;
+    if (log->next_id - log->first > log->capacity) {
+        log->first = log->next_id - log->capacity;
+    }
+}
+
+size_t slowlog_get(const slowlog_t* log, kvs_slow_entry_t* out, size_t max) {
+    size_t count = 0;
+    for (uint64_t id = log->next_id; id > log->first && count < max; id--) {
+        out[count++] = log->entries[(id - 1) % log->capacity];
+    }
+    return count;
+}
+
+void slowlog_reset(slowlog_t* log) {
+    log->first = log->next_id;
+}
+
+const char* slowlog_op_name(kvs_op_t op) {
+    static const char* names[] = {
+        "get", "set", "delete", "mget", "mset", "mdel", "clear", "save", "load", "checkpoint"
+    };
+    return (size_t)op < sizeof(names) / sizeof(names[0]) ? names[op] : "unknown";
+}
+
+void slowlog_format_causes(unsigned causes, char* buf, size_t size) {
+    static const char* tags[] = { "resize", "probe", "alloc", "io" };
+    size_t used = 0;
+    if (size == 0) {
+        return;
+    }
+    buf[0] = '\0';
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        if ((causes & (1u << i)) && used < size) {
+            int n = snprintf(buf + used, size - used, "%s%s", used ? "," : "", tags[i]);
+            used += n > 0 ? (size_t)n : 0;
+        }
+    }
+    if (used == 0) {
+        snprintf(buf, size, "-");
+    }
+}
@@ -0,0 +1,190 @@
+/**
+ * Store statistics report formatting
+ *
+ * Both formats come from the same list of fields: a report writer turns
+ * sections and fields into either text or JSON.
+ */
+
+#include "stats.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+typedef struct {
+    char* buf;
+    size_t size;
+    int len;                // full length so far, may exceed size
+    bool json;
+    bool first_section;
+    bool first_field;
+} report_t;
+
+static void emit(report_t* r, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    size_t used = (size_t)r->len;
+    int n = vsnprintf(used < r->size ? r->buf + used : NULL, used < r->size ? r->size - used : 0, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        r->len += n;
+    }
+}
+
+static void section(report_t* r, const char* name) {
+    if (r->json) {
+        emit(r, "%s\"%s\":{", r->first_section ? "{" : "},", name);
+    } else {
+        emit(r, "%s# %c%s\n", r->first_section ? "" : "\n", toupper((unsigned char)name[0]), name + 1);
+    }
+    r->first_section = false;
+    r->first_field = true;
+}
+
+static void field_name(report_t* r, const char* name) {
+    if (r->json) {
+        emit(r, "%s\"%s\":", r->first_field ? "" : ",", name);
+    } else {
+        emit(r, "%s:", name);
+    }
+    r->first_field = false;
+}
+
+static void field_u64(report_t* r, const char* name, uint64_t value) {
+    field_name(r, name);
+    emit(r, r->json ? "%llu" : "%llu\n", (unsigned long long)value);
+}
+
+static void field_double(report_t* r, const char* name, double value) {
+    field_name(r, name);
+    emit(r, r->json ? "%.4f" : "%.4f\n", value);
+}
+
+static void field_bool(report_t* r, const char* name, bool value) {
+    field_name(r, name);
+    emit(r, r->json ? "%s" : "%s\n", value ? "true" : "false");
+}
+
+/**
+ * A string field, NULL shown as null / empty
+ */
+static void field_string(report_t* r, const char* name, const char* value) {
+    field_name(r, name);
+    if (!r->json) {
+        emit(r, "%s\n", value ? value : "");
+        return;
+    }
+    if (!value) {
+        emit(r, "null");
+        return;
+    }
+    emit(r, "\"");
+    for (const unsigned char* p = (const unsigned char*)value; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            emit(r, "\\%c", *p);
+        } else if (*p < 0x20) {
+            emit(r, "\\u%04x", *p);
+        } else {
+            emit(r, "%c", *p);
+        }
+    }
+    emit(r, "\"");
+}
+
+/**
+ * Summary of one operation's histogram, an object in JSON
+ */
+static void field_latency(report_t* r, const char* name, const histogram_t* hist) {
+    double p50 = (double)histogram_percentile(hist, 50.0) / 1000.0;
+    double p99 = (double)histogram_percentile(hist, 99.0) / 1000.0;
+    double p999 = (double)histogram_percentile(hist, 99.9) / 1000.0;
+    double mean = histogram_mean(hist) / 1000.0;
+    double max = (double)hist->max / 1000.0;
+    unsigned long long calls = (unsigned long long)hist->total;
+
+    field_name(r, name);
+    if (r->json) {
+        emit(r, "{\"calls\":%llu,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+                "\"p99.9_us\":%.3f,\"max_us\":%.3f}", calls, mean, p50, p99, p999, max);
+    } else {
+        emit(r, "calls=%llu,mean=%.3f,p50=%.3f,p99=%.3f,p99.9=%.3f,max=%.3f\n",
+             calls, mean, p50, p99, p999, max);
+    }
+}
+
+int kvs_latency_format(const latency_t* latency, bool json, char* buf, size_t size) {
+    report_t r = { buf, size, 0, json, true, true };
+    if (buf && size > 0) {
+        buf[0] = '\0';
+    }
+
+    section(&r, "latency");
+    for (int op = 0; op < KVS_OP_COUNT; op++) {
+        if (latency->ops[op].total > 0) {
+            field_latency(&r, slowlog_op_name((kvs_op_t)op), &latency->ops[op]);
+        }
+    }
+    if (json) {
+        emit(&r, "}}");
+    }
+    return r.len;
+}
+
+int kvs_info_format(const kvs_info_t* info, bool json, char* buf, size_t size) {
+    report_t r = { buf, size, 0, json, true, true };
+    if (buf && size > 0) {
+        buf[0] = '\0';
+    }
+    const kvs_stats_t* ops = &info->ops;
+
+    section(&r, "operations");
+    field_u64(&r, "gets", ops->gets);
+    field_u64(&r, "get_hits", ops->get_hits);
+    field_u64(&r, "get_misses", ops->gets - ops->get_hits);
+    field_double(&r, "hit_ratio", info->hit_ratio);
+    field_u64(&r, "sets", ops->sets);
+    field_u64(&r, "deletes", ops->deletes);
+    field_u64(&r, "delete_misses", ops->deletes - ops->delete_hits);
+    field_u64(&r, "mget_calls", ops->mgets);
+    field_u64(&r, "mset_calls", ops->msets);
+    field_u64(&r, "mdel_calls", ops->mdels);
+    field_u64(&r, "scan_calls", ops->scans);
+    field_u64(&r, "clears", ops->clears);
+
+    section(&r, "table");
+    field_string(&r, "mode", info->mode);
+    field_u64(&r, "entries", info->entries);
+    field_u64(&r, "capacity", info->capacity);
+    field_u64(&r, "tombstones", info->tombstones);
+    field_double(&r, "load_factor", info->load_factor);
+    field_double(&r, "effective_load_factor", info->effective_load_factor);
+    field_double(&r, "probe_mean", info->probe_mean);
+    field_u64(&r, "probe_max", info->probe_max);
+    field_u64(&r, "resizes", info->resizes);
+    field_u64(&r, "resize_us", info->resize_us);
+
+    section(&r, "memory");
+    field_u64(&r, "table_bytes", info->memory_table);
+    field_u64(&r, "value_bytes", info->memory_values);
+    field_u64(&r, "merkle_bytes", info->memory_merkle);
+    field_u64(&r, "changefeed_bytes", info->memory_changefeed);
+    field_u64(&r, "slowlog_bytes", info->memory_slowlog);
+    field_u64(&r, "latency_bytes", info->memory_latency);
+    field_u64(&r, "total_bytes", info->memory_total);
+    field_u64(&r, "mapped_bytes", info->mapped_bytes);
+
+    section(&r, "persistence");
+    field_string(&r, "file", info->filename);
+    field_u64(&r, "changes_since_save", ops->changes_since_save);
+    field_u64(&r, "saves", ops->saves);
+    field_u64(&r, "save_failures", ops->save_failures);
+    field_u64(&r, "loads", ops->loads);
+    field_u64(&r, "last_save_time", ops->last_save_time);
+    field_u64(&r, "last_save_us", ops->last_save_us);
+    field_u64(&r, "last_save_bytes", ops->last_save_bytes);
+    field_bool(&r, "last_save_ok", ops->last_save_ok);
+
+    if (json) {
+        emit(&r, "}}");
+    }
+    return r.len;
+}
@@ -0,0 +1,311 @@
+/**
+ * io_uring wrapper implementation
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                     void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Probe the kernel once and remember the answer
+ */
+bool uring_available(void) {
+    static int available = -1;
+    if (available >= 0) {
+        return available;
+    }
+
+    available = 0;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = sys_setup(2, &params);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (probe && sys_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        available = probe->last_op >= IORING_OP_SEND_ZC &&
+                    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED) &&
+                    (params.features & IORING_FEAT_EXT_ARG) &&
+                    (params.features & IORING_FEAT_NODROP);
+    }
+
+    free(probe);
+    close(fd);
+    return available;
+}
+
+/**
+ * Create a ring
+ */
+bool uring_init(uring_t* ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    // one submitter, and completions are only reaped when we ask
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+    int fd = sys_setup(entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        fd = sys_setup(entries, &params);
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->features = params.features;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_exit(ring);
+        return false;
+    }
+
+    if (single) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_exit(ring);
+            return false;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_exit(ring);
+        return false;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // the index array is the identity, entries are used in order
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    return true;
+}
+
+void uring_exit(uring_t* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        // full: push what is queued to the kernel and carry on
+        if (uring_submit_and_wait(ring, 0, -1) < 0) {
+            return NULL;
+        }
+        tail = *ring->sq_tail;
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr, int timeout_ms) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void* argp = NULL;
+    size_t arg_size = 0;
+
+    if (wait_nr > 0 && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        arg_size = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int submitted = sys_enter(ring->fd, ring->sq_pending, wait_nr, flags, argp, arg_size);
+    if (submitted < 0) {
+        return -errno;
+    }
+    ring->sq_pending -= (unsigned)submitted < ring->sq_pending ? (unsigned)submitted : ring->sq_pending;
+    return submitted;
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, uint16_t bgid, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len,
+                     bool zero_copy, uint64_t user_data) {
+    sqe->opcode = zero_copy ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, uint32_t events, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+/**
+ * Register a provided buffer ring
+ */
+bool uring_buffers_init(uring_t* ring, uring_buffers_t* buffers, uint16_t bgid,
+                        unsigned count, unsigned size) {
+    memset(buffers, 0, sizeof(*buffers));
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+        return false;
+    }
+
+    buffers->ring_size = count * sizeof(struct io_uring_buf);
+    buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED) {
+        buffers->ring = NULL;
+        return false;
+    }
+    buffers->base = malloc((size_t)count * size);
+    if (!buffers->base) {
+        uring_buffers_free(buffers);
+        return false;
+    }
+    buffers->count = count;
+    buffers->size = size;
+    buffers->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buffers->ring;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        uring_buffers_free(buffers);
+        return false;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        uring_buffer_return(buffers, i);
+    }
+    return true;
+}
+
+void uring_buffers_free(uring_buffers_t* buffers) {
+    if (buffers->ring) {
+        munmap(buffers->ring, buffers->ring_size);
+    }
+    free(buffers->base);
+    memset(buffers, 0, sizeof(*buffers));
+}
+
+void uring_buffer_return(uring_buffers_t* buffers, unsigned bid) {
+    struct io_uring_buf* buf = &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(buffers, bid);
+    buf->len = buffers->size;
+    buf->bid = (uint16_t)bid;
+    buffers->tail++;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
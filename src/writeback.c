@@ -0,0 +1,406 @@
+/**
+ * Write-back cache implementation
+ */
+
+#define _GNU_SOURCE
+
+#include "writeback.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * A key's pending write
+ */
+typedef struct dirty_node {
+    int key;
+    bool deleted;
+    char* value;                // copy, kept (and reused) across writes
+    size_t len;
+    size_t capacity;
+    long long since_ms;         // when the key became dirty
+    struct dirty_node* chain;   // bucket chain
+    struct dirty_node* older;   // age order
+    struct dirty_node* newer;
+} dirty_node_t;
+
+struct writeback {
+    kvs_writer_fn writer;
+    void* ctx;
+    kvs_writeback_config_t config;  // defaults filled in
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // to the flusher: a batch may be due, or stop
+    pthread_cond_t room;        // from the flusher: keys taken or written
+    dirty_node_t** buckets;
+    size_t bucket_mask;
+    dirty_node_t* oldest;
+    dirty_node_t* newest;
+    size_t count;               // keys in the table
+    size_t out;                 // keys in the batch the writer has
+    dirty_node_t** taken;       // that batch
+    kvs_dirty_t* batch;         // and what the writer is given of it
+    long long retry_at_ms;      // no batch before then, after a failure
+    unsigned retry_delay_ms;
+    int flush_waiters;          // writeback_flush callers
+    bool stopping;
+    pthread_t thread;
+    bool started;
+    kvs_writeback_stats_t stats;
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Wait on a condition (monotonic clock) until at_ms
+ */
+static void wait_until(pthread_cond_t* cond, pthread_mutex_t* lock, long long at_ms) {
+    struct timespec ts = { (time_t)(at_ms / 1000), (long)(at_ms % 1000) * 1000000L };
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static dirty_node_t** bucket_for(writeback_t* wb, int key) {
+    // Fibonacci hashing, the top bits pick the bucket
+    uint32_t hash = (uint32_t)key * 0x9e3779b1u;
+    return &wb->buckets[(hash >> 16) & wb->bucket_mask];
+}
+
+static dirty_node_t* find_node(writeback_t* wb, int key) {
+    dirty_node_t* node = *bucket_for(wb, key);
+    while (node && node->key != key) {
+        node = node->chain;
+    }
+    return node;
+}
+
+/**
+ * Add a node to the table, as the newest or (put back) the oldest
+ */
+static void link_node(writeback_t* wb, dirty_node_t* node, bool oldest) {
+    dirty_node_t** bucket = bucket_for(wb, node->key);
+    node->chain = *bucket;
+    *bucket = node;
+
+    if (oldest) {
+        node->older = NULL;
+        node->newer = wb->oldest;
+        if (wb->oldest) {
+            wb->oldest->older = node;
+        } else {
+            wb->newest = node;
+        }
+        wb->oldest = node;
+    } else {
+        node->newer = NULL;
+        node->older = wb->newest;
+        if (wb->newest) {
+            wb->newest->newer = node;
+        } else {
+            wb->oldest = node;
+        }
+        wb->newest = node;
+    }
+    wb->count++;
+}
+
+static void unlink_node(writeback_t* wb, dirty_node_t* node) {
+    dirty_node_t** link = bucket_for(wb, node->key);
+    while (*link != node) {
+        link = &(*link)->chain;
+    }
+    *link = node->chain;
+
+    if (node->older) {
+        node->older->newer = node->newer;
+    } else {
+        wb->oldest = node->newer;
+    }
+    if (node->newer) {
+        node->newer->older = node->older;
+    } else {
+        wb->newest = node->older;
+    }
+    wb->count--;
+}
+
+static void free_node(dirty_node_t* node) {
+    free(node->value);
+    free(node);
+}
+
+/**
+ * When the next batch is due, -1 while nothing is dirty
+ */
+static long long next_batch_ms(writeback_t* wb) {
+    if (wb->count == 0) {
+        return -1;
+    }
+    long long at = wb->oldest->since_ms + wb->config.flush_ms;
+    if (wb->count >= wb->config.batch_size || wb->flush_waiters > 0) {
+        at = 0;
+    }
+    return at > wb->retry_at_ms ? at : wb->retry_at_ms;
+}
+
+/**
+ * Hand the oldest keys to the writer (called with the lock held, which
+ * is let go meanwhile)
+ * @param last Drop the batch if it fails instead of putting it back
+ */
+static void write_batch(writeback_t* wb, bool last) {
+    size_t n = 0;
+    while (n < wb->config.batch_size && wb->oldest) {
+        dirty_node_t* node = wb->oldest;
+        unlink_node(wb, node);
+        wb->taken[n] = node;
+        wb->batch[n].key = node->key;
+        wb->batch[n].value = node->deleted ? NULL : node->value;
+        wb->batch[n].len = node->deleted ? 0 : node->len;
+        n++;
+    }
+    wb->out = n;
+    pthread_cond_broadcast(&wb->room);
+    pthread_mutex_unlock(&wb->lock);
+
+    bool ok = wb->writer(wb->ctx, wb->batch, n);
+
+    pthread_mutex_lock(&wb->lock);
+    wb->out = 0;
+    if (ok) {
+        wb->stats.flushed += n;
+        wb->stats.batches++;
+        wb->retry_at_ms = 0;
+        wb->retry_delay_ms = wb->config.retry_ms;
+    } else {
+        wb->stats.failures++;
+        wb->retry_at_ms = now_ms() + wb->retry_delay_ms;
+        wb->retry_delay_ms = wb->retry_delay_ms * 2 < wb->config.retry_max_ms ? wb->retry_delay_ms * 2
+                                                                            : wb->config.retry_max_ms;
+    }
+    // back in front, oldest first, unless the key was written meanwhile
+    for (size_t i = n; i-- > 0;) {
+        if (ok || last || find_node(wb, wb->taken[i]->key)) {
+            free_node(wb->taken[i]);
+        } else {
+            link_node(wb, wb->taken[i], true);
+        }
+    }
+    pthread_cond_broadcast(&wb->room);
+}
+
+static void* run_flusher(void* arg) {
+    writeback_t* wb = arg;
+    pthread_mutex_lock(&wb->lock);
+    while (!wb->stopping) {
+        long long at = next_batch_ms(wb);
+        if (at < 0) {
+            pthread_cond_wait(&wb->work, &wb->lock);
+        } else if (at > now_ms()) {
+            wait_until(&wb->work, &wb->lock, at);
+        } else {
+            write_batch(wb, false);
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+writeback_t* writeback_create(kvs_writer_fn writer, void* ctx, const kvs_writeback_config_t* config) {
+    if (!writer) {
+        kvs_set_error(KVS_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+
+    writeback_t* wb = calloc(1, sizeof(writeback_t));
+    if (!wb) {
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+    wb->writer = writer;
+    wb->ctx = ctx;
+    if (config) {
+        wb->config = *config;
+    }
+    kvs_writeback_config_t* c = &wb->config;
+    c->batch_size = c->batch_size ? c->batch_size : WRITEBACK_DEFAULT_BATCH;
+    c->flush_ms = c->flush_ms ? c->flush_ms : WRITEBACK_DEFAULT_FLUSH_MS;
+    c->max_dirty = c->max_dirty ? c->max_dirty : WRITEBACK_DEFAULT_MAX_DIRTY;
+    c->max_wait_ms = c->max_wait_ms ? c->max_wait_ms : WRITEBACK_DEFAULT_MAX_WAIT_MS;
+    c->retry_ms = c->retry_ms ? c->retry_ms : WRITEBACK_DEFAULT_RETRY_MS;
+    c->retry_max_ms = c->retry_max_ms ? c->retry_max_ms : WRITEBACK_DEFAULT_RETRY_MAX_MS;
+    wb->retry_delay_ms = c->retry_ms;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->work, &attr);
+    pthread_cond_init(&wb->room, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // about two keys per bucket when full
+    size_t buckets = 64;
+    while (buckets < c->max_dirty / 2 && buckets < ((size_t)1 << 16)) {
+        buckets *= 2;
+    }
+    wb->bucket_mask = buckets - 1;
+    wb->buckets = calloc(buckets, sizeof(dirty_node_t*));
+    wb->taken = malloc(c->batch_size * sizeof(dirty_node_t*));
+    wb->batch = malloc(c->batch_size * sizeof(kvs_dirty_t));
+    if (!wb->buckets || !wb->taken || !wb->batch) {
+        writeback_destroy(wb);
+        kvs_set_error(KVS_ERROR_MEMORY);
+        return NULL;
+    }
+
+    if (pthread_create(&wb->thread, NULL, run_flusher, wb) != 0) {
+        writeback_destroy(wb);
+        kvs_set_error(KVS_ERROR_UNKNOWN);
+        return NULL;
+    }
+    wb->started = true;
+    return wb;
+}
+
+void writeback_destroy(writeback_t* wb) {
+    if (!wb) {
+        return;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+    wb->stopping = true;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+    if (wb->started) {
+        pthread_join(wb->thread, NULL);
+    }
+
+    // one more try for what is still dirty, then it is dropped
+    pthread_mutex_lock(&wb->lock);
+    while (wb->oldest && wb->taken) {
+        write_batch(wb, true);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->work);
+    pthread_cond_destroy(&wb->room);
+    free(wb->buckets);
+    free(wb->taken);
+    free(wb->batch);
+    free(wb);
+}
+
+bool writeback_reserve(writeback_t* wb) {
+    pthread_mutex_lock(&wb->lock);
+    // the batch out counts, it is back in the table if it fails
+    if (wb->count + wb->out >= wb->config.max_dirty) {
+        wb->stats.stalls++;
+        long long deadline = now_ms() + wb->config.max_wait_ms;
+        while (wb->count + wb->out >= wb->config.max_dirty && now_ms() < deadline) {
+            pthread_cond_signal(&wb->work);
+            wait_until(&wb->room, &wb->lock, deadline);
+        }
+        if (wb->count + wb->out >= wb->config.max_dirty) {
+            wb->stats.timeouts++;
+            pthread_mutex_unlock(&wb->lock);
+            kvs_set_error(KVS_ERROR_BACKEND);
+            return false;
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return true;
+}
+
+bool writeback_mark(writeback_t* wb, int key, const char* value, size_t len) {
+    pthread_mutex_lock(&wb->lock);
+    dirty_node_t* node = find_node(wb, key);
+    bool added = !node;
+    if (added) {
+        node = calloc(1, sizeof(dirty_node_t));
+        if (!node) {
+            pthread_mutex_unlock(&wb->lock);
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return false;
+        }
+        node->key = key;
+        node->since_ms = now_ms();
+    }
+
+    if (value && len + 1 > node->capacity) {
+        char* copy = realloc(node->value, len + 1);
+        if (!copy) {
+            if (added) {
+                free(node);
+            }
+            pthread_mutex_unlock(&wb->lock);
+            kvs_set_error(KVS_ERROR_MEMORY);
+            return false;
+        }
+        node->value = copy;
+        node->capacity = len + 1;
+    }
+    node->deleted = !value;
+    node->len = value ? len : 0;
+    if (value) {
+        memcpy(node->value, value, len);
+        node->value[len] = '\0';
+    }
+
+    wb->stats.writes++;
+    if (added) {
+        link_node(wb, node, false);
+        // the first key starts the flusher's clock, a full batch goes at once
+        if (wb->count == 1 || wb->count == wb->config.batch_size) {
+            pthread_cond_signal(&wb->work);
+        }
+    } else {
+        wb->stats.coalesced++;
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return true;
+}
+
+bool writeback_pending(writeback_t* wb, int key) {
+    pthread_mutex_lock(&wb->lock);
+    bool pending = find_node(wb, key) != NULL;
+    for (size_t i = 0; !pending && i < wb->out; i++) {
+        pending = wb->batch[i].key == key;
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return pending;
+}
+
+bool writeback_flush(writeback_t* wb, int timeout_ms) {
+    long long deadline = now_ms() + timeout_ms;
+    pthread_mutex_lock(&wb->lock);
+    wb->flush_waiters++;
+    pthread_cond_signal(&wb->work);
+    while ((wb->count > 0 || wb->out > 0) && (timeout_ms < 0 || now_ms() < deadline)) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&wb->room, &wb->lock);
+        } else {
+            wait_until(&wb->room, &wb->lock, deadline);
+        }
+    }
+    wb->flush_waiters--;
+    bool done = wb->count == 0 && wb->out == 0;
+    pthread_mutex_unlock(&wb->lock);
+
+    if (!done) {
+        kvs_set_error(KVS_ERROR_BACKEND);
+    }
+    return done;
+}
+
+void writeback_stats(writeback_t* wb, kvs_writeback_stats_t* stats) {
+    pthread_mutex_lock(&wb->lock);
+    *stats = wb->stats;
+    stats->dirty = wb->count + wb->out;
+    pthread_mutex_unlock(&wb->lock);
+}
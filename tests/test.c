@@ -5,12 +5,29 @@
  * basic operations, persistence, error handling, and edge cases.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "../include/kvstore.h"
+#include "../include/persistence.h"
+#include "../include/handoff.h"
+#include "../include/server.h"
+#include "../include/command.h"
+#include "../include/replication.h"
+#include "../include/kvsclient.h"
+#include "../include/binproto.h"
+#include "../include/shmring.h"
+#include "../include/histogram.h"
+#include "../include/metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <time.h>
 
 /**
  * Test result tracking
@@ -400,6 +417,2193 @@ static bool test_edge_cases(void) {
     return true;
 }
 
+/**
+ * fwrite replacement that fails after the header, simulating a crash mid-save
+ */
+static size_t failing_write(const void* ptr, size_t size, size_t count, FILE* file) {
+    if (size == sizeof(kvs_file_header_t)) {
+        return fwrite(ptr, size, count, file);
+    }
+    return 0;
+}
+
+/**
+ * Test that a torn save leaves the previous snapshot intact
+ */
+static bool test_torn_save(void) {
+    unlink(TEST_FILENAME);
+
+    kvstore_t* kvs = kvs_create(0);
+    if (!kvs) return false;
+
+    kvs_set(kvs, 1, "first");
+    if (!kvs_save(kvs, TEST_FILENAME)) {
+        kvs_destroy(kvs);
+        return false;
+    }
+
+    // A save that dies part-way through must fail without touching the file
+    kvs_set(kvs, 1, "second");
+    kvs_set(kvs, 2, "extra");
+    kvs_set_write_fn(failing_write);
+    bool saved = kvs_save(kvs, TEST_FILENAME);
+    kvs_set_write_fn(NULL);
+    kvs_destroy(kvs);
+
+    if (saved) return false;
+
+    kvstore_t* loaded = kvs_create(0);
+    if (!loaded) return false;
+
+    bool ok = kvs_load(loaded, TEST_FILENAME) &&
+              kvs_count(loaded) == 1 &&
+              kvs_get(loaded, 1) && strcmp(kvs_get(loaded, 1), "first") == 0;
+
+    kvs_destroy(loaded);
+    unlink(TEST_FILENAME);
+    return ok;
+}
+
+/**
+ * Test the memory-mapped persistent-heap mode across a restart
+ */
+static bool test_mapped_mode(void) {
+    const char* path = "test_mapped.kvm";
+    unlink(path);
+
+    kvstore_t* kvs = kvs_open_mapped(path, 4);
+    if (!kvs) return false;
+
+    // enough entries to resize the table and grow the file
+    char value[64];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(value, sizeof(value), "value_%d", i);
+        if (!kvs_set(kvs, i, value)) {
+            kvs_destroy(kvs);
+            return false;
+        }
+    }
+
+    // grow one value past its block and delete a few keys
+    kvs_set(kvs, 7, "a much longer value that no longer fits the original block");
+    for (int i = 100; i < 200; i++) {
+        kvs_delete(kvs, i);
+    }
+    kvs_destroy(kvs);
+
+    // restart: the data must be there without any load step
+    kvs = kvs_open_mapped(path, 0);
+    if (!kvs) return false;
+
+    bool ok = kvs_count(kvs) == 4900;
+    for (int i = 0; ok && i < 5000; i++) {
+        const char* got = kvs_get(kvs, i);
+        snprintf(value, sizeof(value), "value_%d", i);
+        if (i == 7) {
+            ok = got && strncmp(got, "a much longer", 13) == 0;
+        } else if (i >= 100 && i < 200) {
+            ok = got == NULL;
+        } else {
+            ok = got && strcmp(got, value) == 0;
+        }
+    }
+
+    // snapshots of a mapped store load back into a heap store
+    if (ok) {
+        kvstore_t* heap = kvs_create(0);
+        ok = heap && kvs_save(kvs, TEST_FILENAME) && kvs_load(heap, TEST_FILENAME) &&
+             kvs_count(heap) == 4900;
+        kvs_destroy(heap);
+    }
+
+    kvs_destroy(kvs);
+    unlink(path);
+    unlink(TEST_FILENAME);
+    return ok;
+}
+
+/**
+ * Test that a mapped table reuses the blocks that were free at a crash
+ */
+static bool test_mapped_recovery(void) {
+    const char* path = "test_recovery.kvm";
+    unlink(path);
+
+    char value[4000];
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+
+    long long sizes[3];
+    bool ok = true;
+    for (int round = 0; ok && round < 3; round++) {
+        // a child fills, deletes and dies without closing the table
+        pid_t pid = fork();
+        if (pid == 0) {
+            kvstore_t* kvs = kvs_open_mapped(path, 0);
+            for (int i = 0; kvs && i < 200; i++) {
+                kvs_set(kvs, i, value);
+            }
+            for (int i = 0; kvs && i < 200; i++) {
+                kvs_delete(kvs, i);
+            }
+            _exit(kvs ? 0 : 1);
+        }
+        int status = 0;
+        ok = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        sizes[round] = kvs_file_size(path);
+    }
+
+    // each restart refills the blocks freed before the crash
+    ok = ok && sizes[0] > 0 && sizes[1] == sizes[0] && sizes[2] == sizes[0];
+
+    kvstore_t* kvs = ok ? kvs_open_mapped(path, 0) : NULL;
+    ok = kvs && kvs_count(kvs) == 0 && kvs_set(kvs, 1, "back") && strcmp(kvs_get(kvs, 1), "back") == 0;
+    kvs_destroy(kvs);
+    unlink(path);
+    return ok;
+}
+
+/**
+ * Test handing a memfd-backed table to another process
+ */
+static bool test_handoff(void) {
+    const char* socket_path = "test_handoff.sock";
+
+    kvstore_t* kvs = kvs_create_memfd(0);
+    if (!kvs) return false;
+
+    char value[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(value, sizeof(value), "value_%d", i);
+        kvs_set(kvs, i, value);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        kvs_destroy(kvs);
+        return false;
+    }
+
+    if (pid == 0) {
+        // new process: take over and keep serving from the same table
+        kvstore_t* taken = kvs_handoff_receive(socket_path, 5000);
+        bool ok = taken && kvs_count(taken) == 1000 &&
+                  kvs_get(taken, 500) && strcmp(kvs_get(taken, 500), "value_500") == 0 &&
+                  kvs_set(taken, 1000, "written after takeover");
+        _exit(ok ? 0 : 1);
+    }
+
+    bool sent = kvs_handoff_send(kvs, socket_path);
+
+    // the old store must not be usable after a successful handoff
+    bool released = sent && kvs_get(kvs, 1) == NULL;
+    kvs_destroy(kvs);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return released && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Test the multi-key calls: chunking, duplicate keys, a single resize
+ * per batch, and the mapped table
+ */
+static bool test_multi_key(void) {
+    enum { COUNT = 1000 };
+    kvstore_t* kvs = kvs_create(16);
+    kvstore_t* mapped = kvs_create_memfd(0);
+    int* keys = malloc(COUNT * sizeof(int));
+    const char** values = malloc(COUNT * sizeof(char*));
+    char (*text)[16] = malloc(COUNT * sizeof(*text));
+    bool* deleted = malloc(COUNT * sizeof(bool));
+    bool ok = kvs && mapped && keys && values && text && deleted;
+
+    for (int i = 0; ok && i < COUNT; i++) {
+        keys[i] = i * 7;
+        snprintf(text[i], sizeof(text[i]), "v%d", i);
+        values[i] = text[i];
+    }
+
+    // 1000 new keys: one resize straight to the final capacity
+    ok = ok && kvs_mset(kvs, keys, values, NULL, COUNT) && kvs_count(kvs) == COUNT &&
+         ht_capacity(kvs->table) == 2048 && strcmp(kvs_get(kvs, 7 * 999), "v999") == 0;
+
+    // lookups land in the caller's order, missing keys are NULL
+    keys[5] = -1;
+    ok = ok && kvs_mget(kvs, keys, COUNT, values) == COUNT - 1 && values[5] == NULL &&
+         strcmp(values[0], "v0") == 0 && strcmp(values[COUNT - 1], "v999") == 0;
+    keys[5] = 35;
+
+    // a key given twice keeps the last value, lengths may be explicit
+    int dup_keys[] = { 1, 2, 1 };
+    const char* dup_values[] = { "first", "two", "last-and-more" };
+    size_t dup_lens[] = { 5, 3, 4 };
+    ok = ok && kvs_mset(kvs, dup_keys, dup_values, dup_lens, 3) && strcmp(kvs_get(kvs, 1), "last") == 0 &&
+         strcmp(kvs_get(kvs, 2), "two") == 0;
+    const char* bad[] = { "x", NULL };
+    ok = ok && !kvs_mset(kvs, dup_keys, bad, NULL, 2) && kvs_get_error() == KVS_ERROR_INVALID_PARAM;
+
+    // deletes report which keys were there
+    keys[3] = -5;
+    ok = ok && kvs_mdel(kvs, keys, COUNT, deleted) == COUNT - 1 && !deleted[3] && deleted[4] &&
+         kvs_count(kvs) == 3;
+
+    // the mapped table goes through the same calls, and grows once too
+    for (int i = 0; ok && i < COUNT; i++) {
+        values[i] = text[i];
+    }
+    ok = ok && kvs_mset(mapped, keys, values, NULL, COUNT) && kvs_count(mapped) == COUNT &&
+         mapped->mapped->resizes == 1 && mt_capacity(mapped->mapped) == 2048;
+    int some[] = { 10, 20, 30 };
+    const char* some_values[] = { "a", "b", "c" };
+    const char* got[3];
+    ok = ok && kvs_mset(mapped, some, some_values, NULL, 3) && kvs_mdel(mapped, some + 1, 1, NULL) == 1 &&
+         kvs_mget(mapped, some, 3, got) == 2 && strcmp(got[0], "a") == 0 && got[1] == NULL &&
+         strcmp(got[2], "c") == 0;
+
+    free(keys);
+    free(values);
+    free(text);
+    free(deleted);
+    kvs_destroy(kvs);
+    kvs_destroy(mapped);
+    return ok;
+}
+
+static void count_scanned(void* ctx, int key, const char* value) {
+    (void)value;
+    int* seen = ctx;
+    if (key >= 0 && key < 10000) {
+        seen[key]++;
+    }
+}
+
+/**
+ * Test cursor scans: whole passes, and a pass across resizes and deletes
+ */
+static bool test_scan(void) {
+    kvstore_t* kvs = kvs_create(16);
+    kvstore_t* mapped = kvs_create_memfd(0);
+    int* seen = calloc(10000, sizeof(int));
+    bool ok = kvs && mapped && seen;
+
+    // capacities are powers of two, the cursor relies on it
+    hash_table_t* table = ht_create(100);
+    ok = ok && table && ht_capacity(table) == 128;
+    ht_destroy(table);
+
+    for (int i = 0; ok && i < 100; i++) {
+        ok = kvs_set(kvs, i, "v") && kvs_set(mapped, i * 3, "m");
+    }
+
+    // a quiet pass returns every key once
+    uint64_t cursor = 0;
+    int pages = 0;
+    do {
+        cursor = kvs_scan(kvs, cursor, 7, count_scanned, seen);
+        pages++;
+    } while (ok && cursor != 0);
+    for (int i = 0; ok && i < 100; i++) {
+        ok = seen[i] == 1;
+    }
+    ok = ok && pages > 1;
+
+    // the table grows from 256 to 8192 slots mid-scan: nothing present
+    // throughout is missed
+    memset(seen, 0, 10000 * sizeof(int));
+    cursor = 0;
+    pages = 0;
+    do {
+        cursor = kvs_scan(kvs, cursor, 5, count_scanned, seen);
+        pages++;
+        if (pages == 2) {
+            for (int i = 1000; ok && i < 5000; i++) {
+                ok = kvs_set(kvs, i, "grow");
+            }
+        } else if (pages == 4) {
+            for (int i = 90; i < 100; i++) {
+                kvs_delete(kvs, i);
+            }
+        }
+    } while (ok && cursor != 0);
+    for (int i = 0; ok && i < 90; i++) {
+        ok = seen[i] >= 1;
+    }
+
+    // the mapped table is walked the same way
+    memset(seen, 0, 10000 * sizeof(int));
+    cursor = 0;
+    do {
+        cursor = kvs_scan(mapped, cursor, 10, count_scanned, seen);
+    } while (ok && cursor != 0);
+    for (int i = 0; ok && i < 300; i++) {
+        ok = seen[i] == (i % 3 == 0);
+    }
+
+    ok = ok && kvs_scan(NULL, 0, 10, count_scanned, seen) == 0 && kvs_get_error() == KVS_ERROR_INVALID_PARAM;
+
+    free(seen);
+    kvs_destroy(kvs);
+    kvs_destroy(mapped);
+    return ok;
+}
+
+/**
+ * Test merkle digests and store-to-store diffs
+ */
+static bool test_merkle_diff(void) {
+    kvstore_t* a = kvs_create(0);
+    kvstore_t* b = kvs_create(0);
+    if (!a || !b) {
+        kvs_destroy(a);
+        kvs_destroy(b);
+        return false;
+    }
+
+    char value[32];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(value, sizeof(value), "value_%d", i);
+        kvs_set(a, i, value);
+        kvs_set(b, i, value);
+    }
+
+    // a is enabled after loading data, b before changes: both must agree
+    bool ok = kvs_merkle_enable(a, 0) && kvs_merkle_enable(b, 0) &&
+              merkle_root(a->merkle) == merkle_root(b->merkle);
+
+    kvs_hash_range_t ranges[16];
+    ok = ok && kvs_merkle_diff(a, b, ranges, 16) == 0;
+
+    // diverge on two keys: the diff must cover exactly those hashes
+    kvs_set(b, 42, "changed");
+    kvs_delete(b, 1000);
+    size_t count = kvs_merkle_diff(a, b, ranges, 16);
+    bool found_42 = false;
+    bool found_1000 = false;
+    for (size_t i = 0; i < count && i < 16; i++) {
+        found_42 = found_42 || kvs_hash_in_range(&ranges[i], (uint32_t)ht_hash(42));
+        found_1000 = found_1000 || kvs_hash_in_range(&ranges[i], (uint32_t)ht_hash(1000));
+    }
+    ok = ok && count >= 1 && count <= 2 && found_42 && found_1000;
+
+    // exchanging exported leaf digests finds the same ranges
+    uint64_t* leaves = malloc(sizeof(uint64_t) << MERKLE_DEFAULT_DEPTH);
+    ok = ok && leaves && merkle_level_digests(b->merkle, MERKLE_DEFAULT_DEPTH, leaves) > 0 &&
+         merkle_diff_level(a->merkle, MERKLE_DEFAULT_DEPTH, leaves, ranges, 16) == count;
+    free(leaves);
+
+    // repairing the replica makes the trees equal again
+    kvs_set(b, 42, "value_42");
+    kvs_set(b, 1000, "value_1000");
+    ok = ok && kvs_merkle_diff(a, b, ranges, 16) == 0 &&
+         merkle_root(a->merkle) == merkle_root(b->merkle);
+
+    kvs_destroy(a);
+    kvs_destroy(b);
+    return ok;
+}
+
+/**
+ * Test the change feed: batches from a sequence, eviction by record
+ * count and by value bytes, and the snapshot fallback
+ */
+static bool test_changefeed(void) {
+    kvstore_t* kvs = kvs_create(0);
+    kvstore_t* copy = kvs_create(0);
+    if (!kvs || !copy) {
+        kvs_destroy(kvs);
+        kvs_destroy(copy);
+        return false;
+    }
+
+    // 8 records, 64 bytes of values
+    kvs_set(kvs, 99, "before");
+    bool ok = kvs_changefeed_enable(kvs, 8, 64);
+    uint64_t seq = kvs_changefeed_seq(kvs);
+    ok = ok && kvs_set(kvs, 1, "one") && kvs_set(kvs, 2, "two") && kvs_delete(kvs, 1) &&
+         !kvs_delete(kvs, 1) && kvs_set(kvs, 2, "");
+
+    kvs_change_t changes[16];
+    size_t count = 0;
+    ok = ok && kvs_changefeed_read(kvs, seq, changes, 3, &count) && count == 3 &&
+         changes[0].seq == seq && changes[0].op == KVS_CHANGE_SET && changes[0].key == 1 &&
+         strcmp(changes[0].value, "one") == 0 && changes[0].value_len == 3 &&
+         changes[2].op == KVS_CHANGE_DELETE && changes[2].key == 1 && changes[2].value == NULL;
+    ok = ok && kvs_changefeed_read(kvs, seq + 3, changes, 16, &count) && count == 1 &&
+         changes[0].key == 2 && strcmp(changes[0].value, "") == 0;
+    ok = ok && kvs_changefeed_read(kvs, seq + 4, changes, 16, &count) && count == 0;
+
+    // eight more changes push the first ones out of the ring
+    for (int i = 0; i < 8; i++) {
+        ok = ok && kvs_set(kvs, 10 + i, "v");
+    }
+    ok = ok && !kvs_changefeed_read(kvs, seq, changes, 16, &count) &&
+         kvs_get_error() == KVS_ERROR_TRUNCATED &&
+         kvs_changefeed_read(kvs, seq + 4, changes, 16, &count) && count == 8 &&
+         changes[7].key == 17 && strcmp(changes[7].value, "v") == 0;
+
+    // values filling the arena drop records too, oversized ones are kept without value
+    char value[48];
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    uint64_t big = kvs_changefeed_seq(kvs);
+    ok = ok && kvs_set(kvs, 20, value) && kvs_set(kvs, 21, value) &&
+         !kvs_changefeed_read(kvs, big, changes, 16, &count) &&
+         kvs_changefeed_read(kvs, big + 1, changes, 16, &count) && count == 1 &&
+         changes[0].key == 21 && strcmp(changes[0].value, value) == 0;
+    char huge[100];
+    memset(huge, 'y', sizeof(huge) - 1);
+    huge[sizeof(huge) - 1] = '\0';
+    ok = ok && kvs_set(kvs, 22, huge) &&
+         kvs_changefeed_read(kvs, big + 2, changes, 16, &count) && count == 1 &&
+         changes[0].key == 22 && changes[0].value == NULL && changes[0].value_len == sizeof(huge) - 1;
+
+    // a consumer that fell behind loads a snapshot and carries on from there
+    ok = ok && kvs_changefeed_snapshot(kvs, TEST_FILENAME, &seq) && kvs_load(copy, TEST_FILENAME) &&
+         kvs_set(kvs, 23, "after") && kvs_delete(kvs, 99) &&
+         kvs_changefeed_read(kvs, seq, changes, 16, &count) && count == 2;
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = changes[i].op == KVS_CHANGE_SET ? kvs_set(copy, changes[i].key, changes[i].value)
+                                             : kvs_delete(copy, changes[i].key);
+    }
+    ok = ok && kvs_count(copy) == kvs_count(kvs) && strcmp(kvs_get(copy, 23), "after") == 0 &&
+         kvs_get(copy, 99) == NULL;
+
+    // bulk changes are not itemized, every consumer resyncs
+    seq = kvs_changefeed_seq(kvs);
+    ok = ok && kvs_clear(kvs) && !kvs_changefeed_read(kvs, seq, changes, 16, &count) &&
+         kvs_get_error() == KVS_ERROR_TRUNCATED;
+
+    kvs_destroy(kvs);
+    kvs_destroy(copy);
+    unlink(TEST_FILENAME);
+    return ok;
+}
+
+/**
+ * Test the slow log: what is logged, cause tags, the ring and reset
+ */
+static bool test_slowlog(void) {
+    kvstore_t* kvs = kvs_create(4);
+    if (!kvs) return false;
+    kvs_slow_entry_t entries[8];
+
+    // nothing is logged without a log, or under the threshold
+    bool ok = kvs_slowlog_get(kvs, entries, 8) == 0;
+    ok = ok && kvs_slowlog_enable(kvs, 10 * 1000 * 1000, 4);
+    ok = ok && kvs_set(kvs, 1, "one") && kvs_get(kvs, 1) != NULL;
+    ok = ok && kvs_slowlog_get(kvs, entries, 8) == 0;
+
+    // with a zero threshold every operation is logged, newest first
+    ok = ok && kvs_slowlog_enable(kvs, 0, 4);
+    ok = ok && kvs_set(kvs, 2, "two") && kvs_get(kvs, 2) != NULL && kvs_delete(kvs, 2);
+    ok = ok && kvs_slowlog_get(kvs, entries, 8) == 3;
+    ok = ok && entries[0].op == KVS_OP_DELETE && entries[1].op == KVS_OP_GET && entries[2].op == KVS_OP_SET;
+    ok = ok && entries[0].id == entries[1].id + 1 && entries[2].key == 2 && entries[2].value_len == 3;
+    ok = ok && entries[2].causes == 0;
+
+    // a capacity 4 table holding one entry and one tombstone resizes
+    // during exactly one of the next three sets
+    ok = ok && kvs_set(kvs, 3, "three") && kvs_set(kvs, 4, "four") && kvs_set(kvs, 5, "five");
+    ok = ok && kvs_slowlog_get(kvs, entries, 3) == 3;
+    int resized = 0;
+    for (int i = 0; i < 3; i++) {
+        resized += (entries[i].causes & KVS_SLOW_RESIZE) != 0;
+    }
+    ok = ok && resized == 1 && ht_capacity(kvs->table) == 8;
+
+    // large values and file I/O are tagged
+    char* big = malloc(SLOWLOG_LARGE_VALUE + 1);
+    if (big) {
+        memset(big, 'v', SLOWLOG_LARGE_VALUE);
+        big[SLOWLOG_LARGE_VALUE] = '\0';
+    }
+    ok = ok && big && kvs_set(kvs, 6, big);
+    ok = ok && kvs_slowlog_get(kvs, entries, 1) == 1 && (entries[0].causes & KVS_SLOW_ALLOC);
+    ok = ok && kvs_save(kvs, TEST_FILENAME);
+    ok = ok && kvs_slowlog_get(kvs, entries, 1) == 1 && entries[0].op == KVS_OP_SAVE &&
+         entries[0].causes == KVS_SLOW_IO && entries[0].count == kvs_count(kvs);
+    remove(TEST_FILENAME);
+    free(big);
+
+    // the ring keeps the latest 4; reset drops them and ids carry on
+    ok = ok && kvs_slowlog_get(kvs, entries, 8) == 4 && entries[0].id == entries[3].id + 3;
+    uint64_t last = entries[0].id;
+    kvs_slowlog_reset(kvs);
+    ok = ok && kvs_slowlog_get(kvs, entries, 8) == 0;
+    const int keys[] = { 7, 8 };
+    const char* values[] = { "a", "b" };
+    ok = ok && kvs_mset(kvs, keys, values, NULL, 2);
+    ok = ok && kvs_slowlog_get(kvs, entries, 8) == 1 && entries[0].id == last + 1 &&
+         entries[0].op == KVS_OP_MSET && entries[0].count == 2 && entries[0].key == 7;
+
+    char causes[32];
+    slowlog_format_causes(KVS_SLOW_RESIZE | KVS_SLOW_IO, causes, sizeof(causes));
+    ok = ok && strcmp(causes, "resize,io") == 0 && strcmp(slowlog_op_name(KVS_OP_MDEL), "mdel") == 0;
+
+    kvs_destroy(kvs);
+    return ok;
+}
+
+/**
+ * Test kvs_info: counters, table shape, persistence status and formats
+ */
+static bool test_info(void) {
+    kvstore_t* kvs = kvs_create(16);
+    if (!kvs) return false;
+    kvs_info_t info;
+
+    bool ok = kvs_info(kvs, &info) && info.entries == 0 && info.ops.gets == 0 && !info.ops.last_save_ok;
+    for (int i = 0; i < 20; i++) {
+        ok = ok && kvs_set(kvs, i, "value");
+    }
+    ok = ok && kvs_get(kvs, 1) != NULL && kvs_get(kvs, 100) == NULL;
+    ok = ok && kvs_delete(kvs, 2) && !kvs_delete(kvs, 2);
+    const int keys[] = { 3, 4, 200 };
+    const char* values[3];
+    ok = ok && kvs_mget(kvs, keys, 3, values) == 2;
+
+    ok = ok && kvs_info(kvs, &info);
+    ok = ok && info.ops.gets == 5 && info.ops.get_hits == 3 && info.hit_ratio == 0.6;
+    ok = ok && info.ops.sets == 20 && info.ops.deletes == 2 && info.ops.delete_hits == 1 && info.ops.mgets == 1;
+    ok = ok && info.ops.changes_since_save == 21;
+    ok = ok && info.entries == 19 && info.tombstones == 1 && info.capacity == 32 && info.resizes == 1;
+    ok = ok && info.effective_load_factor > info.load_factor;
+    ok = ok && info.probe_mean >= 0.0 && info.probe_max < info.capacity;
+    ok = ok && info.memory_values == 19 * 6 && info.memory_table == 32 * sizeof(ht_entry_t);
+    ok = ok && info.memory_total == info.memory_table + info.memory_values;
+
+    // a save resets the change count and records the file written
+    ok = ok && kvs_save(kvs, TEST_FILENAME) && kvs_info(kvs, &info);
+    ok = ok && info.ops.saves == 1 && info.ops.last_save_ok && info.ops.changes_since_save == 0;
+    ok = ok && info.ops.last_save_time > 0 && (long long)info.ops.last_save_bytes == kvs_file_size(TEST_FILENAME);
+    ok = ok && info.filename && strcmp(info.filename, TEST_FILENAME) == 0;
+    remove(TEST_FILENAME);
+
+    // both formats, and a truncated buffer still reports the full length
+    char text[4096];
+    char json[4096];
+    char small[16];
+    int text_len = kvs_info_format(&info, false, text, sizeof(text));
+    int json_len = kvs_info_format(&info, true, json, sizeof(json));
+    ok = ok && text_len > 0 && (size_t)text_len < sizeof(text) && strncmp(text, "# Operations\n", 13) == 0;
+    ok = ok && strstr(text, "\ntombstones:1\n") && strstr(text, "\n# Persistence\n");
+    const char* json_start = "{\"operations\":{\"gets\":5,";
+    ok = ok && json_len > 0 && strncmp(json, json_start, strlen(json_start)) == 0;
+    ok = ok && strstr(json, "\"last_save_ok\":true}}") && (size_t)json_len == strlen(json);
+    ok = ok && kvs_info_format(&info, true, small, sizeof(small)) == json_len && strlen(small) == sizeof(small) - 1;
+
+    kvs_destroy(kvs);
+    return ok;
+}
+
+/**
+ * Key predicate for the partial load test: even keys only
+ */
+static bool is_even_key(void* ctx, int key) {
+    (void)ctx;
+    return key % 2 == 0;
+}
+
+/**
+ * Test latency histograms: one per operation type, merged over stores
+ */
+static bool test_latency(void) {
+    const char* filename = "test_latency.bin";
+    kvstore_t* a = kvs_create(0);
+    kvstore_t* b = kvs_create(0);
+    latency_t* merged = latency_create();
+    if (!a || !b || !merged) {
+        kvs_destroy(a);
+        kvs_destroy(b);
+        latency_destroy(merged);
+        return false;
+    }
+
+    // nothing is recorded until enabled
+    kvs_set(a, 1, "x");
+    bool ok = !kvs_latency_merge(a, merged) && kvs_latency_enable(a) && kvs_latency_enable(b);
+    ok = ok && kvs_set(a, 2, "y") && kvs_get(a, 2) && !kvs_get(a, 3) && kvs_delete(a, 1);
+    ok = ok && kvs_set(b, 4, "z") && kvs_get(b, 4) && kvs_save(b, filename);
+
+    ok = ok && kvs_latency_merge(a, merged) && kvs_latency_merge(b, merged);
+    ok = ok && merged->ops[KVS_OP_GET].total == 3 && merged->ops[KVS_OP_SET].total == 2 &&
+         merged->ops[KVS_OP_DELETE].total == 1 && merged->ops[KVS_OP_SAVE].total == 1 &&
+         merged->ops[KVS_OP_LOAD].total == 0 && merged->ops[KVS_OP_SAVE].max > 0;
+
+    char text[1024];
+    int len = kvs_latency_format(merged, false, text, sizeof(text));
+    const char* text_start = "# Latency\nget:calls=3,mean=";
+    ok = ok && len == (int)strlen(text) && strncmp(text, text_start, strlen(text_start)) == 0 &&
+         strstr(text, "\nsave:calls=1,") && !strstr(text, "load:");
+    kvs_latency_format(merged, true, text, sizeof(text));
+    const char* json_start = "{\"latency\":{\"get\":{\"calls\":3,";
+    ok = ok && strncmp(text, json_start, strlen(json_start)) == 0 && strcmp(text + strlen(text) - 2, "}}") == 0;
+
+    kvs_info_t info;
+    ok = ok && kvs_info(a, &info) && info.memory_latency == sizeof(latency_t);
+
+    // reset empties, enabling again keeps, disabling drops
+    kvs_latency_reset(b);
+    kvs_get(b, 4);
+    ok = ok && kvs_latency_enable(b);
+    latency_reset(merged);
+    ok = ok && kvs_latency_merge(b, merged) && merged->ops[KVS_OP_GET].total == 1 &&
+         merged->ops[KVS_OP_SET].total == 0;
+    kvs_latency_disable(b);
+    ok = ok && !kvs_latency_merge(b, merged) && kvs_info(b, &info) && info.memory_latency == 0;
+
+    unlink(filename);
+    latency_destroy(merged);
+    kvs_destroy(a);
+    kvs_destroy(b);
+    return ok;
+}
+
+/**
+ * Test partial loads by hash range, key range and predicate
+ */
+static bool test_load_range(void) {
+    unlink(TEST_FILENAME);
+
+    kvstore_t* kvs = kvs_create(0);
+    kvstore_t* low = kvs_create(0);
+    kvstore_t* high = kvs_create(0);
+    kvstore_t* part = kvs_create(0);
+    bool ok = kvs && low && high && part;
+
+    char value[32];
+    for (int i = 0; ok && i < 5000; i++) {
+        snprintf(value, sizeof(value), "value_%d", i);
+        ok = kvs_set(kvs, i, value);
+    }
+    ok = ok && kvs_save(kvs, TEST_FILENAME);
+
+    // the two halves of the hash space partition the data
+    kvs_load_filter_t filter = { KVS_FILTER_HASH_RANGE, { 0, 0x7FFFFFFF }, 0, 0, NULL, NULL };
+    ok = ok && kvs_load_range(low, TEST_FILENAME, &filter);
+    filter.hash_range.start = 0x80000000u;
+    filter.hash_range.end = UINT32_MAX;
+    ok = ok && kvs_load_range(high, TEST_FILENAME, &filter);
+    ok = ok && kvs_count(low) + kvs_count(high) == 5000 && kvs_count(low) > 0 && kvs_count(high) > 0;
+
+    for (int i = 0; ok && i < 5000; i++) {
+        kvstore_t* owner = (uint32_t)ht_hash(i) <= 0x7FFFFFFF ? low : high;
+        snprintf(value, sizeof(value), "value_%d", i);
+        ok = kvs_get(owner, i) && strcmp(kvs_get(owner, i), value) == 0;
+    }
+
+    // key range
+    kvs_load_filter_t keys = { KVS_FILTER_KEY_RANGE, { 0, 0 }, 100, 199, NULL, NULL };
+    ok = ok && kvs_load_range(part, TEST_FILENAME, &keys) && kvs_count(part) == 100 &&
+         kvs_get(part, 100) && kvs_get(part, 199) && !kvs_get(part, 200);
+
+    // predicate
+    kvs_clear(part);
+    kvs_load_filter_t even = { KVS_FILTER_PREDICATE, { 0, 0 }, 0, 0, is_even_key, NULL };
+    ok = ok && kvs_load_range(part, TEST_FILENAME, &even) && kvs_count(part) == 2500 &&
+         kvs_get(part, 4998) && !kvs_get(part, 4999);
+
+    // version 1 (flat) files are still readable and filterable
+    FILE* file = fopen(TEST_FILENAME, "wb");
+    ok = ok && file;
+    if (file) {
+        kvs_file_header_t header = { KVS_MAGIC_NUMBER, KVS_FILE_VERSION_FLAT, 3, 0 };
+        fwrite(&header, sizeof(header), 1, file);
+        for (int key = 1; key <= 3; key++) {
+            uint32_t len = 3;
+            fwrite(&key, sizeof(key), 1, file);
+            fwrite(&len, sizeof(len), 1, file);
+            fwrite("old", 1, len, file);
+        }
+        fclose(file);
+    }
+    kvs_clear(part);
+    keys.key_min = 2;
+    keys.key_max = 3;
+    ok = ok && kvs_load_range(part, TEST_FILENAME, &keys) && kvs_count(part) == 2 &&
+         !kvs_get(part, 1) && strcmp(kvs_get(part, 3), "old") == 0;
+
+    kvs_destroy(kvs);
+    kvs_destroy(low);
+    kvs_destroy(high);
+    kvs_destroy(part);
+    unlink(TEST_FILENAME);
+    return ok;
+}
+
+static void* run_server(void* arg) {
+    kvs_server_run(arg);
+    return NULL;
+}
+
+static int connect_unix(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Send a request and read until the server hangs up (end it with QUIT)
+ */
+static bool ask(const char* path, const char* request, char* reply, size_t size) {
+    int sock = connect_unix(path);
+    size_t len = strlen(request);
+    bool ok = sock >= 0 && write(sock, request, len) == (ssize_t)len;
+    size_t got = 0;
+    ssize_t n;
+    while (ok && got < size - 1 && (n = read(sock, reply + got, size - 1 - got)) > 0) {
+        got += (size_t)n;
+    }
+    reply[got] = '\0';
+    if (sock >= 0) {
+        close(sock);
+    }
+    return ok;
+}
+
+/**
+ * Walk a server SCAN to the end, counting how often each key comes up
+ */
+static bool scan_server(const char* path, int* seen, int limit) {
+    static char reply[65536];
+    char request[64];
+    unsigned long long cursor = 0;
+    do {
+        size_t keys;
+        snprintf(request, sizeof(request), "SCAN %llu COUNT 16\r\nQUIT\r\n", cursor);
+        if (!ask(path, request, reply, sizeof(reply)) ||
+            sscanf(reply, "*2\r\n$%*d\r\n%llu\r\n*%zu\r\n", &cursor, &keys) != 2) {
+            return false;
+        }
+        // skip "*2", "$n", the cursor and "*k", then read "$n" / key pairs
+        const char* line = reply;
+        for (size_t i = 0; i < 4 + 2 * keys; i++) {
+            if (i >= 4 && i % 2 == 1) {
+                int key = atoi(line);
+                if (key >= 0 && key < limit) {
+                    seen[key]++;
+                }
+            }
+            line = strstr(line, "\r\n");
+            if (!line) {
+                return false;
+            }
+            line += 2;
+        }
+    } while (cursor != 0);
+    return true;
+}
+
+/**
+ * Test the network server with pipelined RESP and inline requests
+ */
+static bool test_server(void) {
+    const char* socket_path = "test_server.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+
+    kvstore_t* kvs = kvs_create(0);
+    kvs_server_t* server = kvs ? kvs_server_create(kvs, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        kvs_destroy(kvs);
+        return false;
+    }
+
+    const char* request =
+        "*3\r\n$3\r\nSET\r\n$1\r\n1\r\n$5\r\nhello\r\n"
+        "GET 1\r\n"
+        "INCR 2\r\nincr 2\r\n"
+        "*4\r\n$4\r\nMGET\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n"
+        "MSET 3 c 4 d\r\n"
+        "DEL 1 3 99\r\n"
+        "MDEL 98 99\r\n"
+        "GET abc\r\n"
+        "SET 5\r\n"
+        "NOPE\r\n"
+        "QUIT\r\n";
+    const char* expected =
+        "+OK\r\n"
+        "$5\r\nhello\r\n"
+        ":1\r\n:2\r\n"
+        "*3\r\n$5\r\nhello\r\n$1\r\n2\r\n$-1\r\n"
+        "+OK\r\n"
+        ":2\r\n"
+        ":0\r\n"
+        "-ERR key is not an integer\r\n"
+        "-ERR wrong number of arguments for 'set' command\r\n"
+        "-ERR unknown command 'NOPE'\r\n"
+        "+OK\r\n";
+
+    int sock = connect_unix(socket_path);
+    bool ok = sock >= 0;
+
+    // send in two pieces, splitting a request, then read until QUIT closes
+    size_t len = strlen(request);
+    size_t half = 20;
+    struct timespec pause = { 0, 10 * 1000000L };
+    ok = ok && write(sock, request, half) == (ssize_t)half;
+    nanosleep(&pause, NULL);
+    ok = ok && write(sock, request + half, len - half) == (ssize_t)(len - half);
+
+    char reply[512];
+    size_t got = 0;
+    ssize_t n;
+    while (ok && got < sizeof(reply) - 1 && (n = read(sock, reply + got, sizeof(reply) - 1 - got)) > 0) {
+        got += (size_t)n;
+    }
+    reply[got] = '\0';
+    ok = ok && strcmp(reply, expected) == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+
+    ok = ok && kvs_count(kvs) == 2 && strcmp(kvs_get(kvs, 2), "2") == 0 &&
+         strcmp(kvs_get(kvs, 4), "d") == 0 && access(socket_path, F_OK) != 0;
+    kvs_destroy(kvs);
+    return ok;
+}
+
+/**
+ * Test a sharded server: commands spanning shards are forwarded between
+ * the event loops and answered in order
+ */
+static bool test_sharded_server(void) {
+    const char* socket_path = "test_sharded.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    enum { SHARDS = 4, KEYS = 200 };
+
+    kvstore_t* shards[SHARDS];
+    bool ok = true;
+    for (int i = 0; i < SHARDS; i++) {
+        shards[i] = kvs_create(0);
+        ok = ok && shards[i];
+    }
+    kvs_server_t* server = ok ? kvs_server_create_sharded(shards, SHARDS, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        for (int i = 0; i < SHARDS; i++) {
+            kvs_destroy(shards[i]);
+        }
+        return false;
+    }
+
+    // the Unix socket is served by loop 0, so most keys live elsewhere
+    static char request[16384];
+    static char expected[16384];
+    size_t req = (size_t)snprintf(request, sizeof(request), "MSET");
+    for (int i = 0; i < KEYS; i++) {
+        req += (size_t)snprintf(request + req, sizeof(request) - req, " %d v%d", i, i);
+    }
+    req += (size_t)snprintf(request + req, sizeof(request) - req, "\r\nMGET");
+    for (int i = 0; i < KEYS; i++) {
+        req += (size_t)snprintf(request + req, sizeof(request) - req, " %d", i);
+    }
+    snprintf(request + req, sizeof(request) - req,
+             " %d\r\nINCR 1000\r\nINCR 1000\r\nDEL 0 1 2 3 999\r\nGET 5\r\nGET 0\r\nQUIT\r\n", KEYS);
+
+    size_t exp = (size_t)snprintf(expected, sizeof(expected), "+OK\r\n*%d\r\n", KEYS + 1);
+    for (int i = 0; i < KEYS; i++) {
+        char value[16];
+        int len = snprintf(value, sizeof(value), "v%d", i);
+        exp += (size_t)snprintf(expected + exp, sizeof(expected) - exp, "$%d\r\n%s\r\n", len, value);
+    }
+    snprintf(expected + exp, sizeof(expected) - exp,
+             "$-1\r\n:1\r\n:2\r\n:4\r\n$2\r\nv5\r\n$-1\r\n+OK\r\n");
+
+    int sock = connect_unix(socket_path);
+    ok = sock >= 0 && write(sock, request, strlen(request)) == (ssize_t)strlen(request);
+
+    static char reply[16384];
+    size_t got = 0;
+    ssize_t n;
+    while (ok && got < sizeof(reply) - 1 && (n = read(sock, reply + got, sizeof(reply) - 1 - got)) > 0) {
+        got += (size_t)n;
+    }
+    reply[got] = '\0';
+    ok = ok && strcmp(reply, expected) == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    // SCAN walks the shards one after the other and returns each key once
+    static int seen[1001];
+    ok = ok && scan_server(socket_path, seen, 1001);
+    for (int key = 0; ok && key <= 1000; key++) {
+        ok = seen[key] == ((key >= 4 && key < KEYS) || key == 1000);
+    }
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+
+    // every key sits in the shard kvs_shard_for_key names, inside its hash range
+    size_t total = 0;
+    for (int key = 0; ok && key <= 1000; key++) {
+        unsigned owner = kvs_shard_for_key(key, SHARDS);
+        kvs_hash_range_t range = kvs_shard_hash_range(owner, SHARDS);
+        uint32_t hash = (uint32_t)ht_hash(key);
+        ok = hash >= range.start && hash <= range.end;
+        for (int i = 0; ok && i < SHARDS; i++) {
+            ok = (kvs_get(shards[i], key) != NULL) == ((unsigned)i == owner && (key >= 4 && (key < KEYS || key == 1000)));
+        }
+    }
+    for (int i = 0; i < SHARDS; i++) {
+        ok = ok && kvs_count(shards[i]) > 0;
+        total += kvs_count(shards[i]);
+    }
+    ok = ok && total == KEYS - 4 + 1;
+
+    // the shards save as one snapshot
+    kvstore_t* whole = kvs_create(0);
+    ok = ok && whole && kvs_save_sharded(shards, SHARDS, TEST_FILENAME) &&
+         kvs_load(whole, TEST_FILENAME) && kvs_count(whole) == total &&
+         strcmp(kvs_get(whole, 199), "v199") == 0 && strcmp(kvs_get(whole, 1000), "2") == 0;
+
+    kvs_destroy(whole);
+    for (int i = 0; i < SHARDS; i++) {
+        kvs_destroy(shards[i]);
+    }
+    unlink(TEST_FILENAME);
+    return ok;
+}
+
+/**
+ * Test the io_uring backend: large values arriving in many receive
+ * buffers, replies bigger than the output limit, forwarding between loops
+ * (the server quietly uses epoll where io_uring is unavailable)
+ */
+static bool test_uring_server(void) {
+    const char* socket_path = "test_uring.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_IO_URING, NULL, 0, false };
+    enum { SHARDS = 2, GETS = 30 };
+    const size_t value_len = KVS_MAX_VALUE_LENGTH;
+
+    kvstore_t* shards[SHARDS] = { kvs_create(0), kvs_create(0) };
+    kvs_server_t* server = shards[0] && shards[1] ? kvs_server_create_sharded(shards, SHARDS, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        kvs_destroy(shards[0]);
+        kvs_destroy(shards[1]);
+        return false;
+    }
+
+    // one big value per shard, then read them back many times over
+    char* value = malloc(value_len);
+    char* request = malloc(4 * value_len);
+    size_t expected_len = 0;
+    bool ok = value && request;
+    size_t req = 0;
+    int keys[SHARDS] = { -1, -1 };
+    for (int key = 0; ok && (keys[0] < 0 || keys[1] < 0); key++) {
+        keys[kvs_shard_for_key(key, SHARDS)] = key;
+    }
+    for (int i = 0; ok && i < SHARDS; i++) {
+        memset(value, 'a' + i, value_len);
+        char key[16];
+        int key_len = snprintf(key, sizeof(key), "%d", keys[i]);
+        req += (size_t)sprintf(request + req, "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$%zu\r\n",
+                               key_len, key, value_len);
+        memcpy(request + req, value, value_len);
+        req += value_len;
+        req += (size_t)sprintf(request + req, "\r\n");
+    }
+    if (ok) {
+        req += (size_t)sprintf(request + req, "MGET %d %d\r\nINFO\r\n", keys[0], keys[1]);
+        for (int i = 0; i < GETS; i++) {
+            req += (size_t)sprintf(request + req, "GET %d\r\n", keys[i % SHARDS]);
+        }
+        req += (size_t)sprintf(request + req, "QUIT\r\n");
+        expected_len = 5 * 3 + (size_t)(2 + GETS) * (value_len + 10);
+    }
+
+    int sock = ok ? connect_unix(socket_path) : -1;
+    ok = ok && sock >= 0;
+
+    // write and read at once, the replies outgrow the socket buffers
+    size_t written = 0;
+    char* reply = malloc(expected_len + 4096);
+    size_t got = 0;
+    ok = ok && reply;
+    while (ok) {
+        if (written < req) {
+            ssize_t n = send(sock, request + written, req - written, MSG_DONTWAIT);
+            if (n > 0) {
+                written += (size_t)n;
+            }
+        }
+        ssize_t n = recv(sock, reply + got, expected_len + 4095 - got, written < req ? MSG_DONTWAIT : 0);
+        if (n > 0) {
+            got += (size_t)n;
+        } else if (n == 0 || got >= expected_len + 4095 || written >= req) {
+            break;
+        }
+    }
+
+    if (reply) {
+        reply[got] = '\0';
+    }
+
+    // MGET's two values, INFO, then the GETs
+    char* rest = reply + 14;
+    ok = ok && got > 14 && strncmp(reply, "+OK\r\n+OK\r\n*2\r\n", 14) == 0;
+    if (ok) {
+        for (int i = 0; ok && i < GETS + 3; i++) {
+            size_t len = 0;
+            ok = sscanf(rest, "$%zu", &len) == 1 && strchr(rest, '\n');
+            rest = ok ? strchr(rest, '\n') + 1 : rest;
+            ok = ok && (size_t)(rest - reply) + len + 2 <= got;
+            if (ok && i == 2) {
+                ok = strncmp(rest, "# Server", 8) == 0;
+            } else if (ok) {
+                char fill = (char)('a' + (i < 2 ? i : i - 3) % SHARDS);
+                ok = len == value_len && rest[0] == fill && rest[len - 1] == fill;
+            }
+            rest += len + 2;
+        }
+        ok = ok && strcmp(rest, "+OK\r\n") == 0;
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    free(reply);
+    free(request);
+    free(value);
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+
+    ok = ok && kvs_count(shards[0]) == 1 && kvs_count(shards[1]) == 1;
+    kvs_destroy(shards[0]);
+    kvs_destroy(shards[1]);
+    return ok;
+}
+
+/**
+ * Read from a replication stream until it holds at least want bytes
+ */
+static size_t read_stream(int sock, char* buf, size_t size, size_t want) {
+    size_t got = 0;
+    ssize_t n;
+    while (got < want && got < size - 1 && (n = read(sock, buf + got, size - 1 - got)) > 0) {
+        got += (size_t)n;
+    }
+    buf[got] = '\0';
+    return got;
+}
+
+/**
+ * Test replication: the log ring, a replica server following a primary,
+ * and partial and full resyncs as seen by a hand-driven replica
+ */
+static bool test_replication(void) {
+    // the ring keeps the newest bytes and reads back in contiguous pieces
+    kvs_repl_log_t log;
+    const char* data;
+    bool ok = kvs_repl_log_init(&log, 8, 100);
+    kvs_repl_log_append(&log, "abcdef", 6);
+    kvs_repl_log_append(&log, "ghij", 4);
+    ok = ok && log.start == 102 && log.end == 110 && !kvs_repl_log_has(&log, 101) &&
+         kvs_repl_log_read(&log, 102, &data) == 2 && memcmp(data, "cd", 2) == 0 &&
+         kvs_repl_log_read(&log, 104, &data) == 6 && memcmp(data, "efghij", 6) == 0 &&
+         kvs_repl_log_read(&log, 110, &data) == 0;
+    kvs_repl_log_free(&log);
+
+    const char* primary_path = "test_primary.sock";
+    const char* replica_path = "test_replica.sock";
+    kvs_server_config_t primary_config = { NULL, 0, primary_path, false, KVS_BACKEND_EPOLL, NULL, 256, false };
+    kvs_server_config_t replica_config = { NULL, 0, replica_path, false, KVS_BACKEND_EPOLL, primary_path, 0, false };
+
+    kvstore_t* primary_kvs = kvs_create(0);
+    kvstore_t* replica_kvs = kvs_create(0);
+    ok = ok && primary_kvs && replica_kvs && kvs_set(primary_kvs, 1, "before") &&
+         kvs_set(replica_kvs, 9, "stale");
+    kvs_server_t* primary = ok ? kvs_server_create(primary_kvs, &primary_config) : NULL;
+    kvs_server_t* replica = ok ? kvs_server_create(replica_kvs, &replica_config) : NULL;
+    pthread_t threads[2];
+    if (!primary || !replica || pthread_create(&threads[0], NULL, run_server, primary) != 0) {
+        kvs_server_destroy(primary);
+        kvs_server_destroy(replica);
+        kvs_destroy(primary_kvs);
+        kvs_destroy(replica_kvs);
+        return false;
+    }
+    if (pthread_create(&threads[1], NULL, run_server, replica) != 0) {
+        kvs_server_stop(primary);
+        pthread_join(threads[0], NULL);
+        kvs_server_destroy(primary);
+        kvs_server_destroy(replica);
+        kvs_destroy(primary_kvs);
+        kvs_destroy(replica_kvs);
+        return false;
+    }
+
+    // the snapshot replaces what the replica had, the writes follow it
+    char reply[1024];
+    ok = ok && ask(primary_path, "SET 2 two\r\nINCR 3\r\nINCR 3\r\nDEL 1 4\r\nQUIT\r\n", reply, sizeof(reply)) &&
+         strcmp(reply, "+OK\r\n:1\r\n:2\r\n:1\r\n+OK\r\n") == 0;
+    const char* expected = "$-1\r\n$3\r\ntwo\r\n$1\r\n2\r\n$-1\r\n+OK\r\n";
+    struct timespec pause = { 0, 10 * 1000000L };
+    for (int i = 0; ok && i < 300; i++) {
+        ok = ask(replica_path, "GET 1\r\nGET 2\r\nGET 3\r\nGET 9\r\nQUIT\r\n", reply, sizeof(reply));
+        if (strcmp(reply, expected) == 0) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    ok = ok && strcmp(reply, expected) == 0;
+    ok = ok && ask(replica_path, "SET 5 x\r\nQUIT\r\n", reply, sizeof(reply)) &&
+         strcmp(reply, "-READONLY You can't write against a read only replica\r\n+OK\r\n") == 0;
+
+    // play a replica by hand: full sync, then pick up where it stopped
+    static char stream[4096];
+    char id[KVS_REPL_ID_LENGTH + 1] = "";
+    unsigned long long offset = 0;
+    size_t snapshot_len = 0;
+    int sock = connect_unix(primary_path);
+    ok = ok && sock >= 0 && write(sock, "PSYNC ? -1\r\n", 12) == 12 &&
+         read_stream(sock, stream, sizeof(stream), 80) > 0 &&
+         sscanf(stream, "+FULLRESYNC %40s %llu\r\n$%zu", id, &offset, &snapshot_len) == 3 &&
+         strlen(id) == KVS_REPL_ID_LENGTH && snapshot_len > 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    ok = ok && ask(primary_path, "SET 6 six\r\nQUIT\r\n", reply, sizeof(reply));
+    char request[128];
+    snprintf(request, sizeof(request), "PSYNC %s %llu\r\n", id, offset);
+    char continued[128];
+    int continued_len = snprintf(continued, sizeof(continued), "+CONTINUE %s\r\n%s", id,
+                                 "*3\r\n$3\r\nSET\r\n$1\r\n6\r\n$3\r\nsix\r\n");
+    sock = ok ? connect_unix(primary_path) : -1;
+    ok = ok && sock >= 0 && write(sock, request, strlen(request)) == (ssize_t)strlen(request) &&
+         read_stream(sock, stream, sizeof(stream), (size_t)continued_len) == (size_t)continued_len &&
+         strcmp(stream, continued) == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    // once the 256 byte log has wrapped past the offset, only a snapshot will do
+    for (int i = 0; ok && i < 20; i++) {
+        ok = ask(primary_path, "SET 7 0123456789abcdef\r\nQUIT\r\n", reply, sizeof(reply));
+    }
+    sock = ok ? connect_unix(primary_path) : -1;
+    ok = ok && sock >= 0 && write(sock, request, strlen(request)) == (ssize_t)strlen(request) &&
+         read_stream(sock, stream, sizeof(stream), 12) > 0 && strncmp(stream, "+FULLRESYNC ", 12) == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    kvs_server_stop(replica);
+    pthread_join(threads[1], NULL);
+    kvs_server_stop(primary);
+    pthread_join(threads[0], NULL);
+    kvs_server_destroy(replica);
+    kvs_server_destroy(primary);
+
+    ok = ok && kvs_count(replica_kvs) >= 3 && kvs_get(replica_kvs, 9) == NULL;
+    kvs_destroy(primary_kvs);
+    kvs_destroy(replica_kvs);
+    return ok;
+}
+
+static void count_reply(void* ctx, const kvsc_reply_t* reply) {
+    long long* sum = ctx;
+    *sum += reply && reply->type == RESP_REPLY_INTEGER ? reply->integer : 1000000;
+}
+
+typedef struct {
+    kvsc_pool_t* pool;
+    int base;
+    bool ok;
+} pool_worker_t;
+
+static void* run_pool_worker(void* arg) {
+    pool_worker_t* worker = arg;
+    worker->ok = true;
+    for (int i = 0; worker->ok && i < 200; i++) {
+        kvsc_conn_t* conn = kvsc_pool_acquire(worker->pool);
+        const char* value;
+        worker->ok = conn && kvsc_set(conn, worker->base + i, "pooled", 0) &&
+                     kvsc_get(conn, worker->base + i, &value, NULL) && value && strcmp(value, "pooled") == 0;
+        kvsc_pool_release(worker->pool, conn);
+    }
+    return NULL;
+}
+
+/**
+ * Test the client library: reply parsing, blocking and pipelined calls,
+ * batched helpers, callbacks, buffer reuse and the connection pool
+ */
+static bool test_client(void) {
+    // replies are measured, then parsed in place
+    char raw[] = "*3\r\n$3\r\nabc\r\n*2\r\n:7\r\n$-1\r\n-ERR no\r\n+OK";
+    size_t raw_len = strlen(raw);
+    resp_reply_t nodes[8];
+    size_t used;
+    size_t consumed;
+    bool ok = resp_parse_reply(raw, raw_len, NULL, &used, &consumed) == RESP_OK && used == 6 &&
+              resp_parse_reply(raw, raw_len, nodes, &used, &consumed) == RESP_OK && consumed == raw_len - 3 && nodes[0].type == RESP_REPLY_ARRAY && nodes[0].len == 3 &&
+              strcmp(nodes[0].elements[0].str, "abc") == 0 && nodes[0].elements[1].elements[0].integer == 7 &&
+              nodes[0].elements[1].elements[1].type == RESP_REPLY_NULL &&
+              strcmp(nodes[0].elements[2].str, "ERR no") == 0;
+    ok = ok && resp_parse_reply(raw + consumed, 3, NULL, &used, &consumed) == RESP_INCOMPLETE &&
+         resp_parse_reply("?x\r\n", 4, NULL, &used, &consumed) == RESP_PROTOCOL_ERROR;
+
+    const char* socket_path = "test_client.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    kvstore_t* kvs = kvs_create(0);
+    kvs_server_t* server = kvs ? kvs_server_create(kvs, &config) : NULL;
+    pthread_t thread;
+    if (!ok || !server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        kvs_destroy(kvs);
+        return false;
+    }
+
+    kvsc_conn_t* conn = kvsc_connect(socket_path, 5000);
+    const char* value;
+    size_t len;
+    bool deleted;
+    ok = conn && kvsc_set(conn, 1, "one", 0) && kvsc_get(conn, 1, &value, &len) &&
+         strcmp(value, "one") == 0 && len == 3 && kvsc_get(conn, 2, &value, NULL) && value == NULL &&
+         kvsc_del(conn, 1, &deleted) && deleted;
+
+    // error replies come back as replies, bad arguments are refused locally
+    const char* bad[] = { "INCR", "5" };
+    const kvsc_reply_t* reply = ok && kvsc_set(conn, 5, "text", 0) ? kvsc_command(conn, 2, bad, NULL) : NULL;
+    ok = ok && reply && reply->type == RESP_REPLY_ERROR && strstr(reply->str, "not an integer");
+    int one_key[] = { 6 };
+    const char* no_value[] = { NULL };
+    ok = ok && !kvsc_mset(conn, one_key, no_value, NULL, 1) && kvs_get_error() == KVS_ERROR_INVALID_PARAM;
+
+    // a pipeline of 100 requests, replies read in order
+    char keys_text[100][8];
+    for (int i = 0; ok && i < 100; i++) {
+        snprintf(keys_text[i], sizeof(keys_text[i]), "%d", 1000 + i);
+        const char* argv[] = { "SET", keys_text[i], keys_text[i] };
+        ok = kvsc_append(conn, 3, argv, NULL);
+    }
+    ok = ok && kvsc_pending(conn) == 100 && !kvsc_get(conn, 1000, &value, NULL);
+    for (int i = 0; ok && i < 100; i++) {
+        reply = kvsc_read_reply(conn);
+        ok = reply && reply->type == RESP_REPLY_STATUS && strcmp(reply->str, "OK") == 0;
+    }
+
+    // batched helpers span several MGET / MSET commands
+    enum { MANY = KVSC_BATCH_KEYS * 2 + 10 };
+    int* keys = malloc(MANY * sizeof(int));
+    const char** values = malloc(MANY * sizeof(char*));
+    size_t* lens = malloc(MANY * sizeof(size_t));
+    ok = ok && keys && values && lens;
+    for (int i = 0; ok && i < MANY; i++) {
+        keys[i] = 5000 + i;
+        values[i] = i % 2 ? "odd" : "even";
+    }
+    ok = ok && kvsc_mset(conn, keys, values, NULL, MANY);
+    keys[7] = -1;
+    ok = ok && kvsc_mget(conn, keys, MANY, values, lens) && values[7] == NULL &&
+         strcmp(values[0], "even") == 0 && strcmp(values[MANY - 1], "odd") == 0 && lens[MANY - 1] == 3;
+
+    // callbacks run in order, ahead of a later blocking call
+    long long sum = 0;
+    const char* incr[] = { "INCR", "77" };
+    for (int i = 0; ok && i < 10; i++) {
+        ok = kvsc_async(conn, 2, incr, NULL, count_reply, &sum);
+    }
+    ok = ok && kvsc_get(conn, 77, &value, NULL) && strcmp(value, "10") == 0 && sum == 55;
+    ok = ok && kvsc_async(conn, 2, incr, NULL, count_reply, &sum);
+    for (int tries = 0; ok && kvsc_pending(conn) > 0 && tries < 100; tries++) {
+        ok = kvsc_poll(conn, 100) >= 0;
+    }
+    ok = ok && sum == 66;
+
+    // once the buffers have grown, the same work allocates nothing
+    size_t in_capacity = conn ? conn->in.capacity : 0;
+    size_t out_capacity = conn ? conn->out.capacity : 0;
+    size_t node_capacity = conn ? conn->node_capacity : 0;
+    if (ok) {
+        keys[7] = 5007;
+    }
+    for (int i = 0; ok && i < MANY; i++) {
+        values[i] = i % 2 ? "odd" : "even";
+    }
+    ok = ok && kvsc_mset(conn, keys, values, NULL, MANY) && kvsc_mget(conn, keys, MANY, values, NULL) &&
+         conn->in.capacity == in_capacity && conn->out.capacity == out_capacity &&
+         conn->node_capacity == node_capacity;
+    kvsc_close(conn);
+
+    // four threads share two pooled connections
+    kvsc_pool_t* pool = kvsc_pool_create(socket_path, 2, 5000);
+    pool_worker_t workers[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        workers[i].pool = pool;
+        workers[i].base = 20000 + i * 1000;
+        workers[i].ok = false;
+    }
+    int started = 0;
+    while (ok && pool && started < 4 && pthread_create(&threads[started], NULL, run_pool_worker, &workers[started]) == 0) {
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    ok = ok && started == 4;
+    for (int i = 0; ok && i < 4; i++) {
+        ok = workers[i].ok;
+    }
+    kvsc_pool_destroy(pool);
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+
+    // a closed server breaks the connection
+    ok = ok && kvsc_connect(socket_path, 100) == NULL && kvs_get_error() == KVS_ERROR_FILE_IO;
+
+    free(keys);
+    free(values);
+    free(lens);
+    kvs_destroy(kvs);
+    return ok;
+}
+
+/**
+ * Test the binary protocol: framing, then a sharded server answering
+ * binary frames and RESP on the same connection
+ */
+static bool test_binary_protocol(void) {
+    // a SET frame parses in place, a truncated one waits for more
+    resp_buf_t buf = { NULL, 0, 0 };
+    int frame_keys[] = { 3, -4 };
+    const char* frame_values[] = { "ab", "" };
+    kvs_bin_frame_t frame;
+    size_t used;
+    bool ok = kvs_bin_add_request(&buf, KVS_BIN_SET, frame_keys, 2, frame_values, NULL) &&
+              buf.len == KVS_BIN_HEADER_SIZE + 18 &&
+              kvs_bin_parse(buf.data, buf.len - 1, &frame, &used) == RESP_INCOMPLETE &&
+              kvs_bin_parse(buf.data, buf.len, &frame, &used) == RESP_OK && used == buf.len &&
+              frame.code == KVS_BIN_SET && frame.count == 2 && kvs_bin_check_request(&frame) &&
+              kvs_bin_key(&frame, 1) == -4 && kvs_bin_value_len(&frame, 0) == 2 &&
+              memcmp(kvs_bin_values(&frame), "ab", 2) == 0;
+    // value lengths that don't add up, an unknown opcode, too many keys
+    if (ok) {
+        kvs_bin_write32(buf.data + KVS_BIN_HEADER_SIZE + 8, 1);
+    }
+    ok = ok && kvs_bin_parse(buf.data, buf.len, &frame, &used) == RESP_OK && !kvs_bin_check_request(&frame);
+    buf.len = 0;
+    ok = ok && kvs_bin_add_header(&buf, 9, 0, 0) && kvs_bin_parse(buf.data, buf.len, &frame, &used) == RESP_OK &&
+         !kvs_bin_check_request(&frame);
+    buf.len = 0;
+    ok = ok && kvs_bin_add_header(&buf, KVS_BIN_GET, KVS_BIN_MAX_KEYS + 1, 4 * (KVS_BIN_MAX_KEYS + 1)) &&
+         kvs_bin_parse(buf.data, buf.len, &frame, &used) == RESP_PROTOCOL_ERROR;
+    resp_buf_free(&buf);
+
+    const char* socket_path = "test_binary.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    enum { SHARDS = 3 };
+    kvstore_t* shards[SHARDS];
+    for (int i = 0; i < SHARDS; i++) {
+        shards[i] = kvs_create(0);
+        ok = ok && shards[i];
+    }
+    kvs_server_t* server = ok ? kvs_server_create_sharded(shards, SHARDS, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        for (int i = 0; i < SHARDS; i++) {
+            kvs_destroy(shards[i]);
+        }
+        return false;
+    }
+
+    // frames of up to KVSC_BIN_BATCH_KEYS keys, spread over every loop
+    enum { MANY = KVSC_BIN_BATCH_KEYS + 100 };
+    int* keys = malloc(MANY * sizeof(int));
+    const char** values = malloc(MANY * sizeof(char*));
+    size_t* lens = malloc(MANY * sizeof(size_t));
+    kvsc_conn_t* conn = kvsc_connect(socket_path, 5000);
+    ok = keys && values && lens && conn;
+    for (int i = 0; ok && i < MANY; i++) {
+        keys[i] = i;
+        values[i] = i % 2 ? "odd" : "even";
+    }
+    const char* value;
+    size_t deleted;
+    ok = ok && kvsc_bin_mset(conn, keys, values, NULL, MANY) && kvsc_get(conn, MANY - 1, &value, NULL) &&
+         strcmp(value, "odd") == 0;
+    ok = ok && kvsc_set(conn, 2, "resp", 0);
+    keys[5] = -1;
+    ok = ok && kvsc_bin_mget(conn, keys, MANY, values, lens) && values[5] == NULL && lens[5] == 0 &&
+         lens[2] == 4 && memcmp(values[2], "resp", 4) == 0 && lens[MANY - 2] == 4 &&
+         memcmp(values[MANY - 2], "even", 4) == 0;
+    ok = ok && kvsc_bin_mdel(conn, keys, 10, &deleted) && deleted == 9 &&
+         kvsc_get(conn, 0, &value, NULL) && value == NULL;
+
+    // bad values are refused by the server, a pending reply locally
+    const char* bad[] = { "x" };
+    size_t bad_lens[] = { 2 };
+    ok = ok && !kvsc_bin_mset(conn, keys + 20, bad, bad_lens, 1) && kvs_get_error() == KVS_ERROR_SERVER &&
+         strstr(kvsc_server_error(conn), "ERR") != NULL && kvsc_get(conn, 20, &value, NULL) &&
+         strcmp(value, "even") == 0;
+    const char* ping[] = { "PING" };
+    ok = ok && kvsc_append(conn, 1, ping, NULL) && !kvsc_bin_mget(conn, keys, 1, values, lens) &&
+         kvs_get_error() == KVS_ERROR_INVALID_PARAM && kvsc_read_reply(conn) != NULL;
+
+    // values adding up to more than a frame holds get an error frame,
+    // and the connection goes on
+    enum { LARGE = KVS_BIN_MAX_BODY / KVS_MAX_VALUE_LENGTH + 10 };
+    char* large = malloc(KVS_MAX_VALUE_LENGTH + 1);
+    ok = ok && large;
+    if (ok) {
+        memset(large, 'v', KVS_MAX_VALUE_LENGTH);
+        large[KVS_MAX_VALUE_LENGTH] = '\0';
+    }
+    for (int i = 0; ok && i < LARGE; i++) {
+        keys[i] = 100000 + i;
+        ok = kvsc_set(conn, keys[i], large, KVS_MAX_VALUE_LENGTH);
+    }
+    ok = ok && !kvsc_bin_mget(conn, keys, LARGE, values, lens) && kvs_get_error() == KVS_ERROR_SERVER &&
+         strstr(kvsc_server_error(conn), "too large") != NULL;
+    ok = ok && kvsc_bin_mget(conn, keys, 2, values, lens) && lens[1] == KVS_MAX_VALUE_LENGTH;
+    free(large);
+    kvsc_close(conn);
+
+    // a malformed header gets an error frame and the connection closes
+    int sock = connect_unix(socket_path);
+    char header[KVS_BIN_HEADER_SIZE] = { (char)KVS_BIN_MAGIC, KVS_BIN_GET, 0, 0x40 };
+    char reply[64];
+    size_t got = sock >= 0 && write(sock, header, sizeof(header)) == (ssize_t)sizeof(header)
+                     ? read_stream(sock, reply, sizeof(reply), sizeof(reply) - 1)
+                     : 0;
+    ok = ok && got > KVS_BIN_HEADER_SIZE && reply[1] == KVS_BIN_ERROR &&
+         kvs_bin_parse(reply, got, &frame, &used) == RESP_OK && used == got;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+    for (int i = 0; i < SHARDS; i++) {
+        kvs_destroy(shards[i]);
+    }
+    free(keys);
+    free(values);
+    free(lens);
+    return ok;
+}
+
+/**
+ * Test the shared-memory transport: ring wrap-around, then a sharded
+ * server serving RESP and binary requests through the rings, pipelines
+ * bigger than a ring, and a server that goes away
+ */
+static bool test_shm_transport(void) {
+    // bytes come out in order across the end of the ring
+    kvs_shm_t shm;
+    int fd = -1;
+    char data[KVS_SHM_RING_SIZE / 2 + 100];
+    memset(data, 'a', sizeof(data));
+    data[sizeof(data) - 1] = 'z';
+    bool ok = kvs_shm_create(&shm, &fd);
+    kvs_shm_t peer = { NULL, NULL, NULL, 0 };
+    ok = ok && kvs_shm_attach(&peer, fd) && peer.ring_size == KVS_SHM_RING_SIZE;
+
+    // ring and table memfds don't pass for each other
+    mapped_table_t* table = mt_create_memfd("test", 0);
+    kvs_shm_t wrong = { NULL, NULL, NULL, 0 };
+    ok = ok && table && !kvs_shm_attach(&wrong, mt_fd(table)) && !mt_attach_fd(fd);
+    mt_close(table);
+    static char copy[KVS_SHM_RING_SIZE];
+    for (int round = 0; ok && round < 3; round++) {
+        ok = kvs_shm_write(&shm.header->requests, shm.requests, shm.ring_size, data, sizeof(data)) == sizeof(data) &&
+             kvs_shm_write(&shm.header->requests, shm.requests, shm.ring_size, data, sizeof(data)) ==
+                 KVS_SHM_RING_SIZE - sizeof(data) &&
+             kvs_shm_readable(&peer.header->requests) == KVS_SHM_RING_SIZE &&
+             kvs_shm_read(&peer.header->requests, peer.requests, peer.ring_size, copy, sizeof(data)) == sizeof(data) &&
+             copy[sizeof(data) - 1] == 'z' &&
+             kvs_shm_read(&peer.header->requests, peer.requests, peer.ring_size, copy, sizeof(copy)) ==
+                 KVS_SHM_RING_SIZE - sizeof(data);
+    }
+    kvs_shm_detach(&peer);
+    kvs_shm_detach(&shm);
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    const char* socket_path = "test_shm.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    enum { SHARDS = 2, MANY = 20000 };
+    kvstore_t* shards[SHARDS];
+    for (int i = 0; i < SHARDS; i++) {
+        shards[i] = kvs_create(0);
+        ok = ok && shards[i];
+    }
+    kvs_server_t* server = ok ? kvs_server_create_sharded(shards, SHARDS, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        for (int i = 0; i < SHARDS; i++) {
+            kvs_destroy(shards[i]);
+        }
+        return false;
+    }
+
+    kvsc_conn_t* conn = kvsc_connect_shm(socket_path, 5000);
+    const char* value;
+    size_t len;
+    ok = conn && conn->shm.header && kvsc_set(conn, 1, "one", 0) && kvsc_get(conn, 1, &value, &len) &&
+         strcmp(value, "one") == 0 && len == 3;
+
+    // about 2.5 MB each way, more than a ring holds
+    int* keys = malloc(MANY * sizeof(int));
+    const char** values = malloc(MANY * sizeof(char*));
+    size_t* lens = malloc(MANY * sizeof(size_t));
+    static char big[100];
+    memset(big, 'b', sizeof(big) - 1);
+    ok = ok && keys && values && lens;
+    for (int i = 0; ok && i < MANY; i++) {
+        keys[i] = i;
+        values[i] = big;
+    }
+    ok = ok && kvsc_mset(conn, keys, values, NULL, MANY) && kvsc_mget(conn, keys, MANY, values, lens) &&
+         lens[MANY - 1] == sizeof(big) - 1 && kvs_count(shards[0]) > 0 && kvs_count(shards[1]) > 0;
+    ok = ok && kvsc_bin_mget(conn, keys, MANY, values, lens) && lens[7] == sizeof(big) - 1 &&
+         memcmp(values[7], big, lens[7]) == 0;
+
+    // callbacks and a second connection on the same loop
+    long long sum = 0;
+    const char* incr[] = { "INCR", "30077" };
+    for (int i = 0; ok && i < 10; i++) {
+        ok = kvsc_async(conn, 2, incr, NULL, count_reply, &sum);
+    }
+    for (int tries = 0; ok && kvsc_pending(conn) > 0 && tries < 100; tries++) {
+        ok = kvsc_poll(conn, 100) >= 0;
+    }
+    kvsc_conn_t* other = kvsc_connect_shm(socket_path, 5000);
+    ok = ok && sum == 55 && other && kvsc_get(other, 30077, &value, NULL) && strcmp(value, "10") == 0;
+    kvsc_close(other);
+
+    // SHM is refused once on shared memory, or pipelined
+    const char* shm_argv[] = { "SHM" };
+    const kvsc_reply_t* reply = ok ? kvsc_command(conn, 1, shm_argv, NULL) : NULL;
+    ok = ok && reply && reply->type == RESP_REPLY_ERROR;
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+
+    // a server that went away breaks the connection
+    ok = ok && !kvsc_get(conn, 1, &value, NULL) && kvs_get_error() == KVS_ERROR_FILE_IO;
+    kvsc_close(conn);
+
+    for (int i = 0; i < SHARDS; i++) {
+        kvs_destroy(shards[i]);
+    }
+    free(keys);
+    free(values);
+    free(lens);
+    return ok;
+}
+
+/**
+ * A write made from another thread after a pause, for the waits below
+ */
+typedef struct {
+    kvstore_t* kvs;         // library: set directly
+    const char* path;       // server: set through a connection
+    int key;
+    const char* value;
+} later_write_t;
+
+static void* write_later(void* arg) {
+    later_write_t* write = arg;
+    struct timespec pause = { 0, 30 * 1000000L };
+    nanosleep(&pause, NULL);
+    if (write->kvs) {
+        kvs_set(write->kvs, write->key, write->value);
+        return NULL;
+    }
+    kvsc_conn_t* conn = kvsc_connect(write->path, 5000);
+    if (conn) {
+        kvsc_set(conn, write->key, write->value, 0);
+    }
+    kvsc_close(conn);
+    return NULL;
+}
+
+/**
+ * Test key waits: versions move on writes, kvs_wait sleeps until they
+ * do or times out, and WAITKEY does the same through the server
+ */
+static bool test_key_wait(void) {
+    kvstore_t* kvs = kvs_create(0);
+    bool ok = kvs && kvs_wait(kvs, 1, 0, 0) == 0 && kvs_get_error() == KVS_ERROR_INVALID_PARAM &&
+              kvs_version(kvs, 1) == 0 && kvs_wait_enable(kvs);
+
+    // 0 returns the current version at once, an unchanged key times out
+    uint32_t version = ok ? kvs_version(kvs, 1) : 0;
+    ok = ok && version != 0 && kvs_wait(kvs, 1, 0, -1) == version && kvs_wait(kvs, 1, version, 0) == version;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ok = ok && kvs_wait(kvs, 1, version, 20) == version;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long waited = (end.tv_sec - start.tv_sec) * 1000LL + (end.tv_nsec - start.tv_nsec) / 1000000;
+    ok = ok && waited >= 19;
+
+    // sets, deletes of present keys and clears move versions on
+    ok = ok && kvs_set(kvs, 1, "a") && kvs_version(kvs, 1) != version;
+    version = kvs_version(kvs, 1);
+    ok = ok && !kvs_delete(kvs, 2) && kvs_version(kvs, 1) == version && kvs_delete(kvs, 1) &&
+         kvs_version(kvs, 1) != version;
+    version = kvs_version(kvs, 1);
+    ok = ok && kvs_clear(kvs) && kvs_version(kvs, 1) != version;
+
+    // a waiter sleeps until another thread writes
+    version = kvs_version(kvs, 1);
+    later_write_t later = { kvs, NULL, 1, "woken" };
+    pthread_t writer;
+    ok = ok && pthread_create(&writer, NULL, write_later, &later) == 0;
+    uint32_t seen = ok ? kvs_wait(kvs, 1, version, 5000) : version;
+    if (ok) {
+        pthread_join(writer, NULL);
+    }
+    ok = ok && seen != version && strcmp(kvs_get(kvs, 1), "woken") == 0;
+    kvs_destroy(kvs);
+
+    // WAITKEY on a sharded server, for a key of each loop
+    const char* socket_path = "test_wait.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    enum { SHARDS = 2 };
+    kvstore_t* shards[SHARDS];
+    for (int i = 0; i < SHARDS; i++) {
+        shards[i] = kvs_create(0);
+        ok = ok && shards[i];
+    }
+    kvs_server_t* server = ok ? kvs_server_create_sharded(shards, SHARDS, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        for (int i = 0; i < SHARDS; i++) {
+            kvs_destroy(shards[i]);
+        }
+        return false;
+    }
+
+    kvsc_conn_t* conn = kvsc_connect(socket_path, 1000);
+    ok = ok && conn;
+    for (int shard = 0; ok && shard < SHARDS; shard++) {
+        int key = 100;
+        while (kvs_shard_for_key(key, SHARDS) != (unsigned)shard) {
+            key++;
+        }
+        const char* value = "";
+        size_t len;
+        ok = kvsc_wait(conn, key, 0, 0, &version, &value, &len) && version != 0 && value == NULL &&
+             kvsc_wait(conn, key, version, 30, &seen, &value, NULL) && seen == version;
+
+        // longer than the connection's own timeout, which is stretched
+        later.kvs = NULL;
+        later.path = socket_path;
+        later.key = key;
+        ok = ok && pthread_create(&writer, NULL, write_later, &later) == 0;
+        bool waited_ok = ok && kvsc_wait(conn, key, version, 5000, &seen, &value, &len);
+        if (ok) {
+            pthread_join(writer, NULL);
+        }
+        ok = waited_ok && seen != version && len == 5 && strcmp(value, "woken") == 0;
+    }
+    const char* bad[] = { "WAITKEY", "1", "-1", "0" };
+    const kvsc_reply_t* reply = ok ? kvsc_command(conn, 4, bad, NULL) : NULL;
+    ok = ok && reply && reply->type == RESP_REPLY_ERROR;
+
+    // a client that hangs up while parked leaves the loops working (its
+    // timeout is past what the clock can reach, so it never expires)
+    kvsc_conn_t* gone = kvsc_connect(socket_path, 1000);
+    ok = ok && gone && kvsc_wait(gone, 101, 0, 0, &version, NULL, NULL);
+    char number[16];
+    snprintf(number, sizeof(number), "%u", version);
+    const char* forever[] = { "WAITKEY", "101", number, "9223372036854775807" };
+    long long sum = 0;
+    ok = ok && kvsc_async(gone, 4, forever, NULL, count_reply, &sum) && kvsc_flush(gone);
+    kvsc_close(gone);
+    const char* value;
+    ok = ok && kvsc_set(conn, 101, "after", 0) && kvsc_get(conn, 101, &value, NULL) && strcmp(value, "after") == 0;
+    kvsc_close(conn);
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+    for (int i = 0; i < SHARDS; i++) {
+        kvs_destroy(shards[i]);
+    }
+    return ok;
+}
+
+/**
+ * Backing service for the read-through tests: even keys hold ten times
+ * the key, odd keys are missing, negative keys fail
+ */
+typedef struct {
+    int calls;              // atomic, the server loads on its own threads
+    int delay_ms;
+} stub_backend_t;
+
+static kvs_load_result_t stub_load(void* ctx, int key, char** value, size_t* len) {
+    stub_backend_t* backend = ctx;
+    __atomic_add_fetch(&backend->calls, 1, __ATOMIC_SEQ_CST);
+    struct timespec pause = { 0, backend->delay_ms * 1000000L };
+    nanosleep(&pause, NULL);
+    if (key < 0) {
+        return KVS_LOAD_FAILED;
+    }
+    if (key % 2) {
+        return KVS_LOAD_MISSING;
+    }
+    *value = malloc(16);
+    if (!*value) {
+        return KVS_LOAD_FAILED;
+    }
+    *len = (size_t)snprintf(*value, 16, "%d", key * 10);
+    return KVS_LOAD_FOUND;
+}
+
+static int stub_calls(stub_backend_t* backend) {
+    return __atomic_load_n(&backend->calls, __ATOMIC_SEQ_CST);
+}
+
+static void count_loaded(void* ctx, const kvsc_reply_t* reply) {
+    int* loaded = ctx;
+    *loaded += reply && reply->type == RESP_REPLY_BULK && strcmp(reply->str, "400") == 0;
+}
+
+/**
+ * Test read-through mode: misses load and are cached, missing keys are
+ * remembered for the TTL, and the server makes one load of a key many
+ * clients miss at once
+ */
+static bool test_read_through(void) {
+    stub_backend_t backend = { 0, 0 };
+    kvstore_t* kvs = kvs_create(0);
+    bool ok = kvs && !kvs_readthrough_enable(kvs, NULL, NULL, 0) &&
+              kvs_readthrough_enable(kvs, stub_load, &backend, 50);
+
+    // a miss loads once, then hits
+    const char* value = ok ? kvs_get(kvs, 10) : NULL;
+    ok = ok && value && strcmp(value, "100") == 0 && strcmp(kvs_get(kvs, 10), "100") == 0 &&
+         stub_calls(&backend) == 1 && kvs_count(kvs) == 1;
+
+    // missing keys are remembered, failures are not
+    ok = ok && !kvs_get(kvs, 11) && !kvs_get(kvs, 11) && stub_calls(&backend) == 2 &&
+         !kvs_readthrough_needed(kvs, 11) && kvs_readthrough_needed(kvs, 12);
+    ok = ok && !kvs_get(kvs, -4) && kvs_get_error() == KVS_ERROR_BACKEND && !kvs_get(kvs, -4) &&
+         stub_calls(&backend) == 4;
+
+    // only kvs_get loads
+    int key = 12;
+    const char* values[1];
+    ok = ok && !kvs_get_cached(kvs, 12) && kvs_mget(kvs, &key, 1, values) == 0 && stub_calls(&backend) == 4;
+
+    // a write ends the remembered miss, the TTL ends the next one
+    ok = ok && kvs_set(kvs, 11, "written") && strcmp(kvs_get(kvs, 11), "written") == 0 && kvs_delete(kvs, 11) &&
+         !kvs_get(kvs, 11) && stub_calls(&backend) == 5;
+    struct timespec ttl = { 0, 60 * 1000000L };
+    nanosleep(&ttl, NULL);
+    ok = ok && !kvs_get(kvs, 11) && stub_calls(&backend) == 6;
+
+    // a load that lands after a write doesn't undo it
+    char* older = malloc(6);
+    if (older) {
+        memcpy(older, "older", 6);
+    }
+    uint32_t generation = kvs_readthrough_generation(kvs, 20);
+    ok = ok && older && kvs_set(kvs, 20, "newer") &&
+         kvs_readthrough_fill(kvs, 20, generation, KVS_LOAD_FOUND, older, 5) &&
+         strcmp(kvs_get(kvs, 20), "newer") == 0;
+
+    // nor does one that lands after a delete
+    char* stale = malloc(6);
+    if (stale) {
+        memcpy(stale, "stale", 6);
+    }
+    ok = ok && stale && kvs_readthrough_needed(kvs, 21);
+    generation = kvs_readthrough_generation(kvs, 21);
+    ok = ok && kvs_set(kvs, 21, "gone") && kvs_delete(kvs, 21) &&
+         kvs_readthrough_fill(kvs, 21, generation, KVS_LOAD_FOUND, stale, 5) && !kvs_get_cached(kvs, 21);
+    kvs_readthrough_disable(kvs);
+    ok = ok && !kvs_get(kvs, 30) && stub_calls(&backend) == 6;
+    kvs_destroy(kvs);
+
+    // the server: slow loads, on a key of each shard
+    const char* socket_path = "test_readthrough.sock";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, false };
+    enum { SHARDS = 2, CLIENTS = 8 };
+    kvstore_t* shards[SHARDS];
+    for (int i = 0; i < SHARDS; i++) {
+        shards[i] = kvs_create(0);
+        ok = ok && shards[i] && kvs_readthrough_enable(shards[i], stub_load, &backend, 1000);
+    }
+    kvs_server_t* server = ok ? kvs_server_create_sharded(shards, SHARDS, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        for (int i = 0; i < SHARDS; i++) {
+            kvs_destroy(shards[i]);
+        }
+        return false;
+    }
+    __atomic_store_n(&backend.calls, 0, __ATOMIC_SEQ_CST);
+    backend.delay_ms = 50;
+
+    // clients on both loops miss the same key at once: one load
+    kvsc_conn_t* conns[CLIENTS];
+    const char* get[] = { "GET", "40" };
+    int loaded = 0;
+    for (int i = 0; i < CLIENTS; i++) {
+        conns[i] = kvsc_connect(socket_path, 5000);
+        ok = ok && conns[i];
+    }
+    for (int i = 0; ok && i < CLIENTS; i++) {
+        ok = kvsc_async(conns[i], 2, get, NULL, count_loaded, &loaded) && kvsc_flush(conns[i]);
+    }
+    for (int i = 0; ok && i < CLIENTS; i++) {
+        for (int tries = 0; ok && kvsc_pending(conns[i]) > 0 && tries < 100; tries++) {
+            ok = kvsc_poll(conns[i], 100) >= 0;
+        }
+    }
+    ok = ok && loaded == CLIENTS && stub_calls(&backend) == 1;
+
+    // MGET loads its misses on whichever shard owns them, INCR reads the loaded value
+    int keys[] = { 40, 42, 43, 44, 46, 48 };
+    const char* found[6];
+    size_t lens[6];
+    ok = ok && kvsc_mget(conns[0], keys, 6, found, lens) && strcmp(found[0], "400") == 0 &&
+         strcmp(found[1], "420") == 0 && found[2] == NULL && strcmp(found[5], "480") == 0 &&
+         stub_calls(&backend) == 6;
+    const char* incr[] = { "INCR", "50" };
+    const kvsc_reply_t* reply = ok ? kvsc_command(conns[1], 2, incr, NULL) : NULL;
+    ok = ok && reply && reply->type == RESP_REPLY_INTEGER && reply->integer == 501;
+
+    // a failed load is an error reply, and is tried again next time
+    ok = ok && !kvsc_get(conns[0], -2, &value, NULL) && kvs_get_error() == KVS_ERROR_SERVER &&
+         strstr(kvsc_server_error(conns[0]), "Backing store failed") != NULL &&
+         !kvsc_get(conns[0], -2, &value, NULL) && stub_calls(&backend) == 9;
+    for (int i = 0; i < CLIENTS; i++) {
+        kvsc_close(conns[i]);
+    }
+
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    kvs_server_destroy(server);
+    for (int i = 0; i < SHARDS; i++) {
+        kvs_destroy(shards[i]);
+    }
+    return ok;
+}
+
+/**
+ * Backing service for the write-back tests, holding keys below 64
+ * Runs on the flusher thread; the test reads it after a flush
+ */
+typedef struct {
+    int calls;              // writer calls, failed ones included
+    int failing;            // calls left to fail (atomic, set while flushing)
+    size_t written;         // writes taken
+    size_t largest;         // biggest batch taken
+    char values[64][16];    // "" for none
+} stub_sink_t;
+
+static bool stub_write(void* ctx, const kvs_dirty_t* entries, size_t count) {
+    stub_sink_t* sink = ctx;
+    sink->calls++;
+    if (__atomic_load_n(&sink->failing, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_sub_fetch(&sink->failing, 1, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].key >= 0 && entries[i].key < 64) {
+            snprintf(sink->values[entries[i].key], 16, "%s", entries[i].value ? entries[i].value : "");
+        }
+    }
+    sink->written += count;
+    sink->largest = count > sink->largest ? count : sink->largest;
+    return true;
+}
+
+/**
+ * Test write-back mode: writes reach the writer coalesced and batched,
+ * failed batches are retried, and writers wait (then fail) while the
+ * backend is too far behind
+ */
+static bool test_write_back(void) {
+    stub_sink_t sink;
+    memset(&sink, 0, sizeof(sink));
+    snprintf(sink.values[3], 16, "stale");
+    kvs_writeback_config_t config = { 4, 50, 8, 100, 5, 20 };
+    kvs_writeback_stats_t stats;
+    kvstore_t* kvs = kvs_create(0);
+    bool ok = kvs && !kvs_writeback_flush(kvs, 0) && kvs_writeback_enable(kvs, stub_write, &sink, &config);
+
+    // ten writes to a key are one write to the backend; a delete goes
+    // out even for a key that is not cached
+    char value[16];
+    for (int i = 0; ok && i < 10; i++) {
+        snprintf(value, sizeof(value), "v%d", i);
+        ok = kvs_set(kvs, 1, value);
+    }
+    ok = ok && kvs_set(kvs, 2, "two") && !kvs_delete(kvs, 3) && kvs_writeback_flush(kvs, 1000);
+    ok = ok && strcmp(sink.values[1], "v9") == 0 && strcmp(sink.values[2], "two") == 0 &&
+         sink.values[3][0] == '\0' && sink.written == 3;
+    ok = ok && kvs_writeback_stats(kvs, &stats) && stats.writes == 12 && stats.coalesced == 9 &&
+         stats.flushed == 3 && stats.dirty == 0;
+
+    // batches stay within batch_size
+    int keys[10];
+    const char* values[10];
+    for (int i = 0; i < 10; i++) {
+        keys[i] = 10 + i;
+        values[i] = "batched";
+    }
+    ok = ok && kvs_mset(kvs, keys, values, NULL, 10) && kvs_writeback_flush(kvs, 1000) && sink.written == 13 &&
+         sink.largest <= 4 && strcmp(sink.values[19], "batched") == 0;
+
+    // a failing backend gets the batch again until it takes it
+    __atomic_store_n(&sink.failing, 2, __ATOMIC_SEQ_CST);
+    ok = ok && kvs_set(kvs, 20, "retried") && kvs_writeback_flush(kvs, 1000) &&
+         strcmp(sink.values[20], "retried") == 0 && kvs_writeback_stats(kvs, &stats) && stats.failures == 2;
+
+    // a stuck backend: writers wait for room, then fail without writing
+    // (the MSET above may have waited for room too)
+    uint64_t stalls = stats.stalls;
+    __atomic_store_n(&sink.failing, 1000000, __ATOMIC_SEQ_CST);
+    for (int key = 30; ok && key < 38; key++) {
+        ok = kvs_set(kvs, key, "queued");
+    }
+    ok = ok && !kvs_set(kvs, 38, "refused") && kvs_get_error() == KVS_ERROR_BACKEND && !kvs_get(kvs, 38) &&
+         !kvs_writeback_flush(kvs, 10) && kvs_writeback_stats(kvs, &stats) && stats.stalls == stalls + 1 &&
+         stats.timeouts == 1 && stats.dirty == 8;
+
+    __atomic_store_n(&sink.failing, 0, __ATOMIC_SEQ_CST);
+    ok = ok && kvs_writeback_flush(kvs, 2000) && strcmp(sink.values[37], "queued") == 0;
+
+    // with read-through on, a key whose delete is queued is not loaded
+    stub_backend_t loads = { 0, 0 };
+    __atomic_store_n(&sink.failing, 1000000, __ATOMIC_SEQ_CST);
+    ok = ok && kvs_readthrough_enable(kvs, stub_load, &loads, 0) && !kvs_delete(kvs, 40) && !kvs_get(kvs, 40) &&
+         stub_calls(&loads) == 0;
+
+    // nor filled by a load that lands while it is queued
+    char* older = malloc(4);
+    if (older) {
+        memcpy(older, "410", 4);
+    }
+    ok = ok && older && !kvs_delete(kvs, 41) &&
+         kvs_readthrough_fill(kvs, 41, kvs_readthrough_generation(kvs, 41), KVS_LOAD_FOUND, older, 3) &&
+         !kvs_get_cached(kvs, 41);
+    __atomic_store_n(&sink.failing, 0, __ATOMIC_SEQ_CST);
+    ok = ok && kvs_writeback_flush(kvs, 2000);
+    const char* loaded = ok ? kvs_get(kvs, 40) : NULL;
+    ok = ok && loaded && strcmp(loaded, "400") == 0 && stub_calls(&loads) == 1;
+
+    // fills are not written back
+    ok = ok && kvs_writeback_stats(kvs, &stats) && stats.dirty == 0;
+    kvs_destroy(kvs);
+    return ok;
+}
+
+/**
+ * Test the latency histogram: bucket precision, percentiles and merging
+ */
+static bool test_histogram(void) {
+    histogram_t* a = malloc(sizeof(histogram_t));
+    histogram_t* b = malloc(sizeof(histogram_t));
+    bool ok = a && b;
+    if (ok) {
+        histogram_reset(a);
+        histogram_reset(b);
+    }
+
+    // small values are exact, larger ones within 1/64 above
+    ok = ok && histogram_percentile(a, 50) == 0 && histogram_mean(a) == 0.0;
+    for (uint64_t v = 1; ok && v <= 100000; v++) {
+        histogram_record(v <= 50000 ? a : b, v);
+    }
+    uint64_t p50 = ok ? histogram_percentile(a, 50) : 0;
+    ok = ok && p50 >= 25000 && p50 <= 25000 + 25000 / 64;
+    ok = ok && histogram_percentile(a, 0) == 1 && histogram_percentile(a, 100) == 50000;
+    ok = ok && histogram_bucket(127) == 127 && histogram_bucket(128) == 128 && histogram_bucket(129) == 128;
+    ok = ok && histogram_bucket(UINT64_MAX) == HISTOGRAM_BUCKETS - 1;
+
+    if (ok) {
+        histogram_merge(a, b);
+    }
+    ok = ok && a->total == 100000 && a->min == 1 && a->max == 100000;
+    uint64_t p99 = ok ? histogram_percentile(a, 99) : 0;
+    ok = ok && p99 >= 99000 && p99 <= 99000 + 99000 / 64;
+    ok = ok && histogram_mean(a) == 50000.5;
+
+    free(a);
+    free(b);
+    return ok;
+}
+
+/**
+ * Test the shared tokenizer and the perfect-hash command table
+ */
+/**
+ * Test metrics: each loop of a sharded server publishes to its shard,
+ * the exporter sums the shards into the textfile and OpenMetrics text
+ */
+static bool test_metrics(void) {
+    const char* socket_path = "test_metrics.sock";
+    const char* textfile = "test_metrics.prom";
+    kvs_server_config_t config = { NULL, 0, socket_path, false, KVS_BACKEND_EPOLL, NULL, 0, true };
+
+    kvstore_t* shards[2] = { kvs_create(0), kvs_create(0) };
+    kvs_server_t* server = shards[0] && shards[1] ? kvs_server_create_sharded(shards, 2, &config) : NULL;
+    pthread_t thread;
+    if (!server || pthread_create(&thread, NULL, run_server, server) != 0) {
+        kvs_server_destroy(server);
+        kvs_destroy(shards[0]);
+        kvs_destroy(shards[1]);
+        return false;
+    }
+
+    const char* request = "MSET 1 a 2 b 3 c 4 d\r\nGET 1\r\nQUIT\r\n";
+    int sock = connect_unix(socket_path);
+    bool ok = sock >= 0 && write(sock, request, strlen(request)) == (ssize_t)strlen(request);
+    char reply[128];
+    size_t got = 0;
+    ssize_t n;
+    while (ok && got < sizeof(reply) - 1 && (n = read(sock, reply + got, sizeof(reply) - 1 - got)) > 0) {
+        got += (size_t)n;
+    }
+    reply[got] = '\0';
+    ok = ok && strcmp(reply, "+OK\r\n$1\r\na\r\n+OK\r\n") == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    // the loops publish once more as they stop
+    kvs_server_stop(server);
+    pthread_join(thread, NULL);
+    ok = ok && server->metrics[0].seq > 0 && server->metrics[0].seq % 2 == 0;
+
+    kvs_metrics_config_t metrics_config = { NULL, 0, textfile, 0 };
+    kvs_metrics_exporter_t* exporter = kvs_metrics_exporter_start(server->metrics, 2, &metrics_config);
+    ok = ok && exporter != NULL;
+    kvs_metrics_exporter_stop(exporter);
+
+    char text[8192];
+    FILE* file = fopen(textfile, "r");
+    size_t len = file ? fread(text, 1, sizeof(text) - 1, file) : 0;
+    text[len] = '\0';
+    if (file) {
+        fclose(file);
+    }
+    char keys[64];
+    snprintf(keys, sizeof(keys), "kvs_keys{shard=\"1\"} %zu\n", kvs_count(shards[1]));
+    ok = ok && strstr(text, "# TYPE kvs_commands_total counter\nkvs_commands_total 3\n") &&
+         strstr(text, "kvs_operations_total{op=\"set\"} 4\n") &&
+         strstr(text, "kvs_get_hits_total 1\n") && strstr(text, keys) &&
+         strstr(text, "kvs_request_latency_seconds_bucket{le=\"+Inf\"} 3\n") &&
+         strstr(text, "kvs_request_latency_seconds_count 3\n") && !strstr(text, "# EOF");
+
+    // OpenMetrics names counter families without _total and ends in # EOF
+    char* open = kvs_metrics_render(server->metrics, 2, true);
+    ok = ok && open && strstr(open, "# TYPE kvs_commands counter\n") &&
+         strstr(open, "# UNIT kvs_request_latency_seconds seconds\n") &&
+         strlen(open) > 6 && strcmp(open + strlen(open) - 6, "# EOF\n") == 0;
+    free(open);
+
+    kvs_server_destroy(server);
+    unlink(textfile);
+    kvs_destroy(shards[0]);
+    kvs_destroy(shards[1]);
+    return ok;
+}
+
+static bool test_command_table(void) {
+    struct {
+        const char* name;
+        kvs_command_id_t id;
+    } names[] = {
+        { "get", KVS_CMD_GET }, { "set", KVS_CMD_SET }, { "del", KVS_CMD_DEL },
+        { "delete", KVS_CMD_DEL }, { "mget", KVS_CMD_MGET }, { "mset", KVS_CMD_MSET },
+        { "mdel", KVS_CMD_MDEL }, { "incr", KVS_CMD_INCR }, { "scan", KVS_CMD_SCAN },
+        { "info", KVS_CMD_INFO },
+        { "ping", KVS_CMD_PING }, { "command", KVS_CMD_COMMAND }, { "quit", KVS_CMD_QUIT },
+        { "exit", KVS_CMD_QUIT }, { "list", KVS_CMD_LIST }, { "ls", KVS_CMD_LIST },
+        { "stats", KVS_CMD_STATS }, { "save", KVS_CMD_SAVE }, { "load", KVS_CMD_LOAD },
+        { "clear", KVS_CMD_CLEAR }, { "handoff", KVS_CMD_HANDOFF }, { "help", KVS_CMD_HELP },
+        { "slowlog", KVS_CMD_SLOWLOG },
+        { "latency", KVS_CMD_LATENCY },
+        { "?", KVS_CMD_HELP }, { "psync", KVS_CMD_PSYNC }, { "replconf", KVS_CMD_REPLCONF },
+        { "shm", KVS_CMD_SHM },
+        { "waitkey", KVS_CMD_WAITKEY },
+        { "GeT", KVS_CMD_GET }, { "MSET", KVS_CMD_MSET },
+        { "gets", KVS_CMD_UNKNOWN }, { "sett", KVS_CMD_UNKNOWN }, { "x", KVS_CMD_UNKNOWN },
+        { "mgez", KVS_CMD_UNKNOWN }, { "", KVS_CMD_UNKNOWN },
+    };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        kvs_slice_t name = { (char*)names[i].name, strlen(names[i].name) };
+        ok = ok && kvs_command_lookup(name) == names[i].id;
+    }
+
+    // every id maps back to a name that resolves to it
+    for (int id = KVS_CMD_UNKNOWN + 1; id < KVS_CMD_COUNT; id++) {
+        const char* text = kvs_command_name((kvs_command_id_t)id);
+        kvs_slice_t name = { (char*)text, strlen(text) };
+        ok = ok && kvs_command_lookup(name) == (kvs_command_id_t)id;
+    }
+
+    // tokenizing leaves the line untouched
+    char line[] = "  set\t42   hello  world \r\n";
+    char copy[sizeof(line)];
+    memcpy(copy, line, sizeof(line));
+
+    kvs_tokenizer_t tok;
+    kvs_tokenizer_init(&tok, line, strlen(line));
+    kvs_slice_t cmd;
+    kvs_slice_t key;
+    int key_value = 0;
+    ok = ok && kvs_next_token(&tok, &cmd) && kvs_command_lookup(cmd) == KVS_CMD_SET &&
+         kvs_next_token(&tok, &key) && kvs_slice_to_int(key, &key_value) && key_value == 42;
+
+    kvs_slice_t rest = kvs_rest_of_line(&tok);
+    ok = ok && rest.len == 12 && memcmp(rest.ptr, "hello  world", 12) == 0 &&
+         !kvs_next_token(&tok, &cmd) && memcmp(line, copy, sizeof(line)) == 0;
+
+    // strict integer parsing
+    kvs_slice_t big = { "2147483648", 10 };
+    kvs_slice_t neg = { "-2147483648", 11 };
+    kvs_slice_t junk = { "12a", 3 };
+    ok = ok && !kvs_slice_to_int(big, &key_value) && kvs_slice_to_int(neg, &key_value) &&
+         key_value == INT32_MIN && !kvs_slice_to_int(junk, &key_value);
+
+    return ok;
+}
+
 /**
  * Main test function
  */
@@ -415,6 +2619,31 @@ int main(void) {
     RUN_TEST(test_large_dataset);
     RUN_TEST(test_resizing);
     RUN_TEST(test_edge_cases);
+    RUN_TEST(test_torn_save);
+    RUN_TEST(test_mapped_mode);
+    RUN_TEST(test_mapped_recovery);
+    RUN_TEST(test_handoff);
+    RUN_TEST(test_multi_key);
+    RUN_TEST(test_scan);
+    RUN_TEST(test_merkle_diff);
+    RUN_TEST(test_changefeed);
+    RUN_TEST(test_slowlog);
+    RUN_TEST(test_info);
+    RUN_TEST(test_latency);
+    RUN_TEST(test_load_range);
+    RUN_TEST(test_server);
+    RUN_TEST(test_sharded_server);
+    RUN_TEST(test_uring_server);
+    RUN_TEST(test_replication);
+    RUN_TEST(test_client);
+    RUN_TEST(test_binary_protocol);
+    RUN_TEST(test_shm_transport);
+    RUN_TEST(test_key_wait);
+    RUN_TEST(test_read_through);
+    RUN_TEST(test_write_back);
+    RUN_TEST(test_histogram);
+    RUN_TEST(test_metrics);
+    RUN_TEST(test_command_table);
     
     // Print results
     printf("\n==================================\n");